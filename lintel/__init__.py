@@ -15,10 +15,37 @@
 # Lintel. If not, see <http://www.gnu.org/licenses/>.
 
 """Wrapper for the Lintel C extension APIs."""
+import atexit
+
 import _lintel
 
+from lintel.aio import submit_async
+from lintel.manifest import Manifest, VideoEntry, write_manifest
+
 
 loadvid = _lintel.loadvid
 loadvid_frame_nums = _lintel.loadvid_frame_nums
+loadvid_timestamps = _lintel.loadvid_timestamps
+loadvid_slowfast = _lintel.loadvid_slowfast
+loadvid_segments = _lintel.loadvid_segments
 # loadvid_frame_index = _lintel.loadvid_frame_index
 frame_count = _lintel.frame_count
+probe_many = _lintel.probe_many
+submit = _lintel.submit
+prefetch = _lintel.prefetch
+start_decode_workers = _lintel.start_decode_workers
+shutdown_decode_workers = _lintel.shutdown_decode_workers
+set_buffer_pool = _lintel.set_buffer_pool
+set_codec_pool = _lintel.set_codec_pool
+set_file_io = _lintel.set_file_io
+set_handle_cache = _lintel.set_handle_cache
+index_shard = _lintel.index_shard
+decode_stats = _lintel.decode_stats
+set_rgb_kernel = _lintel.set_rgb_kernel
+set_tensor_output = _lintel.set_tensor_output
+FrameBuffer = _lintel.FrameBuffer
+VideoReader = _lintel.VideoReader
+
+# NOTE: Decode workers take the GIL to complete futures, so they must finish
+# before the interpreter does.
+atexit.register(shutdown_decode_workers)
@@ -0,0 +1,40 @@
+# Copyright 2018 Brendan Duke.
+#
+# This file is part of Lintel.
+#
+# Lintel is free software: you can redistribute it and/or modify it under the
+# terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+# A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# Lintel. If not, see <http://www.gnu.org/licenses/>.
+
+"""asyncio front end for the native decode queue."""
+import asyncio
+import functools
+
+import _lintel
+
+
+async def submit_async(*args, **kwargs):
+    """Awaitable version of `lintel.submit`.
+
+    Takes the same arguments as `lintel.loadvid_frame_nums`, and returns the
+    same result. The event loop is never blocked: decoding runs on the native
+    decode workers, and if their queue is full, waiting for space runs in the
+    loop's default executor.
+    """
+    kwargs.pop('block', None)
+    loop = asyncio.get_running_loop()
+    try:
+        future = _lintel.submit(*args, block=False, **kwargs)
+    except BlockingIOError:
+        future = await loop.run_in_executor(
+            None, functools.partial(_lintel.submit, *args, **kwargs))
+
+    return await asyncio.wrap_future(future, loop=loop)
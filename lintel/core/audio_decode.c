@@ -0,0 +1,200 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "audio_decode.h"
+#include "video_decode.h"
+#include <libavutil/channel_layout.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+int32_t
+open_audio_stream(struct audio_stream_context *audio,
+                  AVFormatContext *format_context,
+                  int32_t sample_rate,
+                  int32_t num_channels)
+{
+        int32_t stream_index = av_find_best_stream(format_context,
+                                                   AVMEDIA_TYPE_AUDIO,
+                                                   -1,
+                                                   -1,
+                                                   NULL,
+                                                   0);
+        if (stream_index < 0)
+                return stream_index;
+
+        AVStream *audio_stream = format_context->streams[stream_index];
+        audio->stream_index = stream_index;
+        audio->time_base = audio_stream->time_base;
+        audio->sample_rate = sample_rate;
+        audio->num_channels = num_channels;
+
+        /* NOTE: open_video_codec_ctx() opens the decoder of any stream. */
+        audio->codec_context = open_video_codec_ctx(audio_stream, false);
+        if (audio->codec_context == NULL)
+                return AVERROR(EINVAL);
+
+        AVCodecContext *codec_context = audio->codec_context;
+        int64_t in_channel_layout = codec_context->channel_layout;
+        if (in_channel_layout == 0)
+                in_channel_layout =
+                        av_get_default_channel_layout(codec_context->channels);
+
+        audio->swr_context =
+                swr_alloc_set_opts(NULL,
+                                   av_get_default_channel_layout(num_channels),
+                                   AV_SAMPLE_FMT_FLT,
+                                   sample_rate,
+                                   in_channel_layout,
+                                   codec_context->sample_fmt,
+                                   codec_context->sample_rate,
+                                   0,
+                                   NULL);
+        if ((audio->swr_context == NULL) ||
+            (swr_init(audio->swr_context) < 0))
+                return AVERROR(EINVAL);
+
+        audio->frame = av_frame_alloc();
+        if (audio->frame == NULL)
+                return AVERROR(ENOMEM);
+
+        return 0;
+}
+
+int32_t
+set_audio_span(struct audio_stream_context *audio,
+               double start_seconds,
+               double end_seconds)
+{
+        if (end_seconds < start_seconds)
+                end_seconds = start_seconds;
+
+        audio->span_start = start_seconds;
+        audio->span_end = end_seconds;
+        audio->decoded_end = -INFINITY;
+        audio->num_samples = llround((end_seconds - start_seconds)*
+                                     audio->sample_rate);
+
+        free(audio->samples);
+        audio->samples = calloc(audio->num_samples*audio->num_channels + 1,
+                                sizeof(float));
+        if (audio->samples == NULL)
+                return AVERROR(ENOMEM);
+
+        return 0;
+}
+
+/**
+ * place_audio_frame() - Resamples the decoded frame in `audio->frame`, and
+ * copies the part of it inside the span into `audio->samples`.
+ */
+static void
+place_audio_frame(struct audio_stream_context *audio)
+{
+        AVFrame *frame = audio->frame;
+        int64_t pts = (frame->pts != AV_NOPTS_VALUE) ?
+                      frame->pts : frame->best_effort_timestamp;
+        if (pts == AV_NOPTS_VALUE)
+                return;
+
+        double frame_start = pts*av_q2d(audio->time_base);
+        double frame_end = frame_start +
+                (double)frame->nb_samples/audio->codec_context->sample_rate;
+        if (frame_end > audio->decoded_end)
+                audio->decoded_end = frame_end;
+
+        int32_t max_out_samples = swr_get_out_samples(audio->swr_context,
+                                                      frame->nb_samples);
+        if (max_out_samples > audio->scratch_capacity) {
+                float *scratch = realloc(audio->scratch,
+                                         max_out_samples*audio->num_channels*
+                                         sizeof(float));
+                if (scratch == NULL)
+                        return;
+                audio->scratch = scratch;
+                audio->scratch_capacity = max_out_samples;
+        }
+
+        /**
+         * NOTE: The resampler holds back `delay` output samples, so the
+         * samples it outputs now start that much before this frame's PTS.
+         */
+        int64_t delay = swr_get_delay(audio->swr_context, audio->sample_rate);
+        int64_t out_start = llround((frame_start - audio->span_start)*
+                                    audio->sample_rate) - delay;
+
+        uint8_t *out = (uint8_t *)audio->scratch;
+        int32_t num_converted =
+                swr_convert(audio->swr_context,
+                            &out,
+                            audio->scratch_capacity,
+                            (const uint8_t **)frame->extended_data,
+                            frame->nb_samples);
+        if (num_converted <= 0)
+                return;
+
+        int64_t first = (out_start < 0) ? -out_start : 0;
+        int64_t last = num_converted;
+        if (out_start + last > audio->num_samples)
+                last = audio->num_samples - out_start;
+        if (first >= last)
+                return;
+
+        memcpy(audio->samples + (out_start + first)*audio->num_channels,
+               audio->scratch + first*audio->num_channels,
+               (last - first)*audio->num_channels*sizeof(float));
+}
+
+void
+decode_audio_packet(struct audio_stream_context *audio, AVPacket *packet)
+{
+        if (avcodec_send_packet(audio->codec_context, packet) != 0)
+                return;
+
+        while (avcodec_receive_frame(audio->codec_context, audio->frame) == 0) {
+                place_audio_frame(audio);
+                av_frame_unref(audio->frame);
+        }
+}
+
+void flush_audio_stream(struct audio_stream_context *audio)
+{
+        if (audio == NULL)
+                return;
+
+        avcodec_flush_buffers(audio->codec_context);
+        swr_init(audio->swr_context);
+        audio->decoded_end = -INFINITY;
+}
+
+bool is_audio_span_decoded(const struct audio_stream_context *audio)
+{
+        return audio->decoded_end >= audio->span_end;
+}
+
+void close_audio_stream(struct audio_stream_context *audio)
+{
+        av_frame_free(&audio->frame);
+        swr_free(&audio->swr_context);
+        avcodec_close(audio->codec_context);
+        avcodec_free_context(&audio->codec_context);
+        free(audio->samples);
+        free(audio->scratch);
+        audio->samples = NULL;
+        audio->scratch = NULL;
+}
@@ -0,0 +1,132 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _AUDIO_DECODE_H_
+#define _AUDIO_DECODE_H_
+
+/**
+ * Decoding of the audio stream of a video file, from the packets read while
+ * demuxing the video stream, so that audio costs no extra pass over the file.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+#ifdef __cplusplus
+};
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * struct audio_stream_context - Decoder, resampler and output of an audio
+ * stream.
+ * @codec_context: Decoder of the audio stream.
+ * @swr_context: Resampler to float32 at `sample_rate` and `num_channels`.
+ * @frame: Decoded audio frame.
+ * @stream_index: Index of the audio stream in the format context.
+ * @time_base: Time base of the audio stream.
+ * @sample_rate: Output sample rate, in Hz.
+ * @num_channels: Number of output channels.
+ * @span_start: Start of the output span, in seconds of presentation time.
+ * @span_end: End of the output span, in seconds of presentation time.
+ * @decoded_end: End time of the last decoded frame, in seconds of
+ * presentation time.
+ * @samples: Interleaved float32 output samples covering the span, zero where
+ * no audio was decoded.
+ * @num_samples: Number of samples per channel in `samples`.
+ * @scratch: Resampler output, before it is placed in `samples`.
+ * @scratch_capacity: Number of samples per channel `scratch` holds.
+ */
+struct audio_stream_context {
+        AVCodecContext *codec_context;
+        struct SwrContext *swr_context;
+        AVFrame *frame;
+        int32_t stream_index;
+        AVRational time_base;
+        int32_t sample_rate;
+        int32_t num_channels;
+        double span_start;
+        double span_end;
+        double decoded_end;
+        float *samples;
+        int64_t num_samples;
+        float *scratch;
+        int32_t scratch_capacity;
+};
+
+/**
+ * open_audio_stream() - Opens the best audio stream of `format_context` for
+ * decoding to `num_channels` of float32 at `sample_rate`.
+ * @audio: Zeroed context to open.
+ *
+ * Returns 0 on success, AVERROR_STREAM_NOT_FOUND if there is no audio stream,
+ * and another negative value on other failures. Either way, `audio` must be
+ * released with close_audio_stream().
+ */
+int32_t
+open_audio_stream(struct audio_stream_context *audio,
+                  AVFormatContext *format_context,
+                  int32_t sample_rate,
+                  int32_t num_channels);
+
+/**
+ * set_audio_span() - Sets the span of the stream to be output, and allocates
+ * its (zeroed) samples.
+ * @start_seconds: Start of the span, in seconds of presentation time, i.e.,
+ * PTS times time base, which is what keeps audio and video in sync.
+ * @end_seconds: End of the span, in seconds of presentation time.
+ *
+ * Returns 0 on success, and a negative value if out of memory.
+ */
+int32_t
+set_audio_span(struct audio_stream_context *audio,
+               double start_seconds,
+               double end_seconds);
+
+/**
+ * decode_audio_packet() - Decodes `packet` of the audio stream, and places
+ * the samples overlapping the span by their PTS. Packets that fail to decode
+ * are skipped, since audio errors shouldn't fail the video.
+ *
+ * Passing a NULL `packet` drains the decoder at EOF.
+ */
+void
+decode_audio_packet(struct audio_stream_context *audio, AVPacket *packet);
+
+/**
+ * flush_audio_stream() - Resets the decoder and resampler after a seek.
+ *
+ * Does nothing if `audio` is NULL.
+ */
+void flush_audio_stream(struct audio_stream_context *audio);
+
+/**
+ * is_audio_span_decoded() - Returns true iff audio has been decoded up to the
+ * end of the span.
+ */
+bool is_audio_span_decoded(const struct audio_stream_context *audio);
+
+/**
+ * close_audio_stream() - Frees the decoder, resampler and buffers of `audio`.
+ */
+void close_audio_stream(struct audio_stream_context *audio);
+
+#endif // _AUDIO_DECODE_H_
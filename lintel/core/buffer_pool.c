@@ -0,0 +1,409 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "buffer_pool.h"
+#include <libavutil/imgutils.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define POOL_NUM_FRAMES 4
+#define BUFFER_POOL_NUM_SLOTS 32
+#define BUFFER_ALIGN_BYTES 64
+#define PAGE_SIZE_BYTES 4096
+#define HUGE_PAGE_SIZE_BYTES (2 << 20)
+
+/**
+ * struct thread_pool - Scratch objects cached by one thread.
+ * @frames: Idle, unreferenced AVFrames.
+ * @num_frames: Number of valid entries in `frames`.
+ * @frame_rgb: Idle RGB image, or NULL.
+ * @sws_context: Idle swscale context, or NULL.
+ * @rgb_converter: Idle RGB converter, or NULL.
+ */
+struct thread_pool {
+        AVFrame *frames[POOL_NUM_FRAMES];
+        int32_t num_frames;
+        AVFrame *frame_rgb;
+        struct SwsContext *sws_context;
+        struct rgb_converter *rgb_converter;
+};
+
+static pthread_key_t thread_pool_key;
+static pthread_once_t thread_pool_key_once = PTHREAD_ONCE_INIT;
+static bool is_thread_pool_key_valid = false;
+
+static pthread_mutex_t buffer_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_buffer idle_buffers[BUFFER_POOL_NUM_SLOTS];
+static int32_t num_idle_buffers = 0;
+static size_t idle_bytes = 0;
+static size_t max_idle_bytes = 0;
+static bool should_use_huge_pages = false;
+
+static void
+free_rgb_image(AVFrame **frame_rgb)
+{
+        if (*frame_rgb == NULL)
+                return;
+
+        av_freep(&(*frame_rgb)->data[0]);
+        av_frame_free(frame_rgb);
+}
+
+/**
+ * free_thread_pool() - pthread key destructor, which frees the scratch
+ * objects of a thread when it exits.
+ */
+static void
+free_thread_pool(void *arg)
+{
+        struct thread_pool *pool = arg;
+
+        int32_t frame_index;
+        for (frame_index = 0;
+             frame_index < pool->num_frames;
+             ++frame_index)
+                av_frame_free(&pool->frames[frame_index]);
+
+        free_rgb_image(&pool->frame_rgb);
+        sws_freeContext(pool->sws_context);
+        free_rgb_converter(&pool->rgb_converter);
+        free(pool);
+}
+
+static void
+create_thread_pool_key(void)
+{
+        is_thread_pool_key_valid =
+                (pthread_key_create(&thread_pool_key, free_thread_pool) == 0);
+}
+
+/**
+ * get_thread_pool() - Returns the calling thread's pool, creating it on first
+ * use. Returns NULL if it could not be created, in which case callers
+ * allocate and free directly.
+ */
+static struct thread_pool *
+get_thread_pool(void)
+{
+        pthread_once(&thread_pool_key_once, create_thread_pool_key);
+        if (!is_thread_pool_key_valid)
+                return NULL;
+
+        struct thread_pool *pool = pthread_getspecific(thread_pool_key);
+        if (pool != NULL)
+                return pool;
+
+        pool = calloc(1, sizeof(struct thread_pool));
+        if (pool == NULL)
+                return NULL;
+
+        if (pthread_setspecific(thread_pool_key, pool) != 0) {
+                free(pool);
+                return NULL;
+        }
+
+        return pool;
+}
+
+AVFrame *pool_frame_get(void)
+{
+        struct thread_pool *pool = get_thread_pool();
+        if ((pool == NULL) || (pool->num_frames == 0))
+                return av_frame_alloc();
+
+        --pool->num_frames;
+        return pool->frames[pool->num_frames];
+}
+
+void pool_frame_put(AVFrame **frame)
+{
+        if (*frame == NULL)
+                return;
+
+        struct thread_pool *pool = get_thread_pool();
+        if ((pool == NULL) || (pool->num_frames == POOL_NUM_FRAMES)) {
+                av_frame_free(frame);
+                return;
+        }
+
+        av_frame_unref(*frame);
+        pool->frames[pool->num_frames] = *frame;
+        ++pool->num_frames;
+        *frame = NULL;
+}
+
+AVFrame *pool_rgb_image_get(int32_t width, int32_t height)
+{
+        struct thread_pool *pool = get_thread_pool();
+        if ((pool != NULL) && (pool->frame_rgb != NULL)) {
+                AVFrame *frame_rgb = pool->frame_rgb;
+                pool->frame_rgb = NULL;
+                if ((frame_rgb->width == width) &&
+                    (frame_rgb->height == height))
+                        return frame_rgb;
+
+                free_rgb_image(&frame_rgb);
+        }
+
+        AVFrame *frame_rgb = av_frame_alloc();
+        if (frame_rgb == NULL)
+                return NULL;
+
+        frame_rgb->format = AV_PIX_FMT_RGB24;
+        frame_rgb->width = width;
+        frame_rgb->height = height;
+
+        int32_t status = av_image_alloc(frame_rgb->data,
+                                        frame_rgb->linesize,
+                                        frame_rgb->width,
+                                        frame_rgb->height,
+                                        AV_PIX_FMT_RGB24,
+                                        32);
+        if (status < 0) {
+                av_frame_free(&frame_rgb);
+                return NULL;
+        }
+
+        return frame_rgb;
+}
+
+void pool_rgb_image_put(AVFrame **frame_rgb)
+{
+        if (*frame_rgb == NULL)
+                return;
+
+        struct thread_pool *pool = get_thread_pool();
+        if (pool == NULL) {
+                free_rgb_image(frame_rgb);
+                return;
+        }
+
+        /* NOTE: Keep the most recent size, which is the likeliest next. */
+        free_rgb_image(&pool->frame_rgb);
+        pool->frame_rgb = *frame_rgb;
+        *frame_rgb = NULL;
+}
+
+struct SwsContext *
+pool_sws_get(int32_t src_width,
+             int32_t src_height,
+             enum AVPixelFormat src_format,
+             int32_t dst_width,
+             int32_t dst_height,
+             enum AVPixelFormat dst_format,
+             int32_t flags)
+{
+        struct SwsContext *sws_context = NULL;
+        struct thread_pool *pool = get_thread_pool();
+        if (pool != NULL) {
+                sws_context = pool->sws_context;
+                pool->sws_context = NULL;
+        }
+
+        return sws_getCachedContext(sws_context,
+                                    src_width,
+                                    src_height,
+                                    src_format,
+                                    dst_width,
+                                    dst_height,
+                                    dst_format,
+                                    flags,
+                                    NULL,
+                                    NULL,
+                                    NULL);
+}
+
+void pool_sws_put(struct SwsContext **sws_context)
+{
+        if (*sws_context == NULL)
+                return;
+
+        struct thread_pool *pool = get_thread_pool();
+        if (pool == NULL) {
+                sws_freeContext(*sws_context);
+        } else {
+                sws_freeContext(pool->sws_context);
+                pool->sws_context = *sws_context;
+        }
+        *sws_context = NULL;
+}
+
+struct rgb_converter *
+pool_rgb_converter_get(int32_t src_width,
+                       int32_t src_height,
+                       enum AVPixelFormat src_format,
+                       int32_t dst_width,
+                       int32_t dst_height,
+                       enum rgb_kernel kernel)
+{
+        struct thread_pool *pool = get_thread_pool();
+        if ((pool != NULL) && (pool->rgb_converter != NULL)) {
+                struct rgb_converter *converter = pool->rgb_converter;
+                pool->rgb_converter = NULL;
+                if (rgb_converter_matches(converter,
+                                          src_width,
+                                          src_height,
+                                          src_format,
+                                          dst_width,
+                                          dst_height,
+                                          kernel))
+                        return converter;
+
+                free_rgb_converter(&converter);
+        }
+
+        return new_rgb_converter(src_width,
+                                 src_height,
+                                 src_format,
+                                 dst_width,
+                                 dst_height,
+                                 kernel);
+}
+
+void pool_rgb_converter_put(struct rgb_converter **converter)
+{
+        if (*converter == NULL)
+                return;
+
+        struct thread_pool *pool = get_thread_pool();
+        if (pool == NULL) {
+                free_rgb_converter(converter);
+                return;
+        }
+
+        free_rgb_converter(&pool->rgb_converter);
+        pool->rgb_converter = *converter;
+        *converter = NULL;
+}
+
+static size_t
+round_up(size_t size_bytes, size_t alignment)
+{
+        return (size_bytes + alignment - 1)/alignment*alignment;
+}
+
+static void
+free_pool_buffer(struct pool_buffer buffer)
+{
+        if (buffer.is_mmapped)
+                munmap(buffer.data, buffer.capacity_bytes);
+        else
+                free(buffer.data);
+}
+
+void
+buffer_pool_configure(size_t max_cached_bytes, bool use_huge_pages)
+{
+        pthread_mutex_lock(&buffer_pool_lock);
+        max_idle_bytes = max_cached_bytes;
+        should_use_huge_pages = use_huge_pages;
+        while (idle_bytes > max_idle_bytes) {
+                --num_idle_buffers;
+                idle_bytes -= idle_buffers[num_idle_buffers].capacity_bytes;
+                free_pool_buffer(idle_buffers[num_idle_buffers]);
+        }
+        pthread_mutex_unlock(&buffer_pool_lock);
+}
+
+struct pool_buffer buffer_pool_get(size_t size_bytes)
+{
+        struct pool_buffer buffer = {NULL, 0, false};
+
+        /**
+         * NOTE: Take the smallest idle buffer that fits, but not one more
+         * than twice the size needed, so that small requests don't pin large
+         * buffers.
+         */
+        pthread_mutex_lock(&buffer_pool_lock);
+        int32_t best_index = -1;
+        int32_t buffer_index;
+        for (buffer_index = 0;
+             buffer_index < num_idle_buffers;
+             ++buffer_index) {
+                size_t capacity_bytes =
+                        idle_buffers[buffer_index].capacity_bytes;
+                if ((capacity_bytes >= size_bytes) &&
+                    (capacity_bytes <= 2*size_bytes) &&
+                    ((best_index < 0) ||
+                     (capacity_bytes <
+                      idle_buffers[best_index].capacity_bytes)))
+                        best_index = buffer_index;
+        }
+        if (best_index >= 0) {
+                buffer = idle_buffers[best_index];
+                --num_idle_buffers;
+                idle_buffers[best_index] = idle_buffers[num_idle_buffers];
+                idle_bytes -= buffer.capacity_bytes;
+        }
+        bool use_huge_pages = should_use_huge_pages;
+        pthread_mutex_unlock(&buffer_pool_lock);
+
+        if (buffer.data != NULL)
+                return buffer;
+
+        if (use_huge_pages && (size_bytes >= HUGE_PAGE_SIZE_BYTES)) {
+                buffer.capacity_bytes = round_up(size_bytes,
+                                                 HUGE_PAGE_SIZE_BYTES);
+                void *data = mmap(NULL,
+                                  buffer.capacity_bytes,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS,
+                                  -1,
+                                  0);
+                if (data != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+                        madvise(data, buffer.capacity_bytes, MADV_HUGEPAGE);
+#endif
+                        buffer.data = data;
+                        buffer.is_mmapped = true;
+                        return buffer;
+                }
+        }
+
+        buffer.capacity_bytes = round_up((size_bytes > 0) ? size_bytes : 1,
+                                         PAGE_SIZE_BYTES);
+        void *data = NULL;
+        if (posix_memalign(&data,
+                           BUFFER_ALIGN_BYTES,
+                           buffer.capacity_bytes) != 0)
+                data = NULL;
+        buffer.data = data;
+        buffer.is_mmapped = false;
+
+        return buffer;
+}
+
+void buffer_pool_put(struct pool_buffer buffer)
+{
+        if (buffer.data == NULL)
+                return;
+
+        pthread_mutex_lock(&buffer_pool_lock);
+        bool is_cached = ((num_idle_buffers < BUFFER_POOL_NUM_SLOTS) &&
+                          (idle_bytes + buffer.capacity_bytes <= max_idle_bytes));
+        if (is_cached) {
+                idle_buffers[num_idle_buffers] = buffer;
+                ++num_idle_buffers;
+                idle_bytes += buffer.capacity_bytes;
+        }
+        pthread_mutex_unlock(&buffer_pool_lock);
+
+        if (!is_cached)
+                free_pool_buffer(buffer);
+}
@@ -0,0 +1,155 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+/**
+ * Pools that recycle the objects and buffers allocated by every decode call.
+ *
+ * Scratch objects (AVFrames, the RGB conversion image, swscale contexts and
+ * RGB converters) are cached per thread, and are only ever used by one call at a time on that
+ * thread. Large output buffers are cached in one pool shared by all threads,
+ * since an output is freed by whichever thread drops the last reference to
+ * it.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+#ifdef __cplusplus
+};
+#endif
+#include "rgb_convert.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * pool_frame_get() - Returns an empty AVFrame from this thread's pool, or a
+ * newly allocated one if the pool is empty. Returns NULL if out of memory.
+ */
+AVFrame *pool_frame_get(void);
+
+/**
+ * pool_frame_put() - Unreferences `*frame`, returns it to this thread's pool
+ * (or frees it if the pool is full), and sets `*frame` to NULL.
+ *
+ * Like av_frame_free(), does nothing if `*frame` is NULL.
+ */
+void pool_frame_put(AVFrame **frame);
+
+/**
+ * pool_rgb_image_get() - Returns a `width` by `height` RGB24 image, with
+ * 32-byte aligned rows, for use as sws_scale() output.
+ *
+ * The image cached by this thread is reused if it has the same size.
+ * Returns NULL if out of memory. Release with pool_rgb_image_put().
+ */
+AVFrame *pool_rgb_image_get(int32_t width, int32_t height);
+
+/**
+ * pool_rgb_image_put() - Returns `*frame_rgb` to this thread's cache, and
+ * sets `*frame_rgb` to NULL.
+ */
+void pool_rgb_image_put(AVFrame **frame_rgb);
+
+/**
+ * pool_sws_get() - Returns a swscale context for the given conversion.
+ *
+ * The context cached by this thread is reused through
+ * sws_getCachedContext(), so that converting a run of same-sized videos
+ * initializes swscale once. Returns NULL on failure. Release with
+ * pool_sws_put().
+ */
+struct SwsContext *
+pool_sws_get(int32_t src_width,
+             int32_t src_height,
+             enum AVPixelFormat src_format,
+             int32_t dst_width,
+             int32_t dst_height,
+             enum AVPixelFormat dst_format,
+             int32_t flags);
+
+/**
+ * pool_sws_put() - Returns `*sws_context` to this thread's cache, and sets
+ * `*sws_context` to NULL.
+ */
+void pool_sws_put(struct SwsContext **sws_context);
+
+/**
+ * pool_rgb_converter_get() - Returns a converter for the given conversion,
+ * which must be supported by rgb_converter_supports().
+ *
+ * The converter cached by this thread is reused if it matches, so that its
+ * filters are built once per run of same-sized videos. Returns NULL if out of
+ * memory. Release with pool_rgb_converter_put().
+ */
+struct rgb_converter *
+pool_rgb_converter_get(int32_t src_width,
+                       int32_t src_height,
+                       enum AVPixelFormat src_format,
+                       int32_t dst_width,
+                       int32_t dst_height,
+                       enum rgb_kernel kernel);
+
+/**
+ * pool_rgb_converter_put() - Returns `*converter` to this thread's cache, and
+ * sets `*converter` to NULL.
+ */
+void pool_rgb_converter_put(struct rgb_converter **converter);
+
+/**
+ * struct pool_buffer - A large buffer from buffer_pool_get().
+ * @data: Start of the buffer, 64-byte aligned.
+ * @capacity_bytes: Usable size of the buffer, at least the size requested.
+ * @is_mmapped: True iff the buffer was mapped to be backed by huge pages.
+ */
+struct pool_buffer {
+        uint8_t *data;
+        size_t capacity_bytes;
+        bool is_mmapped;
+};
+
+/**
+ * buffer_pool_configure() - Sets the limits of the shared large buffer pool.
+ * @max_cached_bytes: Largest total capacity of idle buffers kept for reuse.
+ * Zero frees the idle buffers, and disables caching.
+ * @should_use_huge_pages: Back new buffers of at least one huge page with
+ * transparent huge pages, to cut page faults when they are first written.
+ */
+void
+buffer_pool_configure(size_t max_cached_bytes, bool should_use_huge_pages);
+
+/**
+ * buffer_pool_get() - Returns a buffer of at least `size_bytes` from the
+ * shared pool, or a newly allocated one.
+ *
+ * On failure, `data` of the result is NULL.
+ */
+struct pool_buffer buffer_pool_get(size_t size_bytes);
+
+/**
+ * buffer_pool_put() - Returns `buffer` to the shared pool, or frees it if the
+ * pool is full. Safe to call from any thread.
+ */
+void buffer_pool_put(struct pool_buffer buffer);
+
+#endif // _BUFFER_POOL_H_
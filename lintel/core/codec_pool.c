@@ -0,0 +1,239 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "codec_pool.h"
+#include "video_decode.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CODEC_POOL_NUM_SLOTS 64
+
+/**
+ * struct codec_key - Parameters a pooled decoder was opened with. Owned by
+ * the decoder, as its `opaque` pointer.
+ * @codec_id: Codec of the stream.
+ * @format: Pixel format of the stream.
+ * @width: Width of the stream.
+ * @height: Height of the stream.
+ * @profile: Codec profile of the stream.
+ * @level: Codec level of the stream.
+ * @color_range: Color range tag of the stream.
+ * @color_space: Color matrix tag of the stream.
+ * @color_primaries: Color primaries tag of the stream.
+ * @color_trc: Transfer characteristic tag of the stream.
+ * @chroma_location: Chroma sample location of the stream.
+ * @sample_aspect_ratio: Sample aspect ratio of the stream.
+ * @field_order: Field order of the stream.
+ * @should_export_mvs: Whether the decoder exports motion vectors.
+ * @extradata_size: Size of `extradata`, in bytes.
+ * @extradata: Copy of the codec extradata of the stream.
+ */
+struct codec_key {
+        enum AVCodecID codec_id;
+        int32_t format;
+        int32_t width;
+        int32_t height;
+        int32_t profile;
+        int32_t level;
+        enum AVColorRange color_range;
+        enum AVColorSpace color_space;
+        enum AVColorPrimaries color_primaries;
+        enum AVColorTransferCharacteristic color_trc;
+        enum AVChromaLocation chroma_location;
+        AVRational sample_aspect_ratio;
+        enum AVFieldOrder field_order;
+        bool should_export_mvs;
+        int32_t extradata_size;
+        uint8_t extradata[];
+};
+
+static pthread_mutex_t codec_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static AVCodecContext *idle_contexts[CODEC_POOL_NUM_SLOTS];
+static int32_t num_idle_contexts = 0;
+static int32_t max_idle_contexts = DEFAULT_CODEC_POOL_SIZE;
+
+static struct codec_key *
+new_codec_key(const AVCodecParameters *codecpar, bool should_export_mvs)
+{
+        struct codec_key *key = malloc(sizeof(struct codec_key) +
+                                       codecpar->extradata_size);
+        if (key == NULL)
+                return NULL;
+
+        key->codec_id = codecpar->codec_id;
+        key->format = codecpar->format;
+        key->width = codecpar->width;
+        key->height = codecpar->height;
+        key->profile = codecpar->profile;
+        key->level = codecpar->level;
+        key->color_range = codecpar->color_range;
+        key->color_space = codecpar->color_space;
+        key->color_primaries = codecpar->color_primaries;
+        key->color_trc = codecpar->color_trc;
+        key->chroma_location = codecpar->chroma_location;
+        key->sample_aspect_ratio = codecpar->sample_aspect_ratio;
+        key->field_order = codecpar->field_order;
+        key->should_export_mvs = should_export_mvs;
+        key->extradata_size = codecpar->extradata_size;
+        if (codecpar->extradata_size > 0)
+                memcpy(key->extradata,
+                       codecpar->extradata,
+                       codecpar->extradata_size);
+
+        return key;
+}
+
+/**
+ * NOTE: avcodec_parameters_to_context() copies the color tags, sample aspect
+ * ratio and field order of the stream into the decoder, which stamps them on
+ * every frame unless the bitstream, e.g., an H.264 SPS with VUI, overrides
+ * them. They are keyed so that a reused decoder never tags frames with those
+ * of the file it was last used for, which the RGB kernels convert by.
+ */
+static bool
+codec_key_matches(const struct codec_key *key,
+                  const AVCodecParameters *codecpar,
+                  bool should_export_mvs)
+{
+        return (key->codec_id == codecpar->codec_id) &&
+               (key->format == codecpar->format) &&
+               (key->width == codecpar->width) &&
+               (key->height == codecpar->height) &&
+               (key->profile == codecpar->profile) &&
+               (key->level == codecpar->level) &&
+               (key->color_range == codecpar->color_range) &&
+               (key->color_space == codecpar->color_space) &&
+               (key->color_primaries == codecpar->color_primaries) &&
+               (key->color_trc == codecpar->color_trc) &&
+               (key->chroma_location == codecpar->chroma_location) &&
+               (key->sample_aspect_ratio.num ==
+                codecpar->sample_aspect_ratio.num) &&
+               (key->sample_aspect_ratio.den ==
+                codecpar->sample_aspect_ratio.den) &&
+               (key->field_order == codecpar->field_order) &&
+               (key->should_export_mvs == should_export_mvs) &&
+               (key->extradata_size == codecpar->extradata_size) &&
+               ((codecpar->extradata_size == 0) ||
+                (memcmp(key->extradata,
+                        codecpar->extradata,
+                        codecpar->extradata_size) == 0));
+}
+
+static void
+free_codec_context(AVCodecContext **codec_context)
+{
+        if (*codec_context == NULL)
+                return;
+
+        free((*codec_context)->opaque);
+        (*codec_context)->opaque = NULL;
+        avcodec_close(*codec_context);
+        avcodec_free_context(codec_context);
+}
+
+AVCodecContext *
+codec_pool_get(AVStream *video_stream, bool should_export_mvs)
+{
+        const AVCodecParameters *codecpar = video_stream->codecpar;
+        AVCodecContext *codec_context = NULL;
+
+        pthread_mutex_lock(&codec_pool_lock);
+        int32_t i;
+        for (i = num_idle_contexts - 1;
+             i >= 0;
+             --i) {
+                if (codec_key_matches(idle_contexts[i]->opaque,
+                                      codecpar,
+                                      should_export_mvs)) {
+                        codec_context = idle_contexts[i];
+                        --num_idle_contexts;
+                        idle_contexts[i] = idle_contexts[num_idle_contexts];
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&codec_pool_lock);
+
+        if (codec_context != NULL)
+                return codec_context;
+
+        codec_context = open_video_codec_ctx(video_stream, should_export_mvs);
+        if (codec_context == NULL)
+                return NULL;
+
+        /**
+         * NOTE: Without a key, e.g., if out of memory, the decoder is freed
+         * by codec_pool_put() instead of being pooled.
+         */
+        codec_context->opaque = new_codec_key(codecpar, should_export_mvs);
+
+        return codec_context;
+}
+
+void codec_pool_put(AVCodecContext **codec_context)
+{
+        if (*codec_context == NULL)
+                return;
+
+        if ((*codec_context)->opaque == NULL) {
+                free_codec_context(codec_context);
+                return;
+        }
+
+        /**
+         * NOTE: Flushing drops the reference frames and any draining state,
+         * so that the next stream starts from its first keyframe.
+         */
+        avcodec_flush_buffers(*codec_context);
+
+        pthread_mutex_lock(&codec_pool_lock);
+        if (num_idle_contexts < max_idle_contexts) {
+                idle_contexts[num_idle_contexts] = *codec_context;
+                ++num_idle_contexts;
+                *codec_context = NULL;
+        }
+        pthread_mutex_unlock(&codec_pool_lock);
+
+        free_codec_context(codec_context);
+}
+
+void codec_pool_configure(int32_t max_idle)
+{
+        AVCodecContext *evicted[CODEC_POOL_NUM_SLOTS];
+        int32_t num_evicted = 0;
+
+        if (max_idle < 0)
+                max_idle = 0;
+        if (max_idle > CODEC_POOL_NUM_SLOTS)
+                max_idle = CODEC_POOL_NUM_SLOTS;
+
+        pthread_mutex_lock(&codec_pool_lock);
+        max_idle_contexts = max_idle;
+        while (num_idle_contexts > max_idle_contexts) {
+                --num_idle_contexts;
+                evicted[num_evicted] = idle_contexts[num_idle_contexts];
+                ++num_evicted;
+        }
+        pthread_mutex_unlock(&codec_pool_lock);
+
+        int32_t i;
+        for (i = 0;
+             i < num_evicted;
+             ++i)
+                free_codec_context(&evicted[i]);
+}
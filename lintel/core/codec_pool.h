@@ -0,0 +1,74 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CODEC_POOL_H_
+#define _CODEC_POOL_H_
+
+/**
+ * Pool of opened video decoders, shared by all threads, so that a run of
+ * files encoded alike opens its decoder once rather than once per file.
+ *
+ * A decoder is only reused for a stream whose codec, size, pixel format,
+ * profile, level, color tags, chroma location, sample aspect ratio, field
+ * order and extradata (e.g., the H.264 SPS and PPS) are identical to those it
+ * was opened with, and with the same motion vector export, so a reused
+ * decoder behaves exactly like a newly opened one.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#ifdef __cplusplus
+};
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Default number of idle decoders kept by the pool. */
+#define DEFAULT_CODEC_POOL_SIZE 8
+
+/**
+ * codec_pool_get() - Returns an opened decoder for `video_stream`: an idle
+ * one from the pool if one matches, or else a newly opened one.
+ * @video_stream: Stream to decode.
+ * @should_export_mvs: Have the decoder export motion vectors. See
+ * open_video_codec_ctx().
+ *
+ * Returns NULL on failure. Release with codec_pool_put().
+ */
+AVCodecContext *
+codec_pool_get(AVStream *video_stream, bool should_export_mvs);
+
+/**
+ * codec_pool_put() - Flushes `*codec_context` and returns it to the pool, or
+ * closes and frees it if the pool is full or disabled. Sets `*codec_context`
+ * to NULL.
+ *
+ * Does nothing if `*codec_context` is NULL.
+ */
+void codec_pool_put(AVCodecContext **codec_context);
+
+/**
+ * codec_pool_configure() - Keeps at most `max_idle` idle decoders (up to
+ * 64), closing any beyond that. Zero disables the pool.
+ */
+void codec_pool_configure(int32_t max_idle);
+
+#endif // _CODEC_POOL_H_
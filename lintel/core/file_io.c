@@ -0,0 +1,479 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "file_io.h"
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef LINTEL_WITH_IO_URING
+#include <liburing.h>
+#endif
+
+#define READAHEAD_ALIGN_BYTES 4096
+
+/**
+ * struct readahead - Asynchronous read of the buffer after the last one the
+ * demuxer read.
+ * @ring: io_uring of the reader, with room for the one read in flight.
+ * @data: FILE_IO_BUFFER_SIZE bytes, page aligned.
+ * @offset: File offset of `data`.
+ * @num_bytes: Number of bytes of `data` read, once `is_valid`.
+ * @is_pending: True iff the read was submitted and not yet reaped.
+ * @is_valid: True iff the read completed, with `num_bytes` bytes.
+ */
+#ifdef LINTEL_WITH_IO_URING
+struct readahead {
+        struct io_uring ring;
+        uint8_t *data;
+        int64_t offset;
+        int32_t num_bytes;
+        bool is_pending;
+        bool is_valid;
+};
+#endif
+
+/**
+ * struct file_reader - A file, or a byte range of one, read by the demuxer
+ * through `avio`.
+ * @avio: AVIOContext reading from `fd`, with a FILE_IO_BUFFER_SIZE buffer.
+ * @fd: Open file.
+ * @owns_fd: True iff `fd` is closed with the reader.
+ * @base_offset: Offset in `fd` of the start of the range.
+ * @size_bytes: Size of the range.
+ * @position: Offset of the next read of the demuxer, in the range.
+ * @access: Last access pattern declared by file_reader_advise().
+ * @readahead: io_uring readahead, or NULL for pread() only.
+ */
+struct file_reader {
+        AVIOContext *avio;
+        int fd;
+        bool owns_fd;
+        int64_t base_offset;
+        int64_t size_bytes;
+        int64_t position;
+        enum file_access access;
+#ifdef LINTEL_WITH_IO_URING
+        struct readahead *readahead;
+#endif
+};
+
+static struct file_io_stats io_stats;
+
+static void count_read(int64_t num_bytes)
+{
+        __atomic_fetch_add(&io_stats.reads, 1, __ATOMIC_RELAXED);
+        if (num_bytes > 0)
+                __atomic_fetch_add(&io_stats.bytes_read,
+                                   num_bytes,
+                                   __ATOMIC_RELAXED);
+}
+
+bool file_io_has_io_uring(void)
+{
+#ifdef LINTEL_WITH_IO_URING
+        return true;
+#else
+        return false;
+#endif
+}
+
+/**
+ * pread_fully() - pread() that retries when interrupted by a signal.
+ */
+static ssize_t
+pread_fully(int fd, uint8_t *buf, int32_t buf_size, int64_t offset)
+{
+        ssize_t num_read;
+        do {
+                num_read = pread(fd, buf, buf_size, offset);
+        } while ((num_read < 0) && (errno == EINTR));
+        count_read(num_read);
+
+        return num_read;
+}
+
+#ifdef LINTEL_WITH_IO_URING
+static struct readahead *new_readahead(void)
+{
+        struct readahead *readahead = calloc(1, sizeof(struct readahead));
+        if (readahead == NULL)
+                return NULL;
+
+        if (posix_memalign((void **)&readahead->data,
+                           READAHEAD_ALIGN_BYTES,
+                           FILE_IO_BUFFER_SIZE) != 0) {
+                free(readahead);
+                return NULL;
+        }
+
+        if (io_uring_queue_init(2, &readahead->ring, 0) < 0) {
+                free(readahead->data);
+                free(readahead);
+                return NULL;
+        }
+
+        return readahead;
+}
+
+/**
+ * reap_readahead() - Waits for the read in flight, if any.
+ */
+static void reap_readahead(struct readahead *readahead)
+{
+        if (!readahead->is_pending)
+                return;
+
+        struct io_uring_cqe *cqe;
+        int32_t status;
+        do {
+                status = io_uring_wait_cqe(&readahead->ring, &cqe);
+        } while (status == -EINTR);
+
+        readahead->is_pending = false;
+        readahead->is_valid = false;
+        if (status < 0)
+                return;
+
+        count_read(cqe->res);
+        if (cqe->res > 0) {
+                readahead->num_bytes = cqe->res;
+                readahead->is_valid = true;
+        }
+        io_uring_cqe_seen(&readahead->ring, cqe);
+}
+
+/**
+ * submit_readahead() - Starts reading the buffer at `offset`, unless the
+ * readahead already covers it.
+ */
+static void
+submit_readahead(struct file_reader *reader, int64_t offset)
+{
+        struct readahead *readahead = reader->readahead;
+        if (readahead->is_pending || (offset >= reader->size_bytes))
+                return;
+        if (readahead->is_valid &&
+            (offset >= readahead->offset) &&
+            (offset < readahead->offset + readahead->num_bytes))
+                return;
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&readahead->ring);
+        if (sqe == NULL)
+                return;
+
+        int64_t remaining = reader->size_bytes - offset;
+        io_uring_prep_read(sqe,
+                           reader->fd,
+                           readahead->data,
+                           (remaining < FILE_IO_BUFFER_SIZE) ?
+                           remaining : FILE_IO_BUFFER_SIZE,
+                           reader->base_offset + offset);
+        if (io_uring_submit(&readahead->ring) != 1)
+                return;
+
+        readahead->offset = offset;
+        readahead->is_pending = true;
+        readahead->is_valid = false;
+}
+
+/**
+ * read_from_readahead() - Copies the bytes at `offset` from the readahead
+ * into `buf`, waiting for the read in flight if needed.
+ *
+ * Returns the number of bytes copied, or 0 if the readahead doesn't cover
+ * `offset`.
+ */
+static int32_t
+read_from_readahead(struct readahead *readahead,
+                    uint8_t *buf,
+                    int32_t buf_size,
+                    int64_t offset)
+{
+        reap_readahead(readahead);
+        if (!readahead->is_valid ||
+            (offset < readahead->offset) ||
+            (offset >= readahead->offset + readahead->num_bytes))
+                return 0;
+
+        int64_t available = readahead->offset + readahead->num_bytes - offset;
+        int32_t num_copied = (available < buf_size) ? available : buf_size;
+        memcpy(buf, readahead->data + (offset - readahead->offset), num_copied);
+        __atomic_fetch_add(&io_stats.readahead_hits, 1, __ATOMIC_RELAXED);
+
+        return num_copied;
+}
+
+static void free_readahead(struct readahead **readahead)
+{
+        if (*readahead == NULL)
+                return;
+
+        reap_readahead(*readahead);
+        io_uring_queue_exit(&(*readahead)->ring);
+        free((*readahead)->data);
+        free(*readahead);
+        *readahead = NULL;
+}
+#endif
+
+/**
+ * read_packet() - AVIOContext read callback.
+ */
+static int
+read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+        struct file_reader *reader = opaque;
+        if (reader->position >= reader->size_bytes)
+                return AVERROR_EOF;
+
+        int64_t remaining = reader->size_bytes - reader->position;
+        if (buf_size > remaining)
+                buf_size = remaining;
+
+        int64_t num_read = 0;
+#ifdef LINTEL_WITH_IO_URING
+        if (reader->readahead != NULL)
+                num_read = read_from_readahead(reader->readahead,
+                                               buf,
+                                               buf_size,
+                                               reader->position);
+#endif
+        if (num_read == 0) {
+                num_read = pread_fully(reader->fd,
+                                       buf,
+                                       buf_size,
+                                       reader->base_offset +
+                                       reader->position);
+                if (num_read < 0)
+                        return AVERROR(errno);
+                if (num_read == 0)
+                        return AVERROR_EOF;
+        }
+        reader->position += num_read;
+
+#ifdef LINTEL_WITH_IO_URING
+        if ((reader->readahead != NULL) &&
+            (reader->access == FILE_ACCESS_SEQUENTIAL))
+                submit_readahead(reader, reader->position);
+#endif
+
+        return num_read;
+}
+
+/**
+ * seek_file() - AVIOContext seek callback.
+ */
+static int64_t
+seek_file(void *opaque, int64_t offset, int whence)
+{
+        struct file_reader *reader = opaque;
+
+        whence &= ~AVSEEK_FORCE;
+        if (whence == AVSEEK_SIZE)
+                return reader->size_bytes;
+
+        int64_t position;
+        if (whence == SEEK_SET)
+                position = offset;
+        else if (whence == SEEK_CUR)
+                position = reader->position + offset;
+        else if (whence == SEEK_END)
+                position = reader->size_bytes + offset;
+        else
+                return AVERROR(EINVAL);
+        if (position < 0)
+                return AVERROR(EINVAL);
+
+        __atomic_fetch_add(&io_stats.seeks, 1, __ATOMIC_RELAXED);
+        reader->position = position;
+
+        return position;
+}
+
+/**
+ * new_file_reader() - Returns a reader of the `size_bytes` bytes of `fd` from
+ * `base_offset`, or NULL if out of memory.
+ */
+static struct file_reader *
+new_file_reader(int fd,
+                bool owns_fd,
+                int64_t base_offset,
+                int64_t size_bytes,
+                enum file_io_backend backend)
+{
+        struct file_reader *reader = calloc(1, sizeof(struct file_reader));
+        uint8_t *buffer = av_malloc(FILE_IO_BUFFER_SIZE);
+        if ((reader == NULL) || (buffer == NULL))
+                goto err_free;
+
+        reader->fd = fd;
+        reader->owns_fd = owns_fd;
+        reader->base_offset = base_offset;
+        reader->size_bytes = size_bytes;
+        reader->access = FILE_ACCESS_SEQUENTIAL;
+        reader->avio = avio_alloc_context(buffer,
+                                          FILE_IO_BUFFER_SIZE,
+                                          0,
+                                          reader,
+                                          read_packet,
+                                          NULL,
+                                          seek_file);
+        if (reader->avio == NULL)
+                goto err_free;
+
+#ifdef LINTEL_WITH_IO_URING
+        /* NOTE: Without a ring, e.g., on old kernels, pread() is used. */
+        if (backend == FILE_IO_IO_URING)
+                reader->readahead = new_readahead();
+#else
+        (void)backend;
+#endif
+
+        return reader;
+
+err_free:
+        av_free(buffer);
+        free(reader);
+
+        return NULL;
+}
+
+int32_t
+open_file_reader(struct file_reader **reader,
+                 const char *filename,
+                 enum file_io_backend backend)
+{
+        *reader = NULL;
+
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return AVERROR(errno);
+
+        struct stat file_stat;
+        if ((fstat(fd, &file_stat) != 0) || !S_ISREG(file_stat.st_mode)) {
+                close(fd);
+                return AVERROR(EINVAL);
+        }
+
+        *reader = new_file_reader(fd, true, 0, file_stat.st_size, backend);
+        if (*reader == NULL) {
+                close(fd);
+                return AVERROR(ENOMEM);
+        }
+
+        return 0;
+}
+
+int32_t
+open_file_range_reader(struct file_reader **reader,
+                       int fd,
+                       int64_t offset,
+                       int64_t length,
+                       enum file_io_backend backend)
+{
+        *reader = NULL;
+        if ((offset < 0) || (length < 0))
+                return AVERROR(EINVAL);
+
+        *reader = new_file_reader(fd, false, offset, length, backend);
+        if (*reader == NULL)
+                return AVERROR(ENOMEM);
+
+        return 0;
+}
+
+AVIOContext *file_reader_avio(struct file_reader *reader)
+{
+        return reader->avio;
+}
+
+void
+file_reader_advise(struct file_reader *reader, enum file_access access)
+{
+        if (reader == NULL)
+                return;
+
+        reader->access = access;
+
+        /**
+         * NOTE: Linux applies these hints to the whole open file, so a shared
+         * fd, e.g., of a tar shard, is left to the kernel's own heuristics.
+         */
+        if (!reader->owns_fd)
+                return;
+
+        posix_fadvise(reader->fd,
+                      0,
+                      0,
+                      (access == FILE_ACCESS_RANDOM) ? POSIX_FADV_RANDOM :
+                                                       POSIX_FADV_SEQUENTIAL);
+}
+
+void close_file_reader(struct file_reader **reader)
+{
+        if (*reader == NULL)
+                return;
+
+#ifdef LINTEL_WITH_IO_URING
+        free_readahead(&(*reader)->readahead);
+#endif
+        /**
+         * NOTE: The demuxer may have replaced the buffer, so it is freed
+         * through the AVIOContext.
+         */
+        av_freep(&(*reader)->avio->buffer);
+        av_freep(&(*reader)->avio);
+        if ((*reader)->owns_fd)
+                close((*reader)->fd);
+        free(*reader);
+        *reader = NULL;
+}
+
+void file_io_get_stats(struct file_io_stats *stats, bool should_reset)
+{
+        if (!should_reset) {
+                stats->reads = __atomic_load_n(&io_stats.reads,
+                                               __ATOMIC_RELAXED);
+                stats->bytes_read = __atomic_load_n(&io_stats.bytes_read,
+                                                    __ATOMIC_RELAXED);
+                stats->seeks = __atomic_load_n(&io_stats.seeks,
+                                               __ATOMIC_RELAXED);
+                stats->readahead_hits =
+                        __atomic_load_n(&io_stats.readahead_hits,
+                                        __ATOMIC_RELAXED);
+                return;
+        }
+
+        stats->reads = __atomic_exchange_n(&io_stats.reads,
+                                           0,
+                                           __ATOMIC_RELAXED);
+        stats->bytes_read = __atomic_exchange_n(&io_stats.bytes_read,
+                                                0,
+                                                __ATOMIC_RELAXED);
+        stats->seeks = __atomic_exchange_n(&io_stats.seeks,
+                                           0,
+                                           __ATOMIC_RELAXED);
+        stats->readahead_hits = __atomic_exchange_n(&io_stats.readahead_hits,
+                                                    0,
+                                                    __ATOMIC_RELAXED);
+}
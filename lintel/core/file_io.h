@@ -0,0 +1,152 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FILE_IO_H_
+#define _FILE_IO_H_
+
+/**
+ * File I/O for the demuxer through a custom AVIOContext, in place of FFmpeg's
+ * `file:` protocol, with larger buffers and access pattern hints.
+ *
+ * Reads are positioned (pread), so a read never moves a shared file offset.
+ * When built with LINTEL_WITH_IO_URING, the io_uring backend also reads the
+ * next buffer asynchronously while the demuxer parses the current one, for
+ * sequential access.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavformat/avio.h>
+#ifdef __cplusplus
+};
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Size of the AVIOContext buffer, and of each read. FFmpeg's is 32 KiB. */
+#define FILE_IO_BUFFER_SIZE (256 << 10)
+
+/**
+ * enum file_io_backend - How the demuxer reads video files.
+ * @FILE_IO_FFMPEG: FFmpeg's own `file:` protocol.
+ * @FILE_IO_PREAD: pread() into FILE_IO_BUFFER_SIZE buffers.
+ * @FILE_IO_IO_URING: As FILE_IO_PREAD, plus io_uring readahead of the next
+ * buffer for sequential access. Only if built with LINTEL_WITH_IO_URING.
+ */
+enum file_io_backend {
+        FILE_IO_FFMPEG = 0,
+        FILE_IO_PREAD,
+        FILE_IO_IO_URING,
+};
+
+/**
+ * enum file_access - Expected access pattern of a file, passed on to the
+ * kernel with posix_fadvise().
+ * @FILE_ACCESS_SEQUENTIAL: Decoding on from one point, e.g., a clip.
+ * @FILE_ACCESS_RANDOM: Seeking between reads, e.g., keyframes only. Also
+ * turns off io_uring readahead.
+ */
+enum file_access {
+        FILE_ACCESS_SEQUENTIAL,
+        FILE_ACCESS_RANDOM,
+};
+
+/**
+ * struct file_io_stats - Process-wide counters of the custom file I/O.
+ * @reads: Read requests issued to the kernel, by pread() or io_uring.
+ * @bytes_read: Bytes returned by those reads.
+ * @seeks: Seeks requested by the demuxer.
+ * @readahead_hits: Reads of the demuxer served by io_uring readahead.
+ */
+struct file_io_stats {
+        uint64_t reads;
+        uint64_t bytes_read;
+        uint64_t seeks;
+        uint64_t readahead_hits;
+};
+
+struct file_reader;
+
+/**
+ * file_io_has_io_uring() - Returns true iff the io_uring backend was built.
+ */
+bool file_io_has_io_uring(void);
+
+/**
+ * open_file_reader() - Opens `filename` for reading through an AVIOContext.
+ * @reader: Output reader. Release with close_file_reader().
+ * @filename: Path of the file.
+ * @backend: FILE_IO_PREAD or FILE_IO_IO_URING. If the io_uring ring can't be
+ * set up, the reader falls back to pread().
+ *
+ * Returns 0 on success, and a negative AVERROR on failure, e.g., if
+ * `filename` is a URL rather than a file.
+ */
+int32_t
+open_file_reader(struct file_reader **reader,
+                 const char *filename,
+                 enum file_io_backend backend);
+
+/**
+ * file_reader_avio() - Returns the AVIOContext of `reader`, to be set as the
+ * `pb` of an AVFormatContext before avformat_open_input().
+ */
+/**
+ * open_file_range_reader() - Opens the `length` bytes of `fd` from `offset`
+ * for reading through an AVIOContext, as if they were a whole file.
+ * @reader: Output reader. Release with close_file_reader().
+ * @fd: Open file, which must outlive the reader, and isn't closed with it.
+ * Only positioned reads are done on `fd`, so it can be shared by readers.
+ * @offset: Start of the range in `fd`.
+ * @length: Size of the range, in bytes.
+ * @backend: FILE_IO_PREAD or FILE_IO_IO_URING.
+ *
+ * Returns 0 on success, and a negative AVERROR on failure.
+ */
+int32_t
+open_file_range_reader(struct file_reader **reader,
+                       int fd,
+                       int64_t offset,
+                       int64_t length,
+                       enum file_io_backend backend);
+
+AVIOContext *file_reader_avio(struct file_reader *reader);
+
+/**
+ * file_reader_advise() - Declares the upcoming access pattern of `reader`.
+ * Does nothing if `reader` is NULL.
+ */
+void
+file_reader_advise(struct file_reader *reader, enum file_access access);
+
+/**
+ * close_file_reader() - Closes `*reader` and frees its AVIOContext, and sets
+ * `*reader` to NULL. Does nothing if `*reader` is NULL.
+ *
+ * Must be called after the AVFormatContext using it is closed.
+ */
+void close_file_reader(struct file_reader **reader);
+
+/**
+ * file_io_get_stats() - Copies the process-wide I/O counters to `stats`, and
+ * zeroes them if `should_reset`.
+ */
+void file_io_get_stats(struct file_io_stats *stats, bool should_reset);
+
+#endif // _FILE_IO_H_
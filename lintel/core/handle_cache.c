@@ -0,0 +1,404 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "handle_cache.h"
+#include "buffer_pool.h"
+#include "codec_pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HANDLE_CACHE_NUM_SLOTS 64
+
+/**
+ * struct handle_key - Identity of the file a cached handle was opened from.
+ * Owned by the video_stream_context, as its `cache_key`.
+ * @mtime_ns: Modification time of the file, in nanoseconds.
+ * @size_bytes: Size of the file.
+ * @should_export_mvs: Whether the decoder exports motion vectors.
+ * @fast_open: Whether the file was opened without find_stream_info.
+ * @pid: Process that opened the file.
+ * @path: Path the file was opened by.
+ */
+struct handle_key {
+        int64_t mtime_ns;
+        int64_t size_bytes;
+        bool should_export_mvs;
+        bool fast_open;
+        pid_t pid;
+        char path[];
+};
+
+/**
+ * NOTE: Idle handles are kept by value, least recently released first, so
+ * that evicting takes the first and a hit takes the last match.
+ */
+static pthread_mutex_t handle_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct video_stream_context idle_handles[HANDLE_CACHE_NUM_SLOTS];
+static int32_t num_idle_handles = 0;
+static int32_t max_idle_handles = 0;
+static struct handle_cache_stats cache_stats;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/**
+ * new_handle_key() - Returns the key of `filename` as it is now, or NULL if
+ * it can't be stat'ed, e.g., for URLs, or if out of memory.
+ */
+static struct handle_key *
+new_handle_key(const char *filename, bool should_export_mvs, bool fast_open)
+{
+        struct stat file_stat;
+        if (stat(filename, &file_stat) != 0)
+                return NULL;
+
+        size_t path_size = strlen(filename) + 1;
+        struct handle_key *key = malloc(sizeof(struct handle_key) + path_size);
+        if (key == NULL)
+                return NULL;
+
+        key->mtime_ns = (int64_t)file_stat.st_mtim.tv_sec*1000000000 +
+                        file_stat.st_mtim.tv_nsec;
+        key->size_bytes = file_stat.st_size;
+        key->should_export_mvs = should_export_mvs;
+        key->fast_open = fast_open;
+        key->pid = getpid();
+        memcpy(key->path, filename, path_size);
+
+        return key;
+}
+
+static bool
+is_same_file(const struct handle_key *a, const struct handle_key *b)
+{
+        return (a->should_export_mvs == b->should_export_mvs) &&
+               (strcmp(a->path, b->path) == 0);
+}
+
+static bool
+is_same_version(const struct handle_key *a, const struct handle_key *b)
+{
+        return (a->mtime_ns == b->mtime_ns) && (a->size_bytes == b->size_bytes);
+}
+
+/**
+ * is_probed_enough() - Returns true iff a handle cached under `idle` was
+ * probed as fully as a call with `key` asks for. A fully probed handle also
+ * serves fast opens, but not the other way around.
+ */
+static bool
+is_probed_enough(const struct handle_key *idle, const struct handle_key *key)
+{
+        return !idle->fast_open || key->fast_open;
+}
+
+/**
+ * close_cached_handle() - Closes a handle that was in the cache, and frees
+ * its key.
+ */
+static void
+close_cached_handle(struct video_stream_context *vid_ctx)
+{
+        pool_frame_put(&vid_ctx->frame);
+        codec_pool_put(&vid_ctx->codec_context);
+        close_video_input(vid_ctx);
+        handle_cache_free_key(vid_ctx);
+}
+
+/**
+ * rewind_handle() - Seeks `vid_ctx` back to the start of its video stream,
+ * and drops the frames buffered in its decoder.
+ *
+ * Returns true on success.
+ */
+static bool
+rewind_handle(struct video_stream_context *vid_ctx)
+{
+        AVStream *video_stream =
+            vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        int64_t start_time = (video_stream->start_time != AV_NOPTS_VALUE) ?
+                             video_stream->start_time : 0;
+
+        if (av_seek_frame(vid_ctx->format_context,
+                          vid_ctx->video_stream_index,
+                          start_time,
+                          AVSEEK_FLAG_BACKWARD) < 0)
+                return false;
+        avcodec_flush_buffers(vid_ctx->codec_context);
+
+        return true;
+}
+
+/**
+ * remove_idle_handle() - Removes slot `index` of the cache, keeping the
+ * order of the others. Must be called with the lock held.
+ */
+static struct video_stream_context
+remove_idle_handle(int32_t index)
+{
+        struct video_stream_context removed = idle_handles[index];
+
+        --num_idle_handles;
+        memmove(idle_handles + index,
+                idle_handles + index + 1,
+                (num_idle_handles - index)*sizeof(idle_handles[0]));
+
+        return removed;
+}
+
+/**
+ * take_handle_to_close() - Takes one idle handle that must be closed out of
+ * the cache into `closed`, and returns true, or returns false if there is
+ * none. Must be called with the lock held.
+ * @key: Key of a handle_cache_get() call, whose file's other versions are
+ * taken, or NULL.
+ * @max_handles: Number of idle handles beyond which the least recently
+ * released are taken.
+ *
+ * NOTE: FFmpeg's file: protocol reads with read() and lseek() on a file
+ * offset that a forked child shares with its parent, so a handle inherited
+ * across fork() would race the parent's reads. The child closes its copies
+ * instead, which leaves the parent's descriptors open. Those aren't counted
+ * as evictions.
+ */
+static bool
+take_handle_to_close(const struct handle_key *key,
+                     int32_t max_handles,
+                     struct video_stream_context *closed)
+{
+        const pid_t pid = getpid();
+        int32_t i;
+        for (i = 0;
+             i < num_idle_handles;
+             ++i) {
+                struct handle_key *idle_key = idle_handles[i].cache_key;
+                if (idle_key->pid != pid) {
+                        *closed = remove_idle_handle(i);
+                        return true;
+                }
+
+                /* NOTE: The file changed since it was cached. */
+                if ((key != NULL) &&
+                    is_same_file(idle_key, key) &&
+                    !is_same_version(idle_key, key)) {
+                        *closed = remove_idle_handle(i);
+                        ++cache_stats.evictions;
+                        return true;
+                }
+        }
+
+        if (num_idle_handles > max_handles) {
+                *closed = remove_idle_handle(0);
+                ++cache_stats.evictions;
+                return true;
+        }
+
+        return false;
+}
+
+/**
+ * close_taken_handles() - Closes the handles take_handle_to_close() takes,
+ * one at a time, each outside the lock.
+ */
+static void
+close_taken_handles(const struct handle_key *key, int32_t max_handles)
+{
+        struct video_stream_context closed;
+        bool should_close;
+        do {
+                pthread_mutex_lock(&handle_cache_lock);
+                should_close = take_handle_to_close(key, max_handles, &closed);
+                pthread_mutex_unlock(&handle_cache_lock);
+
+                if (should_close)
+                        close_cached_handle(&closed);
+        } while (should_close);
+}
+
+static void lock_before_fork(void)
+{
+        pthread_mutex_lock(&handle_cache_lock);
+}
+
+static void unlock_after_fork(void)
+{
+        pthread_mutex_unlock(&handle_cache_lock);
+}
+
+/**
+ * NOTE: The lock is held across fork(), so that a child never inherits it
+ * locked by a thread that doesn't exist in the child.
+ */
+static void register_atfork(void)
+{
+        pthread_atfork(lock_before_fork, unlock_after_fork, unlock_after_fork);
+}
+
+bool
+handle_cache_get(struct video_stream_context *vid_ctx,
+                 const char *filename,
+                 bool should_export_mvs,
+                 bool fast_open)
+{
+        vid_ctx->cache_key = NULL;
+        if (__atomic_load_n(&max_idle_handles, __ATOMIC_RELAXED) == 0)
+                return false;
+
+        struct handle_key *key = new_handle_key(filename,
+                                                should_export_mvs,
+                                                fast_open);
+        if (key == NULL)
+                return false;
+
+        close_taken_handles(key, HANDLE_CACHE_NUM_SLOTS);
+
+        struct video_stream_context cached;
+        bool is_hit = false;
+
+        pthread_mutex_lock(&handle_cache_lock);
+        int32_t i;
+        for (i = num_idle_handles - 1;
+             i >= 0;
+             --i) {
+                struct handle_key *idle_key = idle_handles[i].cache_key;
+                if ((idle_key->pid == key->pid) &&
+                    is_same_file(idle_key, key) &&
+                    is_same_version(idle_key, key) &&
+                    is_probed_enough(idle_key, key)) {
+                        cached = remove_idle_handle(i);
+                        is_hit = true;
+                        break;
+                }
+        }
+        if (is_hit)
+                ++cache_stats.hits;
+        else
+                ++cache_stats.misses;
+        pthread_mutex_unlock(&handle_cache_lock);
+
+        if (!is_hit) {
+                vid_ctx->cache_key = key;
+                return false;
+        }
+
+        /**
+         * NOTE: The interrupt callback of the cached format context still
+         * points at the context it was released from, so it is pointed at
+         * `vid_ctx` before any I/O.
+         */
+        const int64_t deadline_us = vid_ctx->deadline_us;
+        *vid_ctx = cached;
+        vid_ctx->deadline_us = deadline_us;
+        vid_ctx->format_context->interrupt_callback.opaque = vid_ctx;
+        vid_ctx->error_type = NULL;
+        vid_ctx->audio = NULL;
+        vid_ctx->motion = NULL;
+
+        if (!rewind_handle(vid_ctx)) {
+                close_cached_handle(vid_ctx);
+                vid_ctx->cache_key = key;
+                return false;
+        }
+        free(key);
+
+        return true;
+}
+
+bool handle_cache_put(struct video_stream_context *vid_ctx)
+{
+        if (vid_ctx->cache_key == NULL)
+                return false;
+
+        bool is_reusable = (vid_ctx->error_type == NULL) &&
+                           (vid_ctx->audio == NULL) &&
+                           (vid_ctx->format_context != NULL) &&
+                           (vid_ctx->codec_context != NULL) &&
+                           (vid_ctx->frame != NULL);
+        if (!is_reusable) {
+                handle_cache_free_key(vid_ctx);
+                return false;
+        }
+
+        close_taken_handles(NULL, HANDLE_CACHE_NUM_SLOTS);
+
+        struct video_stream_context evicted;
+        bool was_evicted = false;
+        bool was_cached = false;
+
+        pthread_mutex_lock(&handle_cache_lock);
+        if (max_idle_handles > 0) {
+                if (num_idle_handles >= max_idle_handles) {
+                        evicted = remove_idle_handle(0);
+                        was_evicted = true;
+                        ++cache_stats.evictions;
+                }
+                idle_handles[num_idle_handles] = *vid_ctx;
+                ++num_idle_handles;
+                was_cached = true;
+        }
+        pthread_mutex_unlock(&handle_cache_lock);
+
+        if (was_evicted)
+                close_cached_handle(&evicted);
+
+        if (!was_cached) {
+                handle_cache_free_key(vid_ctx);
+                return false;
+        }
+
+        vid_ctx->frame = NULL;
+        vid_ctx->codec_context = NULL;
+        vid_ctx->format_context = NULL;
+        vid_ctx->cache_key = NULL;
+
+        return true;
+}
+
+void handle_cache_free_key(struct video_stream_context *vid_ctx)
+{
+        free(vid_ctx->cache_key);
+        vid_ctx->cache_key = NULL;
+}
+
+void handle_cache_configure(int32_t max_handles)
+{
+        if (max_handles < 0)
+                max_handles = 0;
+        if (max_handles > HANDLE_CACHE_NUM_SLOTS)
+                max_handles = HANDLE_CACHE_NUM_SLOTS;
+
+        pthread_once(&atfork_once, register_atfork);
+
+        pthread_mutex_lock(&handle_cache_lock);
+        __atomic_store_n(&max_idle_handles, max_handles, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&handle_cache_lock);
+
+        close_taken_handles(NULL, max_handles);
+}
+
+void
+handle_cache_get_stats(struct handle_cache_stats *stats, bool should_reset)
+{
+        pthread_mutex_lock(&handle_cache_lock);
+        *stats = cache_stats;
+        stats->num_handles = num_idle_handles;
+        if (should_reset)
+                memset(&cache_stats, 0, sizeof(cache_stats));
+        pthread_mutex_unlock(&handle_cache_lock);
+}
@@ -0,0 +1,113 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HANDLE_CACHE_H_
+#define _HANDLE_CACHE_H_
+
+/**
+ * Cache of opened videos, shared by all threads, so that calls that hit the
+ * same file within a short time seek in an already opened demuxer and decoder
+ * rather than opening the file and probing its streams again.
+ *
+ * Videos are keyed by path, modification time and size, so a file that
+ * changed is opened again. An idle handle is taken out of the cache by the
+ * call that uses it, so a handle is never shared between concurrent calls.
+ * The least recently released handle is evicted first.
+ *
+ * A process forked while handles are cached, e.g., a DataLoader worker,
+ * closes its copies of them on its first use of the cache rather than share
+ * their file offsets with its parent.
+ */
+
+#include "video_decode.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Default number of idle videos kept by the cache, once enabled. */
+#define DEFAULT_HANDLE_CACHE_SIZE 16
+
+/**
+ * struct handle_cache_stats - Counters of the handle cache.
+ * @hits: Opens served by a cached handle.
+ * @misses: Opens of a file while the cache was enabled that had no usable
+ * cached handle.
+ * @evictions: Handles closed by the cache: the least recently used when full,
+ * those of files that changed, and those dropped when the cache shrinks.
+ * Handles a forked child closes rather than share with its parent aren't
+ * counted.
+ * @num_handles: Number of idle handles in the cache.
+ */
+struct handle_cache_stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        int32_t num_handles;
+};
+
+/**
+ * handle_cache_get() - Moves an idle handle of `filename` out of the cache
+ * into `vid_ctx`, rewound to the start of the video.
+ * @vid_ctx: Output video_stream_context, with its deadline already armed.
+ * The deadline is kept.
+ * @filename: Path of the video.
+ * @should_export_mvs: Whether the decoder must export motion vectors.
+ * @fast_open: Whether the call skips find_stream_info. A handle opened with
+ * fast_open only serves calls that also pass it.
+ *
+ * Returns true iff `vid_ctx` was filled from the cache. Otherwise, the caller
+ * opens the video itself, and if the cache is enabled, `vid_ctx->cache_key`
+ * is set so that handle_cache_put() can cache it once released.
+ */
+bool
+handle_cache_get(struct video_stream_context *vid_ctx,
+                 const char *filename,
+                 bool should_export_mvs,
+                 bool fast_open);
+
+/**
+ * handle_cache_put() - Moves the opened `vid_ctx` into the cache, evicting
+ * the least recently used handle if the cache is full.
+ *
+ * Returns true iff `vid_ctx` was cached, in which case its members are left
+ * NULL. Otherwise, e.g., if `vid_ctx` has no cache key, its call ended with
+ * an error, or its audio is still open, only the key is freed, and the caller
+ * closes `vid_ctx` as usual.
+ */
+bool handle_cache_put(struct video_stream_context *vid_ctx);
+
+/**
+ * handle_cache_free_key() - Frees the cache key of `vid_ctx`, e.g., if
+ * opening the video failed after handle_cache_get().
+ */
+void handle_cache_free_key(struct video_stream_context *vid_ctx);
+
+/**
+ * handle_cache_configure() - Keeps at most `max_handles` idle handles (up to
+ * 64), closing the least recently used beyond that. Zero disables the cache,
+ * which is the default.
+ */
+void handle_cache_configure(int32_t max_handles);
+
+/**
+ * handle_cache_get_stats() - Copies the counters of the cache to `stats`,
+ * and zeroes them if `should_reset`.
+ */
+void
+handle_cache_get_stats(struct handle_cache_stats *stats, bool should_reset);
+
+#endif // _HANDLE_CACHE_H_
@@ -0,0 +1,217 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "motion_vectors.h"
+#include <libavutil/motion_vector.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int32_t
+get_grid_size(uint32_t size)
+{
+        return (size + MOTION_CELL_SIZE - 1)/MOTION_CELL_SIZE;
+}
+
+size_t
+motion_field_size_bytes(int32_t num_frames, uint32_t width, uint32_t height)
+{
+        return (size_t)num_frames*get_grid_size(width)*get_grid_size(height)*
+                2*sizeof(float);
+}
+
+int32_t
+init_motion_field(struct motion_field *motion,
+                  float *dest,
+                  int32_t num_frames,
+                  uint32_t src_width,
+                  uint32_t src_height,
+                  uint32_t width,
+                  uint32_t height)
+{
+        motion->dest = dest;
+        motion->num_frames = num_frames;
+        motion->num_filled = 0;
+        motion->grid_width = get_grid_size(width);
+        motion->grid_height = get_grid_size(height);
+        motion->scale_x = (float)width/src_width;
+        motion->scale_y = (float)height/src_height;
+
+        memset(dest, 0, motion_field_size_bytes(num_frames, width, height));
+
+        motion->counts = calloc(motion->grid_width*motion->grid_height + 1,
+                                sizeof(uint32_t));
+        if (motion->counts == NULL)
+                return -1;
+
+        return 0;
+}
+
+/**
+ * get_cell_range() - Sets `first` and `last` to the range of cells overlapped
+ * by the block from `start` to `end`, in output pixels, clamped to a grid of
+ * `grid_size` cells.
+ */
+static void
+get_cell_range(int32_t *first,
+               int32_t *last,
+               float start,
+               float end,
+               int32_t grid_size)
+{
+        *first = (int32_t)floorf(start)/MOTION_CELL_SIZE;
+        *last = ((int32_t)ceilf(end) - 1)/MOTION_CELL_SIZE;
+        if (*first < 0)
+                *first = 0;
+        if (*last >= grid_size)
+                *last = grid_size - 1;
+        if (*last < *first)
+                *last = *first;
+}
+
+void
+fill_motion_field(struct motion_field *motion,
+                  const AVFrame *frame,
+                  int32_t frame_index)
+{
+        if ((frame_index < 0) || (frame_index >= motion->num_frames))
+                return;
+
+        const int32_t grid_size = motion->grid_width*motion->grid_height;
+        float *field = motion->dest + (size_t)frame_index*grid_size*2;
+        memset(field, 0, grid_size*2*sizeof(float));
+        if (frame_index >= motion->num_filled)
+                motion->num_filled = frame_index + 1;
+
+        AVFrameSideData *side_data =
+                av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+        if (side_data == NULL)
+                return;
+
+        memset(motion->counts, 0, grid_size*sizeof(uint32_t));
+
+        const AVMotionVector *vectors = (const AVMotionVector *)side_data->data;
+        const size_t num_vectors = side_data->size/sizeof(AVMotionVector);
+        size_t i;
+        for (i = 0;
+             i < num_vectors;
+             ++i) {
+                const AVMotionVector *vector = &vectors[i];
+
+                /**
+                 * NOTE: The block at dst was predicted from src in the
+                 * reference frame, so the motion into this frame is dst - src
+                 * for a past reference, and src - dst for a future one.
+                 */
+                float dx = vector->dst_x - vector->src_x;
+                float dy = vector->dst_y - vector->src_y;
+                if (vector->motion_scale > 0) {
+                        dx = -(float)vector->motion_x/vector->motion_scale;
+                        dy = -(float)vector->motion_y/vector->motion_scale;
+                }
+                if (vector->source > 0) {
+                        dx = -dx;
+                        dy = -dy;
+                }
+                dx *= motion->scale_x;
+                dy *= motion->scale_y;
+
+                int32_t first_col;
+                int32_t last_col;
+                int32_t first_row;
+                int32_t last_row;
+                get_cell_range(&first_col,
+                               &last_col,
+                               (vector->dst_x - vector->w/2.0f)*motion->scale_x,
+                               (vector->dst_x + vector->w/2.0f)*motion->scale_x,
+                               motion->grid_width);
+                get_cell_range(&first_row,
+                               &last_row,
+                               (vector->dst_y - vector->h/2.0f)*motion->scale_y,
+                               (vector->dst_y + vector->h/2.0f)*motion->scale_y,
+                               motion->grid_height);
+
+                int32_t row;
+                for (row = first_row;
+                     row <= last_row;
+                     ++row) {
+                        int32_t col;
+                        for (col = first_col;
+                             col <= last_col;
+                             ++col) {
+                                int32_t cell = row*motion->grid_width + col;
+                                field[2*cell] += dx;
+                                field[2*cell + 1] += dy;
+                                ++motion->counts[cell];
+                        }
+                }
+        }
+
+        int32_t cell;
+        for (cell = 0;
+             cell < grid_size;
+             ++cell) {
+                if (motion->counts[cell] <= 1)
+                        continue;
+
+                field[2*cell] /= motion->counts[cell];
+                field[2*cell + 1] /= motion->counts[cell];
+        }
+}
+
+void repeat_motion_field(struct motion_field *motion, int32_t frame_index)
+{
+        if ((frame_index <= 0) || (frame_index >= motion->num_frames))
+                return;
+
+        const size_t frame_size = (size_t)motion->grid_width*
+                                  motion->grid_height*2;
+        memcpy(motion->dest + frame_index*frame_size,
+               motion->dest + (frame_index - 1)*frame_size,
+               frame_size*sizeof(float));
+        if (frame_index >= motion->num_filled)
+                motion->num_filled = frame_index + 1;
+}
+
+void loop_motion_field(struct motion_field *motion, int32_t num_frames)
+{
+        if (num_frames > motion->num_frames)
+                num_frames = motion->num_frames;
+
+        const int32_t num_filled = motion->num_filled;
+        if (num_filled == 0)
+                return;
+
+        const size_t frame_size = (size_t)motion->grid_width*
+                                  motion->grid_height*2;
+        int32_t frame_index;
+        for (frame_index = num_filled;
+             frame_index < num_frames;
+             ++frame_index)
+                memcpy(motion->dest + frame_index*frame_size,
+                       motion->dest + (frame_index % num_filled)*frame_size,
+                       frame_size*sizeof(float));
+        if (num_frames > motion->num_filled)
+                motion->num_filled = num_frames;
+}
+
+void free_motion_field(struct motion_field *motion)
+{
+        free(motion->counts);
+        motion->counts = NULL;
+}
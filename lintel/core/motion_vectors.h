@@ -0,0 +1,121 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MOTION_VECTORS_H_
+#define _MOTION_VECTORS_H_
+
+/**
+ * Dense motion fields built from the motion vectors that the decoder exports
+ * with each frame, as a cheap stand-in for optical flow.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/frame.h>
+#ifdef __cplusplus
+};
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Size of the cells of a motion field, in pixels of the output frames. */
+#define MOTION_CELL_SIZE 16
+
+/**
+ * struct motion_field - Output of the motion of each frame converted to RGB,
+ * as a grid of (dx, dy) float32 displacements in output pixels.
+ * @dest: Output of `grid_height*grid_width*2` floats per frame.
+ * @num_frames: Number of frames `dest` holds.
+ * @num_filled: One past the index of the last frame filled in.
+ * @grid_width: Number of columns of cells, one per MOTION_CELL_SIZE pixels of
+ * the output width.
+ * @grid_height: Number of rows of cells.
+ * @scale_x: Output pixels per decoded pixel, horizontally.
+ * @scale_y: Output pixels per decoded pixel, vertically.
+ * @counts: Number of motion vectors summed into each cell of a frame.
+ */
+struct motion_field {
+        float *dest;
+        int32_t num_frames;
+        int32_t num_filled;
+        int32_t grid_width;
+        int32_t grid_height;
+        float scale_x;
+        float scale_y;
+        uint32_t *counts;
+};
+
+/**
+ * motion_field_size_bytes() - Returns the size of the output of a motion
+ * field of `num_frames` frames of `width` by `height` output pixels.
+ */
+size_t
+motion_field_size_bytes(int32_t num_frames, uint32_t width, uint32_t height);
+
+/**
+ * init_motion_field() - Sets up `motion` to fill `dest` with the motion of
+ * `num_frames` frames decoded at `src_width` by `src_height`, and output at
+ * `width` by `height`.
+ *
+ * `dest` must hold motion_field_size_bytes(), and is zeroed. Returns 0 on
+ * success, and a negative value if out of memory. Either way, `motion` must
+ * be released with free_motion_field().
+ */
+int32_t
+init_motion_field(struct motion_field *motion,
+                  float *dest,
+                  int32_t num_frames,
+                  uint32_t src_width,
+                  uint32_t src_height,
+                  uint32_t width,
+                  uint32_t height);
+
+/**
+ * fill_motion_field() - Fills frame `frame_index` of `motion` from the motion
+ * vectors exported with `frame`.
+ *
+ * Each cell is the mean displacement of the blocks overlapping it, from the
+ * previous frame to `frame`. Vectors predicted from a future frame are
+ * negated, assuming constant motion. Cells of intra-coded blocks, and every
+ * cell of keyframes, are zero.
+ */
+void
+fill_motion_field(struct motion_field *motion,
+                  const AVFrame *frame,
+                  int32_t frame_index);
+
+/**
+ * repeat_motion_field() - Copies the motion of frame `frame_index - 1` to
+ * frame `frame_index`, for a frame output twice.
+ */
+void repeat_motion_field(struct motion_field *motion, int32_t frame_index);
+
+/**
+ * loop_motion_field() - Loops the frames filled in so far up to frame
+ * `num_frames`, as the decoders loop the RGB frames of short videos.
+ */
+void loop_motion_field(struct motion_field *motion, int32_t num_frames);
+
+/**
+ * free_motion_field() - Frees the scratch buffers of `motion`. The output is
+ * owned by the caller.
+ */
+void free_motion_field(struct motion_field *motion);
+
+#endif // _MOTION_VECTORS_H_
@@ -0,0 +1,380 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "probe.h"
+#include "video_decode.h"
+#include <libavutil/pixdesc.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * NOTE: Metadata only needs the container header and the first few packets,
+ * so probing is capped well below FFmpeg's defaults (5 MB and 5 seconds), and
+ * skipped when the header is complete.
+ */
+#define PROBE_SIZE_BYTES (1 << 20)
+#define PROBE_ANALYZE_DURATION_US (AV_TIME_BASE/2)
+
+/**
+ * struct probe_work - Work shared between the threads of probe_videos().
+ * @next_file: Index of the next file to be claimed by a worker.
+ *
+ * The other members are the arguments of probe_videos().
+ */
+struct probe_work {
+        struct video_probe *probes;
+        const char *const *filenames;
+        int32_t num_files;
+        int32_t next_file;
+        int32_t timeout_ms;
+        bool should_scan_packets;
+};
+
+/**
+ * append_keyframe() - Appends a keyframe to the keyframe arrays of `probe`,
+ * growing them as needed.
+ * @capacity: In/out number of keyframes allocated in the arrays.
+ *
+ * Returns true on success, and false if out of memory.
+ */
+static bool
+append_keyframe(struct video_probe *probe,
+                int64_t *capacity,
+                int64_t frame_num,
+                int64_t pos,
+                double time)
+{
+        if (probe->num_keyframes >= *capacity) {
+                int64_t new_capacity = (*capacity > 0) ? 2*(*capacity) : 64;
+                int64_t *frame_nums = realloc(probe->keyframe_frame_nums,
+                                              new_capacity*sizeof(int64_t));
+                if (frame_nums == NULL)
+                        return false;
+                probe->keyframe_frame_nums = frame_nums;
+
+                int64_t *positions = realloc(probe->keyframe_pos,
+                                             new_capacity*sizeof(int64_t));
+                if (positions == NULL)
+                        return false;
+                probe->keyframe_pos = positions;
+
+                double *times = realloc(probe->keyframe_times,
+                                        new_capacity*sizeof(double));
+                if (times == NULL)
+                        return false;
+                probe->keyframe_times = times;
+
+                *capacity = new_capacity;
+        }
+
+        probe->keyframe_frame_nums[probe->num_keyframes] = frame_num;
+        probe->keyframe_pos[probe->num_keyframes] = pos;
+        probe->keyframe_times[probe->num_keyframes] = time;
+        ++probe->num_keyframes;
+
+        return true;
+}
+
+static void
+set_probe_error(struct video_probe *probe, const char *what, int32_t status)
+{
+        char av_msg[64] = "";
+
+        if (status < 0)
+                av_strerror(status, av_msg, sizeof(av_msg));
+
+        snprintf(probe->error_msg,
+                 PROBE_ERROR_SIZE,
+                 "%s%s%s",
+                 what,
+                 (status < 0) ? ": " : "",
+                 av_msg);
+}
+
+/**
+ * scan_video_packets() - Reads every packet in the video stream of
+ * `vid_ctx`, without decoding, to count frames and keyframes exactly.
+ *
+ * Returns 0 on success, and a negative value if the deadline passed.
+ */
+static int32_t
+scan_video_packets(struct video_probe *probe,
+                   struct video_stream_context *vid_ctx)
+{
+        AVFormatContext *format_context = vid_ctx->format_context;
+        AVStream *video_stream =
+                format_context->streams[vid_ctx->video_stream_index];
+        int64_t start_time = (video_stream->start_time != AV_NOPTS_VALUE) ?
+                             video_stream->start_time : 0;
+        AVPacket packet;
+        int64_t nb_packets = 0;
+        int64_t keyframe_capacity = 0;
+        int64_t gop_size = 0;
+        int64_t max_gop_size = 0;
+        bool is_out_of_memory = false;
+
+        probe->num_keyframes = 0;
+
+        /* NOTE: Let the demuxer drop audio and other streams early. */
+        uint32_t stream_index;
+        for (stream_index = 0;
+             stream_index < format_context->nb_streams;
+             ++stream_index) {
+                if ((int32_t)stream_index != vid_ctx->video_stream_index)
+                        format_context->streams[stream_index]->discard =
+                                AVDISCARD_ALL;
+        }
+
+        av_init_packet(&packet);
+        packet.data = NULL;
+        packet.size = 0;
+        while (!check_decode_deadline(vid_ctx) &&
+               (av_read_frame(format_context, &packet) == 0)) {
+                if (packet.stream_index == vid_ctx->video_stream_index) {
+                        if (packet.flags & AV_PKT_FLAG_KEY) {
+                                if ((probe->num_keyframes > 0) &&
+                                    (gop_size > max_gop_size))
+                                        max_gop_size = gop_size;
+
+                                int64_t pts = (packet.pts != AV_NOPTS_VALUE) ?
+                                              packet.pts : packet.dts;
+                                double time = ((pts - start_time)*
+                                               av_q2d(video_stream->time_base));
+                                if (!append_keyframe(probe,
+                                                     &keyframe_capacity,
+                                                     nb_packets,
+                                                     packet.pos,
+                                                     time)) {
+                                        is_out_of_memory = true;
+                                        av_packet_unref(&packet);
+                                        break;
+                                }
+                                gop_size = 0;
+                        }
+
+                        ++gop_size;
+                        ++nb_packets;
+                }
+
+                av_packet_unref(&packet);
+        }
+
+        if (is_out_of_memory) {
+                set_probe_error(probe, "out of memory for keyframes", 0);
+                return VID_DECODE_FFMPEG_ERR;
+        }
+
+        if (vid_ctx->error_type != NULL) {
+                set_probe_error(probe, "probe video timeout", 0);
+                return VID_DECODE_TIMEOUT;
+        }
+
+        if ((probe->num_keyframes > 0) && (gop_size > max_gop_size))
+                max_gop_size = gop_size;
+
+        probe->nb_frames = nb_packets;
+        probe->is_nb_frames_exact = true;
+        probe->max_gop_size = max_gop_size;
+
+        return VID_DECODE_SUCCESS;
+}
+
+int32_t
+probe_video(struct video_probe *probe,
+            const char *filename,
+            int32_t timeout_ms,
+            bool should_scan_packets)
+{
+        struct video_stream_context vid_ctx;
+        int32_t status;
+
+        memset(probe, 0, sizeof(*probe));
+        probe->num_keyframes = -1;
+        probe->max_gop_size = -1;
+
+        memset(&vid_ctx, 0, sizeof(vid_ctx));
+        set_decode_deadline(&vid_ctx, timeout_ms);
+
+        vid_ctx.format_context = avformat_alloc_context();
+        if (vid_ctx.format_context == NULL) {
+                set_probe_error(probe, "format context not found", 0);
+                return VID_DECODE_FFMPEG_ERR;
+        }
+        vid_ctx.format_context->interrupt_callback.callback =
+                decode_interrupt_callback;
+        vid_ctx.format_context->interrupt_callback.opaque = &vid_ctx;
+        vid_ctx.format_context->probesize = PROBE_SIZE_BYTES;
+        vid_ctx.format_context->max_analyze_duration =
+                PROBE_ANALYZE_DURATION_US;
+
+        /* NOTE: On failure, avformat_open_input frees the format context. */
+        status = avformat_open_input(&vid_ctx.format_context,
+                                     filename,
+                                     NULL,
+                                     NULL);
+        if (status != 0) {
+                set_probe_error(probe, "open input error", status);
+                return VID_DECODE_FFMPEG_ERR;
+        }
+
+        status = find_video_stream_info(vid_ctx.format_context, true);
+        if (status < 0) {
+                set_probe_error(probe, "stream index not found", status);
+                goto out_close_input;
+        }
+
+        AVStream *video_stream = NULL;
+        uint32_t stream_index;
+        for (stream_index = 0;
+             stream_index < vid_ctx.format_context->nb_streams;
+             ++stream_index) {
+                video_stream = vid_ctx.format_context->streams[stream_index];
+                if (video_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+                        break;
+        }
+        if (stream_index >= vid_ctx.format_context->nb_streams) {
+                set_probe_error(probe, "video stream not found", 0);
+                status = VID_DECODE_FFMPEG_ERR;
+                goto out_close_input;
+        }
+        vid_ctx.video_stream_index = stream_index;
+
+        AVCodecParameters *codecpar = video_stream->codecpar;
+        probe->width = codecpar->width;
+        probe->height = codecpar->height;
+
+        const char *pix_fmt_name =
+                av_get_pix_fmt_name((enum AVPixelFormat)codecpar->format);
+        snprintf(probe->codec_name,
+                 PROBE_NAME_SIZE,
+                 "%s",
+                 avcodec_get_name(codecpar->codec_id));
+        snprintf(probe->pix_fmt_name,
+                 PROBE_NAME_SIZE,
+                 "%s",
+                 (pix_fmt_name != NULL) ? pix_fmt_name : "none");
+
+        AVRational frame_rate = video_stream->avg_frame_rate;
+        if ((frame_rate.num <= 0) || (frame_rate.den <= 0))
+                frame_rate = video_stream->r_frame_rate;
+        if ((frame_rate.num > 0) && (frame_rate.den > 0))
+                probe->fps = av_q2d(frame_rate);
+
+        if (video_stream->duration > 0)
+                probe->duration = (video_stream->duration*
+                                   av_q2d(video_stream->time_base));
+        else if (vid_ctx.format_context->duration > 0)
+                probe->duration = ((double)vid_ctx.format_context->duration/
+                                   AV_TIME_BASE);
+
+        if (video_stream->nb_frames > 0) {
+                probe->nb_frames = video_stream->nb_frames;
+                probe->is_nb_frames_exact = true;
+        } else {
+                probe->nb_frames = llround(probe->duration*probe->fps);
+        }
+
+        status = VID_DECODE_SUCCESS;
+        if (should_scan_packets)
+                status = scan_video_packets(probe, &vid_ctx);
+
+out_close_input:
+        avformat_close_input(&vid_ctx.format_context);
+
+        return (status < 0) ? status : VID_DECODE_SUCCESS;
+}
+
+void free_video_probe(struct video_probe *probe)
+{
+        free(probe->keyframe_frame_nums);
+        free(probe->keyframe_pos);
+        free(probe->keyframe_times);
+        probe->keyframe_frame_nums = NULL;
+        probe->keyframe_pos = NULL;
+        probe->keyframe_times = NULL;
+}
+
+static void *
+probe_worker(void *arg)
+{
+        struct probe_work *work = arg;
+
+        for (;;) {
+                int32_t file_index = __atomic_fetch_add(&work->next_file,
+                                                        1,
+                                                        __ATOMIC_RELAXED);
+                if (file_index >= work->num_files)
+                        break;
+
+                probe_video(&work->probes[file_index],
+                            work->filenames[file_index],
+                            work->timeout_ms,
+                            work->should_scan_packets);
+        }
+
+        return NULL;
+}
+
+void
+probe_videos(struct video_probe *probes,
+             const char *const *filenames,
+             int32_t num_files,
+             int32_t num_workers,
+             int32_t timeout_ms,
+             bool should_scan_packets)
+{
+        struct probe_work work = {probes,
+                                  filenames,
+                                  num_files,
+                                  0,
+                                  timeout_ms,
+                                  should_scan_packets};
+
+        if (num_workers > num_files)
+                num_workers = num_files;
+        if (num_workers < 1)
+                num_workers = 1;
+
+        /**
+         * NOTE: The calling thread is one of the workers. If a thread fails
+         * to start, the remaining workers pick up its share of the files.
+         */
+        pthread_t *threads = malloc((num_workers - 1)*sizeof(pthread_t) + 1);
+        int32_t num_started = 0;
+        if (threads != NULL) {
+                while ((num_started < (num_workers - 1)) &&
+                       (pthread_create(&threads[num_started],
+                                       NULL,
+                                       probe_worker,
+                                       &work) == 0))
+                        ++num_started;
+        }
+
+        probe_worker(&work);
+
+        int32_t thread_index;
+        for (thread_index = 0;
+             thread_index < num_started;
+             ++thread_index)
+                pthread_join(threads[thread_index], NULL);
+
+        free(threads);
+}
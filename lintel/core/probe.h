@@ -0,0 +1,126 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+/**
+ * Helpers for reading video metadata without decoding, on native threads.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PROBE_NAME_SIZE 32
+#define PROBE_ERROR_SIZE 128
+
+/**
+ * struct video_probe - Metadata of a video file, as read by probe_video().
+ * @width: Width of the video stream, in pixels.
+ * @height: Height of the video stream, in pixels.
+ * @fps: Average framerate of the video stream.
+ * @duration: Duration of the video stream, in seconds.
+ * @nb_frames: Number of frames in the video stream.
+ * @is_nb_frames_exact: True iff `nb_frames` was read from the container or
+ * counted, as opposed to estimated from `duration` and `fps`.
+ * @codec_name: Name of the video codec, e.g., "h264".
+ * @pix_fmt_name: Name of the decoded pixel format, e.g., "yuv420p".
+ * @num_keyframes: Number of keyframes, or -1 if packets were not scanned.
+ * @max_gop_size: Largest number of frames from one keyframe to the next, or
+ * -1 if packets were not scanned.
+ * @keyframe_frame_nums: Frame index of each keyframe, or NULL if packets were
+ * not scanned.
+ * @keyframe_pos: Byte offset of each keyframe's packet in the file, or -1
+ * where the demuxer doesn't know it.
+ * @keyframe_times: PTS of each keyframe, in seconds from the start of the
+ * video stream.
+ * @error_msg: Empty on success, otherwise a description of the error.
+ *
+ * The GOP statistics and keyframe indices are counted from packets in decode
+ * order, which matches display order at keyframes for closed GOPs. The
+ * keyframe arrays have `num_keyframes` entries, and are freed by
+ * free_video_probe().
+ */
+struct video_probe {
+        int32_t width;
+        int32_t height;
+        double fps;
+        double duration;
+        int64_t nb_frames;
+        bool is_nb_frames_exact;
+        char codec_name[PROBE_NAME_SIZE];
+        char pix_fmt_name[PROBE_NAME_SIZE];
+        int64_t num_keyframes;
+        int64_t max_gop_size;
+        int64_t *keyframe_frame_nums;
+        int64_t *keyframe_pos;
+        double *keyframe_times;
+        char error_msg[PROBE_ERROR_SIZE];
+};
+
+/**
+ * probe_video() - Reads the metadata of the first video stream in
+ * `filename` into `probe`, without opening a decoder.
+ * @probe: Output metadata.
+ * @filename: Path of the video file.
+ * @timeout_ms: Deadline for probing this file, in milliseconds.
+ * @should_scan_packets: If true, read every packet of the video stream (but
+ * decode none), to count the frames exactly, gather GOP statistics and
+ * collect the keyframe arrays.
+ *
+ * Probing is limited to the small probesize and analyzeduration needed for
+ * metadata. This function does not touch the Python C API, and is safe to
+ * call without the GIL.
+ *
+ * Returns 0 on success, and a negative value on failure, in which case
+ * `probe->error_msg` is set. Either way, `probe` must be released with
+ * free_video_probe().
+ */
+int32_t
+probe_video(struct video_probe *probe,
+            const char *filename,
+            int32_t timeout_ms,
+            bool should_scan_packets);
+
+/**
+ * probe_videos() - Runs probe_video() on each of `filenames` from a pool of
+ * `num_workers` native threads.
+ * @probes: Output array of `num_files` probes, in the order of `filenames`.
+ * @filenames: Paths of the video files.
+ * @num_files: Length of `filenames`.
+ * @num_workers: Number of threads to probe on.
+ * @timeout_ms: Deadline per file, in milliseconds.
+ * @should_scan_packets: As for probe_video().
+ *
+ * Errors are reported per file through `error_msg`, so a bad file never fails
+ * the whole batch. Returns once every file has been probed.
+ */
+void
+probe_videos(struct video_probe *probes,
+             const char *const *filenames,
+             int32_t num_files,
+             int32_t num_workers,
+             int32_t timeout_ms,
+             bool should_scan_packets);
+
+/**
+ * free_video_probe() - Frees the keyframe arrays of `probe`.
+ */
+void free_video_probe(struct video_probe *probe);
+
+#endif // _PROBE_H_
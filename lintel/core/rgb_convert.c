@@ -0,0 +1,700 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "rgb_convert.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Fractional bits of the filter weights. */
+#define FILTER_BITS 14
+#define FILTER_ONE (1 << FILTER_BITS)
+
+/* Fractional bits of the filtered samples fed to the color matrix. */
+#define SAMPLE_BITS 6
+
+/* Fractional bits of the color matrix coefficients. */
+#define MATRIX_BITS 13
+
+/**
+ * NOTE: ROW_KERNEL functions are built for AVX2 and for the baseline, and the
+ * dynamic loader picks the AVX2 build on CPUs that have it.
+ */
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define ROW_KERNEL __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#ifndef ROW_KERNEL
+#define ROW_KERNEL
+#endif
+
+/**
+ * struct yuv_matrix - Fixed-point conversion from Q6 YUV samples to RGB.
+ * @y_offset: Black level of luma, in Q6.
+ * @y_gain: Luma gain, expanding limited range to 0-255, in Q13.
+ * @v_to_r: V coefficient of red, in Q13.
+ * @u_to_g: Negated U coefficient of green, in Q13.
+ * @v_to_g: Negated V coefficient of green, in Q13.
+ * @u_to_b: U coefficient of blue, in Q13.
+ */
+struct yuv_matrix {
+        int32_t y_offset;
+        int32_t y_gain;
+        int32_t v_to_r;
+        int32_t u_to_g;
+        int32_t v_to_g;
+        int32_t u_to_b;
+};
+
+bool rgb_converter_supports(enum AVPixelFormat format, enum rgb_kernel kernel)
+{
+        if ((kernel == RGB_KERNEL_SWSCALE) || (kernel == RGB_KERNEL_REFERENCE))
+                return false;
+
+        return (format == AV_PIX_FMT_YUV420P) ||
+               (format == AV_PIX_FMT_YUVJ420P) ||
+               (format == AV_PIX_FMT_NV12);
+}
+
+/**
+ * get_luma_weights() - Sets the red and blue luma weights, Kr and Kb, of the
+ * colorspace of `frame`.
+ */
+static void
+get_luma_weights(double *kr, double *kb, const AVFrame *frame)
+{
+        switch (frame->colorspace) {
+        case AVCOL_SPC_BT709:
+                goto bt709;
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:
+                goto bt601;
+        case AVCOL_SPC_BT2020_NCL:
+                goto bt2020;
+        default:
+                break;
+        }
+
+        switch (frame->color_primaries) {
+        case AVCOL_PRI_BT709:
+                goto bt709;
+        case AVCOL_PRI_BT470BG:
+        case AVCOL_PRI_SMPTE170M:
+                goto bt601;
+        case AVCOL_PRI_BT2020:
+                goto bt2020;
+        default:
+                break;
+        }
+
+        if (frame->height >= 720)
+                goto bt709;
+
+bt601:
+        *kr = 0.299;
+        *kb = 0.114;
+        return;
+bt709:
+        *kr = 0.2126;
+        *kb = 0.0722;
+        return;
+bt2020:
+        *kr = 0.2627;
+        *kb = 0.0593;
+}
+
+/**
+ * get_sws_colorspace() - Returns the SWS_CS_* colorspace of `frame`, picked
+ * as by get_luma_weights().
+ */
+static int32_t get_sws_colorspace(const AVFrame *frame)
+{
+        switch (frame->colorspace) {
+        case AVCOL_SPC_BT709:
+                return SWS_CS_ITU709;
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:
+                return SWS_CS_ITU601;
+        case AVCOL_SPC_BT2020_NCL:
+                return SWS_CS_BT2020;
+        default:
+                break;
+        }
+
+        switch (frame->color_primaries) {
+        case AVCOL_PRI_BT709:
+                return SWS_CS_ITU709;
+        case AVCOL_PRI_BT470BG:
+        case AVCOL_PRI_SMPTE170M:
+                return SWS_CS_ITU601;
+        case AVCOL_PRI_BT2020:
+                return SWS_CS_BT2020;
+        default:
+                break;
+        }
+
+        return (frame->height >= 720) ? SWS_CS_ITU709 : SWS_CS_ITU601;
+}
+
+bool
+convert_to_rgb_reference(uint8_t *dest,
+                         int32_t dest_stride,
+                         int32_t dst_width,
+                         int32_t dst_height,
+                         const AVFrame *frame)
+{
+        struct SwsContext *sws_context =
+                sws_getContext(frame->width,
+                               frame->height,
+                               frame->format,
+                               dst_width,
+                               dst_height,
+                               AV_PIX_FMT_RGB24,
+                               SWS_BICUBIC |
+                               SWS_ACCURATE_RND |
+                               SWS_FULL_CHR_H_INT,
+                               NULL,
+                               NULL,
+                               NULL);
+        if (sws_context == NULL)
+                return false;
+
+        /**
+         * NOTE: swscale reads neither the colorspace nor the range from the
+         * frame, so both are set here. Setting them fails harmlessly for
+         * source formats that aren't YUV.
+         */
+        bool is_full_range = (frame->color_range == AVCOL_RANGE_JPEG) ||
+                             (frame->format == AV_PIX_FMT_YUVJ420P);
+        sws_setColorspaceDetails(sws_context,
+                                 sws_getCoefficients(get_sws_colorspace(frame)),
+                                 is_full_range,
+                                 sws_getCoefficients(SWS_CS_DEFAULT),
+                                 1,
+                                 0,
+                                 1 << 16,
+                                 1 << 16);
+
+        uint8_t *dst_data[4] = {dest, NULL, NULL, NULL};
+        int32_t dst_linesize[4] = {dest_stride, 0, 0, 0};
+        sws_scale(sws_context,
+                  (const uint8_t *const *)frame->data,
+                  frame->linesize,
+                  0,
+                  frame->height,
+                  dst_data,
+                  dst_linesize);
+        sws_freeContext(sws_context);
+
+        return true;
+}
+
+static void
+init_yuv_matrix(struct yuv_matrix *matrix,
+                const AVFrame *frame,
+                enum AVPixelFormat format)
+{
+        double kr;
+        double kb;
+        get_luma_weights(&kr, &kb, frame);
+        double kg = 1.0 - kr - kb;
+
+        bool is_full_range = (frame->color_range == AVCOL_RANGE_JPEG) ||
+                             (format == AV_PIX_FMT_YUVJ420P);
+        double y_scale = is_full_range ? 1.0 : 255.0/219.0;
+        double c_scale = is_full_range ? 1.0 : 255.0/224.0;
+        double one = 1 << MATRIX_BITS;
+
+        matrix->y_offset = is_full_range ? 0 : (16 << SAMPLE_BITS);
+        matrix->y_gain = lrint(y_scale*one);
+        matrix->v_to_r = lrint(2.0*(1.0 - kr)*c_scale*one);
+        matrix->u_to_g = lrint(2.0*kb*(1.0 - kb)/kg*c_scale*one);
+        matrix->v_to_g = lrint(2.0*kr*(1.0 - kr)/kg*c_scale*one);
+        matrix->u_to_b = lrint(2.0*(1.0 - kb)*c_scale*one);
+}
+
+/**
+ * quantize_weights() - Converts the `num_taps` real `taps` to Q14 `weights`
+ * that sum to exactly one. If the taps are all zero, the first weight is one.
+ */
+static void
+quantize_weights(int16_t *weights, const double *taps, int32_t num_taps)
+{
+        double total = 0.0;
+        int32_t tap;
+        for (tap = 0;
+             tap < num_taps;
+             ++tap)
+                total += taps[tap];
+
+        int32_t sum = 0;
+        int32_t largest = 0;
+        for (tap = 0;
+             tap < num_taps;
+             ++tap) {
+                weights[tap] = (total > 0.0) ?
+                        lrint(taps[tap]/total*FILTER_ONE) : 0;
+                sum += weights[tap];
+                if (weights[tap] > weights[largest])
+                        largest = tap;
+        }
+
+        weights[largest] += FILTER_ONE - sum;
+}
+
+/**
+ * init_resample_filter() - Builds the filter from `src_size` source samples
+ * to `dst_size` output samples.
+ *
+ * Output sample `i` covers the source interval from `i*src_per_dst + offset`
+ * to `(i + 1)*src_per_dst + offset`, in units of source samples. The area
+ * filter averages that interval, and the bilinear filter interpolates at its
+ * center.
+ *
+ * Returns 0 on success, and -1 if out of memory.
+ */
+static int32_t
+init_resample_filter(struct resample_filter *filter,
+                     int32_t src_size,
+                     int32_t dst_size,
+                     double src_per_dst,
+                     double offset,
+                     enum rgb_kernel kernel)
+{
+        bool is_area = (kernel == RGB_KERNEL_AREA) && (src_per_dst > 1.0);
+        int32_t num_taps = is_area ? (int32_t)ceil(src_per_dst) + 1 : 2;
+        if (num_taps > src_size)
+                num_taps = src_size;
+
+        filter->num_taps = num_taps;
+        filter->starts = malloc(dst_size*sizeof(int32_t));
+        filter->weights = malloc(dst_size*num_taps*sizeof(int16_t));
+        double *taps = malloc(num_taps*sizeof(double));
+        if ((filter->starts == NULL) ||
+            (filter->weights == NULL) ||
+            (taps == NULL)) {
+                free(taps);
+                return -1;
+        }
+
+        int32_t i;
+        for (i = 0;
+             i < dst_size;
+             ++i) {
+                double low = i*src_per_dst + offset;
+                double high = low + src_per_dst;
+                int32_t start;
+                int32_t tap;
+                if (is_area) {
+                        low = fmax(low, 0.0);
+                        high = fmin(high, src_size);
+                        start = (int32_t)floor(low);
+                        if (start > src_size - num_taps)
+                                start = src_size - num_taps;
+
+                        for (tap = 0;
+                             tap < num_taps;
+                             ++tap) {
+                                double left = fmax(low, start + tap);
+                                double right = fmin(high, start + tap + 1);
+                                taps[tap] = fmax(right - left, 0.0);
+                        }
+                } else {
+                        double center = 0.5*(low + high) - 0.5;
+                        center = fmin(fmax(center, 0.0), src_size - 1);
+                        start = (int32_t)floor(center);
+                        if (start > src_size - num_taps)
+                                start = src_size - num_taps;
+
+                        taps[0] = 1.0;
+                        if (num_taps == 2) {
+                                taps[1] = center - start;
+                                taps[0] = 1.0 - taps[1];
+                        }
+                }
+
+                filter->starts[i] = start;
+                quantize_weights(filter->weights + i*num_taps, taps, num_taps);
+        }
+
+        free(taps);
+
+        return 0;
+}
+
+static void
+free_resample_filter(struct resample_filter *filter)
+{
+        free(filter->starts);
+        free(filter->weights);
+        filter->starts = NULL;
+        filter->weights = NULL;
+}
+
+struct rgb_converter *
+new_rgb_converter(int32_t src_width,
+                  int32_t src_height,
+                  enum AVPixelFormat src_format,
+                  int32_t dst_width,
+                  int32_t dst_height,
+                  enum rgb_kernel kernel)
+{
+        struct rgb_converter *converter =
+                calloc(1, sizeof(struct rgb_converter));
+        if (converter == NULL)
+                return NULL;
+
+        converter->src_width = src_width;
+        converter->src_height = src_height;
+        converter->src_format = src_format;
+        converter->dst_width = dst_width;
+        converter->dst_height = dst_height;
+        converter->kernel = kernel;
+
+        /**
+         * NOTE: 4:2:0 chroma is sited between the two luma rows it covers,
+         * and (as in MPEG-2 and H.264) level with the left luma column, a
+         * quarter of a chroma sample left of the center of its area.
+         */
+        int32_t chroma_width = (src_width + 1)/2;
+        int32_t chroma_height = (src_height + 1)/2;
+        double x_scale = (double)src_width/dst_width;
+        double y_scale = (double)src_height/dst_height;
+        if ((init_resample_filter(&converter->luma_x,
+                                  src_width,
+                                  dst_width,
+                                  x_scale,
+                                  0.0,
+                                  kernel) < 0) ||
+            (init_resample_filter(&converter->luma_y,
+                                  src_height,
+                                  dst_height,
+                                  y_scale,
+                                  0.0,
+                                  kernel) < 0) ||
+            (init_resample_filter(&converter->chroma_x,
+                                  chroma_width,
+                                  dst_width,
+                                  0.5*x_scale,
+                                  0.25,
+                                  kernel) < 0) ||
+            (init_resample_filter(&converter->chroma_y,
+                                  chroma_height,
+                                  dst_height,
+                                  0.5*y_scale,
+                                  0.0,
+                                  kernel) < 0))
+                goto out_free_converter;
+
+        int32_t max_row_width = (2*chroma_width > src_width) ?
+                                2*chroma_width : src_width;
+        converter->row_sums = malloc(max_row_width*sizeof(int32_t));
+        converter->luma_row = malloc(src_width*sizeof(uint16_t));
+        converter->chroma_row = malloc(2*chroma_width*sizeof(uint16_t));
+        converter->y_out = malloc(dst_width*sizeof(int32_t));
+        converter->u_out = malloc(dst_width*sizeof(int32_t));
+        converter->v_out = malloc(dst_width*sizeof(int32_t));
+        if ((converter->row_sums == NULL) ||
+            (converter->luma_row == NULL) ||
+            (converter->chroma_row == NULL) ||
+            (converter->y_out == NULL) ||
+            (converter->u_out == NULL) ||
+            (converter->v_out == NULL))
+                goto out_free_converter;
+
+        return converter;
+
+out_free_converter:
+        free_rgb_converter(&converter);
+
+        return NULL;
+}
+
+bool
+rgb_converter_matches(const struct rgb_converter *converter,
+                      int32_t src_width,
+                      int32_t src_height,
+                      enum AVPixelFormat src_format,
+                      int32_t dst_width,
+                      int32_t dst_height,
+                      enum rgb_kernel kernel)
+{
+        return (converter->src_width == src_width) &&
+               (converter->src_height == src_height) &&
+               (converter->src_format == src_format) &&
+               (converter->dst_width == dst_width) &&
+               (converter->dst_height == dst_height) &&
+               (converter->kernel == kernel);
+}
+
+/**
+ * filter_rows() - Sums the `num_taps` rows of `width` samples starting at
+ * `src`, `stride` bytes apart, weighted by `weights`, into Q6 `out`.
+ */
+ROW_KERNEL static void
+filter_rows(uint16_t *restrict out,
+            int32_t *restrict sums,
+            const uint8_t *restrict src,
+            ptrdiff_t stride,
+            int32_t width,
+            const int16_t *weights,
+            int32_t num_taps)
+{
+        int32_t weight = weights[0];
+        int32_t x;
+        for (x = 0;
+             x < width;
+             ++x)
+                sums[x] = weight*src[x];
+
+        int32_t tap;
+        for (tap = 1;
+             tap < num_taps;
+             ++tap) {
+                const uint8_t *restrict row = src + tap*stride;
+                weight = weights[tap];
+                if (weight == 0)
+                        continue;
+
+                for (x = 0;
+                     x < width;
+                     ++x)
+                        sums[x] += weight*row[x];
+        }
+
+        const int32_t shift = FILTER_BITS - SAMPLE_BITS;
+        for (x = 0;
+             x < width;
+             ++x)
+                out[x] = (sums[x] + (1 << (shift - 1))) >> shift;
+}
+
+/**
+ * filter_columns() - Resamples the Q6 row `src`, whose samples are `step`
+ * apart, to the `width` Q6 samples of `out`.
+ */
+ROW_KERNEL static void
+filter_columns(int32_t *restrict out,
+               const uint16_t *restrict src,
+               int32_t step,
+               const struct resample_filter *filter,
+               int32_t width)
+{
+        const int32_t num_taps = filter->num_taps;
+        int32_t x;
+        for (x = 0;
+             x < width;
+             ++x) {
+                const int16_t *weights = filter->weights + x*num_taps;
+                const uint16_t *samples = src + filter->starts[x]*step;
+                int32_t sum = 0;
+                int32_t tap;
+                for (tap = 0;
+                     tap < num_taps;
+                     ++tap)
+                        sum += weights[tap]*samples[tap*step];
+
+                out[x] = (sum + (FILTER_ONE >> 1)) >> FILTER_BITS;
+        }
+}
+
+static inline uint8_t
+clamp_to_u8(int32_t value)
+{
+        if (value < 0)
+                return 0;
+        if (value > 255)
+                return 255;
+
+        return value;
+}
+
+/**
+ * yuv_to_rgb_row() - Converts `width` Q6 YUV samples to RGB24 `dest`.
+ */
+ROW_KERNEL static void
+yuv_to_rgb_row(uint8_t *restrict dest,
+               const int32_t *restrict y_row,
+               const int32_t *restrict u_row,
+               const int32_t *restrict v_row,
+               int32_t width,
+               const struct yuv_matrix *matrix)
+{
+        const int32_t shift = MATRIX_BITS + SAMPLE_BITS;
+        const int32_t round = 1 << (shift - 1);
+        const int32_t chroma_offset = 128 << SAMPLE_BITS;
+        const int32_t y_offset = matrix->y_offset;
+        const int32_t y_gain = matrix->y_gain;
+        const int32_t v_to_r = matrix->v_to_r;
+        const int32_t u_to_g = matrix->u_to_g;
+        const int32_t v_to_g = matrix->v_to_g;
+        const int32_t u_to_b = matrix->u_to_b;
+
+        int32_t x;
+        for (x = 0;
+             x < width;
+             ++x) {
+                int32_t y = (y_row[x] - y_offset)*y_gain + round;
+                int32_t u = u_row[x] - chroma_offset;
+                int32_t v = v_row[x] - chroma_offset;
+
+                dest[3*x] = clamp_to_u8((y + v_to_r*v) >> shift);
+                dest[3*x + 1] = clamp_to_u8((y - u_to_g*u - v_to_g*v) >> shift);
+                dest[3*x + 2] = clamp_to_u8((y + u_to_b*u) >> shift);
+        }
+}
+
+/**
+ * get_filter_rows() - Returns the first row of `plane` that `filter` filters
+ * output row `out_y` from, and sets `weights` to the weights of its rows.
+ */
+static const uint8_t *
+get_filter_rows(const struct resample_filter *filter,
+                const uint8_t *plane,
+                int32_t linesize,
+                int32_t out_y,
+                const int16_t **weights)
+{
+        *weights = filter->weights + out_y*filter->num_taps;
+
+        return plane + (ptrdiff_t)filter->starts[out_y]*linesize;
+}
+
+void
+convert_to_rgb(struct rgb_converter *converter,
+               uint8_t *dest,
+               int32_t dest_stride,
+               const AVFrame *frame)
+{
+        struct yuv_matrix matrix;
+        init_yuv_matrix(&matrix, frame, converter->src_format);
+
+        const int32_t chroma_width = (converter->src_width + 1)/2;
+        const bool is_nv12 = (converter->src_format == AV_PIX_FMT_NV12);
+        const struct resample_filter *luma_y = &converter->luma_y;
+        const struct resample_filter *chroma_y = &converter->chroma_y;
+        uint16_t *u_row = converter->chroma_row;
+        uint16_t *v_row = converter->chroma_row + chroma_width;
+
+        int32_t out_y;
+        for (out_y = 0;
+             out_y < converter->dst_height;
+             ++out_y) {
+                const int16_t *weights;
+                const uint8_t *rows = get_filter_rows(luma_y,
+                                                      frame->data[0],
+                                                      frame->linesize[0],
+                                                      out_y,
+                                                      &weights);
+                filter_rows(converter->luma_row,
+                            converter->row_sums,
+                            rows,
+                            frame->linesize[0],
+                            converter->src_width,
+                            weights,
+                            luma_y->num_taps);
+                filter_columns(converter->y_out,
+                               converter->luma_row,
+                               1,
+                               &converter->luma_x,
+                               converter->dst_width);
+
+                rows = get_filter_rows(chroma_y,
+                                       frame->data[1],
+                                       frame->linesize[1],
+                                       out_y,
+                                       &weights);
+                if (is_nv12) {
+                        filter_rows(converter->chroma_row,
+                                    converter->row_sums,
+                                    rows,
+                                    frame->linesize[1],
+                                    2*chroma_width,
+                                    weights,
+                                    chroma_y->num_taps);
+                        filter_columns(converter->u_out,
+                                       converter->chroma_row,
+                                       2,
+                                       &converter->chroma_x,
+                                       converter->dst_width);
+                        filter_columns(converter->v_out,
+                                       converter->chroma_row + 1,
+                                       2,
+                                       &converter->chroma_x,
+                                       converter->dst_width);
+                } else {
+                        filter_rows(u_row,
+                                    converter->row_sums,
+                                    rows,
+                                    frame->linesize[1],
+                                    chroma_width,
+                                    weights,
+                                    chroma_y->num_taps);
+                        rows = get_filter_rows(chroma_y,
+                                               frame->data[2],
+                                               frame->linesize[2],
+                                               out_y,
+                                               &weights);
+                        filter_rows(v_row,
+                                    converter->row_sums,
+                                    rows,
+                                    frame->linesize[2],
+                                    chroma_width,
+                                    weights,
+                                    chroma_y->num_taps);
+                        filter_columns(converter->u_out,
+                                       u_row,
+                                       1,
+                                       &converter->chroma_x,
+                                       converter->dst_width);
+                        filter_columns(converter->v_out,
+                                       v_row,
+                                       1,
+                                       &converter->chroma_x,
+                                       converter->dst_width);
+                }
+
+                yuv_to_rgb_row(dest + (ptrdiff_t)out_y*dest_stride,
+                               converter->y_out,
+                               converter->u_out,
+                               converter->v_out,
+                               converter->dst_width,
+                               &matrix);
+        }
+}
+
+void free_rgb_converter(struct rgb_converter **converter)
+{
+        if (*converter == NULL)
+                return;
+
+        free_resample_filter(&(*converter)->luma_x);
+        free_resample_filter(&(*converter)->luma_y);
+        free_resample_filter(&(*converter)->chroma_x);
+        free_resample_filter(&(*converter)->chroma_y);
+        free((*converter)->row_sums);
+        free((*converter)->luma_row);
+        free((*converter)->chroma_row);
+        free((*converter)->y_out);
+        free((*converter)->u_out);
+        free((*converter)->v_out);
+        free(*converter);
+        *converter = NULL;
+}
@@ -0,0 +1,186 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RGB_CONVERT_H_
+#define _RGB_CONVERT_H_
+
+/**
+ * Conversion of decoded 8-bit YUV 4:2:0 frames (YUV420P, YUVJ420P and NV12)
+ * to resized RGB24, fusing chroma upsampling, the color matrix and the resize
+ * into one pass per output row. Other pixel formats go through swscale.
+ *
+ * The row loops are plain C written for the auto-vectorizer, and on x86-64
+ * are compiled for both AVX2 and the baseline, with the variant picked at
+ * load time. NEON is part of the aarch64 baseline.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+#ifdef __cplusplus
+};
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * enum rgb_kernel - How decoded frames are converted to RGB24.
+ * @RGB_KERNEL_BILINEAR: Fused kernel, resizing with bilinear interpolation.
+ * @RGB_KERNEL_AREA: Fused kernel, downscaling by averaging the source pixels
+ * each output pixel covers, and upscaling bilinearly.
+ * @RGB_KERNEL_SWSCALE: swscale (SWS_FAST_BILINEAR when resizing), for every
+ * format.
+ * @RGB_KERNEL_REFERENCE: swscale with accurate rounding, full chroma
+ * interpolation, and the color matrix and range of the frame, for every
+ * format. Slow, and meant as the golden output of tests.
+ */
+enum rgb_kernel {
+        RGB_KERNEL_BILINEAR = 0,
+        RGB_KERNEL_AREA,
+        RGB_KERNEL_SWSCALE,
+        RGB_KERNEL_REFERENCE,
+};
+
+/**
+ * struct resample_filter - Separable filter from one source dimension to one
+ * output dimension.
+ * @starts: First source index of each output index.
+ * @weights: `num_taps` weights of each output index, in Q14, summing to
+ * 1 << 14.
+ * @num_taps: Number of source indices each output index is filtered from.
+ */
+struct resample_filter {
+        int32_t *starts;
+        int16_t *weights;
+        int32_t num_taps;
+};
+
+/**
+ * struct rgb_converter - Filters and scratch rows of the conversion of one
+ * source size and format to one output size.
+ * @src_width: Width of the decoded frames.
+ * @src_height: Height of the decoded frames.
+ * @src_format: Pixel format of the decoded frames.
+ * @dst_width: Width of the RGB24 output.
+ * @dst_height: Height of the RGB24 output.
+ * @kernel: RGB_KERNEL_BILINEAR or RGB_KERNEL_AREA.
+ * @luma_x: Horizontal filter of the luma plane.
+ * @luma_y: Vertical filter of the luma plane.
+ * @chroma_x: Horizontal filter of the chroma planes.
+ * @chroma_y: Vertical filter of the chroma planes.
+ * @row_sums: Vertical filter sums of one source row.
+ * @luma_row: Vertically filtered luma row, in Q6.
+ * @chroma_row: Vertically filtered chroma row, in Q6. Holds U then V, or
+ * interleaved UV for NV12.
+ * @y_out: Filtered luma of one output row, in Q6.
+ * @u_out: Filtered U of one output row, in Q6.
+ * @v_out: Filtered V of one output row, in Q6.
+ */
+struct rgb_converter {
+        int32_t src_width;
+        int32_t src_height;
+        enum AVPixelFormat src_format;
+        int32_t dst_width;
+        int32_t dst_height;
+        enum rgb_kernel kernel;
+        struct resample_filter luma_x;
+        struct resample_filter luma_y;
+        struct resample_filter chroma_x;
+        struct resample_filter chroma_y;
+        int32_t *row_sums;
+        uint16_t *luma_row;
+        uint16_t *chroma_row;
+        int32_t *y_out;
+        int32_t *u_out;
+        int32_t *v_out;
+};
+
+/**
+ * rgb_converter_supports() - Returns true iff frames of `format` can be
+ * converted with `kernel`, rather than by swscale.
+ */
+bool rgb_converter_supports(enum AVPixelFormat format, enum rgb_kernel kernel);
+
+/**
+ * new_rgb_converter() - Returns a converter of `src_width` by `src_height`
+ * frames of `src_format` to `dst_width` by `dst_height` RGB24, or NULL if out
+ * of memory. `src_format` and `kernel` must be supported.
+ */
+struct rgb_converter *
+new_rgb_converter(int32_t src_width,
+                  int32_t src_height,
+                  enum AVPixelFormat src_format,
+                  int32_t dst_width,
+                  int32_t dst_height,
+                  enum rgb_kernel kernel);
+
+/**
+ * rgb_converter_matches() - Returns true iff `converter` converts the given
+ * source size and format to the given output size with `kernel`.
+ */
+bool
+rgb_converter_matches(const struct rgb_converter *converter,
+                      int32_t src_width,
+                      int32_t src_height,
+                      enum AVPixelFormat src_format,
+                      int32_t dst_width,
+                      int32_t dst_height,
+                      enum rgb_kernel kernel);
+
+/**
+ * convert_to_rgb() - Converts `frame` to RGB24 rows of `dest`, `dest_stride`
+ * bytes apart.
+ *
+ * The color matrix is picked from the colorspace of `frame`, or from its
+ * primaries if the colorspace is unspecified, or else BT.709 for HD and
+ * BT.601 for SD. Limited range is expanded to 0-255, unless `frame` is tagged
+ * full range.
+ */
+void
+convert_to_rgb(struct rgb_converter *converter,
+               uint8_t *dest,
+               int32_t dest_stride,
+               const AVFrame *frame);
+
+/**
+ * convert_to_rgb_reference() - Converts `frame` to `dst_width` by
+ * `dst_height` RGB24 rows of `dest`, `dest_stride` bytes apart, with a
+ * swscale context made for the frame, as RGB_KERNEL_REFERENCE.
+ *
+ * The color matrix is picked from the tags of `frame` as for
+ * convert_to_rgb(), but the matrix, range expansion and chroma upsampling
+ * are swscale's own.
+ *
+ * Returns false if the swscale context couldn't be made.
+ */
+bool
+convert_to_rgb_reference(uint8_t *dest,
+                         int32_t dest_stride,
+                         int32_t dst_width,
+                         int32_t dst_height,
+                         const AVFrame *frame);
+
+/**
+ * free_rgb_converter() - Frees `*converter`, and sets it to NULL. Does
+ * nothing if `*converter` is NULL.
+ */
+void free_rgb_converter(struct rgb_converter **converter);
+
+#endif // _RGB_CONVERT_H_
@@ -0,0 +1,700 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tar_shard.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_SHARD_NUM_SLOTS 64
+
+/**
+ * struct tar_shard - An open tar file, and the index of its members.
+ * @path: Path the shard was opened by.
+ * @fd: Open tar file.
+ * @size_bytes: Size of the tar file.
+ * @mtime_ns: Modification time of the tar file, in nanoseconds.
+ * @num_refs: Number of tar_shard_get() references not yet put.
+ * @last_used: Value of the use clock when the shard was last gotten.
+ * @is_cached: False iff the cache was full of shards in use when this one was
+ * opened, in which case it is closed once its last reference is put.
+ * @index_lock: Guards building the index.
+ * @is_indexed: True once `members` is built.
+ * @members: Regular files of the shard, sorted by name, then offset.
+ * @num_members: Length of `members`.
+ */
+struct tar_shard {
+        char *path;
+        int fd;
+        int64_t size_bytes;
+        int64_t mtime_ns;
+        int32_t num_refs;
+        uint64_t last_used;
+        bool is_cached;
+        pthread_mutex_t index_lock;
+        bool is_indexed;
+        struct tar_member *members;
+        int64_t num_members;
+};
+
+static pthread_mutex_t tar_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tar_shard *open_shards[TAR_SHARD_NUM_SLOTS];
+static int32_t num_open_shards = 0;
+static uint64_t use_clock = 0;
+
+static int64_t get_mtime_ns(const struct stat *file_stat)
+{
+        return (int64_t)file_stat->st_mtim.tv_sec*1000000000 +
+               file_stat->st_mtim.tv_nsec;
+}
+
+static void free_tar_shard(struct tar_shard *shard)
+{
+        int64_t i;
+        for (i = 0;
+             i < shard->num_members;
+             ++i)
+                free(shard->members[i].name);
+        free(shard->members);
+        pthread_mutex_destroy(&shard->index_lock);
+        close(shard->fd);
+        free(shard->path);
+        free(shard);
+}
+
+static struct tar_shard *
+open_tar_shard(const char *path, char *error_buf, size_t error_size)
+{
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                snprintf(error_buf,
+                         error_size,
+                         "%s: %s",
+                         path,
+                         strerror(errno));
+                return NULL;
+        }
+
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+                snprintf(error_buf,
+                         error_size,
+                         "%s: %s",
+                         path,
+                         strerror(errno));
+                close(fd);
+                return NULL;
+        }
+
+        struct tar_shard *shard = calloc(1, sizeof(struct tar_shard));
+        char *path_copy = strdup(path);
+        if ((shard == NULL) || (path_copy == NULL)) {
+                snprintf(error_buf, error_size, "out of memory");
+                free(path_copy);
+                free(shard);
+                close(fd);
+                return NULL;
+        }
+
+        shard->path = path_copy;
+        shard->fd = fd;
+        shard->size_bytes = file_stat.st_size;
+        shard->mtime_ns = get_mtime_ns(&file_stat);
+        shard->num_refs = 1;
+        shard->is_cached = true;
+        pthread_mutex_init(&shard->index_lock, NULL);
+
+        return shard;
+}
+
+/**
+ * find_open_shard() - Returns the cached shard at `path` with a new
+ * reference, or NULL. Must be called with the lock held.
+ * @path: Path of the tar file.
+ * @mtime_ns: Modification time the tar file has now.
+ * @size_bytes: Size the tar file has now.
+ * @stale: Set to a cached shard of `path` that changed since it was opened,
+ * if it is idle and must be freed.
+ *
+ * A shard that changed is taken out of the cache. If it is still in use, it is
+ * freed once its last reference is put instead.
+ */
+static struct tar_shard *
+find_open_shard(const char *path,
+                int64_t mtime_ns,
+                int64_t size_bytes,
+                struct tar_shard **stale)
+{
+        *stale = NULL;
+
+        int32_t i;
+        for (i = 0;
+             i < num_open_shards;
+             ++i) {
+                struct tar_shard *shard = open_shards[i];
+                if (strcmp(shard->path, path) != 0)
+                        continue;
+
+                if ((shard->mtime_ns == mtime_ns) &&
+                    (shard->size_bytes == size_bytes)) {
+                        ++shard->num_refs;
+                        shard->last_used = ++use_clock;
+                        return shard;
+                }
+
+                --num_open_shards;
+                open_shards[i] = open_shards[num_open_shards];
+                if (shard->num_refs == 0)
+                        *stale = shard;
+                else
+                        shard->is_cached = false;
+
+                return NULL;
+        }
+
+        return NULL;
+}
+
+/**
+ * insert_shard() - Adds `shard` to the cache, and returns the least recently
+ * used idle shard that it displaced, or NULL. If every cached shard is in
+ * use, `shard` isn't cached. Must be called with the lock held.
+ */
+static struct tar_shard *insert_shard(struct tar_shard *shard)
+{
+        shard->last_used = ++use_clock;
+        if (num_open_shards < TAR_SHARD_NUM_SLOTS) {
+                open_shards[num_open_shards] = shard;
+                ++num_open_shards;
+                return NULL;
+        }
+
+        int32_t oldest = -1;
+        int32_t i;
+        for (i = 0;
+             i < num_open_shards;
+             ++i) {
+                if ((open_shards[i]->num_refs == 0) &&
+                    ((oldest < 0) ||
+                     (open_shards[i]->last_used <
+                      open_shards[oldest]->last_used)))
+                        oldest = i;
+        }
+
+        if (oldest < 0) {
+                shard->is_cached = false;
+                return NULL;
+        }
+
+        struct tar_shard *evicted = open_shards[oldest];
+        open_shards[oldest] = shard;
+
+        return evicted;
+}
+
+/**
+ * read_fully() - Reads `num_bytes` at `offset` of `fd` into `buf`.
+ *
+ * Returns true iff all of them were read.
+ */
+static bool
+read_fully(int fd, void *buf, size_t num_bytes, int64_t offset)
+{
+        uint8_t *dest = buf;
+        while (num_bytes > 0) {
+                ssize_t num_read = pread(fd, dest, num_bytes, offset);
+                if ((num_read < 0) && (errno == EINTR))
+                        continue;
+                if (num_read <= 0)
+                        return false;
+
+                dest += num_read;
+                num_bytes -= num_read;
+                offset += num_read;
+        }
+
+        return true;
+}
+
+/**
+ * parse_number() - Parses a numeric header field: octal ASCII, or GNU
+ * base-256 if the high bit of the first byte is set.
+ */
+static int64_t parse_number(const uint8_t *field, int32_t size)
+{
+        int64_t value = 0;
+        int32_t i;
+
+        if (field[0] & 0x80) {
+                value = field[0] & 0x3f;
+                for (i = 1;
+                     i < size;
+                     ++i)
+                        value = (value << 8) | field[i];
+
+                return value;
+        }
+
+        for (i = 0;
+             (i < size) && (field[i] == ' ');
+             ++i)
+                ;
+        for (;
+             (i < size) && (field[i] >= '0') && (field[i] <= '7');
+             ++i)
+                value = (value << 3) | (field[i] - '0');
+
+        return value;
+}
+
+/**
+ * is_header_valid() - Checks the checksum of a header block, computed over
+ * unsigned or, as by some old tars, signed bytes.
+ */
+static bool is_header_valid(const uint8_t *header)
+{
+        int64_t unsigned_sum = 0;
+        int64_t signed_sum = 0;
+        int32_t i;
+        for (i = 0;
+             i < TAR_BLOCK_SIZE;
+             ++i) {
+                uint8_t byte = ((i >= 148) && (i < 156)) ? ' ' : header[i];
+                unsigned_sum += byte;
+                signed_sum += (int8_t)byte;
+        }
+
+        int64_t checksum = parse_number(header + 148, 8);
+
+        return (checksum == unsigned_sum) || (checksum == signed_sum);
+}
+
+static bool is_zero_block(const uint8_t *block)
+{
+        int32_t i;
+        for (i = 0;
+             i < TAR_BLOCK_SIZE;
+             ++i) {
+                if (block[i] != 0)
+                        return false;
+        }
+
+        return true;
+}
+
+/**
+ * read_member_data() - Returns a NUL-terminated copy of the `length` bytes
+ * of data at `offset`, e.g., of a long name or pax header, or NULL.
+ */
+static char *
+read_member_data(struct tar_shard *shard, int64_t offset, int64_t length)
+{
+        if ((length < 0) || (length > (1 << 20)))
+                return NULL;
+
+        char *data = malloc(length + 1);
+        if (data == NULL)
+                return NULL;
+
+        if (!read_fully(shard->fd, data, length, offset)) {
+                free(data);
+                return NULL;
+        }
+        data[length] = '\0';
+
+        return data;
+}
+
+/**
+ * parse_pax_header() - Reads the `path` and `size` records of the pax
+ * extended header `records`, of `length` bytes, into `*name` and `*size`.
+ * Records are "<length> <key>=<value>\n".
+ */
+static void
+parse_pax_header(const char *records,
+                 int64_t length,
+                 char **name,
+                 int64_t *size)
+{
+        int64_t offset = 0;
+        while (offset < length) {
+                char *end;
+                int64_t record_length = strtoll(records + offset, &end, 10);
+                if ((record_length <= 0) ||
+                    (offset + record_length > length) ||
+                    (*end != ' '))
+                        return;
+
+                const char *key = end + 1;
+                const char *record_end = records + offset + record_length - 1;
+                const char *equals = memchr(key, '=', record_end - key);
+                if (equals != NULL) {
+                        size_t key_length = equals - key;
+                        const char *value = equals + 1;
+                        if ((key_length == 4) &&
+                            (memcmp(key, "path", 4) == 0)) {
+                                free(*name);
+                                *name = strndup(value, record_end - value);
+                        } else if ((key_length == 4) &&
+                                   (memcmp(key, "size", 4) == 0)) {
+                                *size = strtoll(value, NULL, 10);
+                        }
+                }
+
+                offset += record_length;
+        }
+}
+
+/**
+ * get_header_name() - Returns a copy of the name in a ustar or v7 header.
+ */
+static char *get_header_name(const uint8_t *header)
+{
+        const char *name = (const char *)header;
+        size_t name_length = strnlen(name, 100);
+
+        /* NOTE: Only POSIX ustar headers have a prefix; GNU's use it for times. */
+        const char *prefix = (const char *)header + 345;
+        size_t prefix_length = 0;
+        if (memcmp(header + 257, "ustar\0", 6) == 0)
+                prefix_length = strnlen(prefix, 155);
+
+        char *full_name = malloc(prefix_length + 1 + name_length + 1);
+        if (full_name == NULL)
+                return NULL;
+
+        char *next = full_name;
+        if (prefix_length > 0) {
+                memcpy(next, prefix, prefix_length);
+                next += prefix_length;
+                *next = '/';
+                ++next;
+        }
+        memcpy(next, name, name_length);
+        next[name_length] = '\0';
+
+        return full_name;
+}
+
+static int compare_members(const void *a, const void *b)
+{
+        const struct tar_member *member_a = a;
+        const struct tar_member *member_b = b;
+
+        int32_t order = strcmp(member_a->name, member_b->name);
+        if (order != 0)
+                return order;
+
+        return (member_a->offset > member_b->offset) -
+               (member_a->offset < member_b->offset);
+}
+
+/**
+ * add_member() - Appends a member to the index of `shard`, taking ownership
+ * of `name`.
+ */
+static bool
+add_member(struct tar_shard *shard,
+           int64_t *capacity,
+           char *name,
+           int64_t offset,
+           int64_t length)
+{
+        if (shard->num_members == *capacity) {
+                int64_t new_capacity = (*capacity > 0) ? 2*(*capacity) : 256;
+                struct tar_member *members =
+                        realloc(shard->members,
+                                new_capacity*sizeof(struct tar_member));
+                if (members == NULL) {
+                        free(name);
+                        return false;
+                }
+                shard->members = members;
+                *capacity = new_capacity;
+        }
+
+        struct tar_member *member = shard->members + shard->num_members;
+        member->name = name;
+        member->offset = offset;
+        member->length = length;
+        ++shard->num_members;
+
+        return true;
+}
+
+/**
+ * index_tar_shard() - Reads the headers of `shard` into its member index.
+ *
+ * Handles ustar and v7 headers, GNU long names ('L') and base-256 sizes, and
+ * pax `path` and `size` records. Returns true on success.
+ */
+static bool
+index_tar_shard(struct tar_shard *shard,
+                char *error_buf,
+                size_t error_size)
+{
+        uint8_t header[TAR_BLOCK_SIZE];
+        int64_t capacity = 0;
+        int64_t offset = 0;
+        char *next_name = NULL;
+        int64_t next_size = -1;
+
+        while (offset + TAR_BLOCK_SIZE <= shard->size_bytes) {
+                if (!read_fully(shard->fd, header, TAR_BLOCK_SIZE, offset)) {
+                        snprintf(error_buf,
+                                 error_size,
+                                 "%s: read error at offset %" PRId64,
+                                 shard->path,
+                                 offset);
+                        goto err_free_next_name;
+                }
+                if (is_zero_block(header))
+                        break;
+                if (!is_header_valid(header)) {
+                        snprintf(error_buf,
+                                 error_size,
+                                 "%s: not a tar file, or corrupt at offset %" PRId64,
+                                 shard->path,
+                                 offset);
+                        goto err_free_next_name;
+                }
+
+                const int64_t data_offset = offset + TAR_BLOCK_SIZE;
+                const int64_t data_size = parse_number(header + 124, 12);
+                const char type = header[156];
+                offset = data_offset +
+                         (data_size + TAR_BLOCK_SIZE - 1)/TAR_BLOCK_SIZE*
+                         TAR_BLOCK_SIZE;
+
+                if (type == 'L') {
+                        free(next_name);
+                        next_name = read_member_data(shard,
+                                                     data_offset,
+                                                     data_size);
+                        continue;
+                }
+                if (type == 'x') {
+                        char *records = read_member_data(shard,
+                                                         data_offset,
+                                                         data_size);
+                        if (records != NULL)
+                                parse_pax_header(records,
+                                                 data_size,
+                                                 &next_name,
+                                                 &next_size);
+                        free(records);
+                        continue;
+                }
+
+                if ((type == '0') || (type == '\0') || (type == '7')) {
+                        char *name = (next_name != NULL) ?
+                                     next_name :
+                                     get_header_name(header);
+                        int64_t length = (next_size >= 0) ?
+                                         next_size :
+                                         data_size;
+                        next_name = NULL;
+
+                        /* NOTE: A pax size may differ from the header's. */
+                        if (next_size >= 0)
+                                offset = data_offset +
+                                         (length + TAR_BLOCK_SIZE - 1)/
+                                         TAR_BLOCK_SIZE*TAR_BLOCK_SIZE;
+
+                        if ((name == NULL) ||
+                            !add_member(shard,
+                                        &capacity,
+                                        name,
+                                        data_offset,
+                                        length)) {
+                                snprintf(error_buf,
+                                         error_size,
+                                         "out of memory");
+                                goto err_free_next_name;
+                        }
+                }
+
+                free(next_name);
+                next_name = NULL;
+                next_size = -1;
+        }
+
+        qsort(shard->members,
+              shard->num_members,
+              sizeof(struct tar_member),
+              compare_members);
+
+        return true;
+
+err_free_next_name:
+        free(next_name);
+
+        return false;
+}
+
+struct tar_shard *
+tar_shard_get(const char *path,
+              bool should_index,
+              char *error_buf,
+              size_t error_size)
+{
+        struct stat file_stat;
+        if (stat(path, &file_stat) != 0) {
+                snprintf(error_buf,
+                         error_size,
+                         "%s: %s",
+                         path,
+                         strerror(errno));
+                return NULL;
+        }
+
+        struct tar_shard *stale;
+        pthread_mutex_lock(&tar_shards_lock);
+        struct tar_shard *shard = find_open_shard(path,
+                                                  get_mtime_ns(&file_stat),
+                                                  file_stat.st_size,
+                                                  &stale);
+        pthread_mutex_unlock(&tar_shards_lock);
+
+        if (stale != NULL)
+                free_tar_shard(stale);
+
+        if (shard == NULL) {
+                struct tar_shard *new_shard = open_tar_shard(path,
+                                                             error_buf,
+                                                             error_size);
+                if (new_shard == NULL)
+                        return NULL;
+
+                /* NOTE: Another thread may have opened the shard meanwhile. */
+                struct tar_shard *evicted = NULL;
+                pthread_mutex_lock(&tar_shards_lock);
+                shard = find_open_shard(path,
+                                        new_shard->mtime_ns,
+                                        new_shard->size_bytes,
+                                        &stale);
+                if (shard == NULL) {
+                        evicted = insert_shard(new_shard);
+                        shard = new_shard;
+                        new_shard = NULL;
+                }
+                pthread_mutex_unlock(&tar_shards_lock);
+
+                if (new_shard != NULL)
+                        free_tar_shard(new_shard);
+                if (stale != NULL)
+                        free_tar_shard(stale);
+                if (evicted != NULL)
+                        free_tar_shard(evicted);
+        }
+
+        if (!should_index)
+                return shard;
+
+        pthread_mutex_lock(&shard->index_lock);
+        if (!shard->is_indexed) {
+                shard->is_indexed = index_tar_shard(shard,
+                                                    error_buf,
+                                                    error_size);
+                if (!shard->is_indexed) {
+                        int64_t i;
+                        for (i = 0;
+                             i < shard->num_members;
+                             ++i)
+                                free(shard->members[i].name);
+                        free(shard->members);
+                        shard->members = NULL;
+                        shard->num_members = 0;
+                }
+        }
+        bool is_indexed = shard->is_indexed;
+        pthread_mutex_unlock(&shard->index_lock);
+
+        if (!is_indexed) {
+                tar_shard_put(&shard);
+                return NULL;
+        }
+
+        return shard;
+}
+
+void tar_shard_put(struct tar_shard **shard)
+{
+        if (*shard == NULL)
+                return;
+
+        pthread_mutex_lock(&tar_shards_lock);
+        --(*shard)->num_refs;
+        bool should_free = ((*shard)->num_refs == 0) && !(*shard)->is_cached;
+        pthread_mutex_unlock(&tar_shards_lock);
+
+        if (should_free)
+                free_tar_shard(*shard);
+        *shard = NULL;
+}
+
+int tar_shard_fd(const struct tar_shard *shard)
+{
+        return shard->fd;
+}
+
+int64_t tar_shard_size(const struct tar_shard *shard)
+{
+        return shard->size_bytes;
+}
+
+const struct tar_member *
+tar_shard_find(const struct tar_shard *shard, const char *name)
+{
+        int64_t low = 0;
+        int64_t high = shard->num_members;
+
+        /* NOTE: Finds the first member named at least `name`. */
+        while (low < high) {
+                int64_t middle = low + (high - low)/2;
+                if (strcmp(shard->members[middle].name, name) < 0)
+                        low = middle + 1;
+                else
+                        high = middle;
+        }
+
+        const struct tar_member *found = NULL;
+        for (;
+             (low < shard->num_members) &&
+             (strcmp(shard->members[low].name, name) == 0);
+             ++low)
+                found = shard->members + low;
+
+        return found;
+}
+
+int64_t
+tar_shard_members(const struct tar_shard *shard,
+                  const struct tar_member **members)
+{
+        *members = shard->members;
+
+        return shard->num_members;
+}
@@ -0,0 +1,100 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TAR_SHARD_H_
+#define _TAR_SHARD_H_
+
+/**
+ * Tar shards of videos, e.g., as written for WebDataset, read in place: each
+ * shard is opened once, and its members are served as byte ranges of that
+ * one file descriptor.
+ *
+ * Opened shards and their member indices are cached, shared by all threads.
+ * A cached shard whose modification time or size changed is opened and
+ * indexed again, while calls still reading the old one keep its descriptor.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * struct tar_member - A regular file in a tar shard.
+ * @name: Full path of the member in the archive.
+ * @offset: Byte offset of the member's data in the shard.
+ * @length: Size of the member's data, in bytes.
+ */
+struct tar_member {
+        char *name;
+        int64_t offset;
+        int64_t length;
+};
+
+struct tar_shard;
+
+/**
+ * tar_shard_get() - Returns the cached shard at `path`, opening it if
+ * needed.
+ * @path: Path of the tar file.
+ * @should_index: Also read the member index of the shard, if it isn't yet.
+ * @error_buf: Set to a description of the error on failure.
+ * @error_size: Size of `error_buf`, in bytes.
+ *
+ * Returns NULL on failure. Release with tar_shard_put().
+ */
+struct tar_shard *
+tar_shard_get(const char *path,
+              bool should_index,
+              char *error_buf,
+              size_t error_size);
+
+/**
+ * tar_shard_put() - Releases a reference from tar_shard_get(), and sets
+ * `*shard` to NULL. Does nothing if `*shard` is NULL.
+ */
+void tar_shard_put(struct tar_shard **shard);
+
+/**
+ * tar_shard_fd() - Returns the file descriptor of `shard`, shared by all of
+ * its readers, which must only use positioned reads on it.
+ */
+int tar_shard_fd(const struct tar_shard *shard);
+
+/**
+ * tar_shard_size() - Returns the size of the tar file of `shard`, in bytes.
+ */
+int64_t tar_shard_size(const struct tar_shard *shard);
+
+/**
+ * tar_shard_find() - Returns the member of an indexed `shard` named `name`,
+ * or NULL if there is none. If a name appears more than once, the last
+ * member wins, as when extracting.
+ */
+const struct tar_member *
+tar_shard_find(const struct tar_shard *shard, const char *name);
+
+/**
+ * tar_shard_members() - Sets `*members` to the members of an indexed
+ * `shard`, sorted by name, and returns their number. The members are owned
+ * by `shard`.
+ */
+int64_t
+tar_shard_members(const struct tar_shard *shard,
+                  const struct tar_member **members);
+
+#endif // _TAR_SHARD_H_
@@ -17,6 +17,12 @@
  * Lintel. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "video_decode.h"
+#include "audio_decode.h"
+#include "buffer_pool.h"
+#include "file_io.h"
+#include "motion_vectors.h"
+#include "tar_shard.h"
+#include <libavutil/time.h>
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
@@ -26,25 +32,174 @@
 #include <string.h>
 #include <time.h>
 
+uint64_t next_random(uint64_t *state)
+{
+        uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+
+        return z ^ (z >> 31);
+}
+
+double next_random_unit(uint64_t *state)
+{
+        return (next_random(state) >> 11)*(1.0/(UINT64_C(1) << 53));
+}
+
+void
+set_decode_deadline(struct video_stream_context *vid_ctx, int32_t timeout_ms)
+{
+        vid_ctx->deadline_us = av_gettime_relative() + 1000*(int64_t)timeout_ms;
+}
+
+bool check_decode_deadline(struct video_stream_context *vid_ctx)
+{
+        if (av_gettime_relative() < vid_ctx->deadline_us)
+                return false;
+
+        vid_ctx->error_type = PyExc_TimeoutError;
+        vid_ctx->error_msg = "decode video frame timeout.";
+
+        return true;
+}
+
+int32_t decode_interrupt_callback(void *opaque)
+{
+        return check_decode_deadline((struct video_stream_context *)opaque);
+}
+
+/**
+ * NOTE: Strides of at least DISCARD_MIN_STRIDE frames between the requested
+ * frames of a linear decode turn on discarding, and packets within
+ * DISCARD_MARGIN_FRAMES of a requested frame (by their estimated index) are
+ * always decoded.
+ */
+#define DISCARD_MIN_STRIDE 4
+#define DISCARD_MARGIN_FRAMES 2
+#define DISCARD_MAX_CANDIDATES 64
+
+/**
+ * struct frame_discard - Non-reference frames skipped by the decoder during
+ * a linear decode, because no requested frame is near them.
+ * @wanted: Frame numbers still to be output, in non-decreasing order.
+ * @num_wanted: Length of `wanted`.
+ * @start_time: Start time of the video stream, in its time base.
+ * @avg_frame_duration: Average duration of a frame, in the time base.
+ * @candidates: PTS of the packets sent with AVDISCARD_NONREF, whose frames
+ * have not been output. A reference frame among them is still decoded, and
+ * output in order.
+ * @num_candidates: Length of `candidates`.
+ */
+struct frame_discard {
+        const int32_t *wanted;
+        int32_t num_wanted;
+        int64_t start_time;
+        int64_t avg_frame_duration;
+        int64_t candidates[DISCARD_MAX_CANDIDATES];
+        int32_t num_candidates;
+};
+
+/**
+ * should_discard_packet() - Returns true iff the frame of `packet` isn't
+ * requested, judging by its index estimated from its PTS, and so the decoder
+ * may skip it if no other frame references it.
+ */
+static bool
+should_discard_packet(const struct frame_discard *discard,
+                      const AVPacket *packet)
+{
+        if ((packet->pts == AV_NOPTS_VALUE) ||
+            (discard->num_candidates == DISCARD_MAX_CANDIDATES))
+                return false;
+
+        int64_t estimate = (packet->pts - discard->start_time +
+                            discard->avg_frame_duration/2)/
+                           discard->avg_frame_duration;
+        int32_t i;
+        for (i = 0;
+             i < discard->num_wanted;
+             ++i) {
+                if (discard->wanted[i] > estimate + DISCARD_MARGIN_FRAMES)
+                        break;
+                if (discard->wanted[i] >= estimate - DISCARD_MARGIN_FRAMES)
+                        return false;
+        }
+
+        return true;
+}
+
+/**
+ * get_packet_skip_frame() - Returns the `skip_frame` to send `packet` with,
+ * recording the packet as a candidate if it may be skipped.
+ */
+static enum AVDiscard
+get_packet_skip_frame(struct frame_discard *discard, const AVPacket *packet)
+{
+        if (!should_discard_packet(discard, packet))
+                return AVDISCARD_DEFAULT;
+
+        discard->candidates[discard->num_candidates] = packet->pts;
+        ++discard->num_candidates;
+
+        return AVDISCARD_NONREF;
+}
+
+/**
+ * count_discarded_frames() - Returns the number of frames skipped by the
+ * decoder that are shown after `prev_pts` and before the frame just output,
+ * at `pts`, and forgets those up to `pts`.
+ *
+ * Frames are output in PTS order, so a candidate before `pts` that wasn't
+ * output was skipped.
+ */
+static int32_t
+count_discarded_frames(struct frame_discard *discard,
+                       int64_t prev_pts,
+                       int64_t pts)
+{
+        int32_t num_discarded = 0;
+        int32_t num_kept = 0;
+        int32_t i;
+        for (i = 0;
+             i < discard->num_candidates;
+             ++i) {
+                int64_t candidate = discard->candidates[i];
+                if (candidate > pts) {
+                        discard->candidates[num_kept] = candidate;
+                        ++num_kept;
+                } else if ((candidate < pts) && (candidate > prev_pts)) {
+                        ++num_discarded;
+                }
+        }
+        discard->num_candidates = num_kept;
+
+        return num_discarded;
+}
+
 /**
  * Receives a complete frame from the video stream in format_context that
  * corresponds to video_stream_index.
  *
  * @param vid_ctx Context needed to decode frames from the video stream.
+ * @param discard If not NULL, packets of frames far from the requested ones
+ * are sent with AVDISCARD_NONREF, and recorded in `discard`.
  *
- * @return SUCCESS on success, VID_DECODE_EOF if no frame was received, and
+ * @return SUCCESS on success, VID_DECODE_EOF if no frame was received,
+ * VID_DECODE_TIMEOUT if the deadline of `vid_ctx` passed, and
  * VID_DECODE_FFMPEG_ERR if an FFmpeg error occurred..
  */
 static int32_t
-receive_frame(struct video_stream_context *vid_ctx)
+receive_frame_discarding(struct video_stream_context *vid_ctx,
+                         struct frame_discard *discard)
 {
         AVPacket packet;
         int32_t status;
         bool was_frame_received;
 
         av_init_packet(&packet);
-    
-        vid_ctx->decode_time = time(NULL);
+
+        if (check_decode_deadline(vid_ctx))
+                return VID_DECODE_TIMEOUT;
 
         status = avcodec_receive_frame(vid_ctx->codec_context,
                                        vid_ctx->frame);
@@ -58,10 +213,20 @@ receive_frame(struct video_stream_context *vid_ctx)
                 return VID_DECODE_FFMPEG_ERR;
         }
                     
+        /**
+         * NOTE: The deadline is checked per packet as well as in FFmpeg's
+         * interrupt callback, since a long run of packets from the page cache
+         * never blocks in I/O.
+         */
         was_frame_received = false;
         while (!was_frame_received &&
+               !check_decode_deadline(vid_ctx) &&
                (av_read_frame(vid_ctx->format_context, &packet) == 0)) {
                 if (packet.stream_index == vid_ctx->video_stream_index) {
+                        if (discard != NULL)
+                                vid_ctx->codec_context->skip_frame =
+                                        get_packet_skip_frame(discard, &packet);
+
                         status = avcodec_send_packet(vid_ctx->codec_context,
                                                      &packet);
                         if (status != 0) {
@@ -81,6 +246,9 @@ receive_frame(struct video_stream_context *vid_ctx)
                                 vid_ctx->error_msg = "avcodec receive frame error.";
                                 return VID_DECODE_FFMPEG_ERR;
                         }
+                } else if ((vid_ctx->audio != NULL) &&
+                           (packet.stream_index == vid_ctx->audio->stream_index)) {
+                        decode_audio_packet(vid_ctx->audio, &packet);
                 }
 
                 av_packet_unref(&packet);
@@ -88,7 +256,10 @@ receive_frame(struct video_stream_context *vid_ctx)
 
         if (was_frame_received)
                 return VID_DECODE_SUCCESS;
-        
+
+        if (vid_ctx->error_type == PyExc_TimeoutError)
+                return VID_DECODE_TIMEOUT;
+
         if (vid_ctx->error_type != NULL) {
                 return VID_DECODE_FFMPEG_ERR;
         }
@@ -119,80 +290,74 @@ receive_frame(struct video_stream_context *vid_ctx)
         return VID_DECODE_EOF;
 }
 
-/**
- * Allocates an RGB image frame.
- *
- * @param codec_context Decoder context from the video stream, from which the
- * RGB frame will get its dimensions.
- *
- * @return The allocated RGB frame on success, NULL on failure.
- */
-static AVFrame *
-allocate_rgb_image(AVCodecContext *codec_context)
+static int32_t
+receive_frame(struct video_stream_context *vid_ctx)
 {
-        int32_t status;
-        AVFrame *frame_rgb;
+        return receive_frame_discarding(vid_ctx, NULL);
+}
 
-        frame_rgb = av_frame_alloc();
-        if (frame_rgb == NULL)
-                return NULL;
+int32_t decode_audio_to_span_end(struct video_stream_context *vid_ctx)
+{
+        struct audio_stream_context *audio = vid_ctx->audio;
+        AVPacket packet;
 
-        frame_rgb->format = AV_PIX_FMT_RGB24;
-        frame_rgb->width = codec_context->width;
-        frame_rgb->height = codec_context->height;
-
-        status = av_image_alloc(frame_rgb->data,
-                                frame_rgb->linesize,
-                                frame_rgb->width,
-                                frame_rgb->height,
-                                AV_PIX_FMT_RGB24,
-                                32);
-        if (status < 0)
-        {
-                av_frame_free(&frame_rgb);
-                return NULL;
+        av_init_packet(&packet);
+        while (!is_audio_span_decoded(audio)) {
+                if (check_decode_deadline(vid_ctx))
+                        return VID_DECODE_TIMEOUT;
+
+                if (av_read_frame(vid_ctx->format_context, &packet) != 0) {
+                        decode_audio_packet(audio, NULL);
+                        break;
+                }
+
+                if (packet.stream_index == audio->stream_index)
+                        decode_audio_packet(audio, &packet);
+                av_packet_unref(&packet);
         }
 
-        return frame_rgb;
+        return VID_DECODE_SUCCESS;
 }
 
-static AVFrame *
-allocate_resize_rgb_image(AVCodecContext *codec_context, uint32_t rewidth, uint32_t reheight)
+int32_t
+read_first_gop(struct video_stream_context *vid_ctx, int64_t max_bytes)
 {
-        int32_t status;
-        AVFrame *frame_rgb;
+        AVIOContext *pb = vid_ctx->format_context->pb;
+        int64_t num_keyframes = 0;
+        AVPacket packet;
 
-        frame_rgb = av_frame_alloc();
-        if (frame_rgb == NULL)
-                return NULL;
+        av_init_packet(&packet);
+        packet.data = NULL;
+        packet.size = 0;
+        for (;;) {
+                if (check_decode_deadline(vid_ctx))
+                        return VID_DECODE_TIMEOUT;
+                if ((pb != NULL) && (avio_tell(pb) >= max_bytes))
+                        return VID_DECODE_SUCCESS;
 
-        // resize
-        frame_rgb->format = AV_PIX_FMT_RGB24; // frame mode RGB or BGR
-        frame_rgb->width = rewidth;
-        frame_rgb->height = reheight;
-
-        status = av_image_alloc(frame_rgb->data,
-                                frame_rgb->linesize,
-                                frame_rgb->width,
-                                frame_rgb->height,
-                                AV_PIX_FMT_RGB24,
-                                32);
-        if (status < 0)
-        {
-                av_frame_free(&frame_rgb);
-                return NULL;
-        }
+                if (av_read_frame(vid_ctx->format_context, &packet) != 0)
+                        return VID_DECODE_EOF;
+
+                if ((packet.stream_index == vid_ctx->video_stream_index) &&
+                    (packet.flags & AV_PKT_FLAG_KEY))
+                        ++num_keyframes;
+                av_packet_unref(&packet);
 
-        return frame_rgb;
+                if (num_keyframes > 1)
+                        return VID_DECODE_SUCCESS;
+        }
 }
 
 /**
- * Copies the received frame in `frame` to `dest`, using `frame_rgb` as
- * temporary storage for `sws_scale`.
+ * Copies the received frame in `frame` to `dest`, converting it with the
+ * fused kernel of `vid_ctx` if it supports the pixel format of `frame`, and
+ * otherwise using `frame_rgb` as temporary storage for `sws_scale`. If
+ * `vid_ctx` has a motion field, the motion of `frame` is filled in too.
  *
  * @param dest Destination buffer for RGB24 frame.
  * @param frame Received frame.
- * @param frame_rgb Temporary RGB frame.
+ * @param frame_rgb Temporary RGB frame, of the output size.
+ * @param vid_ctx Context of the video stream `frame` was decoded from.
  * @param sws_context Context to use for sws_scale operation.
  * @param copied_bytes Number of bytes already copied into dest from the video.
  * @param bytes_per_row Number of bytes per row in the video.
@@ -204,16 +369,45 @@ static uint32_t
 copy_next_frame(uint8_t *dest,
                 AVFrame *frame,
                 AVFrame *frame_rgb,
-                AVCodecContext *codec_context,
+                struct video_stream_context *vid_ctx,
                 struct SwsContext *sws_context,
                 uint32_t copied_bytes,
                 const uint32_t bytes_per_row)
 {
+        if (vid_ctx->motion != NULL)
+                fill_motion_field(vid_ctx->motion,
+                                  frame,
+                                  copied_bytes/(bytes_per_row*frame_rgb->height));
+
+        if ((vid_ctx->rgb_kernel == RGB_KERNEL_REFERENCE) &&
+            convert_to_rgb_reference(dest + copied_bytes,
+                                     bytes_per_row,
+                                     frame_rgb->width,
+                                     frame_rgb->height,
+                                     frame))
+                return copied_bytes + bytes_per_row*frame_rgb->height;
+
+        struct rgb_converter *converter = NULL;
+        if (rgb_converter_supports(frame->format, vid_ctx->rgb_kernel))
+                converter = pool_rgb_converter_get(frame->width,
+                                                   frame->height,
+                                                   frame->format,
+                                                   frame_rgb->width,
+                                                   frame_rgb->height,
+                                                   vid_ctx->rgb_kernel);
+        if (converter != NULL) {
+                /* NOTE: The fused kernel writes its rows straight to `dest`. */
+                convert_to_rgb(converter, dest + copied_bytes, bytes_per_row, frame);
+                pool_rgb_converter_put(&converter);
+
+                return copied_bytes + bytes_per_row*frame_rgb->height;
+        }
+
         sws_scale(sws_context,
                   (const uint8_t *const *)(frame->data),
                   frame->linesize,
                   0,
-                  codec_context->height,
+                  vid_ctx->codec_context->height,
                   frame_rgb->data,
                   frame_rgb->linesize);
 
@@ -270,34 +464,34 @@ loop_to_buffer_end(uint8_t *dest,
         }
 }
 
-void decode_video_to_out_buffer(uint8_t *dest,
+int32_t decode_video_to_out_buffer(uint8_t *dest,
                                    struct video_stream_context *vid_ctx,
-                                   int32_t num_requested_frames)
+                                   int32_t num_requested_frames,
+                                   int64_t *first_pts_out)
 {
         AVCodecContext *codec_context = vid_ctx->codec_context;
-        struct SwsContext *sws_context = sws_getContext(codec_context->width,
-                                                        codec_context->height,
-                                                        codec_context->pix_fmt,
-                                                        codec_context->width,
-                                                        codec_context->height,
-                                                        AV_PIX_FMT_RGB24,
-                                                        SWS_BILINEAR,
-                                                        NULL,
-                                                        NULL,
-                                                        NULL);
+        struct SwsContext *sws_context = pool_sws_get(codec_context->width,
+                                                      codec_context->height,
+                                                      codec_context->pix_fmt,
+                                                      codec_context->width,
+                                                      codec_context->height,
+                                                      AV_PIX_FMT_RGB24,
+                                                      SWS_BILINEAR);
         // assert(sws_context != NULL);
         if (sws_context == NULL) {
                 vid_ctx->error_type = PyExc_IOError;
                 vid_ctx->error_msg = "init sws context error";
-                return;
+                return 0;
         }
 
-        AVFrame *frame_rgb = allocate_rgb_image(codec_context);
+        AVFrame *frame_rgb = pool_rgb_image_get(codec_context->width,
+                                               codec_context->height);
         // assert(frame_rgb != NULL);
         if (frame_rgb == NULL) {
                 vid_ctx->error_type = PyExc_IOError;
                 vid_ctx->error_msg = "init frame rgb error";
-                return;
+                pool_sws_put(&sws_context);
+                return 0;
         }
 
         const uint32_t bytes_per_row = 3 * frame_rgb->width;
@@ -316,26 +510,126 @@ void decode_video_to_out_buffer(uint8_t *dest,
                                            frame_number,
                                            bytes_per_frame,
                                            num_requested_frames);
+                        if (frame_number > 0)
+                                frame_number = num_requested_frames;
                         break;
                 }
                 // assert(status == VID_DECODE_SUCCESS);
                 if (status != VID_DECODE_SUCCESS) {
                     goto out_free_frame_rgb_and_sws;
                 }
+                if ((frame_number == 0) && (first_pts_out != NULL))
+                        *first_pts_out = vid_ctx->frame->pts;
 
                 copied_bytes = copy_next_frame(dest,
                                                vid_ctx->frame,
                                                frame_rgb,
-                                               codec_context,
+                                               vid_ctx,
                                                sws_context,
                                                copied_bytes,
                                                bytes_per_row);
         }
 
 out_free_frame_rgb_and_sws:
-        av_freep(frame_rgb->data);
-        av_frame_free(&frame_rgb);
-        sws_freeContext(sws_context);
+        pool_rgb_image_put(&frame_rgb);
+        pool_sws_put(&sws_context);
+
+        return frame_number;
+}
+
+int32_t
+scale_rgb_frames(uint8_t *dest,
+                 uint32_t width,
+                 uint32_t height,
+                 const uint8_t *src,
+                 uint32_t src_width,
+                 uint32_t src_height,
+                 int32_t num_frames)
+{
+        struct SwsContext *sws_context = pool_sws_get(src_width,
+                                                      src_height,
+                                                      AV_PIX_FMT_RGB24,
+                                                      width,
+                                                      height,
+                                                      AV_PIX_FMT_RGB24,
+                                                      SWS_AREA);
+        if (sws_context == NULL)
+                return VID_DECODE_FFMPEG_ERR;
+
+        AVFrame *frame_rgb = pool_rgb_image_get(width, height);
+        if (frame_rgb == NULL) {
+                pool_sws_put(&sws_context);
+                return VID_DECODE_FFMPEG_ERR;
+        }
+
+        /**
+         * NOTE: swscale may write past the end of unaligned output rows, so
+         * rows go through the aligned `frame_rgb`, as in copy_next_frame().
+         */
+        const int32_t src_linesize = 3*src_width;
+        const uint32_t bytes_per_row = 3*width;
+        const uint32_t src_bytes_per_frame = src_linesize*src_height;
+        uint32_t copied_bytes = 0;
+        int32_t frame_number;
+        for (frame_number = 0;
+             frame_number < num_frames;
+             ++frame_number) {
+                const uint8_t *src_frame = src +
+                        (size_t)frame_number*src_bytes_per_frame;
+                sws_scale(sws_context,
+                          &src_frame,
+                          &src_linesize,
+                          0,
+                          src_height,
+                          frame_rgb->data,
+                          frame_rgb->linesize);
+
+                uint8_t *next_row = frame_rgb->data[0];
+                uint32_t row_index;
+                for (row_index = 0;
+                     row_index < height;
+                     ++row_index) {
+                        memcpy(dest + copied_bytes, next_row, bytes_per_row);
+
+                        next_row += frame_rgb->linesize[0];
+                        copied_bytes += bytes_per_row;
+                }
+        }
+
+        pool_rgb_image_put(&frame_rgb);
+        pool_sws_put(&sws_context);
+
+        return VID_DECODE_SUCCESS;
+}
+
+void
+normalize_rgb_frame(float *dest,
+                    const uint8_t *src,
+                    uint32_t num_pixels,
+                    const float mean[3],
+                    const float std[3])
+{
+        float scale[3];
+        float bias[3];
+        int32_t channel;
+        for (channel = 0;
+             channel < 3;
+             ++channel) {
+                scale[channel] = 1.0f/(255.0f*std[channel]);
+                bias[channel] = -mean[channel]/std[channel];
+        }
+
+        uint32_t pixel;
+        for (pixel = 0;
+             pixel < num_pixels;
+             ++pixel) {
+                dest[0] = src[0]*scale[0] + bias[0];
+                dest[1] = src[1]*scale[1] + bias[1];
+                dest[2] = src[2]*scale[2] + bias[2];
+
+                dest += 3;
+                src += 3;
+        }
 }
 
 // int32_t read_memory(void *opaque, uint8_t *buffer, int32_t buf_size_bytes)
@@ -482,8 +776,81 @@ out_free_frame_rgb_and_sws:
 //         return find_video_stream_index(format_context);
 // }
 
+void close_video_input(struct video_stream_context *vid_ctx)
+{
+        avformat_close_input(&vid_ctx->format_context);
+        close_file_reader(&vid_ctx->file);
+        tar_shard_put(&vid_ctx->shard);
+}
+
+/**
+ * NOTE: The fast open limits are enough for the demuxer to read a typical
+ * container header and a first keyframe. The defaults are FFmpeg's own.
+ */
+#define FAST_OPEN_PROBE_SIZE_BYTES (1 << 16)
+#define FAST_OPEN_ANALYZE_DURATION_US (AV_TIME_BASE/10)
+#define DEFAULT_PROBE_SIZE_BYTES 5000000
+
+void set_fast_open_limits(AVFormatContext *format_context)
+{
+        format_context->probesize = FAST_OPEN_PROBE_SIZE_BYTES;
+        format_context->max_analyze_duration = FAST_OPEN_ANALYZE_DURATION_US;
+}
+
+/**
+ * is_video_stream_info_complete() - Checks that the first video stream of
+ * `format_context` has the codec parameters needed to set up decoding.
+ */
+static bool
+is_video_stream_info_complete(AVFormatContext *format_context)
+{
+        uint32_t stream_index;
+        for (stream_index = 0;
+             stream_index < format_context->nb_streams;
+             ++stream_index) {
+                AVStream *video_stream = format_context->streams[stream_index];
+                AVCodecParameters *codecpar = video_stream->codecpar;
+                if (codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
+                        continue;
+
+                bool has_frame_count = ((video_stream->duration > 0) &&
+                                        (video_stream->nb_frames > 0));
+                bool has_frame_rate =
+                        ((video_stream->avg_frame_rate.num > 0) &&
+                         (video_stream->avg_frame_rate.den > 0) &&
+                         (format_context->duration > 0));
+
+                return ((codecpar->codec_id != AV_CODEC_ID_NONE) &&
+                        (codecpar->width > 0) &&
+                        (codecpar->height > 0) &&
+                        (codecpar->format != AV_PIX_FMT_NONE) &&
+                        (has_frame_count || has_frame_rate));
+        }
+
+        return false;
+}
+
+int32_t
+find_video_stream_info(AVFormatContext *format_context, bool fast_open)
+{
+        if (!fast_open)
+                return avformat_find_stream_info(format_context, NULL);
+
+        if (is_video_stream_info_complete(format_context))
+                return 0;
+
+        int32_t status = avformat_find_stream_info(format_context, NULL);
+        if ((status >= 0) && is_video_stream_info_complete(format_context))
+                return status;
+
+        format_context->probesize = DEFAULT_PROBE_SIZE_BYTES;
+        format_context->max_analyze_duration = 0;
+
+        return avformat_find_stream_info(format_context, NULL);
+}
 
-AVCodecContext *open_video_codec_ctx(AVStream *video_stream)
+AVCodecContext *
+open_video_codec_ctx(AVStream *video_stream, bool should_export_mvs)
 {
         int32_t status;
         AVCodecContext *codec_context;
@@ -505,6 +872,9 @@ AVCodecContext *open_video_codec_ctx(AVStream *video_stream)
                 return NULL;
         }
 
+        if (should_export_mvs)
+                codec_context->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+
         status = avcodec_open2(codec_context, video_codec, NULL);
         if (status != 0)
         {
@@ -548,7 +918,8 @@ seek_to_closest_keypoint(float *seek_distance_out,
          * the PTS corresponding to timestamp will be dropped (i.e., frame
          * N - 2 could be dropped, leaving N - 1).
          */
-        int64_t timestamp = rand() % (valid_seek_frame_limit + 1);
+        int64_t timestamp = next_random(&vid_ctx->rng_state) %
+                            (uint64_t)(valid_seek_frame_limit + 1);
         if (timestamp == 0)
                 /* NOTE(brendan): Use AV_NOPTS_VALUE to represent no skip. */
                 return AV_NOPTS_VALUE;
@@ -584,11 +955,119 @@ seek_to_closest_keypoint(float *seek_distance_out,
                 vid_ctx->error_msg = "av seek frame value error";
                 return AV_NOPTS_VALUE;
         }
-        
+        flush_audio_stream(vid_ctx->audio);
 
         return timestamp;
 }
 
+/**
+ * get_num_index_entries() - Returns the number of entries in the seek index
+ * of `stream`.
+ */
+static int32_t get_num_index_entries(AVStream *stream)
+{
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+        return avformat_index_get_entries_count(stream);
+#else
+        return stream->nb_index_entries;
+#endif
+}
+
+static const AVIndexEntry *get_index_entry(AVStream *stream, int32_t i)
+{
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+        return avformat_index_get_entry(stream, i);
+#else
+        return stream->index_entries + i;
+#endif
+}
+
+/**
+ * is_valid_clip_start() - Returns true iff `entry` is a keyframe at or
+ * before `last_start`.
+ */
+static bool
+is_valid_clip_start(const AVIndexEntry *entry, int64_t last_start)
+{
+        return (entry != NULL) &&
+               (entry->flags & AVINDEX_KEYFRAME) &&
+               (entry->timestamp != AV_NOPTS_VALUE) &&
+               (entry->timestamp <= last_start);
+}
+
+bool
+seek_to_random_keyframe(int64_t *start_out,
+                        float *seek_distance_out,
+                        struct video_stream_context *vid_ctx,
+                        uint32_t num_requested_frames)
+{
+        AVStream *video_stream =
+                vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        int64_t start_time = (video_stream->start_time != AV_NOPTS_VALUE) ?
+                             video_stream->start_time : 0;
+
+        int64_t valid_seek_frame_limit = (vid_ctx->nb_frames -
+                                          num_requested_frames);
+        if ((valid_seek_frame_limit < 0) || (vid_ctx->nb_frames <= 0))
+                return false;
+
+        int64_t last_start = start_time +
+                             av_rescale_rnd(valid_seek_frame_limit,
+                                            vid_ctx->duration,
+                                            vid_ctx->nb_frames,
+                                            AV_ROUND_DOWN);
+
+        /**
+         * NOTE: The index is read as the demuxer has it after opening, e.g.,
+         * every sample for MP4, or the cues for Matroska, and is not grown by
+         * reading the file.
+         */
+        int32_t num_entries = get_num_index_entries(video_stream);
+        int64_t num_valid = 0;
+        int32_t i;
+        for (i = 0;
+             i < num_entries;
+             ++i) {
+                if (is_valid_clip_start(get_index_entry(video_stream, i),
+                                        last_start))
+                        ++num_valid;
+        }
+        if (num_valid == 0)
+                return false;
+
+        int64_t pick = next_random(&vid_ctx->rng_state) % (uint64_t)num_valid;
+        int64_t timestamp = AV_NOPTS_VALUE;
+        for (i = 0;
+             i < num_entries;
+             ++i) {
+                const AVIndexEntry *entry = get_index_entry(video_stream, i);
+                if (!is_valid_clip_start(entry, last_start))
+                        continue;
+                if (pick == 0) {
+                        timestamp = entry->timestamp;
+                        break;
+                }
+                --pick;
+        }
+
+        int32_t status = av_seek_frame(vid_ctx->format_context,
+                                       vid_ctx->video_stream_index,
+                                       timestamp,
+                                       AVSEEK_FLAG_BACKWARD);
+        if (status < 0) {
+                vid_ctx->error_type = PyExc_ValueError;
+                vid_ctx->error_msg = "av seek frame value error";
+                return false;
+        }
+        flush_audio_stream(vid_ctx->audio);
+
+        *start_out = timestamp;
+        if (seek_distance_out != NULL)
+                *seek_distance_out = timestamp*av_q2d(video_stream->time_base);
+
+        return true;
+}
+
 int32_t
 skip_past_timestamp(struct video_stream_context *vid_ctx, int64_t timestamp)
 {
@@ -600,7 +1079,8 @@ skip_past_timestamp(struct video_stream_context *vid_ctx, int64_t timestamp)
                 int32_t status = receive_frame(vid_ctx);
                 if (status < 0)
                 {
-                        printf("Ran out of frames during seek.\n");
+                        if (status == VID_DECODE_EOF)
+                                printf("Ran out of frames during seek.\n");
                         return status;
                 }
                 // assert(status == VID_DECODE_SUCCESS);
@@ -632,7 +1112,30 @@ skip_past_timestamp(struct video_stream_context *vid_ctx, int64_t timestamp)
 //         return gop_num;
 // }
 
-void decode_video_from_frame_nums(uint8_t *dest,
+/**
+ * is_stride_at_least() - Returns true iff there are at least two frame
+ * numbers, and each is at least `min_stride` after the one before.
+ */
+static bool
+is_stride_at_least(const int32_t *frame_numbers,
+                   int32_t num_frames,
+                   int32_t min_stride)
+{
+        if (num_frames < 2)
+                return false;
+
+        int32_t i;
+        for (i = 1;
+             i < num_frames;
+             ++i) {
+                if (frame_numbers[i] - frame_numbers[i - 1] < min_stride)
+                        return false;
+        }
+
+        return true;
+}
+
+int32_t decode_video_from_frame_nums(uint8_t *dest,
                                   struct video_stream_context *vid_ctx,
                                   int32_t num_requested_frames,
                                   const int32_t *frame_numbers,
@@ -645,35 +1148,33 @@ void decode_video_from_frame_nums(uint8_t *dest,
         if (num_requested_frames <= 0) {
                 vid_ctx->error_type = PyExc_ValueError;
                 vid_ctx->error_msg = "requested frames number error";
-                return;
+                return 0;
         }
                
         AVCodecContext *codec_context = vid_ctx->codec_context;
-        struct SwsContext *sws_context = sws_getContext(codec_context->width,
-                                                        codec_context->height,
-                                                        codec_context->pix_fmt,
-                                                        *rewidth,
-                                                        *reheight,
-                                                        AV_PIX_FMT_RGB24, // frame mode
-                                                        SWS_FAST_BILINEAR, // resize mode  SWS_BILINEAR SWS_POINT
-                                                        NULL,
-                                                        NULL,
-                                                        NULL);
+        struct SwsContext *sws_context = pool_sws_get(codec_context->width,
+                                                      codec_context->height,
+                                                      codec_context->pix_fmt,
+                                                      *rewidth,
+                                                      *reheight,
+                                                      AV_PIX_FMT_RGB24, // frame mode
+                                                      SWS_FAST_BILINEAR); // resize mode  SWS_BILINEAR SWS_POINT
             
         // assert(sws_context != NULL);
         if (sws_context == NULL) {
                 vid_ctx->error_type = PyExc_IOError;
                 vid_ctx->error_msg = "init sws context error";
-                return;
+                return 0;
         }
 
         // resize image
-        AVFrame *frame_rgb = allocate_resize_rgb_image(codec_context, *rewidth, *reheight);
+        AVFrame *frame_rgb = pool_rgb_image_get(*rewidth, *reheight);
         // assert(frame_rgb != NULL);
         if (frame_rgb == NULL) {
                 vid_ctx->error_type = PyExc_IOError;
                 vid_ctx->error_msg = "init frame rgb error";
-                return;
+                pool_sws_put(&sws_context);
+                return 0;
         }
 
         int32_t status;
@@ -686,6 +1187,31 @@ void decode_video_from_frame_nums(uint8_t *dest,
         int64_t timestamp;
 
         int32_t avg_frame_duration = (vid_ctx->duration / vid_ctx->nb_frames);
+
+        /**
+         * NOTE: Decoding linearly at a large stride, the decoder skips the
+         * non-reference frames (e.g., B-frames) that aren't requested. The
+         * skipped frames are still counted, from the PTS of their packets.
+         */
+        struct frame_discard discard;
+        struct frame_discard *discard_ptr = NULL;
+        if (!should_key &&
+            !should_seek &&
+            (avg_frame_duration > 0) &&
+            is_stride_at_least(frame_numbers,
+                               num_requested_frames,
+                               DISCARD_MIN_STRIDE)) {
+                int32_t stream_index = vid_ctx->video_stream_index;
+                AVStream *video_stream =
+                        vid_ctx->format_context->streams[stream_index];
+                discard.start_time =
+                        (video_stream->start_time != AV_NOPTS_VALUE) ?
+                        video_stream->start_time : 0;
+                discard.avg_frame_duration = avg_frame_duration;
+                discard.num_candidates = 0;
+                discard_ptr = &discard;
+        }
+
         if (should_seek)
         {
                 /**
@@ -706,6 +1232,7 @@ void decode_video_from_frame_nums(uint8_t *dest,
                         vid_ctx->error_msg = "av seek frame error";
                         goto out_free_frame_rgb_and_sws;
                 }
+                flush_audio_stream(vid_ctx->audio);
 
                 /**
                  * NOTE(brendan): Here we are handling seeking, where we need
@@ -748,7 +1275,7 @@ void decode_video_from_frame_nums(uint8_t *dest,
                         copied_bytes = copy_next_frame(dest,
                                                        vid_ctx->frame,
                                                        frame_rgb,
-                                                       codec_context,
+                                                       vid_ctx,
                                                        sws_context,
                                                        copied_bytes,
                                                        bytes_per_row);
@@ -779,8 +1306,15 @@ void decode_video_from_frame_nums(uint8_t *dest,
                                            out_frame_index,
                                            bytes_per_frame,
                                            num_requested_frames);
+                        if (out_frame_index > 0)
+                                out_frame_index = num_requested_frames;
                         goto out_free_frame_rgb_and_sws;
                 }
+                if (discard_ptr != NULL) {
+                        discard.wanted = frame_numbers + out_frame_index;
+                        discard.num_wanted = num_requested_frames -
+                                             out_frame_index;
+                }
                 while (current_frame_index <= desired_frame_num) {
                         if (should_key)
                         {
@@ -796,14 +1330,18 @@ void decode_video_from_frame_nums(uint8_t *dest,
                                         goto out_free_frame_rgb_and_sws;
                                 }
                                 avcodec_flush_buffers(vid_ctx->codec_context);
+                                flush_audio_stream(vid_ctx->audio);
                         }
-                        status = receive_frame(vid_ctx);
+                        status = receive_frame_discarding(vid_ctx,
+                                                          discard_ptr);
                         if (status == VID_DECODE_EOF) {
                                 loop_to_buffer_end(dest,
                                                    copied_bytes,
                                                    out_frame_index,
                                                    bytes_per_frame,
                                                    num_requested_frames);
+                                if (out_frame_index > 0)
+                                        out_frame_index = num_requested_frames;
                                 goto out_free_frame_rgb_and_sws;
                         }
                         
@@ -832,6 +1370,12 @@ void decode_video_from_frame_nums(uint8_t *dest,
                          * frame's PTS. This is to workaround an FFmpeg oddity
                          * where the first frame decoded gets duplicated.
                          */
+                        int64_t pts = vid_ctx->frame->pts;
+                        if (discard_ptr != NULL)
+                                current_frame_index +=
+                                        count_discarded_frames(discard_ptr,
+                                                               prev_pts,
+                                                               pts);
                         if (vid_ctx->frame->pts > prev_pts) {
                                 ++current_frame_index;
                                 prev_pts = vid_ctx->frame->pts;
@@ -849,14 +1393,670 @@ void decode_video_from_frame_nums(uint8_t *dest,
                 copied_bytes = copy_next_frame(dest,
                                                vid_ctx->frame,
                                                frame_rgb,
-                                               codec_context,
+                                               vid_ctx,
                                                sws_context,
                                                copied_bytes,
                                                bytes_per_row);    
         }
 
 out_free_frame_rgb_and_sws:
-        av_freep(frame_rgb->data);
-        av_frame_free(&frame_rgb);
-        sws_freeContext(sws_context);
+        vid_ctx->codec_context->skip_frame = AVDISCARD_DEFAULT;
+        pool_rgb_image_put(&frame_rgb);
+        pool_sws_put(&sws_context);
+
+        return out_frame_index;
+}
+
+/**
+ * get_stream_start_time() - Returns the start time of the video stream, in
+ * its `time_base`, or zero if the container doesn't have it.
+ */
+static int64_t
+get_stream_start_time(struct video_stream_context *vid_ctx)
+{
+        AVStream *video_stream =
+            vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+
+        if (video_stream->start_time != AV_NOPTS_VALUE)
+                return video_stream->start_time;
+
+        return 0;
+}
+
+/**
+ * get_frame_timestamp() - Returns the PTS of `frame`, falling back to
+ * libavcodec's best effort guess for streams without PTS.
+ */
+static int64_t
+get_frame_timestamp(AVFrame *frame)
+{
+        if (frame->pts != AV_NOPTS_VALUE)
+                return frame->pts;
+
+        return frame->best_effort_timestamp;
+}
+
+int64_t
+seconds_to_stream_timestamp(struct video_stream_context *vid_ctx,
+                            double seconds)
+{
+        AVStream *video_stream =
+            vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+
+        return get_stream_start_time(vid_ctx) +
+               llround(seconds/av_q2d(video_stream->time_base));
+}
+
+int32_t decode_video_from_timestamps(uint8_t *dest,
+                                     struct video_stream_context *vid_ctx,
+                                     int32_t num_requested_frames,
+                                     const int64_t *timestamps,
+                                     uint32_t rewidth,
+                                     uint32_t reheight,
+                                     bool should_seek)
+{
+        if (num_requested_frames <= 0) {
+                vid_ctx->error_type = PyExc_ValueError;
+                vid_ctx->error_msg = "requested frames number error";
+                return 0;
+        }
+
+        AVCodecContext *codec_context = vid_ctx->codec_context;
+        struct SwsContext *sws_context = pool_sws_get(codec_context->width,
+                                                      codec_context->height,
+                                                      codec_context->pix_fmt,
+                                                      rewidth,
+                                                      reheight,
+                                                      AV_PIX_FMT_RGB24,
+                                                      SWS_FAST_BILINEAR);
+        if (sws_context == NULL) {
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = "init sws context error";
+                return 0;
+        }
+
+        AVFrame *frame_rgb = pool_rgb_image_get(rewidth, reheight);
+        if (frame_rgb == NULL) {
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = "init frame rgb error";
+                pool_sws_put(&sws_context);
+                return 0;
+        }
+
+        /**
+         * NOTE: `shown` holds the frame picked for the current timestamp,
+         * while `vid_ctx->frame` holds a frame decoded past the current
+         * timestamp, which may be picked for the next one.
+         */
+        int32_t out_frame_index = 0;
+        AVFrame *shown = pool_frame_get();
+        if (shown == NULL) {
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = "init shown frame error";
+                goto out_free_frame_rgb_and_sws;
+        }
+
+        int32_t status;
+        uint32_t copied_bytes = 0;
+        const uint32_t bytes_per_row = 3 * frame_rgb->width;
+        const uint32_t bytes_per_frame = bytes_per_row * frame_rgb->height;
+        const int64_t end_timestamp = (get_stream_start_time(vid_ctx) +
+                                       vid_ctx->duration);
+        bool is_shown_set = false;
+        bool is_shown_converted = false;
+        bool is_next_set = false;
+        bool is_eof = false;
+
+        if (should_seek && (timestamps[0] > get_stream_start_time(vid_ctx))) {
+                status = av_seek_frame(vid_ctx->format_context,
+                                       vid_ctx->video_stream_index,
+                                       timestamps[0],
+                                       AVSEEK_FLAG_BACKWARD);
+                if (status < 0) {
+                        vid_ctx->error_type = PyExc_ValueError;
+                        vid_ctx->error_msg = "av seek frame error";
+                        goto out_free_shown;
+                }
+                avcodec_flush_buffers(codec_context);
+                flush_audio_stream(vid_ctx->audio);
+        }
+
+        for (out_frame_index = 0;
+             out_frame_index < num_requested_frames;
+             ++out_frame_index)
+        {
+                int64_t target = timestamps[out_frame_index];
+                if ((out_frame_index > 0) &&
+                    (target < timestamps[out_frame_index - 1])) {
+                        vid_ctx->error_type = PyExc_ValueError;
+                        vid_ctx->error_msg = "input timestamps must be non-decreasing";
+                        goto out_free_shown;
+                }
+
+                /* Loop frames instead of aborting if we asked for too many. */
+                if ((vid_ctx->duration > 0) && (target >= end_timestamp))
+                        break;
+
+                for (;;) {
+                        if (!is_next_set) {
+                                if (is_eof)
+                                        break;
+
+                                status = receive_frame(vid_ctx);
+                                if (status == VID_DECODE_EOF) {
+                                        is_eof = true;
+                                        break;
+                                }
+                                if (status != VID_DECODE_SUCCESS)
+                                        goto out_free_shown;
+
+                                is_next_set = true;
+                        }
+
+                        int64_t pts = get_frame_timestamp(vid_ctx->frame);
+                        if (is_shown_set && (pts > target))
+                                break;
+
+                        av_frame_unref(shown);
+                        av_frame_move_ref(shown, vid_ctx->frame);
+                        is_shown_set = true;
+                        is_shown_converted = false;
+                        is_next_set = false;
+
+                        if (pts >= target)
+                                break;
+                }
+
+                if (!is_shown_set)
+                        break;
+
+                if (is_shown_converted) {
+                        memcpy(dest + copied_bytes,
+                               dest + copied_bytes - bytes_per_frame,
+                               bytes_per_frame);
+                        copied_bytes += bytes_per_frame;
+                        if (vid_ctx->motion != NULL)
+                                repeat_motion_field(vid_ctx->motion,
+                                                    out_frame_index);
+                } else {
+                        copied_bytes = copy_next_frame(dest,
+                                                       shown,
+                                                       frame_rgb,
+                                                       vid_ctx,
+                                                       sws_context,
+                                                       copied_bytes,
+                                                       bytes_per_row);
+                        is_shown_converted = true;
+                }
+        }
+
+        if (out_frame_index < num_requested_frames) {
+                loop_to_buffer_end(dest,
+                                   copied_bytes,
+                                   out_frame_index,
+                                   bytes_per_frame,
+                                   num_requested_frames);
+                if (out_frame_index > 0)
+                        out_frame_index = num_requested_frames;
+        }
+
+out_free_shown:
+        pool_frame_put(&shown);
+out_free_frame_rgb_and_sws:
+        pool_rgb_image_put(&frame_rgb);
+        pool_sws_put(&sws_context);
+
+        return out_frame_index;
+}
+
+/**
+ * get_segment_target() - Returns the time, in seconds from the start of the
+ * video stream, that segment `segment_index` of `num_segments` is sampled at.
+ * Random times are drawn from `vid_ctx->rng_state`.
+ */
+static double
+get_segment_target(struct video_stream_context *vid_ctx,
+                   double duration_seconds,
+                   int32_t segment_index,
+                   int32_t num_segments,
+                   enum segment_mode mode)
+{
+        double segment_seconds = duration_seconds/num_segments;
+        double segment_start = segment_index*segment_seconds;
+
+        if (mode == SEGMENT_RANDOM)
+                return segment_start +
+                        segment_seconds*next_random_unit(&vid_ctx->rng_state);
+
+        return segment_start + 0.5*segment_seconds;
+}
+
+/**
+ * seek_segment() - Seeks the video stream to the keyframe before
+ * `timestamp`.
+ *
+ * Returns VID_DECODE_SUCCESS, or VID_DECODE_FFMPEG_ERR with the error set in
+ * `vid_ctx`.
+ */
+static int32_t
+seek_segment(struct video_stream_context *vid_ctx, int64_t timestamp)
+{
+        int32_t status = av_seek_frame(vid_ctx->format_context,
+                                       vid_ctx->video_stream_index,
+                                       timestamp,
+                                       AVSEEK_FLAG_BACKWARD);
+        if (status < 0) {
+                vid_ctx->error_type = PyExc_ValueError;
+                vid_ctx->error_msg = "av seek frame error";
+                return VID_DECODE_FFMPEG_ERR;
+        }
+        avcodec_flush_buffers(vid_ctx->codec_context);
+        flush_audio_stream(vid_ctx->audio);
+
+        return VID_DECODE_SUCCESS;
+}
+
+/**
+ * decode_until_timestamp() - Decodes frames into `shown` until one at or
+ * after `stop_timestamp`, and sets `*is_shown_set` once a frame is decoded.
+ *
+ * Returns VID_DECODE_SUCCESS, VID_DECODE_EOF, or an error status.
+ */
+static int32_t
+decode_until_timestamp(struct video_stream_context *vid_ctx,
+                       AVFrame *shown,
+                       int64_t stop_timestamp,
+                       bool *is_shown_set)
+{
+        for (;;) {
+                int32_t status = receive_frame(vid_ctx);
+                if (status != VID_DECODE_SUCCESS)
+                        return status;
+
+                av_frame_unref(shown);
+                av_frame_move_ref(shown, vid_ctx->frame);
+                *is_shown_set = true;
+
+                if (get_frame_timestamp(shown) >= stop_timestamp)
+                        return VID_DECODE_SUCCESS;
+        }
+}
+
+/**
+ * pick_segment_keyframe() - Decodes into `shown` a keyframe inside the
+ * segment from `segment_start` to `segment_end`, if one is found by seeking
+ * back from the middle or the end of the segment, or else the first frame of
+ * the segment. The stream has already been sought back from the middle.
+ *
+ * The keyframe before the middle is tried first, as it is the nearest to the
+ * middle from below, and the keyframe before the end catches one between the
+ * middle and the end. Either costs one decoded frame.
+ */
+static int32_t
+pick_segment_keyframe(struct video_stream_context *vid_ctx,
+                      AVFrame *shown,
+                      int64_t segment_start,
+                      int64_t segment_end,
+                      bool *is_shown_set)
+{
+        int32_t status = decode_until_timestamp(vid_ctx,
+                                                shown,
+                                                INT64_MIN,
+                                                is_shown_set);
+        if ((status != VID_DECODE_SUCCESS) ||
+            (get_frame_timestamp(shown) >= segment_start))
+                return status;
+
+        status = seek_segment(vid_ctx, segment_end - 1);
+        if (status != VID_DECODE_SUCCESS)
+                return status;
+
+        /**
+         * NOTE: If the keyframe before the end is also before the segment,
+         * the segment has no keyframe, and decoding goes on from there to
+         * its first frame.
+         */
+        return decode_until_timestamp(vid_ctx,
+                                      shown,
+                                      segment_start,
+                                      is_shown_set);
+}
+
+int32_t decode_video_segments(uint8_t *dest,
+                              struct video_stream_context *vid_ctx,
+                              int32_t num_segments,
+                              enum segment_mode mode,
+                              uint32_t rewidth,
+                              uint32_t reheight,
+                              int32_t *frame_indices)
+{
+        if (num_segments <= 0) {
+                vid_ctx->error_type = PyExc_ValueError;
+                vid_ctx->error_msg = "requested segments number error";
+                return 0;
+        }
+
+        AVCodecContext *codec_context = vid_ctx->codec_context;
+        struct SwsContext *sws_context = pool_sws_get(codec_context->width,
+                                                      codec_context->height,
+                                                      codec_context->pix_fmt,
+                                                      rewidth,
+                                                      reheight,
+                                                      AV_PIX_FMT_RGB24,
+                                                      SWS_FAST_BILINEAR);
+        if (sws_context == NULL) {
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = "init sws context error";
+                return 0;
+        }
+
+        AVFrame *frame_rgb = pool_rgb_image_get(rewidth, reheight);
+        if (frame_rgb == NULL) {
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = "init frame rgb error";
+                pool_sws_put(&sws_context);
+                return 0;
+        }
+
+        int32_t out_frame_index = 0;
+        AVFrame *shown = pool_frame_get();
+        if (shown == NULL) {
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = "init shown frame error";
+                goto out_free_frame_rgb_and_sws;
+        }
+
+        AVStream *video_stream =
+            vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        const double duration_seconds =
+                vid_ctx->duration*av_q2d(video_stream->time_base);
+        const double segment_seconds = duration_seconds/num_segments;
+        const double ticks_per_frame = (vid_ctx->nb_frames > 0) ?
+                (double)vid_ctx->duration/vid_ctx->nb_frames : 1.0;
+        const int64_t start_time = get_stream_start_time(vid_ctx);
+        const uint32_t bytes_per_row = 3 * frame_rgb->width;
+        const uint32_t bytes_per_frame = bytes_per_row * frame_rgb->height;
+        uint32_t copied_bytes = 0;
+
+        for (out_frame_index = 0;
+             out_frame_index < num_segments;
+             ++out_frame_index)
+        {
+                double target = get_segment_target(vid_ctx,
+                                                   duration_seconds,
+                                                   out_frame_index,
+                                                   num_segments,
+                                                   mode);
+                int64_t target_timestamp =
+                        seconds_to_stream_timestamp(vid_ctx, target);
+
+                int32_t status = seek_segment(vid_ctx, target_timestamp);
+                if (status != VID_DECODE_SUCCESS)
+                        goto out_free_shown;
+
+                bool is_shown_set = false;
+                if (mode == SEGMENT_KEYFRAME)
+                        status = pick_segment_keyframe(
+                                vid_ctx,
+                                shown,
+                                seconds_to_stream_timestamp(
+                                        vid_ctx,
+                                        out_frame_index*segment_seconds),
+                                seconds_to_stream_timestamp(
+                                        vid_ctx,
+                                        (out_frame_index + 1)*segment_seconds),
+                                &is_shown_set);
+                else
+                        status = decode_until_timestamp(vid_ctx,
+                                                        shown,
+                                                        target_timestamp,
+                                                        &is_shown_set);
+                if ((status != VID_DECODE_SUCCESS) &&
+                    (status != VID_DECODE_EOF))
+                        goto out_free_shown;
+
+                /* Past the last frame, loop the frames picked so far. */
+                if (!is_shown_set)
+                        break;
+
+                frame_indices[out_frame_index] =
+                        llround((get_frame_timestamp(shown) - start_time)/
+                                ticks_per_frame);
+                copied_bytes = copy_next_frame(dest,
+                                               shown,
+                                               frame_rgb,
+                                               vid_ctx,
+                                               sws_context,
+                                               copied_bytes,
+                                               bytes_per_row);
+        }
+
+        if (out_frame_index < num_segments) {
+                loop_to_buffer_end(dest,
+                                   copied_bytes,
+                                   out_frame_index,
+                                   bytes_per_frame,
+                                   num_segments);
+
+                int32_t i;
+                for (i = out_frame_index;
+                     (out_frame_index > 0) && (i < num_segments);
+                     ++i)
+                        frame_indices[i] = frame_indices[i % out_frame_index];
+                if (out_frame_index > 0)
+                        out_frame_index = num_segments;
+        }
+
+out_free_shown:
+        pool_frame_put(&shown);
+out_free_frame_rgb_and_sws:
+        pool_rgb_image_put(&frame_rgb);
+        pool_sws_put(&sws_context);
+
+        return out_frame_index;
+}
+
+void init_decode_cursor(struct decode_cursor *cursor)
+{
+        cursor->frame_index = -1;
+        cursor->reach_index = 0;
+        cursor->has_frame = false;
+        cursor->is_eof = false;
+}
+
+/**
+ * cursor_needs_seek() - Returns true iff `target` should be reached by
+ * seeking, rather than by decoding on from `cursor`.
+ */
+static bool
+cursor_needs_seek(const struct decode_cursor *cursor, int64_t target)
+{
+        if (target < cursor->reach_index)
+                return true;
+
+        if (cursor->is_eof)
+                return false;
+
+        int64_t last_index = cursor->has_frame ? cursor->frame_index :
+                                                 cursor->reach_index;
+
+        return (target - last_index) > DECODE_CURSOR_MAX_SKIP_FRAMES;
+}
+
+/**
+ * seek_cursor() - Seeks the video stream to the keyframe before frame
+ * `target`, and moves `cursor` there.
+ *
+ * Returns VID_DECODE_SUCCESS, or VID_DECODE_FFMPEG_ERR with the error set in
+ * `vid_ctx`.
+ */
+static int32_t
+seek_cursor(struct video_stream_context *vid_ctx,
+            struct decode_cursor *cursor,
+            int64_t target,
+            double ticks_per_frame)
+{
+        int64_t timestamp = get_stream_start_time(vid_ctx) +
+                            llround(target*ticks_per_frame);
+        int32_t status = av_seek_frame(vid_ctx->format_context,
+                                       vid_ctx->video_stream_index,
+                                       timestamp,
+                                       AVSEEK_FLAG_BACKWARD);
+        if (status < 0) {
+                vid_ctx->error_type = PyExc_ValueError;
+                vid_ctx->error_msg = "av seek frame error";
+                return VID_DECODE_FFMPEG_ERR;
+        }
+        avcodec_flush_buffers(vid_ctx->codec_context);
+        flush_audio_stream(vid_ctx->audio);
+
+        cursor->frame_index = -1;
+        cursor->reach_index = target;
+        cursor->has_frame = false;
+        cursor->is_eof = false;
+
+        return VID_DECODE_SUCCESS;
+}
+
+/**
+ * advance_cursor() - Decodes on until `vid_ctx->frame` holds the first frame
+ * at or after `target`.
+ *
+ * Returns VID_DECODE_SUCCESS, VID_DECODE_EOF if the video stream ended
+ * first, or the error of receive_frame().
+ */
+static int32_t
+advance_cursor(struct video_stream_context *vid_ctx,
+               struct decode_cursor *cursor,
+               int64_t target,
+               double ticks_per_frame)
+{
+        if (cursor->is_eof)
+                return VID_DECODE_EOF;
+
+        const int64_t start_time = get_stream_start_time(vid_ctx);
+        while (!cursor->has_frame || (cursor->frame_index < target)) {
+                int32_t status = receive_frame(vid_ctx);
+                if (status != VID_DECODE_SUCCESS) {
+                        /**
+                         * NOTE: A failed receive leaves `vid_ctx->frame`
+                         * unset, so the frames up to `frame_index` now take
+                         * a seek. After an error, every frame does.
+                         */
+                        if (status == VID_DECODE_EOF) {
+                                if (cursor->has_frame)
+                                        cursor->reach_index =
+                                                cursor->frame_index + 1;
+                                cursor->is_eof = true;
+                        } else {
+                                cursor->reach_index = INT64_MAX;
+                        }
+                        cursor->has_frame = false;
+
+                        return status;
+                }
+
+                int64_t index =
+                        llround((get_frame_timestamp(vid_ctx->frame) -
+                                 start_time)/ticks_per_frame);
+
+                /* Frames that don't move the PTS forward are duplicates. */
+                if (cursor->has_frame && (index <= cursor->frame_index))
+                        continue;
+
+                if (cursor->has_frame)
+                        cursor->reach_index = cursor->frame_index + 1;
+                else if (index < cursor->reach_index)
+                        cursor->reach_index = index;
+                cursor->frame_index = index;
+                cursor->has_frame = true;
+        }
+
+        return VID_DECODE_SUCCESS;
+}
+
+int32_t
+decode_video_from_cursor(uint8_t *dest,
+                         struct video_stream_context *vid_ctx,
+                         struct decode_cursor *cursor,
+                         int32_t num_requested_frames,
+                         const int64_t *frame_numbers,
+                         uint32_t rewidth,
+                         uint32_t reheight)
+{
+        if (num_requested_frames <= 0) {
+                vid_ctx->error_type = PyExc_ValueError;
+                vid_ctx->error_msg = "requested frames number error";
+                return 0;
+        }
+
+        AVCodecContext *codec_context = vid_ctx->codec_context;
+        struct SwsContext *sws_context = pool_sws_get(codec_context->width,
+                                                      codec_context->height,
+                                                      codec_context->pix_fmt,
+                                                      rewidth,
+                                                      reheight,
+                                                      AV_PIX_FMT_RGB24,
+                                                      SWS_FAST_BILINEAR);
+        if (sws_context == NULL) {
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = "init sws context error";
+                return 0;
+        }
+
+        AVFrame *frame_rgb = pool_rgb_image_get(rewidth, reheight);
+        if (frame_rgb == NULL) {
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = "init frame rgb error";
+                pool_sws_put(&sws_context);
+                return 0;
+        }
+
+        const double ticks_per_frame = (vid_ctx->nb_frames > 0) ?
+                (double)vid_ctx->duration/vid_ctx->nb_frames : 1.0;
+        const uint32_t bytes_per_row = 3 * frame_rgb->width;
+        uint32_t copied_bytes = 0;
+        int32_t out_frame_index;
+        for (out_frame_index = 0;
+             out_frame_index < num_requested_frames;
+             ++out_frame_index) {
+                int64_t target = frame_numbers[out_frame_index];
+                if ((target < 0) ||
+                    ((out_frame_index > 0) &&
+                     (target < frame_numbers[out_frame_index - 1]))) {
+                        vid_ctx->error_type = PyExc_ValueError;
+                        vid_ctx->error_msg = "input frame index error";
+                        break;
+                }
+
+                int32_t status;
+                if (cursor_needs_seek(cursor, target)) {
+                        status = seek_cursor(vid_ctx,
+                                             cursor,
+                                             target,
+                                             ticks_per_frame);
+                        if (status != VID_DECODE_SUCCESS)
+                                break;
+                }
+
+                status = advance_cursor(vid_ctx,
+                                        cursor,
+                                        target,
+                                        ticks_per_frame);
+                if (status != VID_DECODE_SUCCESS)
+                        break;
+
+                copied_bytes = copy_next_frame(dest,
+                                               vid_ctx->frame,
+                                               frame_rgb,
+                                               vid_ctx,
+                                               sws_context,
+                                               copied_bytes,
+                                               bytes_per_row);
+        }
+
+        pool_rgb_image_put(&frame_rgb);
+        pool_sws_put(&sws_context);
+
+        return out_frame_index;
 }
@@ -37,12 +37,22 @@ extern "C" {
 #include <stdbool.h>
 #include <time.h>
 #include <Python.h>
+#include "rgb_convert.h"
 // decode video code
 #define VID_DECODE_SUCCESS 0
 #define VID_DECODE_EOF (-1)
 #define VID_DECODE_FFMPEG_ERR (-2)
 #define VID_DECODE_TIMEOUT (-3)
 
+/* Size of the formatted error message of a video_stream_context. */
+#define VID_CTX_ERROR_SIZE 256
+
+
+struct audio_stream_context;
+struct file_reader;
+struct handle_key;
+struct motion_field;
+struct tar_shard;
 
 struct buffer_data {
         const char *ptr;
@@ -60,6 +70,23 @@ struct buffer_data {
  * @video_stream_index: Index of video stream that frames will be read from.
  * @duration: Duration of the video in the timebase of the video stream.
  * @nb_frames: (Possibly approximate) number of frames in the video.
+ * @deadline_us: Monotonic time (av_gettime_relative() microseconds) after
+ * which demuxing and decoding are abandoned with a TimeoutError.
+ * @audio: Audio stream decoded from the same packets, or NULL.
+ * @motion: Motion field filled for each frame converted to RGB, or NULL. The
+ * codec context must have been opened with motion vector export.
+ * @rgb_kernel: How frames are converted to RGB24. Frames in formats the fused
+ * kernels don't support go through swscale regardless.
+ * @rng_state: State of the random draws of this call, e.g., of random seeks,
+ * seeded per call. See next_random().
+ * @file: Reader the demuxer reads the file through, or NULL if it uses FFmpeg's
+ * own I/O. See close_video_input().
+ * @shard: Tar shard the video is a member of, or NULL. Holds a reference
+ * released by close_video_input().
+ * @cache_key: Key the context is cached under once released, or NULL if it
+ * isn't to be cached. See handle_cache_put().
+ * @error_buf: Storage for `error_msg` when the message is formatted, e.g.,
+ * from an FFmpeg error code, so that it outlives the function that set it.
  */
 struct video_stream_context {
         AVFrame *frame;
@@ -69,12 +96,84 @@ struct video_stream_context {
         int64_t duration;
         int64_t nb_frames;
         // add for python exception
-        time_t decode_time;
-        int32_t timeout_sec;
+        int64_t deadline_us;
         PyObject *error_type;
         char *error_msg;
+        struct audio_stream_context *audio;
+        struct motion_field *motion;
+        enum rgb_kernel rgb_kernel;
+        uint64_t rng_state;
+        struct file_reader *file;
+        struct tar_shard *shard;
+        struct handle_key *cache_key;
+        char error_buf[VID_CTX_ERROR_SIZE];
 };
 
+/**
+ * decode_audio_to_span_end() - Reads on from the current position until the
+ * audio of `vid_ctx` is decoded up to the end of its span, or to EOF.
+ *
+ * Audio packets demuxed while decoding video are decoded as they are read,
+ * but the audio of the last frames may be interleaved after their video.
+ * Video packets read here are skipped without decoding. Returns
+ * VID_DECODE_TIMEOUT if the deadline passes, and VID_DECODE_SUCCESS
+ * otherwise.
+ */
+int32_t decode_audio_to_span_end(struct video_stream_context *vid_ctx);
+
+/**
+ * read_first_gop() - Demuxes the packets of `vid_ctx` from the current
+ * position up to the second keyframe of the video stream, without decoding
+ * them, so that the container header and first GOP are in the page cache.
+ * @max_bytes: Stop once this many bytes of the file have been read, e.g.,
+ * for videos with very long GOPs.
+ *
+ * Returns VID_DECODE_TIMEOUT if the deadline passes, VID_DECODE_EOF if the
+ * video ends first, and VID_DECODE_SUCCESS otherwise.
+ */
+int32_t
+read_first_gop(struct video_stream_context *vid_ctx, int64_t max_bytes);
+
+/**
+ * next_random() - Returns the next 64 random bits of the splitmix64 generator
+ * with state `*state`, and advances the state.
+ *
+ * Unlike rand(), there is no hidden shared state: each decode call draws from
+ * its own `rng_state`, so concurrent calls don't contend, and a call's draws
+ * are reproducible given its seed.
+ */
+uint64_t next_random(uint64_t *state);
+
+/**
+ * next_random_unit() - Returns a uniformly random double in [0, 1), drawn
+ * with next_random().
+ */
+double next_random_unit(uint64_t *state);
+
+/**
+ * set_decode_deadline() - Arms the deadline of `vid_ctx` to expire
+ * `timeout_ms` milliseconds from now, on the monotonic clock.
+ * @vid_ctx: Context whose deadline is set.
+ * @timeout_ms: Budget for the whole open/seek/decode call.
+ */
+void
+set_decode_deadline(struct video_stream_context *vid_ctx, int32_t timeout_ms);
+
+/**
+ * check_decode_deadline() - Checks whether the deadline of `vid_ctx` has
+ * passed, and if so sets a TimeoutError on `vid_ctx`.
+ *
+ * Returns true iff the deadline has passed.
+ */
+bool check_decode_deadline(struct video_stream_context *vid_ctx);
+
+/**
+ * decode_interrupt_callback() - AVIOInterruptCB callback that aborts blocking
+ * FFmpeg I/O once the deadline of the `video_stream_context` passed as
+ * `opaque` has passed.
+ */
+int32_t decode_interrupt_callback(void *opaque);
+
 /**
  * A function for refilling the buffer from a `struct buffer_data` instance.
  *
@@ -121,18 +220,50 @@ struct video_stream_context {
 //                      struct buffer_data *input_buf,
 //                      const uint32_t buffer_size);
 
+/**
+ * close_video_input() - Closes the format context of `vid_ctx`, and the file
+ * reader and tar shard under it, if any.
+ */
+void close_video_input(struct video_stream_context *vid_ctx);
+
+/**
+ * set_fast_open_limits() - Lowers the probesize and analyzeduration of
+ * `format_context` for fast opening. Must be called before
+ * avformat_open_input().
+ */
+void set_fast_open_limits(AVFormatContext *format_context);
+
+/**
+ * find_video_stream_info() - Fills in the stream info of an opened
+ * `format_context`, as avformat_find_stream_info() does.
+ * @format_context: Opened format context.
+ * @fast_open: If false, this is just avformat_find_stream_info(). If true,
+ * stream info probing is skipped entirely when the container header already
+ * gave everything needed to decode the first video stream (codec, size,
+ * pixel format, framerate and duration). If fields are missing, probing runs
+ * within the limits set on `format_context`, and falls back to FFmpeg's
+ * default limits only if fields are still missing after that.
+ *
+ * Returns a non-negative value on success, and an AVERROR on failure.
+ */
+int32_t
+find_video_stream_info(AVFormatContext *format_context, bool fast_open);
+
 /**
  * Allocates a codec context for video_stream, and opens it.  We cannot call
  * avcodec_open2 on an av_stream's codec context directly.
  *
  * @param video_stream Video stream to open codec context for.
+ * @param should_export_mvs Have the decoder export the motion vectors of each
+ * frame as AV_FRAME_DATA_MOTION_VECTORS side data (`+export_mvs`).
  *
  * @warning If successful, codec_context must be freed with
  * avcodec_free_context, and closed with avcodec_close.
  *
  * @return Opened copy of codec_context on success, NULL on failure.
  */
-AVCodecContext *open_video_codec_ctx(AVStream *video_stream);
+AVCodecContext *
+open_video_codec_ctx(AVStream *video_stream, bool should_export_mvs);
 
 /**
  * Seeks the video stream corresponding to `video_stream_index` in
@@ -144,7 +275,8 @@ AVCodecContext *open_video_codec_ctx(AVStream *video_stream);
  *
  * If `should_random_seek` is set, then the video decoding code will attempt to
  * do a random seek within the valid range of the video, i.e. the range for
- * which `num_requested_frames` can still be grabbed.
+ * which `num_requested_frames` can still be grabbed. The seek is drawn from
+ * `vid_ctx->rng_state`.
  *
  * @param seek_distance_out Output seek_distance variable. Only set if random
  * seeking occurred, therefore this output parameter should be initialized to
@@ -163,12 +295,34 @@ seek_to_closest_keypoint(float *seek_distance_out,
                          bool should_random_seek,
                          uint32_t num_requested_frames);
 
+/**
+ * seek_to_random_keyframe() - Seeks to a keyframe drawn uniformly from the
+ * keyframes of the container's seek index that have `num_requested_frames`
+ * frames after them, so that decoding starts at the clip with no pre-roll.
+ * @start_out: Set to the timestamp of the keyframe, in the video stream's
+ * `time_base`.
+ * @seek_distance_out: If not NULL, set to that timestamp in seconds.
+ * @vid_ctx: Context with video stream to seek in. The keyframe is drawn from
+ * `vid_ctx->rng_state`.
+ * @num_requested_frames: Number of frames to be decoded from the keyframe.
+ *
+ * Returns true iff the stream was sought to a keyframe. Returns false without
+ * seeking if the index has no such keyframe, e.g., for a container without an
+ * index, and false with the error set on `vid_ctx` if the seek failed.
+ */
+bool
+seek_to_random_keyframe(int64_t *start_out,
+                        float *seek_distance_out,
+                        struct video_stream_context *vid_ctx,
+                        uint32_t num_requested_frames);
+
 /**
  * Skips frames until a frame that is past `timestamp` has been reached.
  *
  * @param vid_ctx Context needed to decode frames from the video stream.
  *
- * @return 0 on success, a negative value on failure.
+ * @return 0 on success, a negative value on failure (VID_DECODE_TIMEOUT if the
+ * deadline passed).
  */
 int32_t
 skip_past_timestamp(struct video_stream_context *vid_ctx, int64_t timestamp);
@@ -182,16 +336,24 @@ skip_past_timestamp(struct video_stream_context *vid_ctx, int64_t timestamp);
  * unless no frames were received (in which case the output buffer is garbage
  * data).
  *
- * TODO(brendan): Support fixing the framerate?
+ * To sample at a fixed framerate instead, see decode_video_from_timestamps().
+ *
+ * If the deadline of `vid_ctx` passes, decoding stops and a TimeoutError is
+ * set on `vid_ctx`. The frames already in `dest` are left as they are.
  *
  * @param dest Output RGB24 frame buffer.
  * @param vid_ctx Context needed to decode frames from the video stream.
  * @param num_requested_frames Number of frames requested to fill into `dest`.
+ * @param first_pts_out If not NULL, set to the PTS of the first frame
+ * decoded, if any.
+ *
+ * @return The number of frames filled into `dest`, counting looped frames.
  */
-void
+int32_t
 decode_video_to_out_buffer(uint8_t *dest,
                            struct video_stream_context *vid_ctx,
-                           int32_t num_requested_frames);
+                           int32_t num_requested_frames,
+                           int64_t *first_pts_out);
 
 /**
  * decode_video_from_frame_nums() - Decodes video from exactly the frames
@@ -211,8 +373,17 @@ decode_video_to_out_buffer(uint8_t *dest,
  * If there are less than `num_requested_frames` to decode from the video
  * stream, then the initial frames are looped repeatedly until the end of the
  * buffer.
+ *
+ * Decoding linearly (neither `should_key` nor `should_seek`) with a stride of
+ * at least 4 frames between requested frames, the decoder skips the
+ * non-reference frames that are not near a requested frame (AVDISCARD_NONREF).
+ * Skipped frames are still counted, by the PTS of their packets.
+ *
+ * Returns the number of frames filled into `dest`. This is less than
+ * `num_requested_frames` only on error, e.g., if the deadline of `vid_ctx`
+ * passed part way through.
  */
-void
+int32_t
 decode_video_from_frame_nums(uint8_t *dest,
                              struct video_stream_context *vid_ctx,
                              int32_t num_requested_frames,
@@ -221,6 +392,199 @@ decode_video_from_frame_nums(uint8_t *dest,
                              uint32_t *reheight,
                              bool should_key,
                              bool should_seek);
+
+/**
+ * seconds_to_stream_timestamp() - Converts `seconds` from the start of the
+ * video stream to a timestamp in the stream's `time_base`.
+ */
+int64_t
+seconds_to_stream_timestamp(struct video_stream_context *vid_ctx,
+                            double seconds);
+
+/**
+ * decode_video_from_timestamps() - Decodes the frames shown at each of the
+ * presentation timestamps in `timestamps`.
+ * @dest: Destination output buffer for decoded frames.
+ * @vid_ctx: Context needed to decode frames from the video stream.
+ * @num_requested_frames: Number of frames requested to fill into `dest`.
+ * @timestamps: Non-decreasing timestamps, in the video stream's `time_base`.
+ * @rewidth: Width of the frames output to `dest`.
+ * @reheight: Height of the frames output to `dest`.
+ * @should_seek: If true, seek to the keyframe before `timestamps[0]` first.
+ * Since the frames are picked by PTS, this seek is frame-accurate.
+ *
+ * The frame shown at timestamp t is the last frame with a PTS no greater than
+ * t, or the first frame if t is before the first frame. Decoding stops at the
+ * last requested timestamp, and only frames that are picked are converted to
+ * RGB, so frames dropped by resampling cost only their decode. A frame picked
+ * more than once, e.g. when upsampling the framerate, is converted once.
+ *
+ * Timestamps past the end of the video stream loop the initial frames, as in
+ * decode_video_from_frame_nums().
+ *
+ * Returns the number of frames filled into `dest`.
+ */
+int32_t
+decode_video_from_timestamps(uint8_t *dest,
+                             struct video_stream_context *vid_ctx,
+                             int32_t num_requested_frames,
+                             const int64_t *timestamps,
+                             uint32_t rewidth,
+                             uint32_t reheight,
+                             bool should_seek);
+
+/**
+ * enum segment_mode - How decode_video_segments() picks the frame of each
+ * segment.
+ * @SEGMENT_KEYFRAME: The keyframe before the middle of the segment, if it is
+ * inside the segment, or else the keyframe before the end of the segment, if
+ * it is inside the segment, and otherwise the first frame of the segment.
+ * @SEGMENT_NEAREST: The first frame at or after the middle of the segment.
+ * @SEGMENT_RANDOM: The first frame at or after a uniformly random time in
+ * the segment, drawn from the `rng_state` of the video_stream_context.
+ */
+enum segment_mode {
+        SEGMENT_KEYFRAME,
+        SEGMENT_NEAREST,
+        SEGMENT_RANDOM,
+};
+
+/**
+ * decode_video_segments() - Splits the video into `num_segments` segments of
+ * equal duration, and decodes one frame from each, as for Temporal Segment
+ * Networks.
+ * @dest: Destination output buffer for decoded frames.
+ * @vid_ctx: Context needed to decode frames from the video stream.
+ * @num_segments: Number of segments, and of frames filled into `dest`.
+ * @mode: How the frame of each segment is picked.
+ * @rewidth: Width of the frames output to `dest`.
+ * @reheight: Height of the frames output to `dest`.
+ * @frame_indices: Output of the index of each frame picked, from its PTS.
+ *
+ * Segments are found by PTS, so no frame rate is assumed. Each segment seeks
+ * to the keyframe before its target time, and decodes from there.
+ *
+ * If the video runs out before the last segment, the frames picked so far
+ * are looped, as in decode_video_from_frame_nums().
+ *
+ * Returns the number of frames filled into `dest`.
+ */
+int32_t
+decode_video_segments(uint8_t *dest,
+                      struct video_stream_context *vid_ctx,
+                      int32_t num_segments,
+                      enum segment_mode mode,
+                      uint32_t rewidth,
+                      uint32_t reheight,
+                      int32_t *frame_indices);
+
+/**
+ * Targets at most this many frames past the last decoded frame are reached by
+ * decoding on, and targets further ahead by seeking to the keyframe before
+ * them. 250 is the default keyframe interval of x264.
+ */
+#define DECODE_CURSOR_MAX_SKIP_FRAMES 250
+
+/**
+ * struct decode_cursor - Position of a decoder that is kept open across
+ * calls, so that calls that move forward go on decoding from where the last
+ * one stopped, rather than seeking again.
+ * @frame_index: Index of the last frame decoded, from its PTS, or -1 if none
+ * was decoded since the decoder was opened or seeked.
+ * @reach_index: Lowest target index that decoding on can reach, without a
+ * seek. If `has_frame`, this is one past the index of the frame decoded
+ * before it, so that `vid_ctx->frame` is the frame of every target from
+ * `reach_index` to `frame_index`.
+ * @has_frame: True iff `vid_ctx->frame` holds the frame `frame_index`.
+ * @is_eof: True iff the video stream has no frames at or after
+ * `reach_index`.
+ */
+struct decode_cursor {
+        int64_t frame_index;
+        int64_t reach_index;
+        bool has_frame;
+        bool is_eof;
+};
+
+/**
+ * init_decode_cursor() - Sets `cursor` to the start of a newly opened video
+ * stream.
+ */
+void init_decode_cursor(struct decode_cursor *cursor);
+
+/**
+ * decode_video_from_cursor() - Decodes the frames numbered by
+ * `frame_numbers`, going on from the position of `cursor`.
+ * @dest: Destination output buffer for decoded frames.
+ * @vid_ctx: Context of the video stream, kept open across calls.
+ * @cursor: Position of the decoder of `vid_ctx`, updated as frames are
+ * decoded.
+ * @num_requested_frames: Number of frames requested to fill into `dest`.
+ * @frame_numbers: Non-decreasing, non-negative frame indices.
+ * @rewidth: Width of the frames output to `dest`.
+ * @reheight: Height of the frames output to `dest`.
+ *
+ * Frame indices are found from PTS, as in decode_video_segments(), and each
+ * target gets the first frame at or after it. A target behind the cursor, or
+ * more than DECODE_CURSOR_MAX_SKIP_FRAMES ahead of it, seeks to the keyframe
+ * before it, and any other target is reached by decoding on, so that e.g.
+ * consecutive clips of a sliding window are each decoded once.
+ *
+ * Unlike decode_video_from_frame_nums(), frames past the end of the video
+ * stream are not looped: decoding stops there.
+ *
+ * Returns the number of frames filled into `dest`, which is less than
+ * `num_requested_frames` at the end of the video stream, or on error.
+ */
+int32_t
+decode_video_from_cursor(uint8_t *dest,
+                         struct video_stream_context *vid_ctx,
+                         struct decode_cursor *cursor,
+                         int32_t num_requested_frames,
+                         const int64_t *frame_numbers,
+                         uint32_t rewidth,
+                         uint32_t reheight);
+
+/**
+ * scale_rgb_frames() - Rescales RGB24 frames that were already decoded, e.g.,
+ * to derive a smaller output from a larger one without decoding again.
+ * @dest: Output buffer for `num_frames` frames of `width` by `height`.
+ * @width: Width of the frames output to `dest`.
+ * @height: Height of the frames output to `dest`.
+ * @src: Packed RGB24 input frames.
+ * @src_width: Width of the frames in `src`.
+ * @src_height: Height of the frames in `src`.
+ * @num_frames: Number of frames to rescale.
+ *
+ * Area averaging is used, so that a chain of downscales stays free of
+ * aliasing. Returns VID_DECODE_SUCCESS, or VID_DECODE_FFMPEG_ERR if the
+ * swscale context or conversion image can't be allocated.
+ */
+int32_t
+scale_rgb_frames(uint8_t *dest,
+                 uint32_t width,
+                 uint32_t height,
+                 const uint8_t *src,
+                 uint32_t src_width,
+                 uint32_t src_height,
+                 int32_t num_frames);
+
+/**
+ * normalize_rgb_frame() - Converts an RGB24 frame to float32, as
+ * (x/255 - mean)/std per channel.
+ * @dest: Output of `num_pixels`*3 floats, interleaved as in `src`.
+ * @src: Packed RGB24 input.
+ * @num_pixels: Number of pixels in `src`.
+ * @mean: Mean of each of the R, G and B channels, in [0, 1] units.
+ * @std: Standard deviation of each channel, in [0, 1] units.
+ */
+void
+normalize_rgb_frame(float *dest,
+                    const uint8_t *src,
+                    uint32_t num_pixels,
+                    const float mean[3],
+                    const float std[3]);
+
 // int32_t
 // get_video_keyframe_count(struct video_stream_context *vid_ctx);
 
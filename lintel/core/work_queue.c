@@ -0,0 +1,162 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "work_queue.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void *
+work_queue_worker(void *arg)
+{
+        struct work_queue *queue = arg;
+
+        pthread_mutex_lock(&queue->lock);
+        for (;;) {
+                while ((queue->num_items == 0) && !queue->is_stopping)
+                        pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+                /* NOTE: Pending items are drained before stopping. */
+                if (queue->num_items == 0)
+                        break;
+
+                struct work_item item = queue->items[queue->head];
+                queue->head = (queue->head + 1) % queue->capacity;
+                --queue->num_items;
+                pthread_cond_signal(&queue->not_full);
+                pthread_mutex_unlock(&queue->lock);
+
+                item.run(item.arg);
+
+                pthread_mutex_lock(&queue->lock);
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        return NULL;
+}
+
+int32_t
+work_queue_start(struct work_queue *queue,
+                 int32_t num_threads,
+                 int32_t capacity)
+{
+        if (num_threads < 1)
+                num_threads = 1;
+        if (capacity < 1)
+                capacity = 1;
+
+        queue->items = malloc(capacity*sizeof(struct work_item));
+        queue->threads = malloc(num_threads*sizeof(pthread_t));
+        if ((queue->items == NULL) || (queue->threads == NULL))
+                goto err_free;
+
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->not_empty, NULL);
+        pthread_cond_init(&queue->not_full, NULL);
+        queue->capacity = capacity;
+        queue->head = 0;
+        queue->num_items = 0;
+        queue->num_threads = 0;
+        queue->is_stopping = false;
+
+        /**
+         * NOTE: Serve the queue on as many threads as could be started, and
+         * fail only if none could.
+         */
+        while ((queue->num_threads < num_threads) &&
+               (pthread_create(&queue->threads[queue->num_threads],
+                               NULL,
+                               work_queue_worker,
+                               queue) == 0))
+                ++queue->num_threads;
+
+        if (queue->num_threads > 0)
+                return WORK_QUEUE_SUCCESS;
+
+        pthread_cond_destroy(&queue->not_full);
+        pthread_cond_destroy(&queue->not_empty);
+        pthread_mutex_destroy(&queue->lock);
+err_free:
+        free(queue->threads);
+        free(queue->items);
+
+        return WORK_QUEUE_ERR;
+}
+
+int32_t
+work_queue_push(struct work_queue *queue,
+                void (*run)(void *arg),
+                void *arg,
+                bool should_block)
+{
+        int32_t status = WORK_QUEUE_SUCCESS;
+
+        pthread_mutex_lock(&queue->lock);
+
+        while (should_block &&
+               (queue->num_items == queue->capacity) &&
+               !queue->is_stopping)
+                pthread_cond_wait(&queue->not_full, &queue->lock);
+
+        if (queue->is_stopping) {
+                status = WORK_QUEUE_STOPPED;
+        } else if (queue->num_items == queue->capacity) {
+                status = WORK_QUEUE_FULL;
+        } else {
+                int32_t tail = (queue->head + queue->num_items) % queue->capacity;
+                queue->items[tail].run = run;
+                queue->items[tail].arg = arg;
+                ++queue->num_items;
+                pthread_cond_signal(&queue->not_empty);
+        }
+
+        pthread_mutex_unlock(&queue->lock);
+
+        return status;
+}
+
+void work_queue_stop(struct work_queue *queue)
+{
+        pthread_mutex_lock(&queue->lock);
+        queue->is_stopping = true;
+        pthread_cond_broadcast(&queue->not_empty);
+        pthread_cond_broadcast(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
+
+        int32_t thread_index;
+        for (thread_index = 0;
+             thread_index < queue->num_threads;
+             ++thread_index)
+                pthread_join(queue->threads[thread_index], NULL);
+
+        /**
+         * NOTE: The lock and condition variables stay valid, so that pushes
+         * racing with the stop fail with WORK_QUEUE_STOPPED.
+         */
+        free(queue->threads);
+        free(queue->items);
+        queue->threads = NULL;
+        queue->items = NULL;
+        queue->num_threads = 0;
+}
+
+void work_queue_forget(struct work_queue *queue)
+{
+        free(queue->threads);
+        free(queue->items);
+        memset(queue, 0, sizeof(*queue));
+}
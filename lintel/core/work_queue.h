@@ -0,0 +1,116 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _WORK_QUEUE_H_
+#define _WORK_QUEUE_H_
+
+/**
+ * A bounded FIFO of work items, served by a fixed pool of native threads.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WORK_QUEUE_SUCCESS 0
+#define WORK_QUEUE_FULL (-1)
+#define WORK_QUEUE_STOPPED (-2)
+#define WORK_QUEUE_ERR (-3)
+
+/**
+ * struct work_item - One unit of work: `run(arg)` is called on a worker.
+ */
+struct work_item {
+        void (*run)(void *arg);
+        void *arg;
+};
+
+/**
+ * struct work_queue - Ring buffer of pending work items, and its workers.
+ * @lock: Protects all other members.
+ * @not_empty: Signalled when an item is pushed, or the queue is stopping.
+ * @not_full: Signalled when an item is popped, or the queue is stopping.
+ * @items: Ring buffer of `capacity` items.
+ * @head: Index in `items` of the oldest pending item.
+ * @num_items: Number of pending items.
+ * @threads: The `num_threads` worker threads.
+ * @is_stopping: Set by work_queue_stop(), after which pushes fail.
+ */
+struct work_queue {
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+        struct work_item *items;
+        int32_t capacity;
+        int32_t head;
+        int32_t num_items;
+        pthread_t *threads;
+        int32_t num_threads;
+        bool is_stopping;
+};
+
+/**
+ * work_queue_start() - Initializes `queue`, and starts its workers.
+ * @queue: Queue to initialize.
+ * @num_threads: Number of worker threads.
+ * @capacity: Maximum number of pending (not yet running) items.
+ *
+ * Returns WORK_QUEUE_SUCCESS, or WORK_QUEUE_ERR if memory or threads could
+ * not be allocated, in which case `queue` is left uninitialized.
+ */
+int32_t
+work_queue_start(struct work_queue *queue,
+                 int32_t num_threads,
+                 int32_t capacity);
+
+/**
+ * work_queue_push() - Appends `run(arg)` to the back of `queue`.
+ * @should_block: If true, wait for space when the queue is full. Otherwise
+ * return WORK_QUEUE_FULL immediately.
+ *
+ * Returns WORK_QUEUE_SUCCESS if the item was queued, in which case it will
+ * run exactly once. Returns WORK_QUEUE_FULL or WORK_QUEUE_STOPPED otherwise,
+ * and the caller keeps ownership of `arg`.
+ */
+int32_t
+work_queue_push(struct work_queue *queue,
+                void (*run)(void *arg),
+                void *arg,
+                bool should_block);
+
+/**
+ * work_queue_stop() - Stops accepting items, runs the items still pending,
+ * and joins the workers.
+ *
+ * A stopped queue can't be restarted, but it stays valid for
+ * work_queue_push(), which fails with WORK_QUEUE_STOPPED. Must not be called
+ * from a worker, and must be called at most once.
+ */
+void work_queue_stop(struct work_queue *queue);
+
+/**
+ * work_queue_forget() - Drops a queue inherited across fork(), whose workers
+ * don't exist in the child, without locking or joining anything.
+ *
+ * Only to be called in the child, e.g., from a pthread_atfork() handler.
+ * The args of items still pending are leaked, and `queue` is left
+ * uninitialized, to be started again with work_queue_start().
+ */
+void work_queue_forget(struct work_queue *queue);
+
+#endif // _WORK_QUEUE_H_
@@ -0,0 +1,134 @@
+# Copyright 2018 Brendan Duke.
+#
+# This file is part of Lintel.
+#
+# Lintel is free software: you can redistribute it and/or modify it under the
+# terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+# A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# Lintel. If not, see <http://www.gnu.org/licenses/>.
+
+"""The `lintel-index` console script, which builds a dataset manifest."""
+import os
+import sys
+
+import click
+
+import lintel
+from lintel.manifest import write_manifest
+
+
+def _find_videos(paths, file_list, extensions):
+    """Yields the video paths in `paths` (files, or directory trees to walk)
+    and in `file_list`.
+    """
+    for path in paths:
+        if not os.path.isdir(path):
+            yield path
+            continue
+
+        for dirpath, dirnames, filenames in os.walk(path):
+            dirnames.sort()
+            for filename in sorted(filenames):
+                if os.path.splitext(filename)[1].lower() in extensions:
+                    yield os.path.join(dirpath, filename)
+
+    if file_list is not None:
+        for line in file_list:
+            line = line.strip()
+            if line:
+                yield line
+
+
+def _chunks(iterable, chunk_size):
+    chunk = []
+    for item in iterable:
+        chunk.append(item)
+        if len(chunk) == chunk_size:
+            yield chunk
+            chunk = []
+    if chunk:
+        yield chunk
+
+
+@click.command()
+@click.argument('output', type=click.Path(dir_okay=False, writable=True))
+@click.argument('paths', nargs=-1, type=click.Path(exists=True))
+@click.option('--file-list',
+              default=None,
+              type=click.File('r'),
+              help='File listing one video path per line.')
+@click.option('--root',
+              default=None,
+              type=click.Path(exists=True, file_okay=False),
+              help='Store names relative to this directory.')
+@click.option('--extensions',
+              default='.mp4,.avi,.mkv,.mov,.webm',
+              help='Extensions of the videos to index in directory trees.')
+@click.option('--workers',
+              default=os.cpu_count(),
+              type=int,
+              help='Number of native threads to probe on.')
+@click.option('--timeout',
+              default=30.0,
+              type=float,
+              help='Per-video timeout, in seconds.')
+@click.option('--chunk-size',
+              default=4096,
+              type=int,
+              help='Number of videos to probe per batch.')
+def build_index(output,
+                paths,
+                file_list,
+                root,
+                extensions,
+                workers,
+                timeout,
+                chunk_size):
+    """Scans the videos in PATHS into a binary manifest at OUTPUT.
+
+    The manifest holds each video's size, framerate, exact frame count, and
+    the frame index, byte offset and time of each keyframe. Read it with
+    `lintel.Manifest`, which memory-maps it.
+
+    Packets are read but not decoded, on WORKERS native threads. Videos that
+    fail to probe are reported on stderr and left out of the manifest.
+    """
+    extensions = {ext.strip().lower() for ext in extensions.split(',')}
+
+    counts = {'probed': 0, 'errors': 0}
+
+    def probe_videos():
+        for chunk in _chunks(_find_videos(paths, file_list, extensions),
+                             chunk_size):
+            for probe in lintel.probe_many(chunk,
+                                           workers=workers,
+                                           timeout=timeout,
+                                           gop_stats=True):
+                counts['probed'] += 1
+                if probe['error'] is not None:
+                    counts['errors'] += 1
+                    print('{}: {}'.format(probe['filename'], probe['error']),
+                          file=sys.stderr)
+                    continue
+
+                name = probe['filename']
+                if root is not None:
+                    name = os.path.relpath(name, root)
+                yield name, probe
+
+            print('probed {} videos'.format(counts['probed']),
+                  file=sys.stderr)
+
+    # NOTE: Probes are streamed into the manifest a chunk at a time, so
+    # memory doesn't grow with the number of videos.
+    num_videos = write_manifest(output, probe_videos(), chunk_size)
+    print('wrote {} videos to {} ({} errors)'.format(num_videos,
+                                                     output,
+                                                     counts['errors']))
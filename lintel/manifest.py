@@ -0,0 +1,421 @@
+# Copyright 2018 Brendan Duke.
+#
+# This file is part of Lintel.
+#
+# Lintel is free software: you can redistribute it and/or modify it under the
+# terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+# A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# Lintel. If not, see <http://www.gnu.org/licenses/>.
+
+"""Binary manifest of per-video metadata and keyframes.
+
+A manifest is written once by `lintel-index`, and memory-mapped by samplers at
+startup, so that no video has to be probed before training.
+
+The layout is little-endian, with every section 8-byte aligned:
+
+    header: `_HEADER`, giving the counts and section offsets.
+    entries: One `_ENTRY` record per video, sorted by UTF-8 name.
+    names: The UTF-8 names, concatenated.
+    keyframe_frame_nums: uint32 frame index of each keyframe.
+    keyframe_pos: int64 byte offset of each keyframe packet, or -1.
+    keyframe_times: float64 time of each keyframe, in seconds.
+
+The keyframes of a video are the slice of the keyframe arrays given by its
+entry's `keyframes_start` and `num_keyframes`.
+"""
+import collections
+import itertools
+import mmap
+import os
+import tempfile
+
+import numpy as np
+
+
+MAGIC = b'LNTLMFST'
+VERSION = 1
+
+_HEADER = np.dtype([('magic', 'S8'),
+                    ('version', '<u4'),
+                    ('num_videos', '<u4'),
+                    ('num_keyframes', '<u8'),
+                    ('entries_offset', '<u8'),
+                    ('names_offset', '<u8'),
+                    ('frame_nums_offset', '<u8'),
+                    ('pos_offset', '<u8'),
+                    ('times_offset', '<u8')])
+
+_ENTRY = np.dtype([('name_offset', '<u8'),
+                   ('name_length', '<u4'),
+                   ('width', '<u4'),
+                   ('height', '<u4'),
+                   ('flags', '<u4'),
+                   ('fps', '<f8'),
+                   ('duration', '<f8'),
+                   ('frame_count', '<u8'),
+                   ('keyframes_start', '<u8'),
+                   ('num_keyframes', '<u4'),
+                   ('reserved', '<u4')])
+
+_FLAG_FRAME_COUNT_EXACT = 0x1
+
+_KEYFRAME_SECTIONS = collections.OrderedDict([('keyframe_frame_nums', '<u4'),
+                                              ('keyframe_pos', '<i8'),
+                                              ('keyframe_times', '<f8')])
+
+_SPILL_FILES = ['entries', 'names', *_KEYFRAME_SECTIONS]
+
+# Number of videos whose keyframes are gathered at a time when merging.
+_MERGE_BLOCK_SIZE = 65536
+
+
+def _align(offset):
+    return (offset + 7) & ~7
+
+
+class VideoEntry(collections.namedtuple('VideoEntry',
+                                        ['name',
+                                         'width',
+                                         'height',
+                                         'fps',
+                                         'duration',
+                                         'frame_count',
+                                         'frame_count_exact',
+                                         'keyframe_frame_nums',
+                                         'keyframe_pos',
+                                         'keyframe_times'])):
+    """Metadata of one video in a manifest.
+
+    The keyframe arrays are read-only numpy views into the memory-mapped
+    manifest.
+    """
+    __slots__ = ()
+
+    def keyframe_before(self, frame_num):
+        """Returns the index into the keyframe arrays of the last keyframe at
+        or before `frame_num`, i.e., the keyframe a seek to `frame_num` lands
+        on. Returns 0 if `frame_num` precedes the first keyframe.
+        """
+        index = np.searchsorted(self.keyframe_frame_nums,
+                                frame_num,
+                                side='right') - 1
+        return max(int(index), 0)
+
+    def nearest_keyframe(self, frame_num):
+        """Returns the index into the keyframe arrays of the keyframe closest
+        to `frame_num`.
+        """
+        index = self.keyframe_before(frame_num)
+        if ((index + 1 < len(self.keyframe_frame_nums)) and
+                (self.keyframe_frame_nums[index + 1] - frame_num <
+                 frame_num - self.keyframe_frame_nums[index])):
+            return index + 1
+        return index
+
+    def should_seek(self, frame_nums):
+        """Returns the `should_seek` argument of `lintel.loadvid_frame_nums`
+        for `frame_nums` of this video.
+
+        Seeking pays off iff a keyframe after the start of the video comes at
+        or before the first frame, since decoding then starts there rather
+        than from the first frame of the video.
+        """
+        if len(frame_nums) == 0:
+            return False
+        return self.keyframe_before(min(frame_nums)) > 0
+
+
+def _gop_arrays(probe):
+    gop = probe['gop'] or {'keyframe_frame_nums': [],
+                           'keyframe_pos': [],
+                           'keyframe_times': []}
+    return (np.asarray(gop['keyframe_frame_nums'], dtype='<u4'),
+            np.asarray(gop['keyframe_pos'], dtype='<i8'),
+            np.asarray(gop['keyframe_times'], dtype='<f8'))
+
+
+def _spill_chunk(files, chunk, name_offset, keyframes_start):
+    """Appends the entries, names and keyframes of `chunk` to the spill
+    `files`, with offsets into those files, and returns the offsets after it.
+    """
+    entries = np.zeros(len(chunk), dtype=_ENTRY)
+    for i, (name, probe) in enumerate(chunk):
+        name = name.encode('utf-8')
+        keyframe_arrays = _gop_arrays(probe)
+        flags = _FLAG_FRAME_COUNT_EXACT if probe['frame_count_exact'] else 0
+        entries[i] = (name_offset,
+                      len(name),
+                      probe['width'],
+                      probe['height'],
+                      flags,
+                      probe['fps'],
+                      probe['duration'],
+                      probe['frame_count'],
+                      keyframes_start,
+                      len(keyframe_arrays[0]),
+                      0)
+        name_offset += len(name)
+        keyframes_start += len(keyframe_arrays[0])
+
+        files['names'].write(name)
+        for key, array in zip(_KEYFRAME_SECTIONS, keyframe_arrays):
+            files[key].write(array.tobytes())
+
+    files['entries'].write(entries.tobytes())
+
+    return name_offset, keyframes_start
+
+
+def _map_spill(path, dtype):
+    if os.path.getsize(path) == 0:
+        return np.zeros(0, dtype=dtype)
+    return np.memmap(path, dtype=dtype, mode='r')
+
+
+def _gather_ranges(starts, counts):
+    """Returns the indices of the ranges `starts[i]:starts[i] + counts[i]`,
+    concatenated.
+    """
+    starts = starts.astype(np.int64)
+    counts = counts.astype(np.int64)
+    ends = np.cumsum(counts)
+    return (np.repeat(starts - ends + counts, counts) +
+            np.arange(ends[-1] if len(ends) > 0 else 0))
+
+
+def _merge_spill(filename, paths):
+    """Writes the manifest at `filename` from the spill files at `paths`,
+    sorted by name.
+    """
+    entries = np.fromfile(paths['entries'], dtype=_ENTRY)
+    with open(paths['names'], 'rb') as f:
+        names = f.read()
+
+    name_starts = entries['name_offset'].astype(np.int64)
+    name_ends = name_starts + entries['name_length']
+    order = sorted(range(len(entries)),
+                   key=lambda i: names[name_starts[i]:name_ends[i]])
+    order = np.asarray(order, dtype=np.int64)
+
+    sorted_entries = entries[order]
+    name_lengths = sorted_entries['name_length'].astype(np.uint64)
+    sorted_entries['name_offset'] = np.cumsum(name_lengths) - name_lengths
+    num_keyframes = sorted_entries['num_keyframes'].astype(np.uint64)
+    sorted_entries['keyframes_start'] = (np.cumsum(num_keyframes) -
+                                         num_keyframes)
+    total_keyframes = int(num_keyframes.sum())
+
+    section_sizes = [sorted_entries.nbytes, len(names)]
+    section_sizes.extend(total_keyframes*np.dtype(dtype).itemsize
+                         for dtype in _KEYFRAME_SECTIONS.values())
+    offsets = []
+    offset = _HEADER.itemsize
+    for size in section_sizes:
+        offsets.append(offset)
+        offset = _align(offset + size)
+
+    header = np.array([(MAGIC,
+                        VERSION,
+                        len(entries),
+                        total_keyframes,
+                        *offsets)],
+                      dtype=_HEADER)
+
+    with open(filename, 'wb') as f:
+        f.write(header.tobytes())
+
+        f.write(b'\x00'*(offsets[0] - f.tell()))
+        f.write(sorted_entries.tobytes())
+
+        f.write(b'\x00'*(offsets[1] - f.tell()))
+        for i in order:
+            f.write(names[name_starts[i]:name_ends[i]])
+
+        # NOTE: Keyframes are copied a block of videos at a time, so that
+        # only one block of them is in memory.
+        for (key, dtype), offset in zip(_KEYFRAME_SECTIONS.items(),
+                                        offsets[2:]):
+            keyframes = _map_spill(paths[key], dtype)
+            f.write(b'\x00'*(offset - f.tell()))
+            for start in range(0, len(order), _MERGE_BLOCK_SIZE):
+                block = order[start:start + _MERGE_BLOCK_SIZE]
+                indices = _gather_ranges(entries['keyframes_start'][block],
+                                         entries['num_keyframes'][block])
+                f.write(keyframes[indices].tobytes())
+            del keyframes
+
+    return len(entries)
+
+
+def write_manifest(filename, probes, chunk_size=4096):
+    """Writes a manifest of `probes` to `filename`.
+
+    Probes are consumed `chunk_size` at a time, and spilled to temporary files
+    next to `filename`, which are merged in name order at the end. So only
+    one chunk of probes, and the names, are ever held in memory, and `probes`
+    can be a generator over a whole dataset.
+
+    Args:
+        filename: Output path.
+        probes: Iterable of (name, probe) pairs, where probe is a dict as
+            returned by `lintel.probe_many(..., gop_stats=True)` without an
+            error.
+        chunk_size: Number of probes spilled at a time.
+
+    Returns:
+        The number of videos written.
+    """
+    directory = os.path.dirname(os.path.abspath(filename))
+    with tempfile.TemporaryDirectory(dir=directory) as spill_dir:
+        paths = {key: os.path.join(spill_dir, key) for key in _SPILL_FILES}
+        files = {key: open(path, 'wb') for key, path in paths.items()}
+        try:
+            probes = iter(probes)
+            name_offset = 0
+            keyframes_start = 0
+            while True:
+                chunk = list(itertools.islice(probes, chunk_size))
+                if not chunk:
+                    break
+                name_offset, keyframes_start = _spill_chunk(files,
+                                                            chunk,
+                                                            name_offset,
+                                                            keyframes_start)
+        finally:
+            for f in files.values():
+                f.close()
+
+        return _merge_spill(filename, paths)
+
+
+class Manifest(object):
+    """Read-only, memory-mapped view of a manifest written by
+    `write_manifest`.
+
+    Opening a manifest costs one mmap, regardless of the number of videos.
+    Videos are looked up by name with a binary search over the sorted
+    entries, or by index.
+    """
+
+    def __init__(self, filename):
+        with open(filename, 'rb') as f:
+            self._mmap = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        header = None
+        if len(self._mmap) >= _HEADER.itemsize:
+            header = np.frombuffer(self._mmap, dtype=_HEADER, count=1).copy()[0]
+        if ((header is None) or
+                (header['magic'] != MAGIC) or
+                (header['version'] != VERSION)):
+            self._mmap.close()
+            raise ValueError('{} is not a lintel manifest (version {})'.format(
+                filename, VERSION))
+
+        num_videos = int(header['num_videos'])
+        num_keyframes = int(header['num_keyframes'])
+        self._entries = np.frombuffer(self._mmap,
+                                      dtype=_ENTRY,
+                                      count=num_videos,
+                                      offset=int(header['entries_offset']))
+        self._names_offset = int(header['names_offset'])
+        self._frame_nums = np.frombuffer(
+            self._mmap,
+            dtype='<u4',
+            count=num_keyframes,
+            offset=int(header['frame_nums_offset']))
+        self._positions = np.frombuffer(self._mmap,
+                                        dtype='<i8',
+                                        count=num_keyframes,
+                                        offset=int(header['pos_offset']))
+        self._times = np.frombuffer(self._mmap,
+                                    dtype='<f8',
+                                    count=num_keyframes,
+                                    offset=int(header['times_offset']))
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def close(self):
+        """Releases the mapping.
+
+        If keyframe arrays of entries are still referenced, the mapping is
+        released when the last of them is garbage collected instead.
+        """
+        self._entries = None
+        self._frame_nums = None
+        self._positions = None
+        self._times = None
+        try:
+            self._mmap.close()
+        except BufferError:
+            pass
+
+    def __len__(self):
+        return len(self._entries)
+
+    def __contains__(self, name):
+        return self.index(name) is not None
+
+    def __getitem__(self, key):
+        if isinstance(key, str):
+            index = self.index(key)
+            if index is None:
+                raise KeyError(key)
+            key = index
+        return self._entry(key)
+
+    def _name_bytes(self, index):
+        entry = self._entries[index]
+        start = self._names_offset + int(entry['name_offset'])
+        return self._mmap[start:start + int(entry['name_length'])]
+
+    def name(self, index):
+        """Returns the name of the video at `index`."""
+        return self._name_bytes(index).decode('utf-8')
+
+    def names(self):
+        """Yields the names of all videos, in sorted order."""
+        for index in range(len(self)):
+            yield self.name(index)
+
+    def index(self, name):
+        """Returns the index of the video called `name`, or None."""
+        name = name.encode('utf-8')
+        low = 0
+        high = len(self._entries)
+        while low < high:
+            mid = (low + high)//2
+            if self._name_bytes(mid) < name:
+                low = mid + 1
+            else:
+                high = mid
+        if (low < len(self._entries)) and (self._name_bytes(low) == name):
+            return low
+        return None
+
+    def _entry(self, index):
+        entry = self._entries[index]
+        start = int(entry['keyframes_start'])
+        end = start + int(entry['num_keyframes'])
+        return VideoEntry(
+            name=self.name(index),
+            width=int(entry['width']),
+            height=int(entry['height']),
+            fps=float(entry['fps']),
+            duration=float(entry['duration']),
+            frame_count=int(entry['frame_count']),
+            frame_count_exact=bool(entry['flags'] & _FLAG_FRAME_COUNT_EXACT),
+            keyframe_frame_nums=self._frame_nums[start:end],
+            keyframe_pos=self._positions[start:end],
+            keyframe_times=self._times[start:end])
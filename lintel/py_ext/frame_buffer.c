@@ -0,0 +1,416 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#define PY_SSIZE_T_CLEAN
+
+#include "py_ext/frame_buffer.h"
+#include <stdlib.h>
+
+/**
+ * NOTE: These are the structs of the DLPack ABI (dlpack.h, version 0.x),
+ * which is the layout every framework's from_dlpack() consumes.
+ */
+enum {
+        DL_CPU = 1,
+};
+
+enum {
+        DL_UINT = 1,
+        DL_FLOAT = 2,
+};
+
+struct dl_device {
+        int32_t device_type;
+        int32_t device_id;
+};
+
+struct dl_data_type {
+        uint8_t code;
+        uint8_t bits;
+        uint16_t lanes;
+};
+
+struct dl_tensor {
+        void *data;
+        struct dl_device device;
+        int32_t ndim;
+        struct dl_data_type dtype;
+        int64_t *shape;
+        int64_t *strides;
+        uint64_t byte_offset;
+};
+
+struct dl_managed_tensor {
+        struct dl_tensor dl_tensor;
+        void *manager_ctx;
+        void (*deleter)(struct dl_managed_tensor *self);
+};
+
+/**
+ * struct frame_buffer_dl_tensor - A DLPack tensor exported from a
+ * FrameBuffer, which holds a reference to the FrameBuffer until the consumer
+ * calls the deleter.
+ */
+struct frame_buffer_dl_tensor {
+        struct dl_managed_tensor managed;
+        int64_t shape[FRAME_BUFFER_MAX_DIMS];
+        int64_t strides[FRAME_BUFFER_MAX_DIMS];
+};
+
+static const char DLTENSOR_CAPSULE_NAME[] = "dltensor";
+
+struct frame_buffer *new_frame_buffer(Py_ssize_t size_bytes)
+{
+        struct frame_buffer *frames = PyObject_New(struct frame_buffer,
+                                                   &FrameBuffer_Type);
+        if (frames == NULL)
+                return NULL;
+
+        frames->size_bytes = size_bytes;
+        frames->num_exports = 0;
+        frame_buffer_set_shape(frames, 1, &size_bytes, 'B');
+
+        Py_BEGIN_ALLOW_THREADS
+        frames->buffer = buffer_pool_get(size_bytes);
+        Py_END_ALLOW_THREADS
+        if (frames->buffer.data == NULL) {
+                Py_DECREF(frames);
+                return (struct frame_buffer *)PyErr_NoMemory();
+        }
+
+        return frames;
+}
+
+void
+frame_buffer_set_shape(struct frame_buffer *frames,
+                       int32_t ndim,
+                       const Py_ssize_t *shape,
+                       char format)
+{
+        frames->ndim = ndim;
+        frames->itemsize = (format == 'f') ? sizeof(float) : 1;
+        frames->format[0] = format;
+        frames->format[1] = '\0';
+
+        Py_ssize_t stride = frames->itemsize;
+        int32_t dim;
+        for (dim = ndim - 1;
+             dim >= 0;
+             --dim) {
+                frames->shape[dim] = shape[dim];
+                frames->strides[dim] = stride;
+                stride *= shape[dim];
+        }
+}
+
+int32_t
+frame_buffer_truncate(struct frame_buffer *frames, Py_ssize_t size_bytes)
+{
+        if (__atomic_load_n(&frames->num_exports, __ATOMIC_RELAXED) > 0) {
+                PyErr_SetString(PyExc_BufferError,
+                                "cannot truncate a FrameBuffer with exports");
+                return -1;
+        }
+
+        if (size_bytes < frames->size_bytes) {
+                frames->size_bytes = size_bytes;
+                frames->shape[0] = size_bytes/frames->strides[0];
+        }
+
+        return 0;
+}
+
+static void
+frame_buffer_dealloc(struct frame_buffer *frames)
+{
+        buffer_pool_put(frames->buffer);
+        PyObject_Del(frames);
+}
+
+/**
+ * frame_buffer_getbuffer() - Exports the frames with their shape to
+ * consumers that ask for it, e.g., numpy.asarray(), and as flat bytes to
+ * those that don't, e.g., numpy.frombuffer().
+ */
+static int
+frame_buffer_getbuffer(struct frame_buffer *frames,
+                       Py_buffer *view,
+                       int flags)
+{
+        bool is_shaped = ((flags & PyBUF_ND) == PyBUF_ND);
+        if (is_shaped &&
+            (frames->itemsize != 1) &&
+            ((flags & PyBUF_FORMAT) != PyBUF_FORMAT)) {
+                PyErr_SetString(PyExc_BufferError,
+                                "FrameBuffer of float32 needs PyBUF_FORMAT");
+                view->obj = NULL;
+                return -1;
+        }
+
+        view->buf = frames->buffer.data;
+        view->obj = (PyObject *)frames;
+        Py_INCREF(frames);
+        view->len = frames->size_bytes;
+        view->readonly = 0;
+        view->itemsize = is_shaped ? frames->itemsize : 1;
+        view->format = NULL;
+        if ((flags & PyBUF_FORMAT) == PyBUF_FORMAT)
+                view->format = is_shaped ? frames->format : "B";
+        view->ndim = is_shaped ? frames->ndim : 1;
+        view->shape = is_shaped ? frames->shape : NULL;
+        view->strides = NULL;
+        if (is_shaped && ((flags & PyBUF_STRIDES) == PyBUF_STRIDES))
+                view->strides = frames->strides;
+        view->suboffsets = NULL;
+        view->internal = NULL;
+
+        __atomic_add_fetch(&frames->num_exports, 1, __ATOMIC_RELAXED);
+
+        return 0;
+}
+
+static void
+frame_buffer_releasebuffer(struct frame_buffer *frames,
+                           Py_buffer *view)
+{
+        __atomic_sub_fetch(&frames->num_exports, 1, __ATOMIC_RELAXED);
+}
+
+static Py_ssize_t
+frame_buffer_length(struct frame_buffer *frames)
+{
+        return frames->size_bytes;
+}
+
+/**
+ * frame_buffer_dl_deleter() - Called by the consumer of a DLPack tensor when
+ * it is done with it, possibly from a thread without the GIL.
+ */
+static void
+frame_buffer_dl_deleter(struct dl_managed_tensor *managed)
+{
+        PyGILState_STATE gil_state = PyGILState_Ensure();
+        struct frame_buffer *frames = managed->manager_ctx;
+        __atomic_sub_fetch(&frames->num_exports, 1, __ATOMIC_RELAXED);
+        Py_DECREF(frames);
+        PyGILState_Release(gil_state);
+
+        free(managed);
+}
+
+/**
+ * frame_buffer_dl_capsule_destructor() - Deletes the DLPack tensor of a
+ * capsule that was never consumed. A consumer renames the capsule to
+ * "used_dltensor", and takes over calling the deleter.
+ */
+static void
+frame_buffer_dl_capsule_destructor(PyObject *capsule)
+{
+        if (!PyCapsule_IsValid(capsule, DLTENSOR_CAPSULE_NAME))
+                return;
+
+        struct dl_managed_tensor *managed =
+                PyCapsule_GetPointer(capsule, DLTENSOR_CAPSULE_NAME);
+        managed->deleter(managed);
+}
+
+static PyObject *
+frame_buffer_dlpack(struct frame_buffer *frames, PyObject *args, PyObject *kw)
+{
+        PyObject *stream = Py_None;
+        PyObject *max_version = Py_None;
+        PyObject *dl_device = Py_None;
+        PyObject *copy = Py_None;
+        static char *kwlist[] = {"stream",
+                                 "max_version",
+                                 "dl_device",
+                                 "copy",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "|$OOOO:__dlpack__",
+                                         kwlist,
+                                         &stream,
+                                         &max_version,
+                                         &dl_device,
+                                         &copy))
+                return NULL;
+
+        if (stream != Py_None) {
+                PyErr_SetString(PyExc_BufferError,
+                                "FrameBuffer is on the CPU, so stream must be None");
+                return NULL;
+        }
+
+        struct frame_buffer_dl_tensor *tensor =
+                calloc(1, sizeof(struct frame_buffer_dl_tensor));
+        if (tensor == NULL)
+                return PyErr_NoMemory();
+
+        int32_t dim;
+        for (dim = 0;
+             dim < frames->ndim;
+             ++dim) {
+                tensor->shape[dim] = frames->shape[dim];
+                tensor->strides[dim] = frames->strides[dim]/frames->itemsize;
+        }
+
+        struct dl_tensor *dl_tensor = &tensor->managed.dl_tensor;
+        dl_tensor->data = frames->buffer.data;
+        dl_tensor->device.device_type = DL_CPU;
+        dl_tensor->device.device_id = 0;
+        dl_tensor->ndim = frames->ndim;
+        dl_tensor->dtype.code = (frames->format[0] == 'f') ? DL_FLOAT : DL_UINT;
+        dl_tensor->dtype.bits = 8*frames->itemsize;
+        dl_tensor->dtype.lanes = 1;
+        dl_tensor->shape = tensor->shape;
+        dl_tensor->strides = tensor->strides;
+        dl_tensor->byte_offset = 0;
+        tensor->managed.manager_ctx = frames;
+        tensor->managed.deleter = frame_buffer_dl_deleter;
+
+        PyObject *capsule = PyCapsule_New(&tensor->managed,
+                                          DLTENSOR_CAPSULE_NAME,
+                                          frame_buffer_dl_capsule_destructor);
+        if (capsule == NULL) {
+                free(tensor);
+                return NULL;
+        }
+        Py_INCREF(frames);
+        __atomic_add_fetch(&frames->num_exports, 1, __ATOMIC_RELAXED);
+
+        return capsule;
+}
+
+static PyObject *
+frame_buffer_dlpack_device(struct frame_buffer *frames, PyObject *args)
+{
+        return Py_BuildValue("(ii)", DL_CPU, 0);
+}
+
+static PyObject *
+frame_buffer_get_shape(struct frame_buffer *frames, void *closure)
+{
+        PyObject *shape = PyTuple_New(frames->ndim);
+        if (shape == NULL)
+                return NULL;
+
+        int32_t dim;
+        for (dim = 0;
+             dim < frames->ndim;
+             ++dim) {
+                PyObject *size = PyLong_FromSsize_t(frames->shape[dim]);
+                if (size == NULL) {
+                        Py_DECREF(shape);
+                        return NULL;
+                }
+                PyTuple_SET_ITEM(shape, dim, size);
+        }
+
+        return shape;
+}
+
+static PyObject *
+frame_buffer_get_format(struct frame_buffer *frames, void *closure)
+{
+        return PyUnicode_FromString(frames->format);
+}
+
+/**
+ * frame_buffer_reduce() - Pickles a FrameBuffer as a bytearray, since the
+ * pool it came from is local to this process.
+ */
+static PyObject *
+frame_buffer_reduce(struct frame_buffer *frames, PyObject *args)
+{
+        PyObject *contents =
+                PyByteArray_FromStringAndSize((const char *)frames->buffer.data,
+                                              frames->size_bytes);
+        if (contents == NULL)
+                return NULL;
+
+        PyObject *result = Py_BuildValue("(O(O))",
+                                         (PyObject *)&PyByteArray_Type,
+                                         contents);
+        Py_DECREF(contents);
+
+        return result;
+}
+
+static PyBufferProcs frame_buffer_as_buffer = {
+        (getbufferproc)frame_buffer_getbuffer,
+        (releasebufferproc)frame_buffer_releasebuffer,
+};
+
+static PySequenceMethods frame_buffer_as_sequence = {
+        (lenfunc)frame_buffer_length,
+};
+
+static PyMethodDef frame_buffer_methods[] = {
+        {"__reduce__",
+         (PyCFunction)frame_buffer_reduce,
+         METH_NOARGS,
+         PyDoc_STR("Pickles the frames as a bytearray.")},
+        {"__dlpack__",
+         (PyCFunction)frame_buffer_dlpack,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("__dlpack__(stream=None) -> PyCapsule\n"
+                   "Exports the frames as a DLPack tensor, without a copy.")},
+        {"__dlpack_device__",
+         (PyCFunction)frame_buffer_dlpack_device,
+         METH_NOARGS,
+         PyDoc_STR("__dlpack_device__() -> (device_type, device_id) of the CPU")},
+        {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef frame_buffer_getset[] = {
+        {"shape",
+         (getter)frame_buffer_get_shape,
+         NULL,
+         PyDoc_STR("Shape of the frames, e.g., (frames, height, width, 3)."),
+         NULL},
+        {"format",
+         (getter)frame_buffer_get_format,
+         NULL,
+         PyDoc_STR("struct format of the elements: 'B' (uint8) or 'f' (float32)."),
+         NULL},
+        {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyDoc_STRVAR(frame_buffer_doc,
+             "Decoded RGB24 frames in a pooled buffer, returned by the decode\n"
+             "APIs while the buffer pool or tensor output is enabled. Exports its\n"
+             "shape through the buffer protocol, e.g., numpy.asarray(frames) has\n"
+             "shape (frames, height, width, 3), and through __dlpack__, e.g., for\n"
+             "torch.from_dlpack(frames). numpy.frombuffer(frames) still gives the\n"
+             "flat bytes. The buffer goes back to the pool when the FrameBuffer\n"
+             "and all of its exports are garbage collected.");
+
+PyTypeObject FrameBuffer_Type = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "_lintel.FrameBuffer",
+        .tp_basicsize = sizeof(struct frame_buffer),
+        .tp_dealloc = (destructor)frame_buffer_dealloc,
+        .tp_as_sequence = &frame_buffer_as_sequence,
+        .tp_as_buffer = &frame_buffer_as_buffer,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_doc = frame_buffer_doc,
+        .tp_methods = frame_buffer_methods,
+        .tp_getset = frame_buffer_getset,
+};
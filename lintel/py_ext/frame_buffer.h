@@ -0,0 +1,96 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * This file is part of Lintel.
+ *
+ * Lintel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Lintel. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FRAME_BUFFER_H_
+#define _FRAME_BUFFER_H_
+
+/**
+ * FrameBuffer: decoded frames in a buffer from the shared large buffer pool,
+ * which is returned to the pool when the FrameBuffer is garbage collected.
+ *
+ * A FrameBuffer knows the shape of its frames, which it exports through the
+ * buffer protocol and DLPack, so that numpy and deep learning frameworks can
+ * wrap it as a tensor without a copy.
+ */
+
+#include "core/buffer_pool.h"
+#include <Python.h>
+
+#define FRAME_BUFFER_MAX_DIMS 4
+
+/**
+ * struct frame_buffer - A FrameBuffer object.
+ * @buffer: Pooled storage of the frames.
+ * @size_bytes: Number of bytes of frames in `buffer`, at most its capacity.
+ * @num_exports: Number of buffer protocol views and DLPack tensors currently
+ * exported. Updated atomically, since DLPack deleters and free-threaded
+ * builds can release exports from any thread.
+ * @ndim: Number of dimensions of the frames, e.g., 4 for (frames, height,
+ * width, channels), or 1 for flat bytes.
+ * @shape: Size of each dimension. The first is the number of frames.
+ * @strides: C-contiguous strides of each dimension, in bytes.
+ * @itemsize: Size of one element, in bytes.
+ * @format: struct module format of one element: "B" (uint8) or "f"
+ * (float32).
+ */
+struct frame_buffer {
+        PyObject_HEAD
+        struct pool_buffer buffer;
+        Py_ssize_t size_bytes;
+        Py_ssize_t num_exports;
+        int32_t ndim;
+        Py_ssize_t shape[FRAME_BUFFER_MAX_DIMS];
+        Py_ssize_t strides[FRAME_BUFFER_MAX_DIMS];
+        Py_ssize_t itemsize;
+        char format[2];
+};
+
+extern PyTypeObject FrameBuffer_Type;
+
+/**
+ * new_frame_buffer() - Returns a new, flat FrameBuffer of `size_bytes` bytes,
+ * or NULL with a Python exception set.
+ */
+struct frame_buffer *new_frame_buffer(Py_ssize_t size_bytes);
+
+/**
+ * frame_buffer_set_shape() - Sets the shape of the elements of `frames`.
+ * @ndim: Number of dimensions, at most FRAME_BUFFER_MAX_DIMS.
+ * @shape: Size of each dimension.
+ * @format: 'B' for uint8, or 'f' for float32.
+ *
+ * The shape must cover `frames` exactly. Must be called before any export.
+ */
+void
+frame_buffer_set_shape(struct frame_buffer *frames,
+                       int32_t ndim,
+                       const Py_ssize_t *shape,
+                       char format);
+
+/**
+ * frame_buffer_truncate() - Shrinks `frames` to `size_bytes`, for partial
+ * results, which must be a whole number of frames. The capacity is kept, to
+ * go back to the pool.
+ *
+ * Returns 0 on success, and -1 with a Python exception set if `frames` has
+ * exported views.
+ */
+int32_t
+frame_buffer_truncate(struct frame_buffer *frames, Py_ssize_t size_bytes);
+
+#endif // _FRAME_BUFFER_H_
@@ -23,45 +23,157 @@
 #define PY_SSIZE_T_CLEAN
 
 #include "core/video_decode.h"
+#include "core/audio_decode.h"
+#include "core/buffer_pool.h"
+#include "core/codec_pool.h"
+#include "core/file_io.h"
+#include "core/handle_cache.h"
+#include "core/motion_vectors.h"
+#include "core/probe.h"
+#include "core/rgb_convert.h"
+#include "core/tar_shard.h"
+#include "core/work_queue.h"
+#include "py_ext/frame_buffer.h"
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/random_seed.h>
 #include <libswscale/swscale.h>
 #include <Python.h>
 #include <pythread.h>
 #include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
 #define UNUSED(x) x __attribute__ ((__unused__))
 
-#define DEFAULT_TIMEOUT_SEC 3
+#define DEFAULT_TIMEOUT_MS 3000
+#define DEFAULT_DECODE_WORKERS 4
+#define DEFAULT_DECODE_QUEUE_SIZE 64
+#define DEFAULT_BUFFER_POOL_BYTES (256 << 20)
 
 
-#define LOADVID_TIMEOUT 1
+/**
+ * NOTE: Requests of up to this many frames keep their frame indices or times
+ * inline, rather than in a separate allocation.
+ */
+#define FRAMES_REQUEST_INLINE_ITEMS 64
+#define MAX_OUTPUT_SCALES 8
+#define NUM_SLOWFAST_PATHWAYS 2
+
 #define LOADVID_SUCCESS 0
 #define LOADVID_ERR (-1)
 #define LOADVID_ERR_STREAM_INDEX (-2)
 
 PyDoc_STRVAR(module_doc, "Module for loading video data.");
 
-// callback
-int32_t interrupt_callback(void *data) {
-    struct video_stream_context *vid_ctx = data;
-    if (vid_ctx->decode_time == 0) {
-        vid_ctx->decode_time =  time(NULL); //start time
-        return LOADVID_SUCCESS;
-    } else {
-        int64_t time_use =  time(NULL) - vid_ctx->decode_time;
-        if (time_use > vid_ctx->timeout_sec) {// timeout
-            vid_ctx->error_type = PyExc_TimeoutError;
-            vid_ctx->error_msg = "decode video frame timeout.";
-//             printf("decode video timeout.\n");
-            return LOADVID_TIMEOUT;
-        } else {
-            return LOADVID_SUCCESS;
+/**
+ * struct lintel_state - State of one _lintel module object.
+ * @seed_base: Random base of the seeds of calls that don't pass a `seed`.
+ * @num_seeds: Number of seeds drawn from `seed_base`, updated atomically.
+ * @future_type: concurrent.futures.Future, imported by the first submit().
+ */
+struct lintel_state {
+        uint64_t seed_base;
+        uint64_t num_seeds;
+        PyObject *future_type;
+};
+
+static struct lintel_state *
+get_lintel_state(PyObject *module)
+{
+        return PyModule_GetState(module);
+}
+
+/**
+ * get_call_seed() - Sets the RNG state of a call from its `seed` argument, or
+ * if `seed` is NULL or None, from a fresh seed of `module`.
+ *
+ * Fresh seeds are distinct for every call, and are drawn with an atomic
+ * counter rather than a lock. The process ID is mixed in, since forked
+ * processes, e.g., DataLoader workers, inherit the seed base and counter.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+get_call_seed(uint64_t *rng_state, PyObject *module, PyObject *seed)
+{
+        if ((seed == NULL) || (seed == Py_None)) {
+                struct lintel_state *state = get_lintel_state(module);
+                uint64_t seed_index = __atomic_fetch_add(&state->num_seeds,
+                                                         1,
+                                                         __ATOMIC_RELAXED);
+                uint64_t seed_state = (state->seed_base ^
+                                       ((uint64_t)getpid()*
+                                        0x9e3779b97f4a7c15ULL)) +
+                                      seed_index;
+                *rng_state = next_random(&seed_state);
+
+                return 0;
+        }
+
+        if (!PyLong_Check(seed)) {
+                PyErr_SetString(PyExc_TypeError, "seed must be an int or None");
+                return -1;
         }
-    }
+
+        *rng_state = PyLong_AsUnsignedLongLongMask(seed);
+        if ((*rng_state == (uint64_t)-1) && PyErr_Occurred())
+                return -1;
+
+        return 0;
+}
+
+/**
+ * NOTE: The output settings below are process-wide, like the buffer pool and
+ * decode workers. They are stored and loaded atomically, because on
+ * free-threaded builds decode calls can run concurrently with the setters.
+ */
+
+/**
+ * NOTE: Set by set_buffer_pool(). While set, outputs are FrameBuffer objects
+ * backed by the large buffer pool, instead of bytearrays.
+ */
+static bool is_buffer_pool_enabled = false;
+
+/**
+ * NOTE: Set by set_tensor_output(). While set, outputs are shaped FrameBuffer
+ * objects even with the buffer pool disabled.
+ */
+static bool is_tensor_output_enabled = false;
+
+/**
+ * NOTE: Set by set_rgb_kernel(), and copied into each video_stream_context as
+ * it is set up.
+ */
+static enum rgb_kernel rgb_kernel = RGB_KERNEL_BILINEAR;
+
+/**
+ * NOTE: Set by set_file_io(), and used by each video opened from then on.
+ */
+static enum file_io_backend file_io_backend = FILE_IO_FFMPEG;
+
+/**
+ * timeout_to_ms() - Converts a `timeout` argument in (possibly fractional)
+ * seconds to the millisecond budget used by the decode deadline.
+ *
+ * A non-positive timeout selects the default of DEFAULT_TIMEOUT_MS.
+ */
+static int32_t
+timeout_to_ms(double timeout)
+{
+        if (timeout <= 0.0)
+                return DEFAULT_TIMEOUT_MS;
+        if (timeout >= INT32_MAX/1000)
+                return INT32_MAX;
+
+        int32_t timeout_ms = (int32_t)(timeout*1000.0 + 0.5);
+
+        return (timeout_ms > 0) ? timeout_ms : 1;
 }
 
 /**
@@ -94,12 +206,383 @@ alloc_pyarray(const uint32_t out_size_bytes)
         return frames;
 }
 
+/**
+ * truncate_to_decoded() - Shrinks `frames` to hold only the first
+ * `num_decoded` frames of `bytes_per_frame` bytes each, for partial results.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+truncate_to_decoded(PyByteArrayObject *frames,
+                    int32_t num_decoded,
+                    uint32_t bytes_per_frame)
+{
+        Py_ssize_t decoded_size_bytes = (Py_ssize_t)num_decoded*bytes_per_frame;
+        if (decoded_size_bytes >= PyByteArray_GET_SIZE(frames))
+                return 0;
+
+        return PyByteArray_Resize((PyObject *)frames, decoded_size_bytes);
+}
+
+/**
+ * struct output_buffer - Destination of the decoded frames of one call.
+ * @obj: The object returned to the caller: a new bytearray, or the `out`
+ * argument. Owned by the output_buffer.
+ * @view: Writable view of `out`, if `is_external`.
+ * @data: Start of the bytes to decode into, set by prepare_output().
+ * @is_external: True iff the caller passed a buffer as `out`.
+ */
+struct output_buffer {
+        PyObject *obj;
+        Py_buffer view;
+        uint8_t *data;
+        bool is_external;
+};
+
+/**
+ * acquire_output() - Initializes `output`, and if `out` is neither NULL nor
+ * None, takes a writable, C-contiguous view of it to decode into.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure. Either
+ * way, `output` must be released with release_output().
+ */
+static int32_t
+acquire_output(struct output_buffer *output, PyObject *out)
+{
+        memset(output, 0, sizeof(*output));
+        if ((out == NULL) || (out == Py_None))
+                return 0;
+
+        if (PyObject_GetBuffer(out,
+                               &output->view,
+                               PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0)
+                return -1;
+
+        Py_INCREF(out);
+        output->obj = out;
+        output->is_external = true;
+
+        return 0;
+}
+
+/**
+ * prepare_output() - Makes `output` ready to hold `size_bytes` of frames, by
+ * checking the size of the caller's buffer, or allocating a bytearray.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+prepare_output(struct output_buffer *output, uint32_t size_bytes)
+{
+        if (output->is_external) {
+                if (output->view.len < (Py_ssize_t)size_bytes) {
+                        PyErr_Format(PyExc_ValueError,
+                                     "out holds %zd bytes, but %u are needed",
+                                     output->view.len,
+                                     size_bytes);
+                        return -1;
+                }
+                output->data = output->view.buf;
+
+                return 0;
+        }
+
+        if (__atomic_load_n(&is_buffer_pool_enabled, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&is_tensor_output_enabled, __ATOMIC_RELAXED)) {
+                struct frame_buffer *frames = new_frame_buffer(size_bytes);
+                if (frames == NULL)
+                        return -1;
+                output->obj = (PyObject *)frames;
+                output->data = frames->buffer.data;
+
+                return 0;
+        }
+
+        PyByteArrayObject *frames = alloc_pyarray(size_bytes);
+        if (frames == NULL)
+                return -1;
+        output->obj = (PyObject *)frames;
+        output->data = (uint8_t *)(frames->ob_bytes);
+
+        return 0;
+}
+
+/**
+ * set_output_shape() - Sets the shape exported by a FrameBuffer `output`,
+ * e.g., (frames, height, width, 3) of 'B'. Bytearrays and the caller's `out`
+ * buffer stay flat.
+ */
+static void
+set_output_shape(struct output_buffer *output,
+                 int32_t ndim,
+                 const Py_ssize_t *shape,
+                 char format)
+{
+        if (output->is_external ||
+            (output->obj == NULL) ||
+            (Py_TYPE(output->obj) != &FrameBuffer_Type))
+                return;
+
+        frame_buffer_set_shape((struct frame_buffer *)output->obj,
+                               ndim,
+                               shape,
+                               format);
+}
+
+/**
+ * set_frames_shape() - Sets the shape of an `output` of `num_frames` RGB24
+ * frames of `width` by `height`.
+ */
+static void
+set_frames_shape(struct output_buffer *output,
+                 int32_t num_frames,
+                 int32_t width,
+                 int32_t height)
+{
+        const Py_ssize_t shape[] = {num_frames, height, width, 3};
+
+        set_output_shape(output, 4, shape, 'B');
+}
+
+/**
+ * truncate_output() - For partial results, shrinks a bytearray `output` to
+ * the frames decoded. A caller's `out` buffer is left as is, and the frame
+ * count returned alongside it says how much of it was filled.
+ */
+static int32_t
+truncate_output(struct output_buffer *output,
+                int32_t num_decoded,
+                uint32_t bytes_per_frame)
+{
+        if (output->is_external || (output->obj == NULL))
+                return 0;
+
+        if (Py_TYPE(output->obj) == &FrameBuffer_Type)
+                return frame_buffer_truncate(
+                        (struct frame_buffer *)output->obj,
+                        (Py_ssize_t)num_decoded*bytes_per_frame);
+
+        return truncate_to_decoded((PyByteArrayObject *)output->obj,
+                                   num_decoded,
+                                   bytes_per_frame);
+}
+
+/**
+ * release_output() - Releases the view and reference held by `output`.
+ */
+static void
+release_output(struct output_buffer *output)
+{
+        if (output->is_external)
+                PyBuffer_Release(&output->view);
+        Py_CLEAR(output->obj);
+        output->is_external = false;
+}
+
+/**
+ * struct video_source - Where a video is read from: a file, or a member of a
+ * tar shard.
+ * @path: Path of the video, or of the tar shard holding it.
+ * @member: Name of the video in the shard at `path`, or NULL.
+ * @offset: If `member` is NULL and `length` is non-negative, the byte offset
+ * of the video in the shard at `path`, e.g., from index_shard().
+ * @length: Size of the video in the shard, in bytes, or -1 if the video is
+ * not in a shard, or is found by `member`.
+ */
+struct video_source {
+        char *path;
+        char *member;
+        int64_t offset;
+        int64_t length;
+};
+
+static bool is_shard_source(const struct video_source *source)
+{
+        return (source->member != NULL) || (source->length >= 0);
+}
+
+/**
+ * parse_video_source() - "O&" converter of a `filename` argument to a
+ * struct video_source, whose strings are borrowed from the argument.
+ *
+ * Accepts a path (str or bytes), a (shard path, member name) tuple, or a
+ * (shard path, (offset, length)) tuple.
+ */
+static int parse_video_source(PyObject *obj, void *address)
+{
+        struct video_source *source = address;
+        source->member = NULL;
+        source->offset = 0;
+        source->length = -1;
+
+        PyObject *path = obj;
+        PyObject *member = NULL;
+        if (PyTuple_Check(obj) && (PyTuple_GET_SIZE(obj) == 2)) {
+                path = PyTuple_GET_ITEM(obj, 0);
+                member = PyTuple_GET_ITEM(obj, 1);
+        }
+
+        Py_ssize_t path_size;
+        if (PyUnicode_Check(path)) {
+                source->path = (char *)PyUnicode_AsUTF8AndSize(path,
+                                                               &path_size);
+                if (source->path == NULL)
+                        return 0;
+        } else if (PyBytes_Check(path)) {
+                source->path = PyBytes_AS_STRING(path);
+                path_size = PyBytes_GET_SIZE(path);
+        } else {
+                PyErr_SetString(PyExc_TypeError,
+                                "filename must be a str, or a (shard, member) "
+                                "tuple");
+                return 0;
+        }
+        if (strlen(source->path) != (size_t)path_size) {
+                PyErr_SetString(PyExc_ValueError, "embedded null character");
+                return 0;
+        }
+
+        if (member == NULL)
+                return 1;
+
+        if (PyUnicode_Check(member)) {
+                source->member = (char *)PyUnicode_AsUTF8(member);
+                return (source->member != NULL);
+        }
+
+        if (!PyArg_ParseTuple(member,
+                              "LL;member must be a name or (offset, length)",
+                              &source->offset,
+                              &source->length))
+                return 0;
+        if ((source->offset < 0) || (source->length < 0)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "member offset and length must be "
+                                "non-negative");
+                return 0;
+        }
+
+        return 1;
+}
+
+/**
+ * copy_video_source() - Copies `source` into `dest`, with strings owned by
+ * `dest`, for use without the GIL. Release with free_video_source().
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+copy_video_source(struct video_source *dest, const struct video_source *source)
+{
+        *dest = *source;
+        dest->path = NULL;
+        dest->member = NULL;
+
+        size_t path_size = strlen(source->path) + 1;
+        dest->path = PyMem_RawMalloc(path_size);
+        if (dest->path == NULL) {
+                PyErr_NoMemory();
+                return -1;
+        }
+        memcpy(dest->path, source->path, path_size);
+
+        if (source->member == NULL)
+                return 0;
+
+        size_t member_size = strlen(source->member) + 1;
+        dest->member = PyMem_RawMalloc(member_size);
+        if (dest->member == NULL) {
+                PyErr_NoMemory();
+                return -1;
+        }
+        memcpy(dest->member, source->member, member_size);
+
+        return 0;
+}
+
+static void free_video_source(struct video_source *source)
+{
+        PyMem_RawFree(source->path);
+        PyMem_RawFree(source->member);
+        source->path = NULL;
+        source->member = NULL;
+}
+
+/**
+ * open_shard_member() - Sets up `vid_ctx->file` to read the video of a shard
+ * `source` from the shard's file descriptor.
+ *
+ * Returns true on success. On failure, the error is set in `vid_ctx`.
+ */
+static bool
+open_shard_member(struct video_stream_context *vid_ctx,
+                  const struct video_source *source,
+                  enum file_io_backend backend)
+{
+        vid_ctx->shard = tar_shard_get(source->path,
+                                       source->member != NULL,
+                                       vid_ctx->error_buf,
+                                       sizeof(vid_ctx->error_buf));
+        if (vid_ctx->shard == NULL) {
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = vid_ctx->error_buf;
+                return false;
+        }
+
+        int64_t offset = source->offset;
+        int64_t length = source->length;
+        if (source->member != NULL) {
+                const struct tar_member *member =
+                        tar_shard_find(vid_ctx->shard, source->member);
+                if (member == NULL) {
+                        snprintf(vid_ctx->error_buf,
+                                 sizeof(vid_ctx->error_buf),
+                                 "%s: no member %s",
+                                 source->path,
+                                 source->member);
+                        vid_ctx->error_type = PyExc_FileNotFoundError;
+                        vid_ctx->error_msg = vid_ctx->error_buf;
+                        return false;
+                }
+                offset = member->offset;
+                length = member->length;
+        } else if (offset + length > tar_shard_size(vid_ctx->shard)) {
+                vid_ctx->error_type = PyExc_ValueError;
+                vid_ctx->error_msg = "member range is past the end of the shard";
+                return false;
+        }
+
+        /* NOTE: Shard members are always read through a file_reader. */
+        if (backend == FILE_IO_FFMPEG)
+                backend = FILE_IO_PREAD;
+
+        int32_t status = open_file_range_reader(&vid_ctx->file,
+                                                tar_shard_fd(vid_ctx->shard),
+                                                offset,
+                                                length,
+                                                backend);
+        if (status < 0) {
+                av_strerror(status,
+                            vid_ctx->error_buf,
+                            sizeof(vid_ctx->error_buf));
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = vid_ctx->error_buf;
+                return false;
+        }
+
+        return true;
+}
+
 /**
  * setup_vid_stream_context() - Fills in the members of `vid_ctx` by allocating
  * and setting up FFmpeg contexts through libavformat and libavcodec.
  * @vid_ctx: Output video_stream_context to be filled in.
  * @input_buf: buffer_data structure injected into `vid_ctx`, which should have
  * the same lifetime as `vid_ctx`.
+ * @timeout_ms: Deadline for the whole call, in milliseconds.
+ * @fast_open: Skip stream info probing when the container header is complete.
+ * See find_video_stream_info().
+ * @should_export_mvs: Open the decoder to export motion vectors.
  *
  * LOADVID_ERR_STREAM_INDEX is returned if the video corresponding to
  * `input_buf`'s stream index was not found. For other errors, LOADVID_ERR is
@@ -108,12 +591,17 @@ alloc_pyarray(const uint32_t out_size_bytes)
 /* rewrite setup_vid_stream_context fun by read filename */
 static int32_t
 setup_vid_stream_context_filename(struct video_stream_context *vid_ctx,
-                         const char *filename, int32_t timeout)
+                         const struct video_source *source, int32_t timeout_ms,
+                         bool fast_open, bool should_export_mvs)
 {
-        vid_ctx->timeout_sec = timeout;
         vid_ctx->error_type = NULL;
-        vid_ctx->decode_time = time(NULL);
-    
+        vid_ctx->audio = NULL;
+        vid_ctx->motion = NULL;
+        vid_ctx->file = NULL;
+        vid_ctx->shard = NULL;
+        vid_ctx->rgb_kernel = __atomic_load_n(&rgb_kernel, __ATOMIC_RELAXED);
+        set_decode_deadline(vid_ctx, timeout_ms);
+
         vid_ctx->format_context = avformat_alloc_context();
         if (vid_ctx->format_context == NULL) {
                 vid_ctx->error_type = PyExc_IOError;
@@ -122,19 +610,43 @@ setup_vid_stream_context_filename(struct video_stream_context *vid_ctx,
         }
 
         
-        vid_ctx->format_context->interrupt_callback.callback = interrupt_callback;
+        vid_ctx->format_context->interrupt_callback.callback = decode_interrupt_callback;
         vid_ctx->format_context->interrupt_callback.opaque = vid_ctx;
+        if (fast_open)
+                set_fast_open_limits(vid_ctx->format_context);
+
+        /**
+         * NOTE: With a custom file I/O backend, regular files are read
+         * through a file_reader, and anything else, e.g., URLs, is left to
+         * FFmpeg's protocols.
+         */
+        enum file_io_backend backend = __atomic_load_n(&file_io_backend,
+                                                       __ATOMIC_RELAXED);
+        const char *filename = source->path;
+        if (is_shard_source(source)) {
+                if (!open_shard_member(vid_ctx, source, backend))
+                        goto clean_up_format_context;
+                vid_ctx->format_context->pb = file_reader_avio(vid_ctx->file);
 
+                /* NOTE: The member name lets the demuxer probe by extension. */
+                if (source->member != NULL)
+                        filename = source->member;
+        } else if ((backend != FILE_IO_FFMPEG) &&
+                   (open_file_reader(&vid_ctx->file, filename, backend) == 0)) {
+                vid_ctx->format_context->pb = file_reader_avio(vid_ctx->file);
+        }
 
-        char buf[1024];
         int32_t status = avformat_open_input(&vid_ctx->format_context, filename,
                                               NULL, NULL);
         if (status !=0 )
         {
-                av_strerror(status, buf, 1024);
+                av_strerror(status,
+                            vid_ctx->error_buf,
+                            sizeof(vid_ctx->error_buf));
 //                 printf("Cannot open the file, error code=%d, error message: %s\n", status, buf);
                 vid_ctx->error_type = PyExc_IOError;
-                vid_ctx->error_msg = buf;
+                vid_ctx->error_msg = vid_ctx->error_buf;
+                close_video_input(vid_ctx);
                 return LOADVID_ERR;
         }
 
@@ -142,7 +654,7 @@ setup_vid_stream_context_filename(struct video_stream_context *vid_ctx,
         /*
         * Retrieve stream information
         */
-        if (avformat_find_stream_info(vid_ctx->format_context, NULL) < 0) {
+        if (find_video_stream_info(vid_ctx->format_context, fast_open) < 0) {
 //                 printf("Stream index not found.\n");
                 vid_ctx->error_type = PyExc_ValueError;
                 vid_ctx->error_msg = "stream index not found.";
@@ -165,12 +677,13 @@ setup_vid_stream_context_filename(struct video_stream_context *vid_ctx,
         if (stream_index >= vid_ctx->format_context->nb_streams) {
                 vid_ctx->error_type = PyExc_IOError;
                 vid_ctx->error_msg = "format context nb_streams not found.";
-                return VID_DECODE_FFMPEG_ERR;
+                goto clean_up_format_context;
         }
         vid_ctx->video_stream_index = stream_index;
 
         video_stream = vid_ctx->format_context->streams[vid_ctx->video_stream_index];
-        vid_ctx->codec_context = open_video_codec_ctx(video_stream);
+        vid_ctx->codec_context = codec_pool_get(video_stream,
+                                                should_export_mvs);
         if (vid_ctx->codec_context == NULL) {
                 vid_ctx->error_type = PyExc_IOError;
                 vid_ctx->error_msg = "codec_context not found.";
@@ -180,7 +693,7 @@ setup_vid_stream_context_filename(struct video_stream_context *vid_ctx,
         if (vid_ctx->codec_context->pix_fmt == AV_PIX_FMT_NONE) {
                 vid_ctx->error_type = PyExc_IOError;
                 vid_ctx->error_msg = "codec context AV_PIX_FMT_NONE error.";
-                goto clean_up_format_context;
+                goto clean_up_avcodec;
         }
 
         if ((video_stream->duration <= 0) || (video_stream->nb_frames <= 0)) {
@@ -207,7 +720,7 @@ setup_vid_stream_context_filename(struct video_stream_context *vid_ctx,
 //                         printf("Read video frame rate error.");
                         vid_ctx->error_type = PyExc_ValueError;
                         vid_ctx->error_msg = "read video frame rate error.";
-                        goto clean_up_format_context;
+                        goto clean_up_avcodec;
                 }
 
                 enum AVRounding rnd = (enum AVRounding)(AV_ROUND_DOWN |
@@ -247,7 +760,7 @@ setup_vid_stream_context_filename(struct video_stream_context *vid_ctx,
                 vid_ctx->nb_frames = video_stream->nb_frames;
         }
 
-        vid_ctx->frame = av_frame_alloc();
+        vid_ctx->frame = pool_frame_get();
         if (vid_ctx->frame == NULL) {
                 vid_ctx->error_type = PyExc_IOError;
                 vid_ctx->error_msg = "vid_ctx frame not found";
@@ -257,10 +770,9 @@ setup_vid_stream_context_filename(struct video_stream_context *vid_ctx,
         return LOADVID_SUCCESS;
 
 clean_up_avcodec:
-        avcodec_close(vid_ctx->codec_context);
-        avcodec_free_context(&vid_ctx->codec_context);
+        codec_pool_put(&vid_ctx->codec_context);
 clean_up_format_context:
-        avformat_close_input(&vid_ctx->format_context);
+        close_video_input(vid_ctx);
 
         return LOADVID_ERR;
 }
@@ -268,15 +780,66 @@ clean_up_format_context:
 
 
 
+/**
+ * open_vid_stream_context() - Opens `source` into `vid_ctx` as
+ * setup_vid_stream_context_filename() does, but takes an idle handle of the
+ * file from the handle cache instead if there is one.
+ *
+ * Handles opened here go back to the cache when released by
+ * clean_up_vid_ctx(), if the cache is enabled. Members of tar shards are not
+ * cached, since their shard already keeps the file open.
+ */
+static int32_t
+open_vid_stream_context(struct video_stream_context *vid_ctx,
+                        const struct video_source *source,
+                        int32_t timeout_ms,
+                        bool fast_open,
+                        bool should_export_mvs)
+{
+        set_decode_deadline(vid_ctx, timeout_ms);
+        if (is_shard_source(source)) {
+                vid_ctx->cache_key = NULL;
+                return setup_vid_stream_context_filename(vid_ctx,
+                                                         source,
+                                                         timeout_ms,
+                                                         fast_open,
+                                                         should_export_mvs);
+        }
+
+        if (handle_cache_get(vid_ctx,
+                             source->path,
+                             should_export_mvs,
+                             fast_open)) {
+                vid_ctx->rgb_kernel = __atomic_load_n(&rgb_kernel,
+                                                      __ATOMIC_RELAXED);
+                return LOADVID_SUCCESS;
+        }
+
+        int32_t status = setup_vid_stream_context_filename(vid_ctx,
+                                                           source,
+                                                           timeout_ms,
+                                                           fast_open,
+                                                           should_export_mvs);
+        if (status != LOADVID_SUCCESS)
+                handle_cache_free_key(vid_ctx);
+
+        return status;
+}
+
 static void
 clean_up_vid_ctx(struct video_stream_context *vid_ctx)
 {
-        av_frame_free(&vid_ctx->frame);
-        avcodec_close(vid_ctx->codec_context);
-        avcodec_free_context(&vid_ctx->codec_context);
-        // av_freep(&vid_ctx->format_context->pb->buffer);
-        // av_freep(&vid_ctx->format_context->pb);
-        avformat_close_input(&vid_ctx->format_context);
+        if (vid_ctx->audio != NULL) {
+                close_audio_stream(vid_ctx->audio);
+                free(vid_ctx->audio);
+                vid_ctx->audio = NULL;
+        }
+        if (handle_cache_put(vid_ctx))
+                return;
+
+        pool_frame_put(&vid_ctx->frame);
+        codec_pool_put(&vid_ctx->codec_context);
+        close_video_input(vid_ctx);
 }
 
 /**
@@ -318,80 +881,498 @@ get_vid_width_height(uint32_t *width,
         return is_size_dynamic;
 }
 
-static PyObject *
-loadvid_frame_nums(PyObject *self, PyObject *args, PyObject *kw)
+/**
+ * attach_audio_stream() - Opens the audio stream of the opened `vid_ctx`, to
+ * be decoded from the packets demuxed for the video stream.
+ * @sample_rate: Output sample rate, in Hz.
+ * @num_channels: Number of output channels.
+ *
+ * If the file has no audio stream, `vid_ctx->audio` is left NULL, and the
+ * audio result is None. Does not touch the Python C API. Returns true on
+ * success, and false with the error set in `vid_ctx` otherwise.
+ */
+static bool
+attach_audio_stream(struct video_stream_context *vid_ctx,
+                    int32_t sample_rate,
+                    int32_t num_channels)
 {
-        PyObject *result = NULL;
-
-        const char *filename = NULL;
+        struct audio_stream_context *audio =
+                calloc(1, sizeof(struct audio_stream_context));
+        if (audio == NULL) {
+                vid_ctx->error_type = PyExc_MemoryError;
+                vid_ctx->error_msg = "out of memory for audio context";
+                return false;
+        }
 
-        PyObject *frame_nums = NULL;
-        uint32_t width = 0;
-        uint32_t height = 0;
+        int32_t status = open_audio_stream(audio,
+                                           vid_ctx->format_context,
+                                           sample_rate,
+                                           num_channels);
+        if (status < 0) {
+                close_audio_stream(audio);
+                free(audio);
+                if (status == AVERROR_STREAM_NOT_FOUND)
+                        return true;
 
-        // resize
-        uint32_t resize = 0;
-        uint32_t rewidth = 0;
-        uint32_t reheight = 0;
+                vid_ctx->error_type = PyExc_IOError;
+                vid_ctx->error_msg = "open audio stream error.";
+                return false;
+        }
+        vid_ctx->audio = audio;
 
-        /* NOTE(brendan): should_seek must be int (not bool) because Python. */
-        int32_t should_seek = false;
-        int32_t should_key = false;
-        
-        /*timeout*/
-        int32_t timeout = 0;
-            
-        static char *kwlist[] = {"filename",
-                                 "frame_nums",
-                                 "width",
-                                 "height",
-                                 "resize",
-                                 "should_key",
-                                 "should_seek",
-                                 "timeout",
-                                 0};
+        return true;
+}
 
-        if (!PyArg_ParseTupleAndKeywords(args,
-                                         kw,
-                                         "sO|IIIppI:loadvid_frame_nums",
-                                         kwlist,
-                                         &filename,
-                                         &frame_nums,
-                                         &width,
-                                         &height,
-                                         &resize,
-                                         &should_key,
-                                         &should_seek,
-                                         &timeout))
-                return NULL;
+/**
+ * start_audio_span() - Sets the span of audio to decode alongside the video
+ * frames, from the start of the frame at stream timestamp `start_timestamp`,
+ * for `num_frames` frames of `frame_seconds` each.
+ *
+ * Does nothing if there is no audio. Returns false with the error set in
+ * `vid_ctx` if out of memory.
+ */
+static bool
+start_audio_span(struct video_stream_context *vid_ctx,
+                 int64_t start_timestamp,
+                 double num_frames,
+                 double frame_seconds)
+{
+        if (vid_ctx->audio == NULL)
+                return true;
 
-        if (!PySequence_Check(frame_nums)) {
-                PyErr_SetString(PyExc_TypeError,
-                                "frame_nums needs to be a sequence");
-                return NULL;
+        AVStream *video_stream =
+                vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        double start_seconds = start_timestamp*av_q2d(video_stream->time_base);
+        if (set_audio_span(vid_ctx->audio,
+                           start_seconds,
+                           start_seconds + num_frames*frame_seconds) < 0) {
+                vid_ctx->error_type = PyExc_MemoryError;
+                vid_ctx->error_msg = "out of memory for audio samples";
+                return false;
         }
-        if (should_key)
-                should_seek = false;
-    
-        if (timeout <= 0)
-                timeout = DEFAULT_TIMEOUT_SEC;
-
-        struct video_stream_context vid_ctx;
-        int32_t status = setup_vid_stream_context_filename(&vid_ctx, filename, timeout);
 
-        if (status != LOADVID_SUCCESS) {
-                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
-                return NULL;
-        }
+        return true;
+}
 
-        bool is_size_dynamic = get_vid_width_height(&width,
-                                                    &height,
-                                                    &vid_ctx);
-    
-        if (vid_ctx.error_type != NULL) {
-                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
-                return NULL;
+/**
+ * finish_audio_span() - Decodes the audio left in the span after the video
+ * frames have been decoded, unless decoding the video failed.
+ */
+static void
+finish_audio_span(struct video_stream_context *vid_ctx)
+{
+        if ((vid_ctx->audio != NULL) && (vid_ctx->error_type == NULL))
+                decode_audio_to_span_end(vid_ctx);
+}
+
+/**
+ * get_frame_seconds() - Returns the average duration of a frame of the video
+ * stream, in seconds, as used to convert frame indices to timestamps.
+ */
+static double
+get_frame_seconds(struct video_stream_context *vid_ctx)
+{
+        AVStream *video_stream =
+                vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        if (vid_ctx->nb_frames <= 0)
+                return 0.0;
+
+        return ((double)vid_ctx->duration/vid_ctx->nb_frames)*
+                av_q2d(video_stream->time_base);
+}
+
+/**
+ * audio_to_pyobject() - Returns a new reference to a bytearray of the
+ * interleaved float32 samples decoded for `vid_ctx`, or to None if the video
+ * has no audio stream.
+ */
+static PyObject *
+audio_to_pyobject(struct video_stream_context *vid_ctx)
+{
+        struct audio_stream_context *audio = vid_ctx->audio;
+        if (audio == NULL)
+                Py_RETURN_NONE;
+
+        return PyByteArray_FromStringAndSize(
+                (const char *)audio->samples,
+                audio->num_samples*audio->num_channels*sizeof(float));
+}
+
+/**
+ * struct output_scale - One of the output resolutions of a request with
+ * `sizes`.
+ * @width: Width of the frames of this scale.
+ * @height: Height of the frames of this scale.
+ * @source: Index of the scale this one is rescaled from, or -1 for the scale
+ * the video is decoded to.
+ * @output: Buffer holding the frames of this scale.
+ */
+struct output_scale {
+        uint32_t width;
+        uint32_t height;
+        int32_t source;
+        struct output_buffer output;
+};
+
+/**
+ * struct frames_request - Arguments and results of one load_frames() call.
+ * @vid_ctx: Context of the video, opened by open_frames_request().
+ * @source: Copy of where the video is read from, owned by the request.
+ * @frame_nums: Frame indices to decode, or NULL if `seconds` is set.
+ * @seconds: Times to decode the frames shown at, in seconds from the start of
+ * the video stream, or NULL if `frame_nums` is set.
+ * @num_frames: Length of `frame_nums` or `seconds`.
+ * @timeout_ms: Deadline for the whole request, in milliseconds.
+ * @rewidth: Width of the output frames, set by open_frames_request().
+ * @reheight: Height of the output frames, set by open_frames_request().
+ * @is_size_dynamic: Set by open_frames_request() iff the size was read from
+ * the video rather than passed in.
+ * @num_decoded: Number of frames filled, set by decode_frames_request().
+ * @output: Buffer the frames are decoded into.
+ * @inline_items: Storage for `frame_nums` or `seconds` of short requests.
+ * @audio_rate: If positive, also decode the audio spanned by the frames, at
+ * this sample rate.
+ * @audio_channels: Number of channels of the audio output.
+ * @scales: Output resolutions, in the order of the `sizes` argument.
+ * @num_scales: Length of `scales`, or zero if there is one output, `output`.
+ * @scale_order: Indices of `scales`, largest first. The video is decoded to
+ * `scales[scale_order[0]]`, and the others are derived in this order.
+ * @should_export_mvs: Also output the motion of each frame, from the motion
+ * vectors exported by the decoder.
+ * @motion: Motion field filled while decoding, if `should_export_mvs`.
+ * @motion_output: Buffer holding the motion fields.
+ *
+ * The other members are the arguments of loadvid_frame_nums().
+ *
+ * Everything the decode needs is copied out of the Python arguments by
+ * parse_frames_request(), so that open_frames_request() and
+ * decode_frames_request() can run without the GIL, on any thread.
+ */
+struct frames_request {
+        struct video_stream_context vid_ctx;
+        struct video_source source;
+        int32_t *frame_nums;
+        double *seconds;
+        int32_t num_frames;
+        uint32_t width;
+        uint32_t height;
+        uint32_t resize;
+        bool should_key;
+        bool should_seek;
+        int32_t timeout_ms;
+        int32_t audio_rate;
+        int32_t audio_channels;
+        bool allow_partial;
+        bool fast_open;
+        uint32_t rewidth;
+        uint32_t reheight;
+        bool is_size_dynamic;
+        int32_t num_decoded;
+        struct output_buffer output;
+        struct output_scale scales[MAX_OUTPUT_SCALES];
+        int32_t num_scales;
+        int32_t scale_order[MAX_OUTPUT_SCALES];
+        bool should_export_mvs;
+        struct motion_field motion;
+        struct output_buffer motion_output;
+        union {
+                int32_t frame_nums[FRAMES_REQUEST_INLINE_ITEMS];
+                double seconds[FRAMES_REQUEST_INLINE_ITEMS];
+        } inline_items;
+};
+
+/**
+ * free_frames_request() - Closes the video of `req`, and frees the buffers
+ * and references owned by `req`.
+ */
+static void
+free_frames_request(struct frames_request *req)
+{
+        int32_t i;
+        for (i = 0;
+             i < req->num_scales;
+             ++i)
+                release_output(&req->scales[i].output);
+        release_output(&req->output);
+        free_motion_field(&req->motion);
+        release_output(&req->motion_output);
+        clean_up_vid_ctx(&req->vid_ctx);
+        free_video_source(&req->source);
+        if (req->frame_nums != req->inline_items.frame_nums)
+                PyMem_RawFree(req->frame_nums);
+        if (req->seconds != req->inline_items.seconds)
+                PyMem_RawFree(req->seconds);
+        req->frame_nums = NULL;
+        req->seconds = NULL;
+}
+
+/**
+ * parse_frames_request() - Fills in `req` from the arguments of
+ * load_frames().
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure. Either
+ * way, `req` must be released with free_frames_request().
+ */
+static int32_t
+parse_frames_request(struct frames_request *req,
+                     const struct video_source *source,
+                     PyObject *frame_nums,
+                     uint32_t width,
+                     uint32_t height,
+                     uint32_t resize,
+                     bool should_key,
+                     bool should_seek,
+                     double timeout,
+                     bool allow_partial,
+                     bool fast_open,
+                     double seconds_per_item,
+                     PyObject *out,
+                     int32_t audio_rate,
+                     int32_t audio_channels)
+{
+        memset(req, 0, sizeof(*req));
+        req->audio_rate = audio_rate;
+        req->audio_channels = audio_channels;
+        req->width = width;
+        req->height = height;
+        req->resize = resize;
+        req->should_key = should_key;
+        req->should_seek = should_key ? false : should_seek;
+        req->timeout_ms = timeout_to_ms(timeout);
+        req->allow_partial = allow_partial;
+        req->fast_open = fast_open;
+
+        if ((audio_rate > 0) && (audio_channels <= 0)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "audio_channels must be positive");
+                return -1;
+        }
+
+        /**
+         * NOTE: should_key seeks to each frame, so the audio between frames
+         * is never demuxed, and most of the span would be silence.
+         */
+        if ((audio_rate > 0) && should_key) {
+                PyErr_SetString(PyExc_ValueError,
+                                "audio_rate can't be used with should_key");
+                return -1;
+        }
+
+        if (acquire_output(&req->output, out) < 0)
+                return -1;
+
+        if (!PySequence_Check(frame_nums)) {
+                PyErr_SetString(PyExc_TypeError,
+                                "frame_nums needs to be a sequence");
+                return -1;
+        }
+
+        const Py_ssize_t num_frames = PySequence_Size(frame_nums);
+        if (num_frames < 0)
+                return -1;
+        if (num_frames > INT32_MAX) {
+                PyErr_SetString(PyExc_ValueError, "too many frames requested");
+                return -1;
         }
+        req->num_frames = num_frames;
+
+        if (copy_video_source(&req->source, source) < 0)
+                return -1;
+
+        /**
+         * NOTE: If `seconds_per_item` is positive, the items are converted to
+         * seconds here, and to timestamps in the stream's time base once the
+         * video is open.
+         */
+        bool is_inline = (num_frames <= FRAMES_REQUEST_INLINE_ITEMS);
+        if (seconds_per_item > 0.0)
+                req->seconds = is_inline ?
+                        req->inline_items.seconds :
+                        PyMem_RawMalloc(num_frames*sizeof(double));
+        else
+                req->frame_nums = is_inline ?
+                        req->inline_items.frame_nums :
+                        PyMem_RawMalloc(num_frames*sizeof(int32_t));
+        if ((req->seconds == NULL) && (req->frame_nums == NULL)) {
+                PyErr_NoMemory();
+                return -1;
+        }
+
+        Py_ssize_t i;
+        for (i = 0;
+             i < num_frames;
+             ++i) {
+                PyObject *item = PySequence_GetItem(frame_nums, i);
+                if (item == NULL)
+                        return -1;
+
+                if (req->seconds != NULL)
+                        req->seconds[i] = PyFloat_AsDouble(item)*seconds_per_item;
+                else
+                        req->frame_nums[i] = PyLong_AsLong(item);
+                Py_DECREF(item);
+                if (PyErr_Occurred())
+                        return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * parse_frame_size() - Reads one item of `sizes`: an int for square frames,
+ * or a (width, height) pair.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+parse_frame_size(uint32_t *width, uint32_t *height, PyObject *item)
+{
+        long item_width;
+        long item_height;
+
+        if (PyLong_Check(item)) {
+                item_width = PyLong_AsLong(item);
+                item_height = item_width;
+        } else if (!PyArg_ParseTuple(item,
+                                     "ll;sizes items must be ints or (width, height) pairs",
+                                     &item_width,
+                                     &item_height)) {
+                return -1;
+        }
+        if (PyErr_Occurred())
+                return -1;
+
+        if ((item_width <= 0) || (item_height <= 0) ||
+            (item_width > UINT16_MAX) || (item_height > UINT16_MAX)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "sizes must be positive and at most 65535");
+                return -1;
+        }
+        *width = item_width;
+        *height = item_height;
+
+        return 0;
+}
+
+/**
+ * parse_frame_sizes() - Sets the output resolutions of `req` from the `sizes`
+ * argument, and picks the scale each one is derived from.
+ *
+ * Scales are visited largest first. Each is rescaled from the smallest scale
+ * visited so far that is at least as large in both dimensions, so that a
+ * pyramid is built level by level, and from the decoded scale otherwise.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+parse_frame_sizes(struct frames_request *req, PyObject *sizes)
+{
+        if ((sizes == NULL) || (sizes == Py_None))
+                return 0;
+
+        if (req->output.is_external) {
+                PyErr_SetString(PyExc_ValueError,
+                                "out can't be combined with sizes");
+                return -1;
+        }
+
+        PyObject *sizes_seq = PySequence_Fast(sizes,
+                                              "sizes needs to be a sequence");
+        if (sizes_seq == NULL)
+                return -1;
+
+        int32_t status = -1;
+        Py_ssize_t num_scales = PySequence_Fast_GET_SIZE(sizes_seq);
+        if ((num_scales == 0) || (num_scales > MAX_OUTPUT_SCALES)) {
+                PyErr_Format(PyExc_ValueError,
+                             "sizes needs between 1 and %d items",
+                             MAX_OUTPUT_SCALES);
+                goto out_decref_sizes;
+        }
+
+        int32_t i;
+        for (i = 0;
+             i < num_scales;
+             ++i) {
+                struct output_scale *scale = &req->scales[i];
+                if (parse_frame_size(&scale->width,
+                                     &scale->height,
+                                     PySequence_Fast_GET_ITEM(sizes_seq, i)) < 0)
+                        goto out_decref_sizes;
+        }
+        req->num_scales = num_scales;
+
+        for (i = 0;
+             i < num_scales;
+             ++i) {
+                int32_t j = i;
+                uint64_t area = (uint64_t)req->scales[i].width*
+                                req->scales[i].height;
+                while ((j > 0) &&
+                       ((uint64_t)req->scales[req->scale_order[j - 1]].width*
+                        req->scales[req->scale_order[j - 1]].height < area)) {
+                        req->scale_order[j] = req->scale_order[j - 1];
+                        --j;
+                }
+                req->scale_order[j] = i;
+        }
+
+        req->scales[req->scale_order[0]].source = -1;
+        for (i = 1;
+             i < num_scales;
+             ++i) {
+                struct output_scale *scale = &req->scales[req->scale_order[i]];
+                scale->source = req->scale_order[0];
+
+                int32_t j;
+                for (j = 0;
+                     j < i;
+                     ++j) {
+                        const struct output_scale *larger =
+                                &req->scales[req->scale_order[j]];
+                        if ((larger->width >= scale->width) &&
+                            (larger->height >= scale->height))
+                                scale->source = req->scale_order[j];
+                }
+        }
+
+        status = 0;
+
+out_decref_sizes:
+        Py_DECREF(sizes_seq);
+
+        return status;
+}
+
+/**
+ * open_frames_request() - Opens the video of `req`, and sets the size of its
+ * output frames.
+ *
+ * Does not touch the Python C API, so may be called without the GIL. Returns
+ * true on success. On failure, the error is set in `req->vid_ctx`.
+ */
+static bool
+open_frames_request(struct frames_request *req)
+{
+        struct video_stream_context *vid_ctx = &req->vid_ctx;
+
+        int32_t status = open_vid_stream_context(vid_ctx,
+                                                 &req->source,
+                                                 req->timeout_ms,
+                                                 req->fast_open,
+                                                 req->should_export_mvs);
+        if (status != LOADVID_SUCCESS)
+                return false;
+
+        file_reader_advise(vid_ctx->file,
+                           req->should_key ? FILE_ACCESS_RANDOM :
+                                             FILE_ACCESS_SEQUENTIAL);
+
+        req->is_size_dynamic = get_vid_width_height(&req->width,
+                                                    &req->height,
+                                                    vid_ctx);
+        if (vid_ctx->error_type != NULL)
+                return false;
 
         /**
          * TODO(brendan): There is a hole in the logic here, where a bad status
@@ -401,278 +1382,3596 @@ loadvid_frame_nums(PyObject *self, PyObject *args, PyObject *kw)
          * It is safer to pass the width and height as arguments, if there is a
          * possibility that videos in the dataset have no video stream.
          */
-        if (resize == 0) {
-                rewidth = width;
-                reheight = height;
+        if (req->num_scales > 0) {
+                const struct output_scale *decoded =
+                        &req->scales[req->scale_order[0]];
+                req->rewidth = decoded->width;
+                req->reheight = decoded->height;
+        } else if (req->resize == 0) {
+                req->rewidth = req->width;
+                req->reheight = req->height;
         }
         else
         {
-                if (width < height) {
-                        rewidth = resize;
-                        reheight = (uint32_t)(resize * height / width);
+                if (req->width < req->height) {
+                        req->rewidth = req->resize;
+                        req->reheight = (uint32_t)(req->resize*req->height/req->width);
                 } else {
-                        reheight = resize;
-                        rewidth = (uint32_t)(resize * width / height);
+                        req->reheight = req->resize;
+                        req->rewidth = (uint32_t)(req->resize*req->width/req->height);
+                }
+        }
+
+        if ((req->audio_rate > 0) &&
+            !attach_audio_stream(vid_ctx, req->audio_rate, req->audio_channels))
+                return false;
+
+        return true;
+}
+
+/**
+ * prepare_frames_output() - Prepares the output of an opened `req` to hold
+ * its frames.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+prepare_frames_output(struct frames_request *req)
+{
+        if (req->should_export_mvs) {
+                if (prepare_output(&req->motion_output,
+                                   motion_field_size_bytes(req->num_frames,
+                                                           req->rewidth,
+                                                           req->reheight)) < 0)
+                        return -1;
+
+                AVCodecContext *codec_context = req->vid_ctx.codec_context;
+                if (init_motion_field(&req->motion,
+                                      (float *)req->motion_output.data,
+                                      req->num_frames,
+                                      codec_context->width,
+                                      codec_context->height,
+                                      req->rewidth,
+                                      req->reheight) < 0) {
+                        PyErr_NoMemory();
+                        return -1;
+                }
+                req->vid_ctx.motion = &req->motion;
+
+                const Py_ssize_t motion_shape[] = {req->num_frames,
+                                                   req->motion.grid_height,
+                                                   req->motion.grid_width,
+                                                   2};
+                set_output_shape(&req->motion_output, 4, motion_shape, 'f');
+        }
+
+        if (req->num_scales == 0) {
+                if (prepare_output(&req->output,
+                                   req->num_frames*req->rewidth*req->reheight*3) < 0)
+                        return -1;
+                set_frames_shape(&req->output,
+                                 req->num_frames,
+                                 req->rewidth,
+                                 req->reheight);
+
+                return 0;
+        }
+
+        int32_t i;
+        for (i = 0;
+             i < req->num_scales;
+             ++i) {
+                struct output_scale *scale = &req->scales[i];
+                if (prepare_output(&scale->output,
+                                   req->num_frames*scale->width*scale->height*3) < 0)
+                        return -1;
+                set_frames_shape(&scale->output,
+                                 req->num_frames,
+                                 scale->width,
+                                 scale->height);
+        }
+
+        return 0;
+}
+
+/**
+ * finish_frames_outputs() - Completes the outputs of `req` that are built
+ * from the decoded frames: the derived scales, and the motion fields of
+ * looped frames.
+ *
+ * Does not touch the Python C API. Errors are set in `req->vid_ctx`.
+ */
+static void
+finish_frames_outputs(struct frames_request *req)
+{
+        if (req->vid_ctx.motion != NULL)
+                loop_motion_field(req->vid_ctx.motion, req->num_decoded);
+
+        int32_t i;
+        for (i = 1;
+             i < req->num_scales;
+             ++i) {
+                struct output_scale *scale = &req->scales[req->scale_order[i]];
+                const struct output_scale *source = &req->scales[scale->source];
+                if (scale_rgb_frames(scale->output.data,
+                                     scale->width,
+                                     scale->height,
+                                     source->output.data,
+                                     source->width,
+                                     source->height,
+                                     req->num_decoded) != VID_DECODE_SUCCESS) {
+                        req->vid_ctx.error_type = PyExc_IOError;
+                        req->vid_ctx.error_msg = "rescale frames error";
+                        return;
+                }
+        }
+}
+
+/**
+ * decode_frames_request() - Decodes the frames of an opened `req` into its
+ * output, which was readied by prepare_frames_output().
+ *
+ * Does not touch the Python C API, so may be called without the GIL. Errors
+ * are set in `req->vid_ctx`.
+ */
+static void
+decode_frames_request(struct frames_request *req)
+{
+        struct video_stream_context *vid_ctx = &req->vid_ctx;
+        uint8_t *dest = req->output.data;
+        if (req->num_scales > 0)
+                dest = req->scales[req->scale_order[0]].output.data;
+
+        if (req->frame_nums != NULL) {
+                if ((vid_ctx->audio != NULL) && (req->num_frames > 0)) {
+                        int32_t first = req->frame_nums[0];
+                        int32_t last = req->frame_nums[0];
+                        int32_t i;
+                        for (i = 1;
+                             i < req->num_frames;
+                             ++i) {
+                                if (req->frame_nums[i] < first)
+                                        first = req->frame_nums[i];
+                                if (req->frame_nums[i] > last)
+                                        last = req->frame_nums[i];
+                        }
+
+                        double frame_seconds = get_frame_seconds(vid_ctx);
+                        if (!start_audio_span(
+                                    vid_ctx,
+                                    seconds_to_stream_timestamp(vid_ctx,
+                                                                first*frame_seconds),
+                                    last - first + 1,
+                                    frame_seconds))
+                                return;
+                }
+
+                req->num_decoded = decode_video_from_frame_nums(dest,
+                                                                vid_ctx,
+                                                                req->num_frames,
+                                                                req->frame_nums,
+                                                                &req->rewidth,
+                                                                &req->reheight,
+                                                                req->should_key,
+                                                                req->should_seek);
+                finish_frames_outputs(req);
+                finish_audio_span(vid_ctx);
+                return;
+        }
+
+        int64_t inline_timestamps[FRAMES_REQUEST_INLINE_ITEMS];
+        int64_t *timestamps = inline_timestamps;
+        if (req->num_frames > FRAMES_REQUEST_INLINE_ITEMS)
+                timestamps = PyMem_RawMalloc(req->num_frames*sizeof(int64_t));
+        if (timestamps == NULL) {
+                vid_ctx->error_type = PyExc_MemoryError;
+                vid_ctx->error_msg = "out of memory for timestamps";
+                return;
+        }
+
+        int32_t i;
+        for (i = 0;
+             i < req->num_frames;
+             ++i)
+                timestamps[i] = seconds_to_stream_timestamp(vid_ctx,
+                                                            req->seconds[i]);
+
+        /**
+         * NOTE: Times are non-decreasing (decode_video_from_timestamps()
+         * rejects them otherwise), so the span runs from the first to one
+         * frame past the last.
+         */
+        if ((req->num_frames > 0) &&
+            !start_audio_span(vid_ctx,
+                              timestamps[0],
+                              1.0,
+                              req->seconds[req->num_frames - 1] -
+                              req->seconds[0] +
+                              get_frame_seconds(vid_ctx)))
+                goto out_free_timestamps;
+
+        req->num_decoded = decode_video_from_timestamps(dest,
+                                                        vid_ctx,
+                                                        req->num_frames,
+                                                        timestamps,
+                                                        req->rewidth,
+                                                        req->reheight,
+                                                        req->should_seek);
+        finish_frames_outputs(req);
+        finish_audio_span(vid_ctx);
+
+out_free_timestamps:
+        if (timestamps != inline_timestamps)
+                PyMem_RawFree(timestamps);
+}
+
+/**
+ * scales_to_pyobject() - Returns a new reference to a list of the outputs of
+ * the scales of `req`, in the order of the `sizes` argument. With
+ * `allow_partial`, each output is truncated to the frames decoded.
+ */
+static PyObject *
+scales_to_pyobject(struct frames_request *req)
+{
+        PyObject *outputs = PyList_New(req->num_scales);
+        if (outputs == NULL)
+                return NULL;
+
+        int32_t i;
+        for (i = 0;
+             i < req->num_scales;
+             ++i) {
+                struct output_scale *scale = &req->scales[i];
+                if (req->allow_partial &&
+                    (truncate_output(&scale->output,
+                                     req->num_decoded,
+                                     scale->width*scale->height*3) < 0)) {
+                        Py_DECREF(outputs);
+                        return NULL;
                 }
+
+                Py_INCREF(scale->output.obj);
+                PyList_SET_ITEM(outputs, i, scale->output.obj);
+        }
+
+        return outputs;
+}
+
+/**
+ * frames_request_video_result() - Builds the frames part of the result of
+ * loadvid_frame_nums() from the decoded output of `req`.
+ *
+ * Returns a new reference, or NULL with a Python exception set if the decode
+ * failed.
+ */
+static PyObject *
+frames_request_video_result(struct frames_request *req)
+{
+        struct video_stream_context *vid_ctx = &req->vid_ctx;
+        PyObject *frames = req->output.obj;
+
+        /**
+         * NOTE: With `allow_partial`, a deadline that passes part way through
+         * decoding returns the frames decoded so far, rather than raising.
+         */
+        if ((vid_ctx->error_type != NULL) &&
+            !(req->allow_partial && (vid_ctx->error_type == PyExc_TimeoutError))) {
+                PyErr_SetString(vid_ctx->error_type, vid_ctx->error_msg);
+                return NULL;
+        }
+
+        if (req->num_scales > 0) {
+                PyObject *outputs = scales_to_pyobject(req);
+                if ((outputs == NULL) || !req->allow_partial)
+                        return outputs;
+
+                return Py_BuildValue("Ni", outputs, req->num_decoded);
+        }
+
+        bool should_return_size = req->is_size_dynamic || (req->resize != 0);
+        if (req->allow_partial) {
+                if (truncate_output(&req->output,
+                                    req->num_decoded,
+                                    req->rewidth*req->reheight*3) < 0)
+                        return NULL;
+
+                if (!should_return_size)
+                        return Py_BuildValue("Oi", frames, req->num_decoded);
+
+                return Py_BuildValue("Oiii",
+                                     frames,
+                                     req->rewidth,
+                                     req->reheight,
+                                     req->num_decoded);
         }
 
-        const Py_ssize_t num_frames = PySequence_Size(frame_nums);
-        PyByteArrayObject *frames = alloc_pyarray(num_frames*rewidth*reheight*3);
-        if (PyErr_Occurred() || (frames == NULL))
-                return (PyObject *)frames;
+        if (!should_return_size) {
+                Py_INCREF(frames);
+                return frames;
+        }
+
+        return Py_BuildValue("Oii", frames, req->rewidth, req->reheight);
+}
+
+/**
+ * frames_request_result() - Builds the result of loadvid_frame_nums() from
+ * the decoded output of `req`: the frames result, or with audio or motion, a
+ * tuple of the frames result, then the audio, then the motion fields.
+ *
+ * Returns a new reference, or NULL with a Python exception set if the decode
+ * failed.
+ */
+static PyObject *
+frames_request_result(struct frames_request *req)
+{
+        PyObject *video = frames_request_video_result(req);
+        bool should_return_audio = (req->audio_rate > 0);
+        if ((video == NULL) ||
+            (!should_return_audio && !req->should_export_mvs))
+                return video;
+
+        PyObject *result = PyTuple_New(1 +
+                                       should_return_audio +
+                                       req->should_export_mvs);
+        if (result == NULL) {
+                Py_DECREF(video);
+                return NULL;
+        }
+        Py_ssize_t item_index = 0;
+        PyTuple_SET_ITEM(result, item_index++, video);
+
+        if (should_return_audio) {
+                PyObject *audio = audio_to_pyobject(&req->vid_ctx);
+                if (audio == NULL)
+                        goto err_decref_result;
+                PyTuple_SET_ITEM(result, item_index++, audio);
+        }
+
+        if (req->should_export_mvs) {
+                uint32_t motion_bytes_per_frame =
+                        motion_field_size_bytes(1, req->rewidth, req->reheight);
+                if (req->allow_partial &&
+                    (truncate_output(&req->motion_output,
+                                     req->num_decoded,
+                                     motion_bytes_per_frame) < 0))
+                        goto err_decref_result;
+
+                Py_INCREF(req->motion_output.obj);
+                PyTuple_SET_ITEM(result, item_index++, req->motion_output.obj);
+        }
+
+        return result;
+
+err_decref_result:
+        Py_DECREF(result);
+
+        return NULL;
+}
+
+/**
+ * load_frames() - Decodes the frames in `frame_nums` from `source`, for
+ * loadvid_frame_nums() and loadvid_timestamps().
+ * @seconds_per_item: If positive, the items of `frame_nums` are converted to
+ * timestamps by scaling by `seconds_per_item`, and frames are picked by PTS
+ * with decode_video_from_timestamps(). Otherwise they are frame indices.
+ * @sizes: If not NULL or None, the output resolutions. Each frame is decoded
+ * once, and the result holds one buffer per resolution.
+ * @should_export_mvs: Also return the motion field of each frame.
+ *
+ * The other arguments are as passed to loadvid_frame_nums(). The GIL is
+ * released while the video (and audio) is opened and decoded.
+ */
+static PyObject *
+load_frames(const struct video_source *source,
+            PyObject *frame_nums,
+            uint32_t width,
+            uint32_t height,
+            uint32_t resize,
+            bool should_key,
+            bool should_seek,
+            double timeout,
+            bool allow_partial,
+            bool fast_open,
+            double seconds_per_item,
+            PyObject *out,
+            int32_t audio_rate,
+            int32_t audio_channels,
+            PyObject *sizes,
+            bool should_export_mvs)
+{
+        PyObject *result = NULL;
+        struct frames_request req;
+        bool is_open;
+
+        if (parse_frames_request(&req,
+                                 source,
+                                 frame_nums,
+                                 width,
+                                 height,
+                                 resize,
+                                 should_key,
+                                 should_seek,
+                                 timeout,
+                                 allow_partial,
+                                 fast_open,
+                                 seconds_per_item,
+                                 out,
+                                 audio_rate,
+                                 audio_channels) < 0)
+                goto out_free_request;
+        if (parse_frame_sizes(&req, sizes) < 0)
+                goto out_free_request;
+        req.should_export_mvs = should_export_mvs;
+
+        Py_BEGIN_ALLOW_THREADS
+        is_open = open_frames_request(&req);
+        Py_END_ALLOW_THREADS
+        if (!is_open) {
+                PyErr_SetString(req.vid_ctx.error_type, req.vid_ctx.error_msg);
+                goto out_free_request;
+        }
+
+        if (prepare_frames_output(&req) < 0)
+                goto out_free_request;
+
+        Py_BEGIN_ALLOW_THREADS
+        decode_frames_request(&req);
+        Py_END_ALLOW_THREADS
+
+        result = frames_request_result(&req);
+
+out_free_request:
+        free_frames_request(&req);
+
+        return result;
+}
+
+static PyObject *
+loadvid_frame_nums(PyObject *self, PyObject *args, PyObject *kw)
+{
+        struct video_source source;
+
+        PyObject *frame_nums = NULL;
+        uint32_t width = 0;
+        uint32_t height = 0;
+
+        // resize
+        uint32_t resize = 0;
+
+        /* NOTE(brendan): should_seek must be int (not bool) because Python. */
+        int32_t should_seek = false;
+        int32_t should_key = false;
+        
+        /* timeout in seconds, may be fractional */
+        double timeout = 0.0;
+        int32_t allow_partial = false;
+        double target_fps = 0.0;
+        int32_t fast_open = false;
+        PyObject *out = NULL;
+        int32_t audio_rate = 0;
+        int32_t audio_channels = 1;
+        PyObject *sizes = NULL;
+        int32_t motion_vectors = false;
+            
+        static char *kwlist[] = {"filename",
+                                 "frame_nums",
+                                 "width",
+                                 "height",
+                                 "resize",
+                                 "should_key",
+                                 "should_seek",
+                                 "timeout",
+                                 "allow_partial",
+                                 "target_fps",
+                                 "fast_open",
+                                 "out",
+                                 "audio_rate",
+                                 "audio_channels",
+                                 "sizes",
+                                 "motion_vectors",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O&O|IIIppdpdpOiiOp:loadvid_frame_nums",
+                                         kwlist,
+                                         parse_video_source,
+                                         &source,
+                                         &frame_nums,
+                                         &width,
+                                         &height,
+                                         &resize,
+                                         &should_key,
+                                         &should_seek,
+                                         &timeout,
+                                         &allow_partial,
+                                         &target_fps,
+                                         &fast_open,
+                                         &out,
+                                         &audio_rate,
+                                         &audio_channels,
+                                         &sizes,
+                                         &motion_vectors))
+                return NULL;
+
+        /**
+         * NOTE: With a target_fps, frame_nums index a timeline resampled to
+         * target_fps, and frames are picked by PTS. Seeking is then
+         * frame-accurate, so should_key's approximate keyframe seeks don't
+         * apply.
+         */
+        if ((target_fps > 0.0) && should_key) {
+                PyErr_SetString(PyExc_ValueError,
+                                "should_key cannot be used with target_fps");
+                return NULL;
+        }
+
+        return load_frames(&source,
+                           frame_nums,
+                           width,
+                           height,
+                           resize,
+                           should_key,
+                           should_seek,
+                           timeout,
+                           allow_partial,
+                           fast_open,
+                           (target_fps > 0.0) ? 1.0/target_fps : 0.0,
+                           out,
+                           audio_rate,
+                           audio_channels,
+                           sizes,
+                           motion_vectors);
+}
+
+static PyObject *
+loadvid_timestamps(PyObject *self, PyObject *args, PyObject *kw)
+{
+        struct video_source source;
+        PyObject *seconds = NULL;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t resize = 0;
+        int32_t should_seek = true;
+        double timeout = 0.0;
+        int32_t allow_partial = false;
+        int32_t fast_open = false;
+        PyObject *out = NULL;
+        int32_t audio_rate = 0;
+        int32_t audio_channels = 1;
+        PyObject *sizes = NULL;
+        int32_t motion_vectors = false;
+
+        static char *kwlist[] = {"filename",
+                                 "seconds",
+                                 "width",
+                                 "height",
+                                 "resize",
+                                 "should_seek",
+                                 "timeout",
+                                 "allow_partial",
+                                 "fast_open",
+                                 "out",
+                                 "audio_rate",
+                                 "audio_channels",
+                                 "sizes",
+                                 "motion_vectors",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O&O|IIIpdppOiiOp:loadvid_timestamps",
+                                         kwlist,
+                                         parse_video_source,
+                                         &source,
+                                         &seconds,
+                                         &width,
+                                         &height,
+                                         &resize,
+                                         &should_seek,
+                                         &timeout,
+                                         &allow_partial,
+                                         &fast_open,
+                                         &out,
+                                         &audio_rate,
+                                         &audio_channels,
+                                         &sizes,
+                                         &motion_vectors))
+                return NULL;
+
+        return load_frames(&source,
+                           seconds,
+                           width,
+                           height,
+                           resize,
+                           false,
+                           should_seek,
+                           timeout,
+                           allow_partial,
+                           fast_open,
+                           1.0,
+                           out,
+                           audio_rate,
+                           audio_channels,
+                           sizes,
+                           motion_vectors);
+}
+
+/**
+ * parse_segment_mode() - Converts the `mode` argument of loadvid_segments().
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+parse_segment_mode(enum segment_mode *mode, const char *mode_name)
+{
+        if (strcmp(mode_name, "keyframe") == 0) {
+                *mode = SEGMENT_KEYFRAME;
+        } else if (strcmp(mode_name, "nearest") == 0) {
+                *mode = SEGMENT_NEAREST;
+        } else if (strcmp(mode_name, "random") == 0) {
+                *mode = SEGMENT_RANDOM;
+        } else {
+                PyErr_Format(PyExc_ValueError,
+                             "mode must be 'keyframe', 'nearest' or 'random', not '%s'",
+                             mode_name);
+                return -1;
+        }
+
+        return 0;
+}
+
+static PyObject *
+loadvid_segments(PyObject *self, PyObject *args, PyObject *kw)
+{
+        struct video_source source;
+        int32_t num_segments = 0;
+        const char *mode_name = "keyframe";
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t resize = 0;
+        double timeout = 0.0;
+        int32_t fast_open = false;
+        PyObject *out = NULL;
+        PyObject *seed = NULL;
+        uint64_t rng_state;
+
+        static char *kwlist[] = {"filename",
+                                 "num_segments",
+                                 "mode",
+                                 "width",
+                                 "height",
+                                 "resize",
+                                 "timeout",
+                                 "fast_open",
+                                 "out",
+                                 "seed",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O&i|sIIIdpOO:loadvid_segments",
+                                         kwlist,
+                                         parse_video_source,
+                                         &source,
+                                         &num_segments,
+                                         &mode_name,
+                                         &width,
+                                         &height,
+                                         &resize,
+                                         &timeout,
+                                         &fast_open,
+                                         &out,
+                                         &seed))
+                return NULL;
+
+        enum segment_mode mode;
+        if (parse_segment_mode(&mode, mode_name) < 0)
+                return NULL;
+
+        if (get_call_seed(&rng_state, self, seed) < 0)
+                return NULL;
+
+        if (num_segments <= 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "num_segments must be positive");
+                return NULL;
+        }
+
+        /**
+         * NOTE: The frame_nums of the request are sized from a placeholder
+         * sequence, and receive the indices of the frames picked.
+         */
+        PyObject *zero = Py_BuildValue("(i)", 0);
+        if (zero == NULL)
+                return NULL;
+        PyObject *placeholder = PySequence_Repeat(zero, num_segments);
+        Py_DECREF(zero);
+        if (placeholder == NULL)
+                return NULL;
+
+        PyObject *result = NULL;
+        PyObject *frame_indices = NULL;
+        struct frames_request req;
+        bool is_open;
+        if (parse_frames_request(&req,
+                                 &source,
+                                 placeholder,
+                                 width,
+                                 height,
+                                 resize,
+                                 false,
+                                 true,
+                                 timeout,
+                                 false,
+                                 fast_open,
+                                 0.0,
+                                 out,
+                                 0,
+                                 1) < 0)
+                goto out_free_request;
+
+        Py_BEGIN_ALLOW_THREADS
+        is_open = open_frames_request(&req);
+        Py_END_ALLOW_THREADS
+        if (!is_open) {
+                PyErr_SetString(req.vid_ctx.error_type, req.vid_ctx.error_msg);
+                goto out_free_request;
+        }
+
+        if (prepare_frames_output(&req) < 0)
+                goto out_free_request;
+
+        req.vid_ctx.rng_state = rng_state;
+        file_reader_advise(req.vid_ctx.file, FILE_ACCESS_RANDOM);
+        Py_BEGIN_ALLOW_THREADS
+        req.num_decoded = decode_video_segments(req.output.data,
+                                                &req.vid_ctx,
+                                                num_segments,
+                                                mode,
+                                                req.rewidth,
+                                                req.reheight,
+                                                req.frame_nums);
+        Py_END_ALLOW_THREADS
+
+        if (req.vid_ctx.error_type != NULL) {
+                PyErr_SetString(req.vid_ctx.error_type, req.vid_ctx.error_msg);
+                goto out_free_request;
+        }
+        if (req.num_decoded == 0) {
+                PyErr_SetString(PyExc_ValueError, "no frames decoded");
+                goto out_free_request;
+        }
+
+        frame_indices = PyList_New(num_segments);
+        int32_t i;
+        for (i = 0;
+             (i < num_segments) && (frame_indices != NULL);
+             ++i) {
+                PyObject *frame_index = PyLong_FromLong(req.frame_nums[i]);
+                if (frame_index == NULL)
+                        Py_CLEAR(frame_indices);
+                else
+                        PyList_SET_ITEM(frame_indices, i, frame_index);
+        }
+        if (frame_indices == NULL)
+                goto out_free_request;
+
+        if (req.is_size_dynamic || (req.resize != 0))
+                result = Py_BuildValue("ONii",
+                                       req.output.obj,
+                                       frame_indices,
+                                       req.rewidth,
+                                       req.reheight);
+        else
+                result = Py_BuildValue("ON", req.output.obj, frame_indices);
+
+out_free_request:
+        free_frames_request(&req);
+        Py_DECREF(placeholder);
+
+        return result;
+}
+
+/**
+ * struct pathway - One output of loadvid_slowfast(): a subset of the decoded
+ * frames, at its own size and sample format.
+ * @frame_nums: Frame indices of the pathway, non-decreasing.
+ * @num_frames: Length of `frame_nums`.
+ * @union_indices: Index of each frame of the pathway in the union of the
+ * frames of all pathways, which is what gets decoded.
+ * @width: Width of the output frames, or zero for the decoded width.
+ * @height: Height of the output frames, or zero for the decoded height.
+ * @should_normalize: Output float32 (x/255 - mean)/std, rather than uint8.
+ * @mean: Per-channel mean, if `should_normalize`.
+ * @std: Per-channel standard deviation, if `should_normalize`.
+ * @is_decoded_output: True iff the pathway is exactly the decoded frames, so
+ * that the decoded buffer is returned as is.
+ * @output: Buffer holding the frames of the pathway.
+ */
+struct pathway {
+        int32_t *frame_nums;
+        int32_t num_frames;
+        int32_t *union_indices;
+        uint32_t width;
+        uint32_t height;
+        bool should_normalize;
+        float mean[3];
+        float std[3];
+        bool is_decoded_output;
+        struct output_buffer output;
+};
+
+/**
+ * free_pathway() - Frees the buffers and references owned by `pathway`.
+ */
+static void
+free_pathway(struct pathway *pathway)
+{
+        release_output(&pathway->output);
+        PyMem_RawFree(pathway->frame_nums);
+        PyMem_RawFree(pathway->union_indices);
+        pathway->frame_nums = NULL;
+        pathway->union_indices = NULL;
+}
+
+/**
+ * parse_channel_stats() - Reads a per-channel statistic, `mean` or `std`, of
+ * a pathway from `obj`, a sequence of three floats, or None to leave `stats`
+ * as they are.
+ *
+ * Returns 1 if `obj` was read, 0 if it is None, and -1 with a Python
+ * exception set on failure.
+ */
+static int32_t
+parse_channel_stats(float stats[3], PyObject *obj, const char *name)
+{
+        if (obj == Py_None)
+                return 0;
+
+        PyObject *stats_seq = PySequence_Fast(obj, "mean and std need to be sequences");
+        if (stats_seq == NULL)
+                return -1;
+
+        int32_t status = -1;
+        if (PySequence_Fast_GET_SIZE(stats_seq) != 3) {
+                PyErr_Format(PyExc_ValueError,
+                             "%s needs one value per RGB channel",
+                             name);
+                goto out_decref_stats;
+        }
+
+        int32_t channel;
+        for (channel = 0;
+             channel < 3;
+             ++channel) {
+                stats[channel] = PyFloat_AsDouble(
+                        PySequence_Fast_GET_ITEM(stats_seq, channel));
+                if (PyErr_Occurred())
+                        goto out_decref_stats;
+        }
+        status = 1;
+
+out_decref_stats:
+        Py_DECREF(stats_seq);
+
+        return status;
+}
+
+/**
+ * parse_pathway() - Fills in `pathway` from the arguments of
+ * loadvid_slowfast() for it.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure. Either
+ * way, `pathway` must be released with free_pathway().
+ */
+static int32_t
+parse_pathway(struct pathway *pathway,
+              PyObject *frame_nums,
+              PyObject *size,
+              PyObject *mean,
+              PyObject *std)
+{
+        memset(pathway, 0, sizeof(*pathway));
+        pathway->std[0] = pathway->std[1] = pathway->std[2] = 1.0f;
+
+        if ((size != Py_None) &&
+            (parse_frame_size(&pathway->width, &pathway->height, size) < 0))
+                return -1;
+
+        int32_t status_mean = parse_channel_stats(pathway->mean, mean, "mean");
+        if (status_mean < 0)
+                return -1;
+        int32_t status_std = parse_channel_stats(pathway->std, std, "std");
+        if (status_std < 0)
+                return -1;
+        pathway->should_normalize = (status_mean > 0) || (status_std > 0);
+
+        PyObject *frame_nums_seq = PySequence_Fast(frame_nums,
+                                                   "frame_nums need to be sequences");
+        if (frame_nums_seq == NULL)
+                return -1;
+
+        int32_t status = -1;
+        Py_ssize_t num_frames = PySequence_Fast_GET_SIZE(frame_nums_seq);
+        if ((num_frames == 0) || (num_frames > INT32_MAX)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "every pathway needs at least one frame");
+                goto out_decref_frame_nums;
+        }
+        pathway->num_frames = num_frames;
+        pathway->frame_nums = PyMem_RawMalloc(num_frames*sizeof(int32_t));
+        pathway->union_indices = PyMem_RawMalloc(num_frames*sizeof(int32_t));
+        if ((pathway->frame_nums == NULL) || (pathway->union_indices == NULL)) {
+                PyErr_NoMemory();
+                goto out_decref_frame_nums;
+        }
+
+        Py_ssize_t i;
+        for (i = 0;
+             i < num_frames;
+             ++i) {
+                pathway->frame_nums[i] = PyLong_AsLong(
+                        PySequence_Fast_GET_ITEM(frame_nums_seq, i));
+                if (PyErr_Occurred())
+                        goto out_decref_frame_nums;
+
+                if ((pathway->frame_nums[i] < 0) ||
+                    ((i > 0) &&
+                     (pathway->frame_nums[i] < pathway->frame_nums[i - 1]))) {
+                        PyErr_SetString(PyExc_ValueError,
+                                        "frame_nums must be non-negative and non-decreasing");
+                        goto out_decref_frame_nums;
+                }
+        }
+        status = 0;
+
+out_decref_frame_nums:
+        Py_DECREF(frame_nums_seq);
+
+        return status;
+}
+
+/**
+ * merge_pathways() - Returns a new reference to a list of the union of the
+ * frame indices of `pathways`, in increasing order, and sets the
+ * `union_indices` of each pathway to index into it.
+ *
+ * Returns NULL with a Python exception set on failure.
+ */
+static PyObject *
+merge_pathways(struct pathway *pathways, int32_t num_pathways)
+{
+        PyObject *union_frame_nums = PyList_New(0);
+        if (union_frame_nums == NULL)
+                return NULL;
+
+        int32_t heads[NUM_SLOWFAST_PATHWAYS] = {0};
+        int32_t num_union = 0;
+        for (;;) {
+                int32_t next_frame_num = INT32_MAX;
+                bool is_done = true;
+                int32_t i;
+                for (i = 0;
+                     i < num_pathways;
+                     ++i) {
+                        if (heads[i] >= pathways[i].num_frames)
+                                continue;
+
+                        is_done = false;
+                        if (pathways[i].frame_nums[heads[i]] < next_frame_num)
+                                next_frame_num = pathways[i].frame_nums[heads[i]];
+                }
+                if (is_done)
+                        break;
+
+                PyObject *item = PyLong_FromLong(next_frame_num);
+                if ((item == NULL) ||
+                    (PyList_Append(union_frame_nums, item) < 0)) {
+                        Py_XDECREF(item);
+                        Py_DECREF(union_frame_nums);
+                        return NULL;
+                }
+                Py_DECREF(item);
+
+                for (i = 0;
+                     i < num_pathways;
+                     ++i) {
+                        struct pathway *pathway = &pathways[i];
+                        while ((heads[i] < pathway->num_frames) &&
+                               (pathway->frame_nums[heads[i]] == next_frame_num)) {
+                                pathway->union_indices[heads[i]] = num_union;
+                                ++heads[i];
+                        }
+                }
+                ++num_union;
+        }
+
+        return union_frame_nums;
+}
+
+/**
+ * prepare_pathway_output() - Sets the size of `pathway` from the decoded
+ * frames of `req`, and prepares its output.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+prepare_pathway_output(struct pathway *pathway, struct frames_request *req)
+{
+        if (pathway->width == 0) {
+                pathway->width = req->rewidth;
+                pathway->height = req->reheight;
+        }
+
+        pathway->is_decoded_output = !pathway->should_normalize &&
+                                     (pathway->width == req->rewidth) &&
+                                     (pathway->height == req->reheight) &&
+                                     (pathway->num_frames == req->num_frames);
+        if (pathway->is_decoded_output) {
+                Py_INCREF(req->output.obj);
+                pathway->output.obj = req->output.obj;
+
+                return 0;
+        }
+
+        uint32_t bytes_per_sample = pathway->should_normalize ? sizeof(float) : 1;
+
+        if (prepare_output(&pathway->output,
+                           pathway->num_frames*pathway->width*
+                           pathway->height*3*bytes_per_sample) < 0)
+                return -1;
+
+        const Py_ssize_t shape[] = {pathway->num_frames,
+                                    pathway->height,
+                                    pathway->width,
+                                    3};
+        set_output_shape(&pathway->output,
+                         4,
+                         shape,
+                         pathway->should_normalize ? 'f' : 'B');
+
+        return 0;
+}
+
+/**
+ * fill_pathway() - Gathers the frames of `pathway` from the frames decoded
+ * by `req`, rescaling and normalizing them as needed.
+ *
+ * Does not touch the Python C API, so may be called without the GIL. Returns
+ * true on success. On failure, the error is set in `req->vid_ctx`.
+ */
+static bool
+fill_pathway(struct pathway *pathway, struct frames_request *req)
+{
+        if (pathway->is_decoded_output)
+                return true;
+
+        const uint32_t num_pixels = pathway->width*pathway->height;
+        const uint32_t decoded_bytes_per_frame = req->rewidth*req->reheight*3;
+        bool is_rescaled = (pathway->width != req->rewidth) ||
+                           (pathway->height != req->reheight);
+        uint8_t *scaled = NULL;
+        if (is_rescaled && pathway->should_normalize) {
+                scaled = malloc(num_pixels*3);
+                if (scaled == NULL) {
+                        req->vid_ctx.error_type = PyExc_MemoryError;
+                        req->vid_ctx.error_msg = "out of memory for pathway";
+                        return false;
+                }
+        }
+
+        bool is_filled = false;
+        int32_t i;
+        for (i = 0;
+             i < pathway->num_frames;
+             ++i) {
+                const uint8_t *src = req->output.data +
+                        (size_t)pathway->union_indices[i]*decoded_bytes_per_frame;
+                uint8_t *dest = pathway->output.data +
+                        (size_t)i*num_pixels*3*(pathway->should_normalize ?
+                                                sizeof(float) : 1);
+
+                if (is_rescaled) {
+                        uint8_t *scale_dest = (scaled != NULL) ? scaled : dest;
+                        if (scale_rgb_frames(scale_dest,
+                                             pathway->width,
+                                             pathway->height,
+                                             src,
+                                             req->rewidth,
+                                             req->reheight,
+                                             1) != VID_DECODE_SUCCESS) {
+                                req->vid_ctx.error_type = PyExc_IOError;
+                                req->vid_ctx.error_msg = "rescale frames error";
+                                goto out_free_scaled;
+                        }
+                        src = scale_dest;
+                }
+
+                if (pathway->should_normalize)
+                        normalize_rgb_frame((float *)dest,
+                                            src,
+                                            num_pixels,
+                                            pathway->mean,
+                                            pathway->std);
+                else if (!is_rescaled)
+                        memcpy(dest, src, num_pixels*3);
+        }
+        is_filled = true;
+
+out_free_scaled:
+        free(scaled);
+
+        return is_filled;
+}
+
+static PyObject *
+loadvid_slowfast(PyObject *self, PyObject *args, PyObject *kw)
+{
+        struct video_source source;
+        PyObject *fast_frame_nums = NULL;
+        PyObject *slow_frame_nums = Py_None;
+        uint32_t alpha = 4;
+        PyObject *fast_size = Py_None;
+        PyObject *slow_size = Py_None;
+        PyObject *fast_mean = Py_None;
+        PyObject *fast_std = Py_None;
+        PyObject *slow_mean = Py_None;
+        PyObject *slow_std = Py_None;
+        int32_t should_seek = false;
+        double timeout = 0.0;
+        int32_t fast_open = false;
+
+        static char *kwlist[] = {"filename",
+                                 "fast_frame_nums",
+                                 "slow_frame_nums",
+                                 "alpha",
+                                 "fast_size",
+                                 "slow_size",
+                                 "fast_mean",
+                                 "fast_std",
+                                 "slow_mean",
+                                 "slow_std",
+                                 "should_seek",
+                                 "timeout",
+                                 "fast_open",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O&O|OIOOOOOOpdp:loadvid_slowfast",
+                                         kwlist,
+                                         parse_video_source,
+                                         &source,
+                                         &fast_frame_nums,
+                                         &slow_frame_nums,
+                                         &alpha,
+                                         &fast_size,
+                                         &slow_size,
+                                         &fast_mean,
+                                         &fast_std,
+                                         &slow_mean,
+                                         &slow_std,
+                                         &should_seek,
+                                         &timeout,
+                                         &fast_open))
+                return NULL;
+
+        PyObject *result = NULL;
+        PyObject *union_frame_nums = NULL;
+        struct pathway pathways[NUM_SLOWFAST_PATHWAYS];
+        struct pathway *fast = &pathways[0];
+        struct pathway *slow = &pathways[1];
+        struct frames_request req;
+        bool is_open;
+        memset(pathways, 0, sizeof(pathways));
+        memset(&req, 0, sizeof(req));
+
+        /**
+         * NOTE: By default the slow pathway takes every `alpha`th frame of
+         * the fast pathway, as in SlowFast networks.
+         */
+        if (slow_frame_nums == Py_None) {
+                if (alpha == 0) {
+                        PyErr_SetString(PyExc_ValueError,
+                                        "alpha must be positive");
+                        return NULL;
+                }
+
+                PyObject *step = PyLong_FromUnsignedLong(alpha);
+                PyObject *slice = (step != NULL) ?
+                        PySlice_New(NULL, NULL, step) : NULL;
+                Py_XDECREF(step);
+                if (slice == NULL)
+                        return NULL;
+
+                slow_frame_nums = PyObject_GetItem(fast_frame_nums, slice);
+                Py_DECREF(slice);
+                if (slow_frame_nums == NULL)
+                        return NULL;
+        } else {
+                Py_INCREF(slow_frame_nums);
+        }
+
+        if ((parse_pathway(fast,
+                           fast_frame_nums,
+                           fast_size,
+                           fast_mean,
+                           fast_std) < 0) ||
+            (parse_pathway(slow,
+                           slow_frame_nums,
+                           slow_size,
+                           slow_mean,
+                           slow_std) < 0))
+                goto out_free_request;
+
+        /**
+         * NOTE: The union is decoded once, at the larger of the two sizes,
+         * and the smaller pathway is rescaled from it. If the fast pathway
+         * has no size, the union is decoded at the size of the video.
+         */
+        uint32_t width = fast->width;
+        uint32_t height = fast->height;
+        if ((width > 0) &&
+            ((uint64_t)slow->width*slow->height > (uint64_t)width*height)) {
+                width = slow->width;
+                height = slow->height;
+        }
+
+        union_frame_nums = merge_pathways(pathways, NUM_SLOWFAST_PATHWAYS);
+        if (union_frame_nums == NULL)
+                goto out_free_request;
+
+        if (parse_frames_request(&req,
+                                 &source,
+                                 union_frame_nums,
+                                 width,
+                                 height,
+                                 0,
+                                 false,
+                                 should_seek,
+                                 timeout,
+                                 false,
+                                 fast_open,
+                                 0.0,
+                                 NULL,
+                                 0,
+                                 1) < 0)
+                goto out_free_request;
+
+        Py_BEGIN_ALLOW_THREADS
+        is_open = open_frames_request(&req);
+        Py_END_ALLOW_THREADS
+        if (!is_open) {
+                PyErr_SetString(req.vid_ctx.error_type, req.vid_ctx.error_msg);
+                goto out_free_request;
+        }
+
+        if ((prepare_frames_output(&req) < 0) ||
+            (prepare_pathway_output(fast, &req) < 0) ||
+            (prepare_pathway_output(slow, &req) < 0))
+                goto out_free_request;
+
+        Py_BEGIN_ALLOW_THREADS
+        decode_frames_request(&req);
+        if ((req.vid_ctx.error_type == NULL) && fill_pathway(fast, &req))
+                fill_pathway(slow, &req);
+        Py_END_ALLOW_THREADS
+
+        if (req.vid_ctx.error_type != NULL) {
+                PyErr_SetString(req.vid_ctx.error_type, req.vid_ctx.error_msg);
+                goto out_free_request;
+        }
+
+        if (req.is_size_dynamic)
+                result = Py_BuildValue("OOii",
+                                       fast->output.obj,
+                                       slow->output.obj,
+                                       req.rewidth,
+                                       req.reheight);
+        else
+                result = Py_BuildValue("OO",
+                                       fast->output.obj,
+                                       slow->output.obj);
+
+out_free_request:
+        free_frames_request(&req);
+        Py_XDECREF(union_frame_nums);
+        free_pathway(fast);
+        free_pathway(slow);
+        Py_DECREF(slow_frame_nums);
+
+        return result;
+}
+
+/**
+ * struct decode_job - A loadvid_frame_nums() request submitted to the decode
+ * queue with submit().
+ * @req: The request, decoded without the GIL on a queue worker.
+ * @future: The concurrent.futures.Future completed with the result of `req`.
+ */
+struct decode_job {
+        struct frames_request req;
+        PyObject *future;
+};
+
+/**
+ * NOTE: The decode queue is started by the first submit(), or explicitly by
+ * start_decode_workers(). It is only started and stopped with
+ * `decode_queue_lock` held, since on free-threaded builds the GIL doesn't
+ * serialize those calls.
+ */
+static struct work_queue decode_queue;
+static bool is_decode_queue_started = false;
+static bool is_decode_queue_stopped = false;
+static pthread_mutex_t decode_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t decode_queue_atfork_once = PTHREAD_ONCE_INIT;
+
+/**
+ * reset_decode_queue_in_child() - Forgets the decode queue of the parent in a
+ * forked child, e.g., a DataLoader worker, whose first submit() then starts
+ * workers of its own.
+ *
+ * NOTE: The lock isn't taken before fork(), since shutdown_decode_workers()
+ * holds it while its workers wait for the GIL, which the forking thread
+ * holds. It is initialized again instead, as CPython does for its own locks.
+ * Jobs the parent still had queued are leaked in the child.
+ */
+static void
+reset_decode_queue_in_child(void)
+{
+        pthread_mutex_init(&decode_queue_lock, NULL);
+        if (is_decode_queue_started && !is_decode_queue_stopped)
+                work_queue_forget(&decode_queue);
+        is_decode_queue_started = false;
+        is_decode_queue_stopped = false;
+}
+
+static void
+register_decode_queue_atfork(void)
+{
+        pthread_atfork(NULL, NULL, reset_decode_queue_in_child);
+}
+
+/**
+ * lock_decode_queue() - Locks `decode_queue_lock`, waiting for it without the
+ * GIL, so that a thread holding the lock can still take the GIL.
+ */
+static void
+lock_decode_queue(void)
+{
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&decode_queue_lock);
+        Py_END_ALLOW_THREADS
+}
+
+/**
+ * free_decode_job() - Releases `job`. Must be called with the GIL held.
+ */
+static void
+free_decode_job(struct decode_job *job)
+{
+        Py_XDECREF(job->future);
+        free_frames_request(&job->req);
+        PyMem_RawFree(job);
+}
+
+/**
+ * call_future_method() - Calls `future.name(arg)`, or `future.name()` if
+ * `arg` is NULL, reporting (rather than raising) any exception.
+ *
+ * Returns a new reference to the result, or NULL on error.
+ */
+static PyObject *
+call_future_method(PyObject *future, const char *name, PyObject *arg)
+{
+        PyObject *result = PyObject_CallMethod(future,
+                                               name,
+                                               (arg != NULL) ? "(O)" : NULL,
+                                               arg);
+        if (result == NULL)
+                PyErr_WriteUnraisable(future);
+
+        return result;
+}
+
+/**
+ * set_future_exception() - Completes `future` with the current Python
+ * exception, which is cleared.
+ */
+static void
+set_future_exception(PyObject *future)
+{
+        PyObject *type;
+        PyObject *value;
+        PyObject *traceback;
+
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        if (traceback != NULL)
+                PyException_SetTraceback(value, traceback);
+
+        Py_XDECREF(call_future_method(future, "set_exception", value));
+
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(traceback);
+}
+
+/**
+ * run_decode_job() - Decode queue worker function for a `struct decode_job`.
+ *
+ * The GIL is only held to start the future, to allocate the output and to
+ * complete the future. Opening and decoding run without it. Completing the
+ * future runs its callbacks on this thread, which for asyncio.wrap_future()
+ * schedules the result onto the event loop with call_soon_threadsafe().
+ */
+static void
+run_decode_job(void *arg)
+{
+        struct decode_job *job = arg;
+        PyGILState_STATE gil_state = PyGILState_Ensure();
+
+        PyObject *is_running = call_future_method(job->future,
+                                                  "set_running_or_notify_cancel",
+                                                  NULL);
+        if (is_running == NULL)
+                goto out_free_job;
+        bool is_cancelled = (is_running == Py_False);
+        Py_DECREF(is_running);
+        if (is_cancelled)
+                goto out_free_job;
+
+        bool is_open;
+        Py_BEGIN_ALLOW_THREADS
+        is_open = open_frames_request(&job->req);
+        Py_END_ALLOW_THREADS
+        if (!is_open) {
+                PyErr_SetString(job->req.vid_ctx.error_type,
+                                job->req.vid_ctx.error_msg);
+                set_future_exception(job->future);
+                goto out_free_job;
+        }
+
+        if (prepare_frames_output(&job->req) < 0) {
+                set_future_exception(job->future);
+                goto out_free_job;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        decode_frames_request(&job->req);
+        Py_END_ALLOW_THREADS
+
+        PyObject *result = frames_request_result(&job->req);
+        if (result == NULL) {
+                set_future_exception(job->future);
+                goto out_free_job;
+        }
+
+        Py_XDECREF(call_future_method(job->future, "set_result", result));
+        Py_DECREF(result);
+
+out_free_job:
+        free_decode_job(job);
+        PyGILState_Release(gil_state);
+}
+
+/**
+ * ensure_decode_queue() - Starts the decode queue with `num_workers` threads
+ * and room for `queue_size` pending jobs, unless it is already started, and
+ * imports the Future type of `state`. Must be called with
+ * `decode_queue_lock` held.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure.
+ */
+static int32_t
+ensure_decode_queue(struct lintel_state *state,
+                    int32_t num_workers,
+                    int32_t queue_size)
+{
+        if (is_decode_queue_stopped) {
+                PyErr_SetString(PyExc_RuntimeError,
+                                "decode workers have been shut down");
+                return -1;
+        }
+
+        if (state->future_type == NULL) {
+                PyObject *futures = PyImport_ImportModule("concurrent.futures");
+                if (futures == NULL)
+                        return -1;
+
+                state->future_type = PyObject_GetAttrString(futures, "Future");
+                Py_DECREF(futures);
+                if (state->future_type == NULL)
+                        return -1;
+        }
+
+        if (is_decode_queue_started)
+                return 0;
+
+        pthread_once(&decode_queue_atfork_once, register_decode_queue_atfork);
+
+#if PY_VERSION_HEX < 0x03070000
+        /* NOTE: Workers take the GIL with PyGILState_Ensure(). */
+        PyEval_InitThreads();
+#endif
+
+        if (work_queue_start(&decode_queue,
+                             num_workers,
+                             queue_size) != WORK_QUEUE_SUCCESS) {
+                PyErr_SetString(PyExc_RuntimeError,
+                                "could not start decode workers");
+                return -1;
+        }
+        is_decode_queue_started = true;
+
+        return 0;
+}
+
+static PyObject *
+start_decode_workers(PyObject *self, PyObject *args, PyObject *kw)
+{
+        int32_t num_workers = DEFAULT_DECODE_WORKERS;
+        int32_t queue_size = DEFAULT_DECODE_QUEUE_SIZE;
+
+        static char *kwlist[] = {"num_workers",
+                                 "queue_size",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "|ii:start_decode_workers",
+                                         kwlist,
+                                         &num_workers,
+                                         &queue_size))
+                return NULL;
+
+        lock_decode_queue();
+        int32_t status = -1;
+        if (is_decode_queue_started)
+                PyErr_SetString(PyExc_RuntimeError,
+                                "decode workers are already started");
+        else
+                status = ensure_decode_queue(get_lintel_state(self),
+                                             num_workers,
+                                             queue_size);
+        pthread_mutex_unlock(&decode_queue_lock);
+
+        if (status < 0)
+                return NULL;
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+shutdown_decode_workers(PyObject *self, PyObject *UNUSED(args))
+{
+        lock_decode_queue();
+        if (!is_decode_queue_started || is_decode_queue_stopped) {
+                pthread_mutex_unlock(&decode_queue_lock);
+                Py_RETURN_NONE;
+        }
+
+        is_decode_queue_stopped = true;
+
+        /* NOTE: Pending jobs still run, and need the GIL to complete. */
+        Py_BEGIN_ALLOW_THREADS
+        work_queue_stop(&decode_queue);
+        Py_END_ALLOW_THREADS
+        pthread_mutex_unlock(&decode_queue_lock);
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+submit(PyObject *self, PyObject *args, PyObject *kw)
+{
+        struct video_source source;
+        PyObject *frame_nums = NULL;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t resize = 0;
+        int32_t should_key = false;
+        int32_t should_seek = false;
+        double timeout = 0.0;
+        int32_t allow_partial = false;
+        double target_fps = 0.0;
+        int32_t fast_open = false;
+        PyObject *out = NULL;
+        int32_t audio_rate = 0;
+        int32_t audio_channels = 1;
+        PyObject *sizes = NULL;
+        int32_t motion_vectors = false;
+        int32_t should_block = true;
+
+        static char *kwlist[] = {"filename",
+                                 "frame_nums",
+                                 "width",
+                                 "height",
+                                 "resize",
+                                 "should_key",
+                                 "should_seek",
+                                 "timeout",
+                                 "allow_partial",
+                                 "target_fps",
+                                 "fast_open",
+                                 "out",
+                                 "audio_rate",
+                                 "audio_channels",
+                                 "sizes",
+                                 "motion_vectors",
+                                 "block",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O&O|IIIppdpdpOiiOpp:submit",
+                                         kwlist,
+                                         parse_video_source,
+                                         &source,
+                                         &frame_nums,
+                                         &width,
+                                         &height,
+                                         &resize,
+                                         &should_key,
+                                         &should_seek,
+                                         &timeout,
+                                         &allow_partial,
+                                         &target_fps,
+                                         &fast_open,
+                                         &out,
+                                         &audio_rate,
+                                         &audio_channels,
+                                         &sizes,
+                                         &motion_vectors,
+                                         &should_block))
+                return NULL;
+
+        if ((target_fps > 0.0) && should_key) {
+                PyErr_SetString(PyExc_ValueError,
+                                "should_key cannot be used with target_fps");
+                return NULL;
+        }
+
+        struct lintel_state *state = get_lintel_state(self);
+        lock_decode_queue();
+        int32_t queue_status = ensure_decode_queue(state,
+                                                   DEFAULT_DECODE_WORKERS,
+                                                   DEFAULT_DECODE_QUEUE_SIZE);
+        pthread_mutex_unlock(&decode_queue_lock);
+        if (queue_status < 0)
+                return NULL;
+
+        struct decode_job *job = PyMem_RawMalloc(sizeof(struct decode_job));
+        if (job == NULL)
+                return PyErr_NoMemory();
+        job->future = NULL;
+
+        if (parse_frames_request(&job->req,
+                                 &source,
+                                 frame_nums,
+                                 width,
+                                 height,
+                                 resize,
+                                 should_key,
+                                 should_seek,
+                                 timeout,
+                                 allow_partial,
+                                 fast_open,
+                                 (target_fps > 0.0) ? 1.0/target_fps : 0.0,
+                                 out,
+                                 audio_rate,
+                                 audio_channels) < 0)
+                goto err_free_job;
+        if (parse_frame_sizes(&job->req, sizes) < 0)
+                goto err_free_job;
+        job->req.should_export_mvs = motion_vectors;
+
+        PyObject *future = PyObject_CallObject(state->future_type, NULL);
+        if (future == NULL)
+                goto err_free_job;
+        Py_INCREF(future);
+        job->future = future;
+
+        int32_t status;
+        if (should_block) {
+                Py_BEGIN_ALLOW_THREADS
+                status = work_queue_push(&decode_queue,
+                                         run_decode_job,
+                                         job,
+                                         true);
+                Py_END_ALLOW_THREADS
+        } else {
+                status = work_queue_push(&decode_queue,
+                                         run_decode_job,
+                                         job,
+                                         false);
+        }
+
+        if (status == WORK_QUEUE_SUCCESS)
+                return future;
+
+        if (status == WORK_QUEUE_FULL)
+                PyErr_SetString(PyExc_BlockingIOError, "decode queue is full");
+        else
+                PyErr_SetString(PyExc_RuntimeError,
+                                "decode workers have been shut down");
+        Py_DECREF(future);
+
+err_free_job:
+        free_decode_job(job);
+
+        return NULL;
+}
+
+/* Bytes of a video read by a prefetch, if its first GOP is longer. */
+#define PREFETCH_MAX_BYTES (8 << 20)
+
+/**
+ * struct prefetch_job - A video opened and read ahead on the decode queue by
+ * prefetch().
+ * @source: Copy of where the video is read from, owned by the job.
+ * @timeout_ms: Deadline for opening and reading the video, in milliseconds.
+ * @fast_open: As for loadvid_frame_nums().
+ */
+struct prefetch_job {
+        struct video_source source;
+        int32_t timeout_ms;
+        bool fast_open;
+};
+
+/* NOTE: Counted for decode_stats(), by prefetch jobs without the GIL. */
+static uint64_t num_prefetched = 0;
+static uint64_t num_prefetch_errors = 0;
+
+/**
+ * free_prefetch_job() - Releases `job`. Doesn't need the GIL.
+ */
+static void free_prefetch_job(struct prefetch_job *job)
+{
+        free_video_source(&job->source);
+        PyMem_RawFree(job);
+}
+
+/**
+ * run_prefetch_job() - Decode queue worker function for a
+ * `struct prefetch_job`.
+ *
+ * Opens the video and reads its first GOP, which leaves the container header
+ * and first GOP in the page cache. If the handle cache is enabled, the opened
+ * video is then cached, ready for the next call on it. Doesn't touch the
+ * Python C API, so runs without the GIL.
+ */
+static void
+run_prefetch_job(void *arg)
+{
+        struct prefetch_job *job = arg;
+        struct video_stream_context vid_ctx;
+
+        int32_t status = open_vid_stream_context(&vid_ctx,
+                                                 &job->source,
+                                                 job->timeout_ms,
+                                                 job->fast_open,
+                                                 false);
+        if (status == LOADVID_SUCCESS) {
+                file_reader_advise(vid_ctx.file, FILE_ACCESS_SEQUENTIAL);
+                if (read_first_gop(&vid_ctx,
+                                   PREFETCH_MAX_BYTES) == VID_DECODE_TIMEOUT)
+                        status = LOADVID_ERR;
+                clean_up_vid_ctx(&vid_ctx);
+        }
+
+        __atomic_fetch_add((status == LOADVID_SUCCESS) ? &num_prefetched :
+                                                         &num_prefetch_errors,
+                           1,
+                           __ATOMIC_RELAXED);
+
+        free_prefetch_job(job);
+}
+
+static PyObject *
+prefetch(PyObject *self, PyObject *args, PyObject *kw)
+{
+        PyObject *filenames = NULL;
+        double timeout = 0.0;
+        int32_t fast_open = false;
+        int32_t should_block = false;
+
+        static char *kwlist[] = {"filenames",
+                                 "timeout",
+                                 "fast_open",
+                                 "block",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O|dpp:prefetch",
+                                         kwlist,
+                                         &filenames,
+                                         &timeout,
+                                         &fast_open,
+                                         &should_block))
+                return NULL;
+
+        PyObject *filenames_seq = PySequence_Fast(filenames,
+                                                  "filenames must be a "
+                                                  "sequence");
+        if (filenames_seq == NULL)
+                return NULL;
+
+        struct lintel_state *state = get_lintel_state(self);
+        lock_decode_queue();
+        int32_t queue_status = ensure_decode_queue(state,
+                                                   DEFAULT_DECODE_WORKERS,
+                                                   DEFAULT_DECODE_QUEUE_SIZE);
+        pthread_mutex_unlock(&decode_queue_lock);
+        if (queue_status < 0)
+                goto err_decref_seq;
+
+        Py_ssize_t num_queued = 0;
+        Py_ssize_t num_filenames = PySequence_Fast_GET_SIZE(filenames_seq);
+        Py_ssize_t i;
+        for (i = 0;
+             i < num_filenames;
+             ++i) {
+                PyObject *filename = PySequence_Fast_GET_ITEM(filenames_seq, i);
+                struct video_source source;
+                if (!parse_video_source(filename, &source))
+                        goto err_decref_seq;
+
+                struct prefetch_job *job =
+                        PyMem_RawCalloc(1, sizeof(struct prefetch_job));
+                if (job == NULL) {
+                        PyErr_NoMemory();
+                        goto err_decref_seq;
+                }
+                job->timeout_ms = timeout_to_ms(timeout);
+                job->fast_open = fast_open;
+                if (copy_video_source(&job->source, &source) < 0) {
+                        free_prefetch_job(job);
+                        goto err_decref_seq;
+                }
+
+                int32_t status;
+                if (should_block) {
+                        Py_BEGIN_ALLOW_THREADS
+                        status = work_queue_push(&decode_queue,
+                                                 run_prefetch_job,
+                                                 job,
+                                                 true);
+                        Py_END_ALLOW_THREADS
+                } else {
+                        status = work_queue_push(&decode_queue,
+                                                 run_prefetch_job,
+                                                 job,
+                                                 false);
+                }
+                if (status == WORK_QUEUE_SUCCESS) {
+                        ++num_queued;
+                        continue;
+                }
+
+                free_prefetch_job(job);
+
+                /**
+                 * NOTE: Prefetching is only a hint, so the rest of the files
+                 * are dropped while the queue is full.
+                 */
+                if (status == WORK_QUEUE_FULL)
+                        break;
+
+                PyErr_SetString(PyExc_RuntimeError,
+                                "decode workers have been shut down");
+                goto err_decref_seq;
+        }
+        Py_DECREF(filenames_seq);
+
+        return PyLong_FromSsize_t(num_queued);
+
+err_decref_seq:
+        Py_DECREF(filenames_seq);
+
+        return NULL;
+}
+
+static PyObject *
+frame_count(PyObject *self, PyObject *args, PyObject *kw)
+{
+        struct video_source source;
+        int64_t frame_num = 0;
+        double timeout = 0.0;
+        int32_t fast_open = false;
+
+        static char *kwlist[] = {"filename",
+                                 "timeout",
+                                 "fast_open",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O&|dp:get_video_frame_num",
+                                         kwlist,
+                                         parse_video_source,
+                                         &source,
+                                         &timeout,
+                                         &fast_open))
+                return NULL;
+
+        struct video_stream_context vid_ctx;
+
+        int32_t status = open_vid_stream_context(&vid_ctx,
+                                                 &source,
+                                                 timeout_to_ms(timeout),
+                                                 fast_open,
+                                                 false);
+        
+        if (status != LOADVID_SUCCESS) {
+                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+                return NULL;
+        }
+        frame_num = vid_ctx.nb_frames;
+
+        clean_up_vid_ctx(&vid_ctx);
+
+        return Py_BuildValue("i", frame_num);
+}
+
+
+
+/**
+ * keyframes_to_list() - Builds a Python list of the `num_keyframes` int64s
+ * (or doubles, if `times` is non-NULL) in the keyframe array of a probe.
+ */
+static PyObject *
+keyframes_to_list(const int64_t *values,
+                  const double *times,
+                  int64_t num_keyframes)
+{
+        PyObject *list = PyList_New(num_keyframes);
+        if (list == NULL)
+                return NULL;
+
+        int64_t i;
+        for (i = 0;
+             i < num_keyframes;
+             ++i) {
+                PyObject *item = (times != NULL) ?
+                                 PyFloat_FromDouble(times[i]) :
+                                 PyLong_FromLongLong(values[i]);
+                if (item == NULL) {
+                        Py_DECREF(list);
+                        return NULL;
+                }
+                PyList_SET_ITEM(list, i, item);
+        }
+
+        return list;
+}
+
+/**
+ * probe_to_dict() - Builds the dict returned by probe_many() for one file.
+ * @probe: Metadata as read by probe_video().
+ * @filename: Python str path of the probed file.
+ * @should_scan_packets: True iff GOP statistics were gathered.
+ */
+static PyObject *
+probe_to_dict(const struct video_probe *probe,
+              PyObject *filename,
+              bool should_scan_packets)
+{
+        if (probe->error_msg[0] != '\0')
+                return Py_BuildValue("{s:O,s:s}",
+                                     "filename", filename,
+                                     "error", probe->error_msg);
+
+        PyObject *result = Py_BuildValue("{s:O,s:O,s:i,s:i,s:d,s:d,s:L,s:O,s:s,s:s}",
+                                         "filename", filename,
+                                         "error", Py_None,
+                                         "width", probe->width,
+                                         "height", probe->height,
+                                         "fps", probe->fps,
+                                         "duration", probe->duration,
+                                         "frame_count", (long long)probe->nb_frames,
+                                         "frame_count_exact",
+                                         probe->is_nb_frames_exact ? Py_True : Py_False,
+                                         "codec", probe->codec_name,
+                                         "pix_fmt", probe->pix_fmt_name);
+        if (result == NULL)
+                return NULL;
+
+        PyObject *gop_stats = Py_None;
+        Py_INCREF(gop_stats);
+        if (should_scan_packets) {
+                Py_DECREF(gop_stats);
+                gop_stats = Py_BuildValue(
+                        "{s:L,s:L,s:d,s:N,s:N,s:N}",
+                        "num_keyframes", (long long)probe->num_keyframes,
+                        "max_gop_size", (long long)probe->max_gop_size,
+                        "mean_gop_size",
+                        (probe->num_keyframes > 0) ?
+                        (double)probe->nb_frames/probe->num_keyframes : 0.0,
+                        "keyframe_frame_nums",
+                        keyframes_to_list(probe->keyframe_frame_nums,
+                                          NULL,
+                                          probe->num_keyframes),
+                        "keyframe_pos",
+                        keyframes_to_list(probe->keyframe_pos,
+                                          NULL,
+                                          probe->num_keyframes),
+                        "keyframe_times",
+                        keyframes_to_list(NULL,
+                                          probe->keyframe_times,
+                                          probe->num_keyframes));
+                if (gop_stats == NULL) {
+                        Py_DECREF(result);
+                        return NULL;
+                }
+        }
+
+        int32_t status = PyDict_SetItemString(result, "gop", gop_stats);
+        Py_DECREF(gop_stats);
+        if (status < 0) {
+                Py_DECREF(result);
+                return NULL;
+        }
+
+        return result;
+}
+
+static PyObject *
+probe_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+        PyObject *result = NULL;
+        PyObject *filenames = NULL;
+        int32_t num_workers = 4;
+        double timeout = 0.0;
+        int32_t gop_stats = false;
+
+        static char *kwlist[] = {"filenames",
+                                 "workers",
+                                 "timeout",
+                                 "gop_stats",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O|idp:probe_many",
+                                         kwlist,
+                                         &filenames,
+                                         &num_workers,
+                                         &timeout,
+                                         &gop_stats))
+                return NULL;
+
+        /**
+         * NOTE: Copy to a tuple, so that the UTF-8 paths borrowed from its
+         * items stay alive while the GIL is released.
+         */
+        PyObject *paths_tuple = PySequence_Tuple(filenames);
+        if (paths_tuple == NULL)
+                return NULL;
+
+        const Py_ssize_t num_files = PyTuple_GET_SIZE(paths_tuple);
+        const char **paths = PyMem_RawMalloc(num_files*sizeof(char *) + 1);
+        struct video_probe *probes =
+                PyMem_RawMalloc(num_files*sizeof(struct video_probe) + 1);
+        if ((paths == NULL) || (probes == NULL)) {
+                PyErr_NoMemory();
+                goto clean_up;
+        }
+
+        Py_ssize_t i;
+        for (i = 0;
+             i < num_files;
+             ++i) {
+                paths[i] = PyUnicode_AsUTF8(PyTuple_GET_ITEM(paths_tuple, i));
+                if (paths[i] == NULL)
+                        goto clean_up;
+        }
+
+        int32_t timeout_ms = timeout_to_ms(timeout);
+        Py_BEGIN_ALLOW_THREADS
+        probe_videos(probes,
+                     paths,
+                     num_files,
+                     num_workers,
+                     timeout_ms,
+                     gop_stats);
+        Py_END_ALLOW_THREADS
+
+        result = PyList_New(num_files);
+        for (i = 0;
+             (i < num_files) && (result != NULL);
+             ++i) {
+                PyObject *probe = probe_to_dict(&probes[i],
+                                                PyTuple_GET_ITEM(paths_tuple, i),
+                                                gop_stats);
+                if (probe == NULL) {
+                        Py_CLEAR(result);
+                        break;
+                }
+                PyList_SET_ITEM(result, i, probe);
+        }
+
+        for (i = 0;
+             i < num_files;
+             ++i)
+                free_video_probe(&probes[i]);
+
+clean_up:
+        PyMem_RawFree(probes);
+        PyMem_RawFree(paths);
+        Py_DECREF(paths_tuple);
+
+        return result;
+}
+
+
+static PyObject *
+loadvid(PyObject *self, PyObject *args, PyObject *kw)
+{
+        PyObject *result = NULL;
+        struct video_source source;
+        int32_t should_random_seek = true;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t num_frames = 32;
+        float seek_distance = 0.0f;
+        double timeout = 0.0;
+        int32_t allow_partial = false;
+        int32_t num_decoded = 0;
+        double target_fps = 0.0;
+        int32_t fast_open = false;
+        PyObject *out = NULL;
+        int32_t audio_rate = 0;
+        int32_t audio_channels = 1;
+        PyObject *seed = NULL;
+        const char *random_seek_mode = "uniform";
+        uint64_t rng_state;
+        struct output_buffer output;
+        int64_t *timestamps = NULL;
+        static char *kwlist[] = {"filename",
+                                 "should_random_seek",
+                                 "width",
+                                 "height",
+                                 "num_frames",
+                                 "timeout",
+                                 "allow_partial",
+                                 "target_fps",
+                                 "fast_open",
+                                 "out",
+                                 "audio_rate",
+                                 "audio_channels",
+                                 "seed",
+                                 "random_seek_mode",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O&|$pIIIdpdpOiiOs:loadvid",
+                                         kwlist,
+                                         parse_video_source,
+                                         &source,
+                                         &should_random_seek,
+                                         &width,
+                                         &height,
+                                         &num_frames,
+                                         &timeout,
+                                         &allow_partial,
+                                         &target_fps,
+                                         &fast_open,
+                                         &out,
+                                         &audio_rate,
+                                         &audio_channels,
+                                         &seed,
+                                         &random_seek_mode))
+                return NULL;
+
+        if ((audio_rate > 0) && (audio_channels <= 0)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "audio_channels must be positive");
+                return NULL;
+        }
+
+        bool is_keyframe_mode = (strcmp(random_seek_mode, "keyframe") == 0);
+        if (!is_keyframe_mode && (strcmp(random_seek_mode, "uniform") != 0)) {
+                PyErr_Format(PyExc_ValueError,
+                             "unknown random_seek_mode '%s'",
+                             random_seek_mode);
+                return NULL;
+        }
+
+        if (get_call_seed(&rng_state, self, seed) < 0)
+                return NULL;
+
+        if (acquire_output(&output, out) < 0) {
+                release_output(&output);
+                return NULL;
+        }
+
+        struct video_stream_context vid_ctx;
+        int32_t status = open_vid_stream_context(&vid_ctx,
+                                                 &source,
+                                                 timeout_to_ms(timeout),
+                                                 fast_open,
+                                                 false);
+        if (status != LOADVID_SUCCESS) {
+                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+                release_output(&output);
+                return NULL;
+        }
+        vid_ctx.rng_state = rng_state;
+
+        bool is_size_dynamic = get_vid_width_height(&width,
+                                                    &height,
+                                                    &vid_ctx);
+        // add for width/height error
+        if (vid_ctx.error_type != NULL) {
+                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+                goto clean_up_av_frame;
+        }
+
+        if ((audio_rate > 0) &&
+            !attach_audio_stream(&vid_ctx, audio_rate, audio_channels)) {
+                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+                goto clean_up_av_frame;
+        }
+
+        if (prepare_output(&output, num_frames*width*height*3) < 0)
+                goto clean_up_av_frame;
+        set_frames_shape(&output, num_frames, width, height);
+
+        /**
+         * NOTE: At a target_fps, `num_frames` output frames span
+         * num_frames*fps/target_fps frames of the source video, which must
+         * fit after the random seek point.
+         */
+        AVStream *video_stream =
+                vid_ctx.format_context->streams[vid_ctx.video_stream_index];
+        uint32_t num_seek_frames = num_frames;
+        if ((target_fps > 0.0) && (video_stream->avg_frame_rate.den > 0))
+                num_seek_frames = (uint32_t)ceil(
+                        num_frames*av_q2d(video_stream->avg_frame_rate)/target_fps);
+
+        /**
+         * NOTE: In keyframe mode, the clip starts at a random keyframe, so no
+         * pre-roll frames are decoded and dropped. Videos without a seek
+         * index fall back to a random timestamp.
+         */
+        int64_t timestamp = AV_NOPTS_VALUE;
+        int64_t keyframe_start = AV_NOPTS_VALUE;
+        bool is_keyframe_start = false;
+        if (should_random_seek && is_keyframe_mode)
+                is_keyframe_start = seek_to_random_keyframe(&keyframe_start,
+                                                            &seek_distance,
+                                                            &vid_ctx,
+                                                            num_seek_frames);
+        if (!is_keyframe_start && (vid_ctx.error_type == NULL))
+                timestamp = seek_to_closest_keypoint(&seek_distance,
+                                                     &vid_ctx,
+                                                     should_random_seek,
+                                                     num_seek_frames);
+    
+        if (vid_ctx.error_type != NULL) {
+                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+                goto clean_up_av_frame;
+        }
+
+        /**
+         * NOTE: Without a random seek, seek_to_closest_keypoint() returns 0
+         * rather than a timestamp, so the span starts at the stream start,
+         * which is nonzero for, e.g., MPEG-TS.
+         */
+        int64_t start = is_keyframe_start ? keyframe_start : timestamp;
+        if (!should_random_seek || (start == AV_NOPTS_VALUE))
+                start = seconds_to_stream_timestamp(&vid_ctx, 0.0);
+
+        /**
+         * NOTE: The audio spans the output frames: `num_frames` frames of
+         * 1/target_fps seconds at a target_fps, or the `num_seek_frames`
+         * source frames otherwise.
+         */
+        bool is_audio_started;
+        if (target_fps > 0.0)
+                is_audio_started = start_audio_span(&vid_ctx,
+                                                    start,
+                                                    num_frames,
+                                                    1.0/target_fps);
+        else
+                is_audio_started = start_audio_span(&vid_ctx,
+                                                    start,
+                                                    num_seek_frames,
+                                                    get_frame_seconds(&vid_ctx));
+        if (!is_audio_started) {
+                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+                goto clean_up_av_frame;
+        }
+
+        /*
+         * NOTE(brendan): after this point, the only possible errors are due to
+         * not having enough frames in the video stream past the initial seek
+         * point. All other errors are covered by asserts.
+         *
+         * Therefore we return the frames buffer regardless, and it is a
+         * feature to return garbage in the decoded video output buffer, rather
+         * than returning an error, if there weren't any frames to decode in
+         * the first place.
+         */
+        if (target_fps > 0.0) {
+                timestamps = PyMem_RawMalloc(num_frames*sizeof(int64_t));
+                if (timestamps == NULL) {
+                        PyErr_NoMemory();
+                        goto clean_up_av_frame;
+                }
+
+                double ticks_per_frame =
+                        1.0/(target_fps*av_q2d(video_stream->time_base));
+                uint32_t i;
+                for (i = 0;
+                     i < num_frames;
+                     ++i)
+                        timestamps[i] = start + llround(i*ticks_per_frame);
+
+                /**
+                 * NOTE: Frames are picked by PTS, so the pre-roll frames from
+                 * the keyframe up to `start` are decoded but never converted,
+                 * and skip_past_timestamp() is not needed.
+                 */
+                num_decoded = decode_video_from_timestamps(output.data,
+                                                           &vid_ctx,
+                                                           num_frames,
+                                                           timestamps,
+                                                           width,
+                                                           height,
+                                                           false);
+        } else {
+                status = skip_past_timestamp(&vid_ctx, timestamp);
+                if (status == VID_DECODE_TIMEOUT) {
+                        if (!allow_partial) {
+                                PyErr_SetString(vid_ctx.error_type,
+                                                vid_ctx.error_msg);
+                                goto clean_up_av_frame;
+                        }
+                } else if (status != VID_DECODE_SUCCESS) {
+                        PyErr_SetString(PyExc_ValueError,
+                                        "skip past timestamp error.");
+                        goto clean_up_av_frame;
+                } else {
+                        int64_t first_pts = AV_NOPTS_VALUE;
+                        num_decoded = decode_video_to_out_buffer(output.data,
+                                                                 &vid_ctx,
+                                                                 num_frames,
+                                                                 &first_pts);
+
+                        /**
+                         * NOTE: The index may hold decode timestamps, e.g.,
+                         * for MP4, so the start is reported from the first
+                         * frame itself.
+                         */
+                        if (is_keyframe_start &&
+                            (first_pts != AV_NOPTS_VALUE))
+                                seek_distance = first_pts*
+                                                av_q2d(video_stream->time_base);
+                }
+        }
+        finish_audio_span(&vid_ctx);
+
+        if ((vid_ctx.error_type != NULL) &&
+            !(allow_partial && (vid_ctx.error_type == PyExc_TimeoutError))) {
+                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+                goto clean_up_av_frame;
+        }
+
+        if (allow_partial &&
+            (truncate_output(&output, num_decoded, width*height*3) < 0))
+                goto clean_up_av_frame;
+
+        PyObject *frames = output.obj;
+        if (allow_partial) {
+                if (!is_size_dynamic)
+                        result = Py_BuildValue("Ofi",
+                                               frames,
+                                               seek_distance,
+                                               num_decoded);
+                else
+                        result = Py_BuildValue("Oiifi",
+                                               frames,
+                                               width,
+                                               height,
+                                               seek_distance,
+                                               num_decoded);
+        } else if (!is_size_dynamic) {
+                result = Py_BuildValue("Of", frames, seek_distance);
+        } else {
+                result = Py_BuildValue("Oiif",
+                                       frames,
+                                       width,
+                                       height,
+                                       seek_distance);
+        }
+
+        if ((result != NULL) && (audio_rate > 0)) {
+                PyObject *audio = audio_to_pyobject(&vid_ctx);
+                if (audio == NULL)
+                        Py_CLEAR(result);
+                else
+                        result = Py_BuildValue("(NN)", result, audio);
+        }
+
+clean_up_av_frame:
+        PyMem_RawFree(timestamps);
+        clean_up_vid_ctx(&vid_ctx);
+        release_output(&output);
+
+        return result;
+}
+
+static PyObject *
+set_buffer_pool(PyObject *self, PyObject *args, PyObject *kw)
+{
+        int32_t enabled = true;
+        Py_ssize_t max_cached_bytes = DEFAULT_BUFFER_POOL_BYTES;
+        int32_t huge_pages = false;
+
+        static char *kwlist[] = {"enabled",
+                                 "max_cached_bytes",
+                                 "huge_pages",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "|pnp:set_buffer_pool",
+                                         kwlist,
+                                         &enabled,
+                                         &max_cached_bytes,
+                                         &huge_pages))
+                return NULL;
+
+        if (max_cached_bytes < 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "max_cached_bytes must be non-negative");
+                return NULL;
+        }
+
+        __atomic_store_n(&is_buffer_pool_enabled, enabled, __ATOMIC_RELAXED);
+        buffer_pool_configure(enabled ? (size_t)max_cached_bytes : 0,
+                              huge_pages);
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+set_codec_pool(PyObject *self, PyObject *args, PyObject *kw)
+{
+        int32_t enabled = true;
+        int32_t max_cached_contexts = DEFAULT_CODEC_POOL_SIZE;
+
+        static char *kwlist[] = {"enabled",
+                                 "max_cached_contexts",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "|pi:set_codec_pool",
+                                         kwlist,
+                                         &enabled,
+                                         &max_cached_contexts))
+                return NULL;
+
+        if (max_cached_contexts < 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "max_cached_contexts must be non-negative");
+                return NULL;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        codec_pool_configure(enabled ? max_cached_contexts : 0);
+        Py_END_ALLOW_THREADS
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+set_handle_cache(PyObject *self, PyObject *args, PyObject *kw)
+{
+        int32_t enabled = true;
+        int32_t max_handles = DEFAULT_HANDLE_CACHE_SIZE;
+
+        static char *kwlist[] = {"enabled",
+                                 "max_handles",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "|pi:set_handle_cache",
+                                         kwlist,
+                                         &enabled,
+                                         &max_handles))
+                return NULL;
+
+        if (max_handles < 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "max_handles must be non-negative");
+                return NULL;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        handle_cache_configure(enabled ? max_handles : 0);
+        Py_END_ALLOW_THREADS
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+decode_stats(PyObject *self, PyObject *args, PyObject *kw)
+{
+        int32_t should_reset = false;
+
+        static char *kwlist[] = {"reset", 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "|p:decode_stats",
+                                         kwlist,
+                                         &should_reset))
+                return NULL;
+
+        struct handle_cache_stats cache_stats;
+        handle_cache_get_stats(&cache_stats, should_reset);
+        struct file_io_stats io_stats;
+        file_io_get_stats(&io_stats, should_reset);
+
+        uint64_t prefetched;
+        uint64_t prefetch_errors;
+        if (should_reset) {
+                prefetched = __atomic_exchange_n(&num_prefetched,
+                                                 0,
+                                                 __ATOMIC_RELAXED);
+                prefetch_errors = __atomic_exchange_n(&num_prefetch_errors,
+                                                      0,
+                                                      __ATOMIC_RELAXED);
+        } else {
+                prefetched = __atomic_load_n(&num_prefetched,
+                                             __ATOMIC_RELAXED);
+                prefetch_errors = __atomic_load_n(&num_prefetch_errors,
+                                                  __ATOMIC_RELAXED);
+        }
+
+        return Py_BuildValue("{s:K,s:K,s:K,s:i,s:K,s:K,s:K,s:K,s:K,s:K}",
+                             "handle_cache_hits",
+                             (unsigned long long)cache_stats.hits,
+                             "handle_cache_misses",
+                             (unsigned long long)cache_stats.misses,
+                             "handle_cache_evictions",
+                             (unsigned long long)cache_stats.evictions,
+                             "handle_cache_size",
+                             cache_stats.num_handles,
+                             "io_reads",
+                             (unsigned long long)io_stats.reads,
+                             "io_bytes_read",
+                             (unsigned long long)io_stats.bytes_read,
+                             "io_seeks",
+                             (unsigned long long)io_stats.seeks,
+                             "io_readahead_hits",
+                             (unsigned long long)io_stats.readahead_hits,
+                             "prefetched",
+                             (unsigned long long)prefetched,
+                             "prefetch_errors",
+                             (unsigned long long)prefetch_errors);
+}
+
+static PyObject *
+set_file_io(PyObject *self, PyObject *args, PyObject *kw)
+{
+        const char *backend_name;
+
+        static char *kwlist[] = {"backend", 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "s:set_file_io",
+                                         kwlist,
+                                         &backend_name))
+                return NULL;
+
+        enum file_io_backend backend;
+        if (strcmp(backend_name, "ffmpeg") == 0) {
+                backend = FILE_IO_FFMPEG;
+        } else if (strcmp(backend_name, "pread") == 0) {
+                backend = FILE_IO_PREAD;
+        } else if (strcmp(backend_name, "io_uring") == 0) {
+                if (!file_io_has_io_uring()) {
+                        PyErr_SetString(PyExc_ValueError,
+                                        "lintel was built without io_uring; "
+                                        "set LINTEL_WITH_IO_URING=1 to build it");
+                        return NULL;
+                }
+                backend = FILE_IO_IO_URING;
+        } else {
+                PyErr_Format(PyExc_ValueError,
+                             "backend must be 'ffmpeg', 'pread' or 'io_uring', "
+                             "not '%s'",
+                             backend_name);
+                return NULL;
+        }
+
+        __atomic_store_n(&file_io_backend, backend, __ATOMIC_RELAXED);
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+index_shard(PyObject *self, PyObject *args, PyObject *kw)
+{
+        const char *path;
+
+        static char *kwlist[] = {"path", 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "s:index_shard",
+                                         kwlist,
+                                         &path))
+                return NULL;
+
+        struct tar_shard *shard;
+        char error_buf[VID_CTX_ERROR_SIZE];
+        Py_BEGIN_ALLOW_THREADS
+        shard = tar_shard_get(path, true, error_buf, sizeof(error_buf));
+        Py_END_ALLOW_THREADS
+        if (shard == NULL) {
+                PyErr_SetString(PyExc_IOError, error_buf);
+                return NULL;
+        }
+
+        const struct tar_member *members;
+        int64_t num_members = tar_shard_members(shard, &members);
+        PyObject *result = PyList_New(num_members);
+        if (result == NULL)
+                goto out_put_shard;
+
+        int64_t i;
+        for (i = 0;
+             i < num_members;
+             ++i) {
+                PyObject *item = Py_BuildValue("(sLL)",
+                                               members[i].name,
+                                               (long long)members[i].offset,
+                                               (long long)members[i].length);
+                if (item == NULL) {
+                        Py_CLEAR(result);
+                        goto out_put_shard;
+                }
+                PyList_SET_ITEM(result, i, item);
+        }
+
+out_put_shard:
+        tar_shard_put(&shard);
+
+        return result;
+}
+
+static PyObject *
+set_rgb_kernel(PyObject *self, PyObject *args, PyObject *kw)
+{
+        const char *kernel;
+
+        static char *kwlist[] = {"kernel", 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "s:set_rgb_kernel",
+                                         kwlist,
+                                         &kernel))
+                return NULL;
+
+        enum rgb_kernel new_kernel;
+        if (strcmp(kernel, "bilinear") == 0) {
+                new_kernel = RGB_KERNEL_BILINEAR;
+        } else if (strcmp(kernel, "area") == 0) {
+                new_kernel = RGB_KERNEL_AREA;
+        } else if (strcmp(kernel, "swscale") == 0) {
+                new_kernel = RGB_KERNEL_SWSCALE;
+        } else if (strcmp(kernel, "reference") == 0) {
+                new_kernel = RGB_KERNEL_REFERENCE;
+        } else {
+                PyErr_Format(PyExc_ValueError,
+                             "kernel must be 'bilinear', 'area', 'swscale' or 'reference', not '%s'",
+                             kernel);
+                return NULL;
+        }
+        __atomic_store_n(&rgb_kernel, new_kernel, __ATOMIC_RELAXED);
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+set_tensor_output(PyObject *self, PyObject *args, PyObject *kw)
+{
+        int32_t enabled = true;
+
+        static char *kwlist[] = {"enabled", 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "|p:set_tensor_output",
+                                         kwlist,
+                                         &enabled))
+                return NULL;
+
+        __atomic_store_n(&is_tensor_output_enabled, enabled, __ATOMIC_RELAXED);
+
+        Py_RETURN_NONE;
+}
+
+/**
+ * struct video_reader - A video kept open across calls, with a clip cursor.
+ * @vid_ctx: Context of the video, open iff `is_open`.
+ * @cursor: Position of the decoder of `vid_ctx`.
+ * @width: Width of the output frames.
+ * @height: Height of the output frames.
+ * @timeout_ms: Deadline of opening the video, and of each call, in
+ * milliseconds.
+ * @fps: Average frame rate of the video stream.
+ * @duration_seconds: Duration of the video stream, in seconds.
+ * @position: First frame of the next clip of next_clip().
+ * @is_open: False once close() has been called.
+ * @is_busy: Set while a call is decoding without the GIL, so that calls on
+ * the same reader from other threads raise rather than race.
+ */
+struct video_reader {
+        PyObject_HEAD
+        struct video_stream_context vid_ctx;
+        struct decode_cursor cursor;
+        uint32_t width;
+        uint32_t height;
+        int32_t timeout_ms;
+        double fps;
+        double duration_seconds;
+        int64_t position;
+        bool is_open;
+        bool is_busy;
+};
+
+static int
+video_reader_init(struct video_reader *reader, PyObject *args, PyObject *kw)
+{
+        struct video_source source;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t resize = 0;
+        double timeout = 0.0;
+        int32_t fast_open = false;
+
+        static char *kwlist[] = {"filename",
+                                 "width",
+                                 "height",
+                                 "resize",
+                                 "timeout",
+                                 "fast_open",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "O&|IIIdp:VideoReader",
+                                         kwlist,
+                                         parse_video_source,
+                                         &source,
+                                         &width,
+                                         &height,
+                                         &resize,
+                                         &timeout,
+                                         &fast_open))
+                return -1;
+
+        if ((width == 0) != (height == 0)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "width and height must be set together");
+                return -1;
+        }
+
+        if (reader->is_open) {
+                PyErr_SetString(PyExc_RuntimeError,
+                                "VideoReader is already open");
+                return -1;
+        }
+
+        struct video_stream_context *vid_ctx = &reader->vid_ctx;
+        int32_t status;
+        reader->timeout_ms = timeout_to_ms(timeout);
+        Py_BEGIN_ALLOW_THREADS
+        status = setup_vid_stream_context_filename(vid_ctx,
+                                                   &source,
+                                                   reader->timeout_ms,
+                                                   fast_open,
+                                                   false);
+        Py_END_ALLOW_THREADS
+        if (status != LOADVID_SUCCESS) {
+                PyErr_SetString(vid_ctx->error_type, vid_ctx->error_msg);
+                return -1;
+        }
+        reader->is_open = true;
+        init_decode_cursor(&reader->cursor);
+        reader->position = 0;
+
+        AVStream *video_stream =
+                vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        reader->fps = av_q2d(video_stream->avg_frame_rate);
+        reader->duration_seconds =
+                vid_ctx->duration*av_q2d(video_stream->time_base);
+
+        /**
+         * NOTE: `resize` scales the shorter side of the video to `resize`, as
+         * for loadvid_frame_nums(), and otherwise the frames are output at
+         * `width` by `height`, or at the size of the video.
+         */
+        const uint32_t video_width = vid_ctx->codec_context->width;
+        const uint32_t video_height = vid_ctx->codec_context->height;
+        if (resize != 0) {
+                if (video_width < video_height) {
+                        width = resize;
+                        height = (uint32_t)((uint64_t)resize*video_height/
+                                            video_width);
+                } else {
+                        height = resize;
+                        width = (uint32_t)((uint64_t)resize*video_width/
+                                           video_height);
+                }
+        } else if (width == 0) {
+                width = video_width;
+                height = video_height;
+        }
+        reader->width = width;
+        reader->height = height;
+
+        return 0;
+}
+
+static void
+video_reader_close_ctx(struct video_reader *reader)
+{
+        if (!reader->is_open)
+                return;
+
+        clean_up_vid_ctx(&reader->vid_ctx);
+        reader->is_open = false;
+}
 
-        int32_t *frame_nums_buf = PyMem_RawMalloc(num_frames*sizeof(int32_t));
-        if (frame_nums_buf == NULL)
-                return PyErr_NoMemory();
+static void
+video_reader_dealloc(struct video_reader *reader)
+{
+        video_reader_close_ctx(reader);
+        Py_TYPE(reader)->tp_free((PyObject *)reader);
+}
 
-        int32_t i;
-        for (i = 0;
-             i < num_frames;
-             ++i) {
-                PyObject *item = PySequence_GetItem(frame_nums, i);
-                if (item == NULL)
-                        goto clean_up;
+/**
+ * acquire_video_reader() - Claims `reader` for one call, failing if it is
+ * closed or in use by another thread.
+ *
+ * Returns 0 on success, and -1 with a Python exception set on failure. On
+ * success, `reader` must be released with release_video_reader().
+ */
+static int32_t
+acquire_video_reader(struct video_reader *reader)
+{
+        if (__atomic_exchange_n(&reader->is_busy, true, __ATOMIC_ACQUIRE)) {
+                PyErr_SetString(PyExc_RuntimeError,
+                                "VideoReader is in use by another thread");
+                return -1;
+        }
 
-                frame_nums_buf[i] = PyLong_AsLong(item);
-                Py_DECREF(item);
-                if (PyErr_Occurred())
-                        goto clean_up;
+        if (!reader->is_open) {
+                __atomic_store_n(&reader->is_busy, false, __ATOMIC_RELEASE);
+                PyErr_SetString(PyExc_ValueError,
+                                "I/O operation on closed VideoReader");
+                return -1;
         }
 
-        result = (PyObject *)frames;
+        return 0;
+}
+
+static void
+release_video_reader(struct video_reader *reader)
+{
+        __atomic_store_n(&reader->is_busy, false, __ATOMIC_RELEASE);
+}
 
-        decode_video_from_frame_nums((uint8_t *)(frames->ob_bytes),
-                                                 &vid_ctx,
-                                                 num_frames,
-                                                 frame_nums_buf,
-                                                 &rewidth,
-                                                 &reheight,
-                                                 should_key,
-                                                 should_seek);
-        if (vid_ctx.error_type != NULL) {
-                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+/**
+ * video_reader_decode() - Decodes the `num_frames` frames of `frame_nums`
+ * with the cursor of `reader`, which must be acquired.
+ *
+ * Returns the frames, truncated to those before the end of the video, and
+ * shaped (frames, height, width, 3) if a FrameBuffer. Returns NULL with a
+ * Python exception set on failure.
+ */
+static PyObject *
+video_reader_decode(struct video_reader *reader,
+                    const int64_t *frame_nums,
+                    int32_t num_frames)
+{
+        struct video_stream_context *vid_ctx = &reader->vid_ctx;
+        const uint32_t bytes_per_frame = 3*reader->width*reader->height;
+        struct output_buffer output;
+        PyObject *result = NULL;
+        int32_t num_decoded;
+
+        if (num_frames <= 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "at least one frame must be requested");
+                return NULL;
+        }
+        if ((uint64_t)num_frames*bytes_per_frame > UINT32_MAX) {
+                PyErr_SetString(PyExc_ValueError, "too many frames requested");
                 return NULL;
         }
-    
-        PyMem_RawFree(frame_nums_buf);
 
-clean_up:
-        clean_up_vid_ctx(&vid_ctx);
+        acquire_output(&output, NULL);
+        if (prepare_output(&output, (uint32_t)num_frames*bytes_per_frame) < 0)
+                goto out_release_output;
+        set_frames_shape(&output, num_frames, reader->width, reader->height);
 
-        if (result != (PyObject *)frames) {
-                Py_CLEAR(frames);
-                return result;
+        vid_ctx->error_type = NULL;
+        Py_BEGIN_ALLOW_THREADS
+        set_decode_deadline(vid_ctx, reader->timeout_ms);
+        num_decoded = decode_video_from_cursor(output.data,
+                                               vid_ctx,
+                                               &reader->cursor,
+                                               num_frames,
+                                               frame_nums,
+                                               reader->width,
+                                               reader->height);
+        Py_END_ALLOW_THREADS
+        if (vid_ctx->error_type != NULL) {
+                PyErr_SetString(vid_ctx->error_type, vid_ctx->error_msg);
+                goto out_release_output;
         }
 
-        if (!is_size_dynamic && resize == 0)
-                return (PyObject *)frames;
+        if (truncate_output(&output, num_decoded, bytes_per_frame) < 0)
+                goto out_release_output;
+
+        result = output.obj;
+        Py_INCREF(result);
 
-        result = Py_BuildValue("Oii", frames, rewidth, reheight);
-        Py_DECREF(frames);
+out_release_output:
+        release_output(&output);
 
         return result;
 }
 
 static PyObject *
-frame_count(PyObject *self, PyObject *args, PyObject *kw)
+video_reader_read(struct video_reader *reader, PyObject *args, PyObject *kw)
 {
-        const char *filename = NULL;
-        int64_t frame_num = 0;
-        int32_t timeout = 0;
+        PyObject *frame_nums = NULL;
+        PyObject *result = NULL;
+        int64_t *targets = NULL;
 
-        static char *kwlist[] = {"filename",
-                                 "timeout",
-                                 0};
+        static char *kwlist[] = {"frame_nums", 0};
 
         if (!PyArg_ParseTupleAndKeywords(args,
                                          kw,
-                                         "s|I:get_video_frame_num",
+                                         "O:read",
                                          kwlist,
-                                         &filename,
-                                         &timeout))
+                                         &frame_nums))
                 return NULL;
-    
-        if (timeout <= 0) {
-            timeout = DEFAULT_TIMEOUT_SEC;
+
+        PyObject *items = PySequence_Fast(frame_nums,
+                                          "frame_nums needs to be a sequence");
+        if (items == NULL)
+                return NULL;
+
+        const Py_ssize_t num_frames = PySequence_Fast_GET_SIZE(items);
+        if (num_frames > INT32_MAX) {
+                PyErr_SetString(PyExc_ValueError, "too many frames requested");
+                goto out_decref_items;
         }
 
-        struct video_stream_context vid_ctx;
+        targets = PyMem_Malloc((num_frames + 1)*sizeof(int64_t));
+        if (targets == NULL) {
+                PyErr_NoMemory();
+                goto out_decref_items;
+        }
 
-        int32_t status = setup_vid_stream_context_filename(&vid_ctx, filename, timeout);
-        
-        if (status != LOADVID_SUCCESS) {
-                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
-                return NULL;
+        Py_ssize_t i;
+        for (i = 0;
+             i < num_frames;
+             ++i) {
+                targets[i] = PyLong_AsLongLong(
+                        PySequence_Fast_GET_ITEM(items, i));
+                if (PyErr_Occurred())
+                        goto out_free_targets;
+                if ((targets[i] < 0) ||
+                    ((i > 0) && (targets[i] < targets[i - 1]))) {
+                        PyErr_SetString(PyExc_ValueError,
+                                        "frame_nums must be non-negative and "
+                                        "non-decreasing");
+                        goto out_free_targets;
+                }
         }
-        frame_num = vid_ctx.nb_frames;
 
-        clean_up_vid_ctx(&vid_ctx);
+        if (acquire_video_reader(reader) < 0)
+                goto out_free_targets;
 
-        return Py_BuildValue("i", frame_num);
-}
+        result = video_reader_decode(reader, targets, num_frames);
+        if ((result != NULL) && (num_frames > 0))
+                reader->position = targets[num_frames - 1] + 1;
 
+        release_video_reader(reader);
 
+out_free_targets:
+        PyMem_Free(targets);
+out_decref_items:
+        Py_DECREF(items);
+
+        return result;
+}
 
 static PyObject *
-loadvid(PyObject *self, PyObject *args, PyObject *kw)
+video_reader_next_clip(struct video_reader *reader,
+                       PyObject *args,
+                       PyObject *kw)
 {
+        int32_t num_frames = 0;
+        int32_t stride = 1;
         PyObject *result = NULL;
-        const char *filename = NULL;
-        Py_ssize_t in_size_bytes = 0;
-        bool should_random_seek = true;
-        uint32_t width = 0;
-        uint32_t height = 0;
-        uint32_t num_frames = 32;
-        float seek_distance = 0.0f;
-        int32_t timeout = 0;
-        static char *kwlist[] = {"filename",
-                                 "should_random_seek",
-                                 "width",
-                                 "height",
-                                 "num_frames",
-                                 "timeout",
-                                 0};
+
+        static char *kwlist[] = {"num_frames", "stride", 0};
 
         if (!PyArg_ParseTupleAndKeywords(args,
                                          kw,
-                                         "s#|$pIIII:loadvid",
+                                         "i|i:next_clip",
                                          kwlist,
-                                         &filename,
-                                         &in_size_bytes,
-                                         &should_random_seek,
-                                         &width,
-                                         &height,
                                          &num_frames,
-                                         &timeout))
+                                         &stride))
                 return NULL;
-        
-        if (timeout <= 0) {
-            timeout = DEFAULT_TIMEOUT_SEC;
-        }
-
-        struct video_stream_context vid_ctx;
-        int32_t status = setup_vid_stream_context_filename(&vid_ctx, filename, timeout);
 
-        bool is_size_dynamic = get_vid_width_height(&width,
-                                                    &height,
-                                                    &vid_ctx);
-        // add for width/height error
-        if (vid_ctx.error_type != NULL) {
-                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+        if (stride <= 0) {
+                PyErr_SetString(PyExc_ValueError, "stride must be positive");
+                return NULL;
+        }
+        if (num_frames <= 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "num_frames must be positive");
                 return NULL;
         }
 
-        PyByteArrayObject *frames = alloc_pyarray(num_frames*width*height*3);
-        if (PyErr_Occurred() || (frames == NULL))
-                return (PyObject *)frames;
+        int64_t *targets = PyMem_Malloc(num_frames*sizeof(int64_t));
+        if (targets == NULL)
+                return PyErr_NoMemory();
 
-        if (status != LOADVID_SUCCESS) {
-                /**
-                 * NOTE(brendan): In case there was a stream index error,
-                 * return a garbage buffer.
-                 */
-                if (status == LOADVID_ERR_STREAM_INDEX) {
-                          PyErr_SetString(PyExc_ValueError, "Load video stream index error.");
-                          goto return_frames;
-                }
-                PyErr_SetString(PyExc_ValueError, "Load video error.");
+        if (acquire_video_reader(reader) < 0)
+                goto out_free_targets;
+
+        int32_t i;
+        for (i = 0;
+             i < num_frames;
+             ++i)
+                targets[i] = reader->position + (int64_t)i*stride;
+
+        result = video_reader_decode(reader, targets, num_frames);
+        if (result != NULL)
+                reader->position += (int64_t)num_frames*stride;
+
+        release_video_reader(reader);
+
+out_free_targets:
+        PyMem_Free(targets);
+
+        return result;
+}
+
+static PyObject *
+video_reader_seek(struct video_reader *reader, PyObject *args, PyObject *kw)
+{
+        long long frame = 0;
+
+        static char *kwlist[] = {"frame", 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "L:seek",
+                                         kwlist,
+                                         &frame))
                 return NULL;
-        }
 
-        int64_t timestamp = seek_to_closest_keypoint(&seek_distance,
-                                                     &vid_ctx,
-                                                     should_random_seek,
-                                                     num_frames);
-    
-        if (vid_ctx.error_type != NULL) {
-                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+        if (frame < 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "frame must be non-negative");
                 return NULL;
         }
 
-        /*
-         * NOTE(brendan): after this point, the only possible errors are due to
-         * not having enough frames in the video stream past the initial seek
-         * point. All other errors are covered by asserts.
-         *
-         * Therefore we return the frames buffer regardless, and it is a
-         * feature to return garbage in the decoded video output buffer, rather
-         * than returning an error, if there weren't any frames to decode in
-         * the first place.
+        if (acquire_video_reader(reader) < 0)
+                return NULL;
+
+        /**
+         * NOTE: The decoder itself only seeks when the next clip is decoded,
+         * and then only if `frame` is behind it or far ahead of it.
          */
-        result = (PyObject *)frames;
+        reader->position = frame;
 
-        status = skip_past_timestamp(&vid_ctx, timestamp);
-        if (status != VID_DECODE_SUCCESS) {
-                PyErr_SetString(PyExc_ValueError, "skip past timestamp error.");
-                goto clean_up_av_frame;
-        }
+        release_video_reader(reader);
 
-        decode_video_to_out_buffer((uint8_t *)(frames->ob_bytes),
-                                               &vid_ctx,
-                                               num_frames);
-        
-        if (vid_ctx.error_type != NULL) {
-                PyErr_SetString(vid_ctx.error_type, vid_ctx.error_msg);
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+video_reader_close(struct video_reader *reader, PyObject *args)
+{
+        if (__atomic_exchange_n(&reader->is_busy, true, __ATOMIC_ACQUIRE)) {
+                PyErr_SetString(PyExc_RuntimeError,
+                                "VideoReader is in use by another thread");
                 return NULL;
         }
-        
-clean_up_av_frame:
-        clean_up_vid_ctx(&vid_ctx);
 
-        if (result != (PyObject *)frames) {
-                Py_CLEAR(frames);
-                return result;
-        }
+        video_reader_close_ctx(reader);
 
-return_frames:
-        if (!is_size_dynamic)
-                result = Py_BuildValue("Of", frames, seek_distance);
-        else
-                result = Py_BuildValue("Oiif",
-                                       frames,
-                                       width,
-                                       height,
-                                       seek_distance);
-        Py_DECREF(frames);
+        release_video_reader(reader);
 
-        return result;
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+video_reader_enter(struct video_reader *reader, PyObject *args)
+{
+        Py_INCREF(reader);
+
+        return (PyObject *)reader;
+}
+
+static PyObject *
+video_reader_exit(struct video_reader *reader, PyObject *args)
+{
+        return video_reader_close(reader, NULL);
+}
+
+static PyObject *
+video_reader_get_fps(struct video_reader *reader, void *closure)
+{
+        return PyFloat_FromDouble(reader->fps);
+}
+
+static PyObject *
+video_reader_get_duration(struct video_reader *reader, void *closure)
+{
+        return PyFloat_FromDouble(reader->duration_seconds);
+}
+
+static PyObject *
+video_reader_get_frame_count(struct video_reader *reader, void *closure)
+{
+        return PyLong_FromLongLong(reader->vid_ctx.nb_frames);
+}
+
+static PyObject *
+video_reader_get_width(struct video_reader *reader, void *closure)
+{
+        return PyLong_FromUnsignedLong(reader->width);
+}
+
+static PyObject *
+video_reader_get_height(struct video_reader *reader, void *closure)
+{
+        return PyLong_FromUnsignedLong(reader->height);
 }
 
+static PyObject *
+video_reader_get_position(struct video_reader *reader, void *closure)
+{
+        return PyLong_FromLongLong(reader->position);
+}
+
+static PyObject *
+video_reader_get_closed(struct video_reader *reader, void *closure)
+{
+        return PyBool_FromLong(!reader->is_open);
+}
+
+static PyMethodDef video_reader_methods[] = {
+        {"read",
+         (PyCFunction)video_reader_read,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("read(frame_nums) -> frames\n"
+                   "Decodes the frames numbered by the non-decreasing frame_nums,\n"
+                   "going on from the frames last decoded where possible. The next\n"
+                   "clip then starts after the last of frame_nums.")},
+        {"next_clip",
+         (PyCFunction)video_reader_next_clip,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("next_clip(num_frames, stride=1) -> frames\n"
+                   "Decodes num_frames frames, stride apart, from the position, and\n"
+                   "moves the position past them.")},
+        {"seek",
+         (PyCFunction)video_reader_seek,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("seek(frame) -> None\n"
+                   "Moves the position to frame. The decoder only seeks if frame is\n"
+                   "behind the frames last decoded, or far ahead of them.")},
+        {"close",
+         (PyCFunction)video_reader_close,
+         METH_NOARGS,
+         PyDoc_STR("close() -> None\n"
+                   "Closes the video. Called when the VideoReader is collected.")},
+        {"__enter__",
+         (PyCFunction)video_reader_enter,
+         METH_NOARGS,
+         PyDoc_STR("Returns the VideoReader itself.")},
+        {"__exit__",
+         (PyCFunction)video_reader_exit,
+         METH_VARARGS,
+         PyDoc_STR("Closes the video.")},
+        {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef video_reader_getset[] = {
+        {"width",
+         (getter)video_reader_get_width,
+         NULL,
+         PyDoc_STR("Width of the output frames."),
+         NULL},
+        {"height",
+         (getter)video_reader_get_height,
+         NULL,
+         PyDoc_STR("Height of the output frames."),
+         NULL},
+        {"fps",
+         (getter)video_reader_get_fps,
+         NULL,
+         PyDoc_STR("Average frame rate of the video stream."),
+         NULL},
+        {"duration",
+         (getter)video_reader_get_duration,
+         NULL,
+         PyDoc_STR("Duration of the video stream, in seconds."),
+         NULL},
+        {"frame_count",
+         (getter)video_reader_get_frame_count,
+         NULL,
+         PyDoc_STR("(Possibly approximate) number of frames in the video."),
+         NULL},
+        {"position",
+         (getter)video_reader_get_position,
+         NULL,
+         PyDoc_STR("First frame of the next clip of next_clip()."),
+         NULL},
+        {"closed",
+         (getter)video_reader_get_closed,
+         NULL,
+         PyDoc_STR("True once the video is closed."),
+         NULL},
+        {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyDoc_STRVAR(video_reader_doc,
+             "VideoReader(filename, width=0, height=0, resize=0, timeout=0,\n"
+             "            fast_open=False)\n"
+             "A video kept open across calls, for decoding many clips of one\n"
+             "video, e.g., the windows of sliding-window inference. Calls that\n"
+             "move forward go on decoding from the frames last decoded, rather\n"
+             "than opening the video and seeking again. Frames are output at\n"
+             "width by height, or the size of the video, or with resize, with their\n"
+             "shorter side scaled to resize. timeout applies to opening the video\n"
+             "and to each call.\n"
+             "Frames are returned as by loadvid_frame_nums, as a ByteArray object,\n"
+             "or a FrameBuffer shaped (frames, height, width, 3). Frames past the\n"
+             "end of the video are left out, so the last clips may be short, or\n"
+             "empty. Frame indices are found from PTS, as for loadvid_segments.");
+
+static PyTypeObject VideoReader_Type = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "_lintel.VideoReader",
+        .tp_basicsize = sizeof(struct video_reader),
+        .tp_dealloc = (destructor)video_reader_dealloc,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_doc = video_reader_doc,
+        .tp_methods = video_reader_methods,
+        .tp_getset = video_reader_getset,
+        .tp_init = (initproc)video_reader_init,
+        .tp_new = PyType_GenericNew,
+};
+
 static PyMethodDef lintel_methods[] = {
         {"loadvid",
          (PyCFunction)loadvid,
          METH_VARARGS | METH_KEYWORDS,
-         PyDoc_STR("loadvid(encoded_video, should_random_seek, width, height, num_frames) -> "
+         PyDoc_STR("loadvid(encoded_video, should_random_seek, width, height, num_frames, timeout, allow_partial, target_fps, fast_open, out, audio_rate, audio_channels, seed, random_seek_mode) -> "
                    "tuple(decoded video ByteArray object, seek_distance) or\n"
                    "tuple(decoded video ByteArray object, width, height, seek_distance)\n"
-                   "if width and height are not passed as arguments.")},
+                   "if width and height are not passed as arguments.\n"
+                   "timeout is in seconds (may be fractional). With allow_partial, the\n"
+                   "frames decoded before the timeout are returned, with their count\n"
+                   "appended to the tuple.\n"
+                   "If target_fps is set, the clip is resampled to target_fps by PTS.\n"
+                   "If out is a writable buffer, frames are decoded into it, and it is\n"
+                   "returned in place of the ByteArray object.\n"
+                   "If audio_rate is set, the result is tuple(result, audio), where audio\n"
+                   "is a ByteArray of interleaved float32 samples at audio_rate with\n"
+                   "audio_channels channels, decoded in the same pass, or None.\n"
+                   "The random seek is drawn from seed, an int, so that it is\n"
+                   "reproducible, or from a fresh seed if seed is None.\n"
+                   "random_seek_mode is 'uniform' (the default) to draw the start from\n"
+                   "all frames, or 'keyframe' to draw it from the indexed keyframes,\n"
+                   "so that no frames before the start are decoded.")},
         {"loadvid_frame_nums",
          (PyCFunction)loadvid_frame_nums,
          METH_VARARGS | METH_KEYWORDS,
-         PyDoc_STR("loadvid_frame_nums(filename, frame_nums, width, height, resize, should_key, should_seek) -> "
+         PyDoc_STR("loadvid_frame_nums(filename, frame_nums, width, height, resize, should_key, should_seek, timeout, allow_partial, target_fps, fast_open, out, audio_rate, audio_channels, sizes, motion_vectors) -> "
                    "decoded video ByteArray object or\n"
                    "tuple(decoded video ByteArray object, width, height)\n"
-                   "if width and height are not passed as arguments, and resize is zero.")},
+                   "if width and height are not passed as arguments, and resize is zero.\n"
+                   "timeout is in seconds (may be fractional). With allow_partial, the\n"
+                   "frames decoded before the timeout are returned, with their count\n"
+                   "appended to the result.\n"
+                   "If target_fps is set, frame_nums index the video resampled to\n"
+                   "target_fps, and frames are picked by PTS.\n"
+                   "If out is a writable buffer, frames are decoded into it, and it is\n"
+                   "returned in place of the ByteArray object. With allow_partial, out\n"
+                   "is not truncated.\n"
+                   "If audio_rate is set, the result is tuple(result, audio) as for\n"
+                   "loadvid, with the audio spanning the first to the last frame.\n"
+                   "audio_rate can't be combined with should_key.\n"
+                   "If sizes is a list of ints or (width, height) pairs, each frame is\n"
+                   "decoded once, and a list of ByteArray objects, one per size, is\n"
+                   "returned in place of the frames. Smaller sizes are derived from\n"
+                   "larger ones. width, height and resize are then ignored.\n"
+                   "If motion_vectors is set, the motion fields of the frames are\n"
+                   "appended to the result tuple (after the audio), as a ByteArray of\n"
+                   "float32 (dx, dy) in output pixels, with shape (num_frames,\n"
+                   "ceil(height/16), ceil(width/16), 2), from the codec's motion vectors.\n"
+                   "filename may also be a member of a tar shard, as (shard, name) or\n"
+                   "(shard, (offset, length)), for this and the other decode APIs. See\n"
+                   "index_shard.")},
+        {"loadvid_timestamps",
+         (PyCFunction)loadvid_timestamps,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("loadvid_timestamps(filename, seconds, width, height, resize, should_seek, timeout, allow_partial, fast_open, out, audio_rate, audio_channels, sizes, motion_vectors) -> "
+                   "decoded video ByteArray object or\n"
+                   "tuple(decoded video ByteArray object, width, height)\n"
+                   "with the frames shown at each of the non-decreasing times in seconds.\n"
+                   "The result is as for loadvid_frame_nums.")},
 
+        {"loadvid_segments",
+         (PyCFunction)loadvid_segments,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("loadvid_segments(filename, num_segments, mode, width, height, resize, timeout, fast_open, out, seed) -> "
+                   "tuple(decoded video ByteArray object, frame indices) or\n"
+                   "tuple(decoded video ByteArray object, frame indices, width, height)\n"
+                   "if width and height are not passed as arguments, or resize is set.\n"
+                   "Splits the video into num_segments segments of equal duration, and\n"
+                   "decodes one frame per segment: with mode 'keyframe', the keyframe\n"
+                   "before the middle of the segment if it is inside it, with 'nearest',\n"
+                   "the frame at the middle, and with 'random', the frame at a random time\n"
+                   "in the segment, drawn from seed as in loadvid(). The frame indices\n"
+                   "are those of the frames picked.")},
+        {"loadvid_slowfast",
+         (PyCFunction)loadvid_slowfast,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("loadvid_slowfast(filename, fast_frame_nums, slow_frame_nums, alpha, fast_size, slow_size, fast_mean, fast_std, slow_mean, slow_std, should_seek, timeout, fast_open) -> "
+                   "tuple(fast frames, slow frames) or\n"
+                   "tuple(fast frames, slow frames, width, height)\n"
+                   "if fast_size is not passed.\n"
+                   "Decodes the union of the two non-decreasing frame sets once. By\n"
+                   "default the slow set is every alpha-th fast frame. Each pathway has\n"
+                   "its own size (an int or (width, height) pair), and if its mean or std\n"
+                   "is passed, holds float32 (x/255 - mean)/std per RGB channel instead\n"
+                   "of uint8.")},
+        {"submit",
+         (PyCFunction)submit,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("submit(filename, frame_nums, width, height, resize, should_key, should_seek, timeout, allow_partial, target_fps, fast_open, out, audio_rate, audio_channels, sizes, motion_vectors, block) -> "
+                   "concurrent.futures.Future\n"
+                   "Queues loadvid_frame_nums on the native decode workers, and returns a\n"
+                   "future for its result. The GIL is released while decoding.\n"
+                   "If the queue is full, waits for space, or raises BlockingIOError if\n"
+                   "block is False.")},
+        {"start_decode_workers",
+         (PyCFunction)start_decode_workers,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("start_decode_workers(num_workers, queue_size) -> None\n"
+                   "Starts the native decode workers used by submit, with room for\n"
+                   "queue_size pending requests. Otherwise, the first submit starts them\n"
+                   "with the defaults.")},
+        {"shutdown_decode_workers",
+         (PyCFunction)shutdown_decode_workers,
+         METH_NOARGS,
+         PyDoc_STR("shutdown_decode_workers() -> None\n"
+                   "Runs the pending requests, then stops the decode workers for good.")},
+        {"prefetch",
+         (PyCFunction)prefetch,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("prefetch(filenames, timeout, fast_open, block) -> number of files queued\n"
+                   "Opens each of filenames on the decode workers in the background,\n"
+                   "and reads its container header and first GOP (at most 8 MiB), so\n"
+                   "that they are in the page cache for a later decode. If the handle\n"
+                   "cache is enabled (set_handle_cache), the opened video is kept\n"
+                   "there, ready for the next decode call on it. Prefetches share the\n"
+                   "decode queue with submit(). Unless block is set, files that don't\n"
+                   "fit in the queue are skipped. timeout bounds each prefetch.")},
         {"frame_count",
          (PyCFunction)frame_count,
          METH_VARARGS | METH_KEYWORDS,
-         PyDoc_STR("frame_count(filename, should_key) -> "
-                   "frame_num")},
+         PyDoc_STR("frame_count(filename, timeout, fast_open) -> "
+                   "frame_num\n"
+                   "fast_open skips stream info probing when the container header\n"
+                   "is complete, as for the other APIs.")},
+        {"set_buffer_pool",
+         (PyCFunction)set_buffer_pool,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("set_buffer_pool(enabled, max_cached_bytes, huge_pages) -> None\n"
+                   "While enabled, decode APIs return FrameBuffer objects instead of\n"
+                   "ByteArray objects. Their memory is recycled through a pool keeping\n"
+                   "up to max_cached_bytes of idle buffers. With huge_pages, buffers of\n"
+                   "2 MiB or more are backed by transparent huge pages.")},
+        {"set_codec_pool",
+         (PyCFunction)set_codec_pool,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("set_codec_pool(enabled, max_cached_contexts) -> None\n"
+                   "Opened video decoders are kept in a pool of up to\n"
+                   "max_cached_contexts (default 8, at most 64) idle decoders, and\n"
+                   "reused for files with the same codec, size, pixel format, profile\n"
+                   "and extradata. Enabled by default.")},
+        {"set_handle_cache",
+         (PyCFunction)set_handle_cache,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("set_handle_cache(enabled, max_handles) -> None\n"
+                   "While enabled, videos opened by loadvid, loadvid_frame_nums,\n"
+                   "frame_count and the other decode APIs are kept open after the call,\n"
+                   "up to max_handles (default 16, at most 64) idle videos, least\n"
+                   "recently used evicted first. A later call on the same path, with\n"
+                   "the same modification time and size, rewinds an idle video instead\n"
+                   "of opening and probing the file again. Disabled by default.")},
+        {"decode_stats",
+         (PyCFunction)decode_stats,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("decode_stats(reset) -> dict(handle_cache_hits,\n"
+                   "handle_cache_misses, handle_cache_evictions, handle_cache_size,\n"
+                   "io_reads, io_bytes_read, io_seeks, io_readahead_hits, prefetched,\n"
+                   "prefetch_errors)\n"
+                   "Process-wide decode counters. The io_ counters count the reads of\n"
+                   "the set_file_io backends, and the prefetch counters the prefetches\n"
+                   "completed and failed. With reset, the counters are zeroed after\n"
+                   "they are read.")},
+        {"set_file_io",
+         (PyCFunction)set_file_io,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("set_file_io(backend) -> None\n"
+                   "Selects how video files are read: 'ffmpeg' (default) with FFmpeg's\n"
+                   "file protocol, 'pread' with positioned reads into 256 KiB buffers,\n"
+                   "or 'io_uring', which also reads the next buffer ahead with io_uring\n"
+                   "during sequential decoding, if built with LINTEL_WITH_IO_URING=1.\n"
+                   "With 'pread' and 'io_uring', files are also given posix_fadvise\n"
+                   "hints: random for should_key and segment sampling, and sequential\n"
+                   "otherwise.")},
+        {"index_shard",
+         (PyCFunction)index_shard,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("index_shard(path) -> list of (name, offset, length)\n"
+                   "Reads the member index of the tar shard at path, e.g., of a\n"
+                   "WebDataset, sorted by name. The shard stays open and indexed, so\n"
+                   "that videos passed as filename=(path, name), or as\n"
+                   "filename=(path, (offset, length)) with an offset and length\n"
+                   "from this index, are read in place from one file descriptor.\n"
+                   "Shards must not change while lintel has them open.")},
+        {"set_rgb_kernel",
+         (PyCFunction)set_rgb_kernel,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("set_rgb_kernel(kernel) -> None\n"
+                   "Selects how YUV 4:2:0 frames are converted to resized RGB24:\n"
+                   "'bilinear' (default) or 'area' for the fused kernels, which\n"
+                   "honor the color range and matrix of the video, or 'swscale'.\n"
+                   "Other pixel formats always go through swscale. 'reference' is a\n"
+                   "slow, accurate swscale conversion honoring the same tags, for tests.")},
+        {"set_tensor_output",
+         (PyCFunction)set_tensor_output,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("set_tensor_output(enabled) -> None\n"
+                   "While enabled, decode APIs return FrameBuffer objects shaped\n"
+                   "(frames, height, width, 3), which numpy.asarray() and\n"
+                   "torch.from_dlpack() take without a copy, instead of flat\n"
+                   "ByteArray objects. FrameBuffers from the buffer pool are shaped\n"
+                   "the same way.")},
+        {"probe_many",
+         (PyCFunction)probe_many,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("probe_many(filenames, workers, timeout, gop_stats) -> "
+                   "list of dict(filename, error, width, height, fps, duration,\n"
+                   "frame_count, frame_count_exact, codec, pix_fmt, gop)\n"
+                   "Probes metadata on `workers` native threads, without the GIL.\n"
+                   "Per-file errors are reported in 'error' instead of raising.\n"
+                   "With gop_stats, every packet is read (not decoded), so that\n"
+                   "frame_count is exact and 'gop' holds keyframe statistics, and\n"
+                   "the frame index, byte offset and time of each keyframe.")},
         {NULL, NULL, 0, NULL}
 };
 
+static int
+lintel_exec(PyObject *module)
+{
+        struct lintel_state *state = get_lintel_state(module);
+        state->seed_base = ((uint64_t)av_get_random_seed() << 32) |
+                           av_get_random_seed();
+        state->num_seeds = 0;
+        state->future_type = NULL;
+
+        if (PyType_Ready(&FrameBuffer_Type) < 0)
+                return -1;
+
+        Py_INCREF(&FrameBuffer_Type);
+        if (PyModule_AddObject(module,
+                               "FrameBuffer",
+                               (PyObject *)&FrameBuffer_Type) < 0) {
+                Py_DECREF(&FrameBuffer_Type);
+                return -1;
+        }
+
+        if (PyType_Ready(&VideoReader_Type) < 0)
+                return -1;
+
+        Py_INCREF(&VideoReader_Type);
+        if (PyModule_AddObject(module,
+                               "VideoReader",
+                               (PyObject *)&VideoReader_Type) < 0) {
+                Py_DECREF(&VideoReader_Type);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int
+lintel_traverse(PyObject *module, visitproc visit, void *arg)
+{
+        Py_VISIT(get_lintel_state(module)->future_type);
+
+        return 0;
+}
+
+static int
+lintel_clear(PyObject *module)
+{
+        Py_CLEAR(get_lintel_state(module)->future_type);
+
+        return 0;
+}
+
+static void
+lintel_free(void *module)
+{
+        lintel_clear((PyObject *)module);
+}
+
+/**
+ * NOTE: Decoding runs without the GIL already, and the remaining shared state
+ * is either per module, per call, or process-wide behind locks and atomics,
+ * so the module declares that it is safe on free-threaded builds.
+ *
+ * It isn't safe in subinterpreters, though: FrameBuffer and VideoReader are
+ * static types, the decode queue and caches are shared by the process, and
+ * decode workers and DLPack deleters take the GIL with PyGILState_Ensure(),
+ * which always uses the main interpreter. Importing it from a subinterpreter
+ * fails with an ImportError.
+ */
+static PyModuleDef_Slot lintel_slots[] = {
+        {Py_mod_exec, lintel_exec},
+#ifdef Py_mod_multiple_interpreters
+        {Py_mod_multiple_interpreters,
+         Py_MOD_MULTIPLE_INTERPRETERS_NOT_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+        {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+        {0, NULL}
+};
+
 static struct PyModuleDef
 lintelmodule = {
         PyModuleDef_HEAD_INIT,
         "_lintel",
         module_doc,
-        0,
+        sizeof(struct lintel_state),
         lintel_methods,
-        NULL,
-        NULL,
-        NULL,
-        NULL
+        lintel_slots,
+        lintel_traverse,
+        lintel_clear,
+        lintel_free
 };
 
 PyMODINIT_FUNC
@@ -680,7 +4979,6 @@ PyInit__lintel(void)
 {
         av_register_all();
         av_log_set_level(AV_LOG_ERROR);
-        srand(time(NULL));
 
         return PyModuleDef_Init(&lintelmodule);
 }
@@ -0,0 +1,429 @@
+# Copyright 2018 Brendan Duke.
+#
+# This file is part of Lintel.
+#
+# Lintel is free software: you can redistribute it and/or modify it under the
+# terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+# A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# Lintel. If not, see <http://www.gnu.org/licenses/>.
+
+"""The `lintel-server` console script, a decode service shared by the
+processes of one node, and its `Client`.
+
+The server decodes on one pool of native decode workers, into the slots of a
+`SharedRing` it owns. The slots double as an LRU cache of decoded clips, so a
+clip requested by several processes is decoded once, and identical requests
+that arrive while it is decoding wait for that decode.
+
+Requests and responses are lines of JSON on a Unix socket. A request is
+
+    {"op": "loadvid_frame_nums", "source": ..., "frame_nums": [...],
+     "kwargs": {...}}
+
+and its response is `{"handle": [...]}`, the fields of a `SlotHandle`, or
+`{"error": ..., "message": ...}`. The client attaches to the ring by the name
+in the handle, and copies the frames out of the slot.
+"""
+import asyncio
+import collections
+import functools
+import json
+import os
+import signal
+import socket
+import threading
+
+import click
+import numpy as np
+
+import lintel
+from lintel.shm import SharedRing, SlotHandle
+
+
+DEFAULT_SOCKET_PATH = '/tmp/lintel-server.sock'
+
+# NOTE: Arguments that would decode into a second buffer, or return something
+# other than frames, aren't forwarded.
+_FORWARDED_KWARGS = frozenset(['width',
+                               'height',
+                               'resize',
+                               'should_key',
+                               'should_seek',
+                               'timeout',
+                               'allow_partial',
+                               'target_fps',
+                               'fast_open'])
+
+_ERRORS = {error.__name__: error
+           for error in [BlockingIOError,
+                         FileNotFoundError,
+                         MemoryError,
+                         OSError,
+                         TimeoutError,
+                         TypeError,
+                         ValueError]}
+
+_MAX_REQUEST_SIZE = 1 << 24
+
+# Number of times a client re-requests a clip that was evicted before it was
+# copied out of its slot.
+_MAX_ATTEMPTS = 3
+
+
+def _source_from_json(source):
+    """JSON has no tuples, so shard sources arrive as lists."""
+    if isinstance(source, str):
+        return source
+
+    path, member = source
+    if isinstance(member, list):
+        member = tuple(member)
+
+    return path, member
+
+
+def _source_to_json(source):
+    """Paths are made absolute, since the server's working directory isn't
+    the client's.
+    """
+    if isinstance(source, (str, bytes)):
+        return os.path.abspath(os.fsdecode(source))
+
+    path, member = source
+    if not isinstance(member, str):
+        member = [int(member[0]), int(member[1])]
+
+    return [os.path.abspath(os.fsdecode(path)), member]
+
+
+def _cache_key(source, frame_nums, kwargs):
+    """Keys a clip on the file's real path, modification time and size, so
+    that a file reached by another path is shared, and a file that changed is
+    decoded again.
+    """
+    if isinstance(source, str):
+        path, member = source, None
+    else:
+        path, member = source
+
+    file_stat = os.stat(path)
+
+    return json.dumps([os.path.realpath(path),
+                       file_stat.st_mtime_ns,
+                       file_stat.st_size,
+                       member,
+                       frame_nums,
+                       sorted(kwargs.items())])
+
+
+class _FrameCache(object):
+    """LRU of clips decoded into the slots of `ring`.
+
+    Slots are either free, decoding, or holding a cached clip, and only the
+    cached clips are evicted. Only used from the event loop, so it needs no
+    locking.
+    """
+
+    def __init__(self, ring):
+        self._ring = ring
+        self._free_slots = list(range(ring.num_slots))
+        self._entries = collections.OrderedDict()
+        self._pending = {}
+        self._slot_ready = asyncio.Condition()
+        self.stats = collections.Counter()
+
+    async def get(self, source, frame_nums, kwargs):
+        """Returns a `SlotHandle` to the frames of `source`, decoding them
+        unless they are cached or already being decoded.
+        """
+        key = _cache_key(source, frame_nums, kwargs)
+
+        handle = self._entries.get(key)
+        if handle is not None:
+            self._entries.move_to_end(key)
+            self.stats['hits'] += 1
+            return handle
+
+        pending = self._pending.get(key)
+        if pending is not None:
+            self.stats['shared'] += 1
+            return await asyncio.shield(pending)
+
+        self.stats['misses'] += 1
+        pending = asyncio.get_running_loop().create_future()
+        self._pending[key] = pending
+        try:
+            handle = await self._decode(key,
+                                        _source_from_json(source),
+                                        frame_nums,
+                                        kwargs)
+        except Exception as e:
+            pending.set_exception(e)
+            # NOTE: Retrieves the exception, so that it isn't logged as
+            # unhandled if no other request waited for this decode.
+            pending.exception()
+            raise
+        finally:
+            del self._pending[key]
+
+        pending.set_result(handle)
+        return handle
+
+    async def _decode(self, key, source, frame_nums, kwargs):
+        slot = await self._acquire_slot()
+        try:
+            handle = await self._ring.submit_frame_nums(slot,
+                                                        source,
+                                                        frame_nums,
+                                                        **kwargs)
+        except Exception:
+            await self._add(slot, None, None)
+            raise
+
+        # NOTE: A partial clip, e.g., cut short by its timeout, is returned
+        # but never hit, so that it is decoded again next time.
+        if handle.num_frames < len(frame_nums):
+            key = object()
+        await self._add(slot, key, handle)
+
+        return handle
+
+    async def _acquire_slot(self):
+        async with self._slot_ready:
+            while (not self._free_slots) and (not self._entries):
+                await self._slot_ready.wait()
+
+            if self._free_slots:
+                return self._free_slots.pop()
+
+            _, handle = self._entries.popitem(last=False)
+            self.stats['evictions'] += 1
+            return handle.slot
+
+    async def _add(self, slot, key, handle):
+        """Caches `handle` under `key`, or frees `slot` if `handle` is None."""
+        async with self._slot_ready:
+            if handle is None:
+                self._free_slots.append(slot)
+            else:
+                self._entries[key] = handle
+            self._slot_ready.notify()
+
+
+async def _handle_request(cache, request):
+    op = request.get('op')
+    if op == 'stats':
+        return {'stats': dict(cache.stats)}
+    if op != 'loadvid_frame_nums':
+        raise ValueError('unknown op {}'.format(op))
+
+    kwargs = request.get('kwargs', {})
+    unsupported = set(kwargs) - _FORWARDED_KWARGS
+    if unsupported:
+        raise ValueError('unsupported arguments {}'.format(
+            sorted(unsupported)))
+
+    handle = await cache.get(request['source'],
+                             [int(n) for n in request['frame_nums']],
+                             kwargs)
+
+    return {'handle': list(handle)}
+
+
+async def _handle_connection(cache, reader, writer):
+    try:
+        while True:
+            line = await reader.readline()
+            if not line:
+                break
+
+            try:
+                response = await _handle_request(cache, json.loads(line))
+            except Exception as e:
+                response = {'error': type(e).__name__, 'message': str(e)}
+
+            writer.write(json.dumps(response).encode() + b'\n')
+            await writer.drain()
+    except ConnectionError:
+        pass
+    finally:
+        writer.close()
+
+
+def _remove_stale_socket(socket_path):
+    """Removes the socket of a server that is no longer running."""
+    if not os.path.exists(socket_path):
+        return
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        try:
+            sock.connect(socket_path)
+        except ConnectionRefusedError:
+            os.unlink(socket_path)
+            return
+
+    raise click.ClickException(
+        'a server is already listening on {}'.format(socket_path))
+
+
+async def _serve(ring, socket_path):
+    cache = _FrameCache(ring)
+
+    _remove_stale_socket(socket_path)
+
+    # NOTE: Only processes of the same user may connect, since they are
+    # handed the shared memory, which is created user-only too.
+    umask = os.umask(0o077)
+    try:
+        server = await asyncio.start_unix_server(
+            functools.partial(_handle_connection, cache),
+            path=socket_path,
+            limit=_MAX_REQUEST_SIZE)
+    finally:
+        os.umask(umask)
+
+    stopping = asyncio.Event()
+    loop = asyncio.get_running_loop()
+    for signum in [signal.SIGINT, signal.SIGTERM]:
+        loop.add_signal_handler(signum, stopping.set)
+
+    click.echo('lintel-server: serving {} slots of {} bytes on {}'.format(
+        ring.num_slots, ring.slot_size, socket_path))
+    try:
+        async with server:
+            await stopping.wait()
+    finally:
+        os.unlink(socket_path)
+
+
+@click.command()
+@click.option('--socket-path',
+              default=DEFAULT_SOCKET_PATH,
+              type=str,
+              help='Unix socket to listen on.')
+@click.option('--num-slots',
+              default=256,
+              type=int,
+              help='Number of clips the shared cache holds.')
+@click.option('--slot-size',
+              default=32*256*256*3,
+              type=int,
+              help='Largest clip the server returns, in bytes.')
+@click.option('--num-workers',
+              default=8,
+              type=int,
+              help='Number of native decode workers.')
+@click.option('--queue-size',
+              default=128,
+              type=int,
+              help='Number of decode requests the workers queue.')
+def serve(socket_path, num_slots, slot_size, num_workers, queue_size):
+    """Serves `loadvid_frame_nums` to the processes of this node over a Unix
+    socket, from one pool of decode workers and one shared cache of decoded
+    clips.
+    """
+    lintel.start_decode_workers(num_workers=num_workers,
+                                queue_size=queue_size)
+
+    ring = SharedRing.create(num_slots, slot_size)
+    try:
+        asyncio.run(_serve(ring, socket_path))
+    finally:
+        ring.close()
+        ring.unlink()
+
+
+class Client(object):
+    """Connection to a `lintel-server`.
+
+    A client is safe to share between threads, which take turns on its
+    socket, but not across `fork`, so make one per dataloader worker.
+    """
+
+    def __init__(self, socket_path=DEFAULT_SOCKET_PATH):
+        self._socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._socket.connect(socket_path)
+        self._file = self._socket.makefile('rwb')
+        self._lock = threading.Lock()
+        self._rings = {}
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def close(self):
+        """Closes the connection, and unmaps the server's ring."""
+        for ring in self._rings.values():
+            ring.close()
+        self._rings = {}
+        self._file.close()
+        self._socket.close()
+
+    def _request(self, request):
+        with self._lock:
+            self._file.write(json.dumps(request).encode() + b'\n')
+            self._file.flush()
+            line = self._file.readline()
+        if not line:
+            raise ConnectionError('lintel-server closed the connection')
+
+        response = json.loads(line)
+        if 'error' in response:
+            raise _ERRORS.get(response['error'], RuntimeError)(
+                response['message'])
+
+        return response
+
+    def _attach(self, name):
+        ring = self._rings.get(name)
+        if ring is None:
+            ring = SharedRing.attach(name)
+            self._rings[name] = ring
+
+        return ring
+
+    def loadvid_frame_nums(self, filename, frame_nums, **kwargs):
+        """Decodes `frame_nums` of `filename` on the server, as
+        `lintel.loadvid_frame_nums` does.
+
+        Takes `width`, `height`, `resize`, `should_key`, `should_seek`,
+        `timeout`, `allow_partial`, `target_fps` and `fast_open`, and returns
+        a uint8 numpy array of shape (num_frames, height, width, 3), copied
+        out of the server's shared memory. With `allow_partial`, `num_frames`
+        may be fewer than `len(frame_nums)`.
+        """
+        request = {'op': 'loadvid_frame_nums',
+                   'source': _source_to_json(filename),
+                   'frame_nums': [int(n) for n in frame_nums],
+                   'kwargs': kwargs}
+
+        for _ in range(_MAX_ATTEMPTS):
+            handle = SlotHandle(*self._request(request)['handle'])
+            ring = self._attach(handle.name)
+
+            # NOTE: The server may evict the clip while it is being copied,
+            # so the copy only counts if the slot wasn't written meanwhile.
+            try:
+                frames = np.array(ring.frames(handle))
+            except ValueError:
+                continue
+            if ring.is_current(handle):
+                return frames
+
+        raise RuntimeError(
+            'clip evicted before it was read, the server needs more slots')
+
+    def stats(self):
+        """Returns the server's counts of cache hits, misses, evictions, and
+        requests that shared a decode already in progress.
+        """
+        return self._request({'op': 'stats'})['stats']
@@ -0,0 +1,321 @@
+# Copyright 2018 Brendan Duke.
+#
+# This file is part of Lintel.
+#
+# Lintel is free software: you can redistribute it and/or modify it under the
+# terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# Lintel is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+# A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# Lintel. If not, see <http://www.gnu.org/licenses/>.
+
+"""Ring of fixed-size slots in POSIX shared memory, for returning decoded
+clips from dataloader worker processes without copying them through a pipe.
+
+The consumer creates the ring, and workers attach to it by name. A worker
+decodes straight into a slot, and sends back only the small, picklable
+`SlotHandle`. The consumer then reads the frames in place.
+
+The layout of the shared memory is:
+
+    header: `_HEADER`, giving the number and size of slots.
+    slot table: One `_SLOT` record per slot.
+    slots: `num_slots` slots of `slot_size` bytes, each page aligned.
+
+Each slot record has a generation counter, which is odd while the slot is
+being written. A handle records the generation of the write that produced it,
+so a handle to a slot that has since been overwritten is detected as stale.
+"""
+import collections
+from multiprocessing import resource_tracker
+from multiprocessing import shared_memory
+
+import numpy as np
+
+import _lintel
+from lintel.aio import submit_async
+
+
+MAGIC = b'LNTLRING'
+
+_PAGE_SIZE = 4096
+
+_HEADER = np.dtype([('magic', 'S8'),
+                    ('num_slots', '<u4'),
+                    ('reserved', '<u4'),
+                    ('slot_size', '<u8'),
+                    ('slots_offset', '<u8')])
+
+_SLOT = np.dtype([('generation', '<u8'),
+                  ('num_frames', '<u4'),
+                  ('height', '<u4'),
+                  ('width', '<u4'),
+                  ('reserved', '<u4')])
+
+
+# NOTE: Arguments that would decode into a second buffer, or return something
+# besides the frames, aren't supported, since only frames fit a slot.
+_UNSUPPORTED_KWARGS = frozenset(['out',
+                                 'audio_rate',
+                                 'audio_channels',
+                                 'sizes',
+                                 'motion_vectors'])
+
+
+def _align(offset, alignment):
+    return (offset + alignment - 1)//alignment*alignment
+
+
+SlotHandle = collections.namedtuple('SlotHandle',
+                                    ['name',
+                                     'slot',
+                                     'generation',
+                                     'num_frames',
+                                     'height',
+                                     'width'])
+SlotHandle.__doc__ = """Reference to a clip decoded into a `SharedRing` slot.
+
+`num_frames` counts the frames filled, which with `allow_partial` may be fewer
+than were requested.
+"""
+
+
+class SharedRing(object):
+    """Fixed-size slots in POSIX shared memory, for decoded clips.
+
+    Create the ring in the consumer with `SharedRing.create`, pass `ring.name`
+    to the workers, and attach to it there with `SharedRing.attach`. Slots are
+    addressed by index, e.g., one or more slots per worker, and the consumer
+    releases a slot back to its worker by whatever protocol it already uses
+    to hand out work.
+    """
+
+    def __init__(self, shm, is_owner):
+        self._shm = shm
+        self._is_owner = is_owner
+
+        header = np.frombuffer(shm.buf, dtype=_HEADER, count=1).copy()[0]
+        if header['magic'] != MAGIC:
+            shm.close()
+            raise ValueError('{} is not a lintel ring'.format(shm.name))
+
+        self.num_slots = int(header['num_slots'])
+        self.slot_size = int(header['slot_size'])
+        self._slots_offset = int(header['slots_offset'])
+        self._slot_stride = _align(self.slot_size, _PAGE_SIZE)
+        self._table = np.frombuffer(shm.buf,
+                                    dtype=_SLOT,
+                                    count=self.num_slots,
+                                    offset=_HEADER.itemsize)
+
+    @classmethod
+    def create(cls, num_slots, slot_size, name=None):
+        """Creates a ring of `num_slots` slots of `slot_size` bytes each.
+
+        The creator owns the shared memory, and removes it in `unlink`.
+        """
+        slots_offset = _align(_HEADER.itemsize + num_slots*_SLOT.itemsize,
+                              _PAGE_SIZE)
+        size = slots_offset + num_slots*_align(slot_size, _PAGE_SIZE)
+        shm = shared_memory.SharedMemory(name=name, create=True, size=size)
+
+        header = np.array([(MAGIC, num_slots, 0, slot_size, slots_offset)],
+                          dtype=_HEADER)
+        shm.buf[:_HEADER.itemsize] = header.tobytes()
+
+        return cls(shm, is_owner=True)
+
+    @classmethod
+    def attach(cls, name):
+        """Attaches to the ring created under `name`."""
+        shm = shared_memory.SharedMemory(name=name)
+
+        # NOTE: The resource tracker of an attaching process would otherwise
+        # unlink the shared memory when that process exits, under the owner.
+        resource_tracker.unregister(shm._name, 'shared_memory')
+
+        return cls(shm, is_owner=False)
+
+    @property
+    def name(self):
+        """Name that other processes attach to the ring by."""
+        return self._shm.name
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def close(self):
+        """Unmaps the ring from this process."""
+        self._table = None
+        self._shm.close()
+
+    def unlink(self):
+        """Removes the shared memory. Only valid in the creating process."""
+        if not self._is_owner:
+            raise RuntimeError('only the creator of a ring can unlink it')
+        self._shm.unlink()
+
+    def _slot_range(self, slot):
+        if not 0 <= slot < self.num_slots:
+            raise IndexError('slot {} out of range'.format(slot))
+        start = self._slots_offset + slot*self._slot_stride
+        return start, start + self.slot_size
+
+    @staticmethod
+    def _check_kwargs(kwargs):
+        """Rejects arguments whose results `_publish_frames` can't parse,
+        before anything is written to the slot.
+        """
+        unsupported = set(kwargs) & _UNSUPPORTED_KWARGS
+        if unsupported:
+            raise ValueError('unsupported arguments {}'.format(
+                sorted(unsupported)))
+
+    def _decode(self, slot, decode_fn, *args, **kwargs):
+        self._check_kwargs(kwargs)
+        start, end = self._slot_range(slot)
+        record = self._table[slot:slot + 1]
+
+        record['generation'] |= 1
+        out = self._shm.buf[start:end]
+        try:
+            result = decode_fn(*args, out=out, **kwargs)
+        finally:
+            out.release()
+            # NOTE: Leave the slot readable-but-stale if the decode raised.
+            record['generation'] += 1
+
+        return result
+
+    async def _decode_async(self, slot, submit_fn, *args, **kwargs):
+        self._check_kwargs(kwargs)
+        start, end = self._slot_range(slot)
+
+        # NOTE: The decode's exception outlives this frame in its future, so
+        # the frame keeps no view of the shared memory, which would stop the
+        # ring from closing.
+        self._table['generation'][slot:slot + 1] |= 1
+        out = self._shm.buf[start:end]
+        try:
+            result = await submit_fn(*args, out=out, **kwargs)
+        finally:
+            out.release()
+            self._table['generation'][slot:slot + 1] += 1
+
+        return result
+
+    def _publish(self, slot, num_frames, height, width):
+        record = self._table[slot:slot + 1]
+        record['num_frames'] = num_frames
+        record['height'] = height
+        record['width'] = width
+
+        return SlotHandle(name=self.name,
+                          slot=slot,
+                          generation=int(record['generation'][0]),
+                          num_frames=num_frames,
+                          height=height,
+                          width=width)
+
+    def loadvid_frame_nums(self, slot, filename, frame_nums, **kwargs):
+        """Runs `lintel.loadvid_frame_nums` into `slot`, and returns a
+        `SlotHandle` to the frames.
+        """
+        result = self._decode(slot,
+                              _lintel.loadvid_frame_nums,
+                              filename,
+                              frame_nums,
+                              **kwargs)
+
+        return self._publish_frames(slot, result, len(frame_nums), kwargs)
+
+    async def submit_frame_nums(self, slot, filename, frame_nums, **kwargs):
+        """Awaitable version of `loadvid_frame_nums`, which decodes on the
+        native decode workers through `lintel.submit_async`.
+        """
+        result = await self._decode_async(slot,
+                                          submit_async,
+                                          filename,
+                                          frame_nums,
+                                          **kwargs)
+
+        return self._publish_frames(slot, result, len(frame_nums), kwargs)
+
+    def loadvid_timestamps(self, slot, filename, seconds, **kwargs):
+        """Runs `lintel.loadvid_timestamps` into `slot`, and returns a
+        `SlotHandle` to the frames.
+        """
+        result = self._decode(slot,
+                              _lintel.loadvid_timestamps,
+                              filename,
+                              seconds,
+                              **kwargs)
+
+        return self._publish_frames(slot, result, len(seconds), kwargs)
+
+    def loadvid(self, slot, filename, **kwargs):
+        """Runs `lintel.loadvid` into `slot`, and returns a `SlotHandle` to the
+        frames, and the seek distance.
+        """
+        result = self._decode(slot, _lintel.loadvid, filename, **kwargs)
+
+        num_frames = kwargs.get('num_frames', 32)
+        if kwargs.get('allow_partial', False):
+            *result, num_frames = result
+        if len(result) == 2:
+            _, seek_distance = result
+            height, width = kwargs['height'], kwargs['width']
+        else:
+            _, width, height, seek_distance = result
+
+        return self._publish(slot, num_frames, height, width), seek_distance
+
+    def _publish_frames(self, slot, result, num_frames, kwargs):
+        if not isinstance(result, tuple):
+            result = (result,)
+        if kwargs.get('allow_partial', False):
+            *result, num_frames = result
+        if len(result) == 1:
+            height, width = kwargs['height'], kwargs['width']
+        else:
+            _, width, height = result
+
+        return self._publish(slot, num_frames, height, width)
+
+    def is_current(self, handle):
+        """Returns True iff the slot of `handle` hasn't been written to since
+        `handle` was made.
+        """
+        return handle.generation == self._table[handle.slot]['generation']
+
+    def frames(self, handle):
+        """Returns the frames of `handle` as a read-only uint8 numpy array of
+        shape (num_frames, height, width, 3), which views the slot in place.
+
+        Raises ValueError if the slot has been overwritten since `handle` was
+        made. The view is only valid until the slot is reused, and must be
+        dropped before the ring is closed.
+        """
+        if not self.is_current(handle):
+            raise ValueError('slot {} has been overwritten'.format(
+                handle.slot))
+
+        start, _ = self._slot_range(handle.slot)
+        frames = np.frombuffer(self._shm.buf,
+                               dtype=np.uint8,
+                               count=handle.num_frames*handle.height*handle.width*3,
+                               offset=start)
+        frames.flags.writeable = False
+
+        return frames.reshape(handle.num_frames,
+                              handle.height,
+                              handle.width,
+                              3)
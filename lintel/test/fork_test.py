@@ -0,0 +1,70 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Checks that submit() works in a process forked after the parent used it,
+as DataLoader workers are.
+"""
+import os
+
+import click
+import numpy as np
+
+import lintel
+
+
+def _submit_frames(filename, frame_nums, timeout):
+    future = lintel.submit(filename, frame_nums, width=64, height=64)
+    frames, _, _ = future.result(timeout=timeout)
+
+    return np.frombuffer(frames, dtype=np.uint8)
+
+
+def check_submit_after_fork(filename, frame_nums=(0, 4, 8), timeout=30.0):
+    """Submits in the parent, then forks a child that submits too, and checks
+    that the child's future completes with the parent's frames.
+    """
+    frame_nums = list(frame_nums)
+    expected = _submit_frames(filename, frame_nums, timeout)
+
+    pid = os.fork()
+    if pid == 0:
+        status = 1
+        try:
+            frames = _submit_frames(filename, frame_nums, timeout)
+            if np.array_equal(frames, expected):
+                status = 0
+        finally:
+            os._exit(status)
+
+    _, status = os.waitpid(pid, 0)
+    assert os.WIFEXITED(status) and (os.WEXITSTATUS(status) == 0), status
+
+    # NOTE: The parent's workers are unaffected by the fork.
+    assert np.array_equal(_submit_frames(filename, frame_nums, timeout),
+                          expected)
+
+
+@click.command()
+@click.option('--filename',
+              required=True,
+              type=str,
+              help='Name of the input video.')
+@click.option('--timeout',
+              default=30.0,
+              type=float,
+              help='Seconds to wait for each decode before failing.')
+def fork_test(filename, timeout):
+    """Tests that a forked child gets decode workers of its own."""
+    check_submit_after_fork(filename, timeout=timeout)
+    print('submit after fork passed')
@@ -0,0 +1,141 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Round-trip test of the binary manifest, which needs no video."""
+import os
+import random
+import tempfile
+
+import click
+import numpy as np
+
+from lintel.manifest import Manifest, write_manifest
+
+
+def _fake_probe(rng, num_keyframes):
+    frame_count = rng.randint(1, 10000)
+    if num_keyframes is None:
+        gop = None
+    else:
+        keyframe_frame_nums = sorted(rng.sample(range(1, frame_count + 1),
+                                                min(num_keyframes,
+                                                    frame_count)))
+        keyframe_frame_nums = [0] + keyframe_frame_nums[:-1]
+        gop = {'keyframe_frame_nums': keyframe_frame_nums,
+               'keyframe_pos': [48 + 1000*n for n in keyframe_frame_nums],
+               'keyframe_times': [n/30.0 for n in keyframe_frame_nums]}
+
+    return {'width': rng.randint(1, 4096),
+            'height': rng.randint(1, 4096),
+            'fps': 30.0,
+            'duration': frame_count/30.0,
+            'frame_count': frame_count,
+            'frame_count_exact': rng.random() < 0.5,
+            'gop': gop}
+
+
+def _check_entry(entry, name, probe):
+    assert entry.name == name
+    assert entry.width == probe['width']
+    assert entry.height == probe['height']
+    assert entry.fps == probe['fps']
+    assert entry.duration == probe['duration']
+    assert entry.frame_count == probe['frame_count']
+    assert entry.frame_count_exact == probe['frame_count_exact']
+
+    gop = probe['gop'] or {'keyframe_frame_nums': [],
+                           'keyframe_pos': [],
+                           'keyframe_times': []}
+    assert list(entry.keyframe_frame_nums) == gop['keyframe_frame_nums']
+    assert list(entry.keyframe_pos) == gop['keyframe_pos']
+    assert list(entry.keyframe_times) == gop['keyframe_times']
+
+
+def _check_keyframe_lookups(entry, rng):
+    keyframes = list(entry.keyframe_frame_nums)
+    if not keyframes:
+        return
+
+    for _ in range(20):
+        frame_num = rng.randint(0, entry.frame_count)
+        before = entry.keyframe_before(frame_num)
+        assert keyframes[before] <= frame_num
+        assert ((before + 1 == len(keyframes)) or
+                (keyframes[before + 1] > frame_num))
+
+        nearest = entry.nearest_keyframe(frame_num)
+        assert (abs(keyframes[nearest] - frame_num) ==
+                min(abs(k - frame_num) for k in keyframes))
+
+        assert entry.should_seek([frame_num]) == (before > 0)
+
+
+def test_manifest_round_trip(num_videos=1000, chunk_size=97, seed=0):
+    """Writes fake probes in several chunks, out of name order, then checks
+    every entry and keyframe lookup of the memory-mapped manifest.
+    """
+    rng = random.Random(seed)
+    probes = {}
+    for i in range(num_videos):
+        name = 'class{}/vidéo_{}.mp4'.format(rng.randint(0, 9), i)
+        num_keyframes = rng.choice([None, 0, 1, 5, 50])
+        probes[name] = _fake_probe(rng, num_keyframes)
+
+    items = list(probes.items())
+    rng.shuffle(items)
+
+    with tempfile.TemporaryDirectory() as directory:
+        filename = os.path.join(directory, 'videos.lmf')
+        assert write_manifest(filename,
+                              iter(items),
+                              chunk_size=chunk_size) == num_videos
+
+        with Manifest(filename) as manifest:
+            assert len(manifest) == num_videos
+            assert list(manifest.names()) == sorted(
+                probes, key=lambda name: name.encode('utf-8'))
+
+            for name, probe in items:
+                assert name in manifest
+                entry = manifest[name]
+                _check_entry(entry, name, probe)
+                _check_keyframe_lookups(entry, rng)
+
+            assert 'missing.mp4' not in manifest
+            assert manifest.index('missing.mp4') is None
+
+        empty = os.path.join(directory, 'empty.lmf')
+        assert write_manifest(empty, []) == 0
+        with Manifest(empty) as manifest:
+            assert len(manifest) == 0
+            assert np.array_equal(list(manifest.names()), [])
+
+
+@click.command()
+@click.option('--num-videos',
+              default=1000,
+              type=int,
+              help='Number of fake videos in the manifest.')
+@click.option('--chunk-size',
+              default=97,
+              type=int,
+              help='Number of probes spilled at a time.')
+@click.option('--seed',
+              default=0,
+              type=int,
+              help='Seed of the fake probes.')
+def manifest_test(num_videos, chunk_size, seed):
+    """Tests that a manifest reads back what was written."""
+    test_manifest_round_trip(num_videos, chunk_size, seed)
+    print('manifest round trip passed')
@@ -0,0 +1,176 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Accuracy test and benchmark of the RGB conversion kernels."""
+import time
+
+import click
+import numpy as np
+
+import lintel
+
+
+KERNELS = ['bilinear', 'area', 'swscale']
+
+
+def _decode(filename, frame_nums, width, height, kernel):
+    lintel.set_rgb_kernel(kernel)
+    frames = lintel.loadvid_frame_nums(filename,
+                                       frame_nums=frame_nums,
+                                       width=width,
+                                       height=height)
+    frames = np.frombuffer(frames, dtype=np.uint8)
+    return np.reshape(frames, newshape=(len(frame_nums), height, width, 3))
+
+
+def _area_downscale(frames, factor):
+    """Averages each `factor` by `factor` block of `frames`, in float."""
+    num_frames, height, width, _ = frames.shape
+    height = height//factor*factor
+    width = width//factor*factor
+    blocks = frames[:, :height, :width].astype(np.float64)
+    blocks = np.reshape(blocks,
+                        newshape=(num_frames,
+                                  height//factor,
+                                  factor,
+                                  width//factor,
+                                  factor,
+                                  3))
+    return blocks.mean(axis=(2, 4))
+
+
+def _psnr(frames, golden):
+    mse = np.mean((frames.astype(np.float64) - golden)**2)
+    if mse == 0:
+        return float('inf')
+    return 10*np.log10(255**2/mse)
+
+
+def _rgb_kernel_test_accuracy(filename,
+                              frame_nums,
+                              factor,
+                              min_psnr,
+                              min_resize_psnr):
+    """Compares the kernels to golden images from the 'reference' kernel,
+    swscale with accurate rounding, full chroma interpolation and the color
+    tags of the video. It shares only the choice of color matrix with the
+    fused kernels.
+
+    At the native size, the fused kernels are a pure color conversion, so
+    they are checked against the reference frames, which tests the color
+    matrix, range expansion and chroma upsampling. Downscaled, they are
+    checked against the reference frames averaged over `factor` by `factor`
+    blocks in float: `area` against `min_psnr`, and `bilinear`, which aliases,
+    against `min_resize_psnr`.
+
+    swscale doesn't honor the colorspace of the video, so its PSNR also
+    includes any difference in color matrix, and is only printed.
+    """
+    probe = lintel.probe_many([filename])[0]
+    width = probe['width']
+    height = probe['height']
+
+    reference = _decode(filename, frame_nums, width, height, 'reference')
+    for kernel in ['bilinear', 'area']:
+        frames = _decode(filename, frame_nums, width, height, kernel)
+        psnr = _psnr(frames, reference)
+        print('{} at native size: PSNR {:.2f} dB'.format(kernel, psnr))
+        assert psnr >= min_psnr, '{} color PSNR {} < {}'.format(
+            kernel, psnr, min_psnr)
+
+    golden = _area_downscale(reference, factor)
+    out_height, out_width = golden.shape[1:3]
+    min_psnrs = {'area': min_psnr, 'bilinear': min_resize_psnr}
+    for kernel in KERNELS:
+        frames = _decode(filename,
+                         frame_nums,
+                         out_width,
+                         out_height,
+                         kernel)
+        psnr = _psnr(frames, golden)
+        print('{}: PSNR {:.2f} dB'.format(kernel, psnr))
+        if kernel in min_psnrs:
+            assert psnr >= min_psnrs[kernel], '{} PSNR {} < {}'.format(
+                kernel, psnr, min_psnrs[kernel])
+
+
+def _rgb_kernel_test_benchmark(filename, frame_nums, width, height, repeats):
+    """Times decoding `frame_nums` at `width` by `height` with each kernel."""
+    for kernel in KERNELS:
+        _decode(filename, frame_nums, width, height, kernel)
+
+        start = time.perf_counter()
+        for _ in range(repeats):
+            _decode(filename, frame_nums, width, height, kernel)
+        end = time.perf_counter()
+
+        print('{}: {:.2f} ms per call'.format(
+            kernel, 1000*(end - start)/repeats))
+
+
+@click.command()
+@click.option('--filename',
+              default=None,
+              type=str,
+              help='Name of the input video.')
+@click.option('--num-frames',
+              default=32,
+              type=int,
+              help='Number of consecutive frames to decode.')
+@click.option('--factor',
+              default=4,
+              type=int,
+              help='Downscale factor of the accuracy test.')
+@click.option('--min-psnr',
+              default=38.0,
+              type=float,
+              help=('Lowest PSNR of the fused kernels at native size, and of '
+                    'the area kernel downscaled, that passes.'))
+@click.option('--min-resize-psnr',
+              default=28.0,
+              type=float,
+              help='Lowest PSNR of the bilinear kernel downscaled that passes.')
+@click.option('--width',
+              default=224,
+              type=int,
+              help='Output width of the benchmark.')
+@click.option('--height',
+              default=224,
+              type=int,
+              help='Output height of the benchmark.')
+@click.option('--repeats',
+              default=20,
+              type=int,
+              help='Number of timed calls per kernel.')
+def rgb_kernel_test(filename,
+                    num_frames,
+                    factor,
+                    min_psnr,
+                    min_resize_psnr,
+                    width,
+                    height,
+                    repeats):
+    """Tests the accuracy of the fused YUV to RGB kernels against golden
+    images from swscale, and benchmarks them against swscale.
+    """
+    frame_nums = list(range(num_frames))
+
+    _rgb_kernel_test_accuracy(filename,
+                              frame_nums,
+                              factor,
+                              min_psnr,
+                              min_resize_psnr)
+    _rgb_kernel_test_benchmark(filename, frame_nums, width, height, repeats)
+
+    lintel.set_rgb_kernel('bilinear')
@@ -0,0 +1,151 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Checks `lintel.index_shard` against Python's tarfile, on shards written in
+each tar format, which needs no video.
+"""
+import io
+import os
+import tarfile
+import tempfile
+import time
+
+import click
+
+import lintel
+
+
+_BLOCK_SIZE = 512
+
+
+def _add_file(archive, name, size, fill, pax_headers=None):
+    info = tarfile.TarInfo(name)
+    info.size = size
+    if pax_headers is not None:
+        info.pax_headers = pax_headers
+    archive.addfile(info, io.BytesIO(bytes([fill])*size))
+
+
+def _patch_size_field(path, header_offset, size_field):
+    """Overwrites the size field of the header at `header_offset`, and fixes
+    its checksum.
+    """
+    with open(path, 'r+b') as f:
+        f.seek(header_offset)
+        header = bytearray(f.read(_BLOCK_SIZE))
+        header[124:136] = size_field
+        header[148:156] = b' '*8
+        header[148:156] = '{:06o}\0 '.format(sum(header)).encode('ascii')
+        f.seek(header_offset)
+        f.write(header)
+
+
+def _base256(number):
+    return bytes([0x80]) + number.to_bytes(11, 'big')
+
+
+def _write_shards(directory):
+    """Writes one shard per tar format, and returns their paths.
+
+    The ustar shard splits a long name into its prefix, the GNU shard stores
+    long names in 'L' entries, and the pax shard stores non-ASCII names as pax
+    `path` records. One GNU member's size is rewritten in base-256, and one
+    pax member's header size is zeroed so that only its pax `size` holds.
+    """
+    paths = {}
+
+    ustar_path = os.path.join(directory, 'ustar.tar')
+    with tarfile.open(ustar_path, 'w', format=tarfile.USTAR_FORMAT) as archive:
+        _add_file(archive, 'a.mp4', 7, 1)
+        _add_file(archive, 'd'*90 + '/' + 'y'*60 + '.mp4', 1007, 2)
+        _add_file(archive, 'dup.mp4', 3, 3)
+        _add_file(archive, 'dup.mp4', 2000, 4)
+        directory_info = tarfile.TarInfo('emptydir')
+        directory_info.type = tarfile.DIRTYPE
+        archive.addfile(directory_info)
+    paths[tarfile.USTAR_FORMAT] = ustar_path
+
+    gnu_path = os.path.join(directory, 'gnu.tar')
+    with tarfile.open(gnu_path, 'w', format=tarfile.GNU_FORMAT) as archive:
+        _add_file(archive, 'dir/' + 'x'*300 + '.mp4', 1500, 5)
+        _add_file(archive, 'base256.mp4', 513, 6)
+        _add_file(archive, 'b.mp4', 0, 7)
+    with tarfile.open(gnu_path) as archive:
+        member = archive.getmember('base256.mp4')
+    _patch_size_field(gnu_path,
+                      member.offset_data - _BLOCK_SIZE,
+                      _base256(member.size))
+    paths[tarfile.GNU_FORMAT] = gnu_path
+
+    pax_path = os.path.join(directory, 'pax.tar')
+    with tarfile.open(pax_path, 'w', format=tarfile.PAX_FORMAT) as archive:
+        _add_file(archive, 'z/vidéo_ü.mp4', 900, 8)
+        _add_file(archive, 'p'*200 + '.mp4', 40, 9)
+        _add_file(archive, 'pax_size.mp4', 2500, 10, {'size': '2500'})
+        _add_file(archive, 'last.mp4', 11, 11)
+    with tarfile.open(pax_path) as archive:
+        member = archive.getmember('pax_size.mp4')
+    _patch_size_field(pax_path,
+                      member.offset_data - _BLOCK_SIZE,
+                      b'0'*11 + b'\0')
+    paths[tarfile.PAX_FORMAT] = pax_path
+
+    return paths
+
+
+def _expected_members(path):
+    with tarfile.open(path) as archive:
+        members = [(m.name, m.offset_data, m.size)
+                   for m in archive.getmembers() if m.isfile()]
+
+    return sorted(members, key=lambda m: (m[0].encode('utf-8'), m[1]))
+
+
+def _check_shard(path):
+    expected = _expected_members(path)
+    members = [(name, offset, length)
+               for name, offset, length in lintel.index_shard(path)]
+    assert members == expected, (path, members, expected)
+
+
+def test_tar_shard_index():
+    """Indexes shards in the ustar, GNU and pax formats, then rewrites one and
+    checks that it is indexed again rather than served from the cache.
+    """
+    with tempfile.TemporaryDirectory() as directory:
+        paths = _write_shards(directory)
+        for path in paths.values():
+            _check_shard(path)
+            # NOTE: The second index is read from the cached shard.
+            _check_shard(path)
+
+        path = paths[tarfile.USTAR_FORMAT]
+        with tarfile.open(path, 'w', format=tarfile.USTAR_FORMAT) as archive:
+            _add_file(archive, 'rewritten.mp4', 100, 12)
+        _check_shard(path)
+
+        # NOTE: Rewrites the shard in place with the same size, so that only
+        # its modification time tells it changed.
+        with tarfile.open(path, 'w', format=tarfile.USTAR_FORMAT) as archive:
+            _add_file(archive, 'same_size.mp4', 100, 13)
+        mtime_ns = time.time_ns() + 10**9
+        os.utime(path, ns=(mtime_ns, mtime_ns))
+        _check_shard(path)
+
+
+@click.command()
+def tar_shard_test():
+    """Tests that shards are indexed as tarfile reads them."""
+    test_tar_shard_index()
+    print('tar shard index passed')
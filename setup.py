@@ -1,16 +1,38 @@
 """Installs Lintel, the video decoding Python module."""
 import distutils.core
+import os
 import setuptools
 
 
+define_macros = [('MAJOR_VERSION', '1'), ('MINOR_VERSION', '0')]
+libraries = ['avformat', 'avcodec', 'swscale', 'avutil', 'swresample',
+             'pthread']
+
+# NOTE: The io_uring file I/O backend needs liburing, so it is opt-in.
+if os.environ.get('LINTEL_WITH_IO_URING', '0') == '1':
+    define_macros.append(('LINTEL_WITH_IO_URING', '1'))
+    libraries.append('uring')
+
 lintel_module = distutils.core.Extension(
     '_lintel',
-    define_macros=[('MAJOR_VERSION', '1'), ('MINOR_VERSION', '0')],
+    define_macros=define_macros,
     undef_macros=['NDEBUG'],
+    extra_compile_args=['-O3'],
     include_dirs=['/usr/include/ffmpeg', 'lintel'],
-    libraries=['avformat', 'avcodec', 'swscale', 'avutil', 'swresample'],
+    libraries=libraries,
     sources=['lintel/py_ext/lintelmodule.c',
-             'lintel/core/video_decode.c'])
+             'lintel/py_ext/frame_buffer.c',
+             'lintel/core/audio_decode.c',
+             'lintel/core/buffer_pool.c',
+             'lintel/core/codec_pool.c',
+             'lintel/core/file_io.c',
+             'lintel/core/handle_cache.c',
+             'lintel/core/motion_vectors.c',
+             'lintel/core/video_decode.c',
+             'lintel/core/probe.c',
+             'lintel/core/rgb_convert.c',
+             'lintel/core/tar_shard.c',
+             'lintel/core/work_queue.c'])
 
 
 setuptools.setup(author='Brendan Duke',
@@ -24,6 +46,12 @@ setuptools.setup(author='Brendan Duke',
                  entry_points="""
                      [console_scripts]
                      lintel_test=lintel.test.loadvid_test:loadvid_test
+                     lintel_rgb_kernel_test=lintel.test.rgb_kernel_test:rgb_kernel_test
+                     lintel_manifest_test=lintel.test.manifest_test:manifest_test
+                     lintel_tar_shard_test=lintel.test.tar_shard_test:tar_shard_test
+                     lintel_fork_test=lintel.test.fork_test:fork_test
+                     lintel-index=lintel.index:build_index
+                     lintel-server=lintel.server:serve
                  """,
                  install_requires=['Click', 'numpy'],
                  ext_modules=[lintel_module],